@@ -227,6 +227,38 @@ _Static_assert(sizeof(struct homa_abort_args) >= 32, "homa_abort_args shrunk");
 _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 #endif
 
+/**
+ * define homa_wait_stats - Structure that returns information about
+ * message waits on a socket from the HOMAIOCWAITSTATS ioctl.
+ */
+struct homa_wait_stats {
+	/**
+	 * @fast_wakeups: number of times a message arrived for a thread
+	 * while it was polling (no context switch needed).
+	 */
+	uint64_t fast_wakeups;
+
+	/**
+	 * @slow_wakeups: number of times a thread had to go to sleep
+	 * before a message arrived (or the wait ended).
+	 */
+	uint64_t slow_wakeups;
+
+	/** @poll_usecs: total time threads have spent polling. */
+	uint64_t poll_usecs;
+
+	/**
+	 * @poll_budget_usecs: how long a thread will currently poll on
+	 * this socket before sleeping; adapted over time from the
+	 * socket's recent wait times.
+	 */
+	uint64_t poll_budget_usecs;
+};
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_wait_stats) >= 32, "homa_wait_stats shrunk");
+_Static_assert(sizeof(struct homa_wait_stats) <= 32, "homa_wait_stats grew");
+#endif
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
@@ -247,6 +279,7 @@ _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 #define HOMAIOCRECV   _IOWR(0x89, 0xe1, struct homa_recv_args)
 #define HOMAIOCREPLY  _IOWR(0x89, 0xe2, struct homa_reply_args)
 #define HOMAIOCABORT  _IOWR(0x89, 0xe3, struct homa_abort_args)
+#define HOMAIOCWAITSTATS _IOR(0x89, 0xe4, struct homa_wait_stats)
 #define HOMAIOCFREEZE _IO(0x89, 0xef)
 
 extern ssize_t homa_recvp(int fd, struct homa_recv_args *args);
@@ -29,6 +29,11 @@
 
 #include "homa.h"
 
+/* When HOMA_XDP is defined, homa_recvp, homa_replyp, homa_sendp, and
+ * homa_abortp are provided by the user-space endpoint in util/homa_xdp.c
+ * instead of the kernel module.
+ */
+#ifndef HOMA_XDP
 /**
  * homa_recvp() - Wait for an incoming message (either request or
  * response) and return it.
@@ -75,6 +80,7 @@ ssize_t homa_sendp(int sockfd, struct homa_send_args *args) {
 int homa_abortp(int sockfd, struct homa_abort_args *args) {
 	return ioctl(sockfd, HOMAIOCABORT, args);
 }
+#endif /* HOMA_XDP */
 
 /**
  * homa_recv() - Wait for an incoming message (either request or
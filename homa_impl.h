@@ -39,6 +39,7 @@
 #endif
 
 #include <linux/audit.h>
+#include <linux/hash.h>
 #include <linux/icmp.h>
 #include <linux/init.h>
 #include <linux/list.h>
@@ -48,9 +49,11 @@
 #include <linux/completion.h>
 #include <linux/proc_fs.h>
 #include <linux/sched/signal.h>
+#include <linux/siphash.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
 #include <linux/socket.h>
+#include <net/busy_poll.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/protocol.h>
@@ -74,6 +77,10 @@ extern cycles_t mock_get_cycles(void);
 #define signal_pending(xxx) mock_signal_pending
 extern int mock_signal_pending;
 
+#undef in_softirq
+#define in_softirq() mock_in_softirq
+extern int mock_in_softirq;
+
 #define rcu_read_lock mock_rcu_read_lock
 extern void mock_rcu_read_lock(void);
 
@@ -87,9 +94,38 @@ extern void mock_rcu_read_unlock(void);
 
 #define kmalloc mock_kmalloc
 extern void *mock_kmalloc(size_t size, gfp_t flags);
+
+#define kmem_cache_alloc mock_kmem_cache_alloc
+extern void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags);
+
+#undef alloc_workqueue
+#define alloc_workqueue(fmt, flags, max_active) mock_alloc_workqueue(fmt)
+extern struct workqueue_struct *mock_alloc_workqueue(const char *name);
+
+#define queue_work_node mock_queue_work_node
+extern bool mock_queue_work_node(int node, struct workqueue_struct *wq,
+		struct work_struct *work);
+
+#undef cpu_to_node
+#define cpu_to_node mock_cpu_to_node
+extern int mock_cpu_to_node(int cpu);
+
+#undef topology_physical_package_id
+#define topology_physical_package_id mock_topology_package_id
+extern int mock_topology_package_id(int cpu);
+
+#undef topology_die_id
+#define topology_die_id mock_topology_die_id
+extern int mock_topology_die_id(int cpu);
+
+#undef topology_core_id
+#define topology_core_id mock_topology_core_id
+extern int mock_topology_core_id(int cpu);
 #endif
 
 #include "homa.h"
+#include "homa_wire.h"
+#include "homa_policy.h"
 #include "timetrace.h"
 
 /* Forward declarations. */
@@ -104,38 +140,10 @@ extern void     homa_grantable_lock_slow(struct homa *homa);
 extern void     homa_peer_lock_slow(struct homa_peer *peer);
 extern void     homa_rpc_lock_slow(struct homa_rpc *rpc);
 extern void     homa_sock_lock_slow(struct homa_sock *hsk);
+extern void     homa_sock_ready_lock_slow(struct homa_sock *hsk);
+extern void     homa_sock_reap_work(struct work_struct *work);
 extern void     homa_throttle_lock_slow(struct homa *homa);
 
-/**
- * enum homa_packet_type - Defines the possible types of Homa packets.
- *
- * See the xxx_header structs below for more information about each type.
- */
-enum homa_packet_type {
-	DATA               = 0x10,
-	GRANT              = 0x11,
-	RESEND             = 0x12,
-	UNKNOWN            = 0x13,
-	BUSY               = 0x14,
-	CUTOFFS            = 0x15,
-	FREEZE             = 0x16,
-	NEED_ACK           = 0x17,
-	ACK                = 0x18,
-	BOGUS              = 0x19,      /* Used only in unit tests. */
-	/* If you add a new type here, you must also do the following:
-	 * 1. Change BOGUS so it is the highest opcode
-	 * 2. Add support for the new opcode in homa_print_packet,
-	 *    homa_print_packet_short, homa_symbol_for_type, and mock_skb_new.
-	 * 3. Add the header length to header_lengths in homa_plumbing.c.
-	 */
-};
-
-/** define HOMA_IPV6_HEADER_LENGTH - Size of IP header (V6). */
-#define HOMA_IPV6_HEADER_LENGTH 40
-
-/** define HOMA_IPV4_HEADER_LENGTH - Size of IP header (V4). */
-#define HOMA_IPV4_HEADER_LENGTH 20
-
 /**
  * define HOMA_SKB_EXTRA - How many bytes of additional space to allow at the
  * beginning of each sk_buff, before the IP header. This includes room for a
@@ -144,377 +152,63 @@ enum homa_packet_type {
  */
 #define HOMA_SKB_EXTRA 40
 
-/**
- * define HOMA_ETH_OVERHEAD - Number of bytes per Ethernet packet for CRC,
- * preamble, and inter-packet gap.
- */
-#define HOMA_ETH_OVERHEAD 24
-
-/**
- * define HOMA_MIN_PKT_LENGTH - Every Homa packet must be padded to at least
- * this length to meet Ethernet frame size limitations. This number includes
- * Homa headers and data, but not IP or Ethernet headers.
- */
-#define HOMA_MIN_PKT_LENGTH 26
-
-/**
- * define HOMA_MAX_HEADER - Number of bytes in the largest Homa header.
- */
-#define HOMA_MAX_HEADER 90
-
-/**
- * define ETHERNET_MAX_PAYLOAD - Maximum length of an Ethernet packet,
- * excluding preamble, frame delimeter, VLAN header, CRC, and interpacket gap;
- * i.e. all of this space is available for Homa.
- */
-#define ETHERNET_MAX_PAYLOAD 1500
-
-/**
- * define HOMA_MAX_PRIORITIES - The maximum number of priority levels that
- * Homa can use (the actual number can be restricted to less than this at
- * runtime). Changing this value will affect packet formats.
- */
-#define HOMA_MAX_PRIORITIES 8
-
 #define sizeof32(type) ((int) (sizeof(type)))
 
 /** define CACHE_LINE_SIZE - The number of bytes in a cache line. */
 #define CACHE_LINE_SIZE 64
 
 /**
- * define NUM_PEER_UNACKED_IDS - The number of ids for unacked RPCs that
- * can be stored in a struct homa_peer.
+ * define HOMA_BUNDLE_PEERS - The maximum number of distinct peers for
+ * which a core can accumulate control packets at once during SoftIRQ
+ * processing.
  */
-#define NUM_PEER_UNACKED_IDS 5
+#define HOMA_BUNDLE_PEERS 4
 
 /**
- * struct common_header - Wire format for the first bytes in every Homa
- * packet. This must partially match the format of a TCP header so that
- * Homa can piggyback on TCP segmentation offload (and possibly other
- * features, such as RSS).
+ * define HOMA_CLIENT_ID_BLOCK - The number of client RPC ids that a core
+ * reserves from homa->next_outgoing_id at once; it then hands them out
+ * locally, so that cores don't all contend for that counter.
  */
-struct common_header {
-	/**
-	 * @sport: Port on source machine from which packet was sent.
-	 * Must be in the same position as in a TCP header.
-	 */
-	__be16 sport;
-
-	/**
-	 * @dport: Port on destination that is to receive packet. Must be
-	 * in the same position as in a TCP header.
-	 */
-	__be16 dport;
-
-	/**
-	 * @unused1: corresponds to the sequence number field in TCP headers;
-	 * must not be used by Homa, in case it gets incremented during TCP
-	 * offload.
-	 */
-	__be32 unused1;
-
-	__be32 unused2;
-
-	/**
-	 * @doff: High order 4 bits holds the number of 4-byte chunks in a
-	 * data_header (low-order bits unused). Used only for DATA packets;
-	 * must be in the same position as the data offset in a TCP header.
-	 */
-	__u8 doff;
-
-	/** @type: One of the values of &enum packet_type. */
-	__u8 type;
-
-	__u16 unused3;
-
-	/**
-	 * @checksum: not used by Homa, but must occupy the same bytes as
-	 * the checksum in a TCP header (TSO may modify this?).*/
-	__be16 checksum;
-
-	__u16 unused4;
-
-	/**
-	 * @sender_id: the identifier of this RPC as used on the sender (i.e.,
-	 * if the low-order bit is set, then the sender is the server for
-	 * this RPC).
-	 */
-	__be64 sender_id;
-} __attribute__((packed));
+#define HOMA_CLIENT_ID_BLOCK 1024
 
 /**
- * struct homa_ack - Identifies an RPC that can be safely deleted by its
- * server. After sending the response for an RPC, the server must retain its
- * state for the RPC until it knows that the client has successfully
- * received the entire response. An ack indicates this. Clients will
- * piggyback acks on future data packets, but if a client doesn't send
- * any data to the server, the server will eventually request an ack
- * explicitly with a NEED_ACK packet, in which case the client will
- * return an explicit ACK.
+ * define CORES_TO_CHECK - The number of candidate cores that
+ * homa_gro_complete considers when choosing a core for SoftIRQ processing.
  */
-struct homa_ack {
-	/**
-	 * @id: The client's identifier for the RPC. 0 means this ack
-	 * is invalid.
-	 */
-	__be64 client_id;
-
-	/** @client_port: The client-side port for the RPC. */
-	__be16 client_port;
-
-	/** @server_port: The server-side port for the RPC. */
-	__be16 server_port;
-} __attribute__((packed));
+#define CORES_TO_CHECK 4
 
 /**
- * struct data_segment - Wire format for a chunk of data that is part of
- * a DATA packet. A single sk_buff can hold multiple data_segments in order
- * to enable send and receive offload (the idea is to carry many network
- * packets of info in a single traversal of the Linux networking stack).
- * A DATA sk_buff contains a data_header followed by any number of
- * data_segments.
+ * define HOMA_STEER_BUCKETS - The number of entries in homa->rx_steer;
+ * must be a power of 2.
  */
-struct data_segment {
-	/**
-	 * @offset: Offset within message of the first byte of data in
-	 * this segment. Segments within an sk_buff are not guaranteed
-	 * to be in order.
-	 */
-	__be32 offset;
-
-	/** @segment_length: Number of bytes of data in this segment. */
-	__be32 segment_length;
-
-	/** @ack: If the @client_id field is nonzero, provides info about
-	 * an RPC that the recipient can now safely free.
-	 */
-	struct homa_ack ack;
-
-	/** @data: the payload of this segment. */
-	char data[0];
-} __attribute__((packed));
-
-/* struct data_header - Overall header format for a DATA sk_buff, which
- * contains this header followed by any number of data_segments.
- */
-struct data_header {
-	struct common_header common;
-
-	/** @message_length: Total #bytes in the *message* */
-	__be32 message_length;
-
-	/**
-	 * @incoming: The receiver can expect the sender to send all of the
-	 * bytes in the message up to at least this offset (exclusive),
-	 * even without additional grants. This includes unscheduled
-	 * bytes, granted bytes, plus any additional bytes the sender
-	 * transmits unilaterally (e.g., to send batches, such as with GSO).
-	 */
-	__be32 incoming;
-
-	/**
-	 * @cutoff_version: The cutoff_version from the most recent
-	 * CUTOFFS packet that the source of this packet has received
-	 * from the destination of this packet, or 0 if the source hasn't
-	 * yet received a CUTOFFS packet.
-	 */
-	__be16 cutoff_version;
-
-	/**
-	 * @retransmit: 1 means this packet was sent in response to a RESEND
-	 * (it has already been sent previously).
-	 */
-	__u8 retransmit;
-
-	__u8 pad;
-
-	/** @seg: First of possibly many segments */
-	struct data_segment seg;
-} __attribute__((packed));
-_Static_assert(sizeof(struct data_header) <= HOMA_MAX_HEADER,
-		"data_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
-_Static_assert(sizeof(struct data_header) >= HOMA_MIN_PKT_LENGTH,
-		"data_header too small: Homa doesn't currently have code"
-		"to pad data packets");
-_Static_assert(((sizeof(struct data_header) - sizeof(struct data_segment))
-		& 0x3) == 0,
-		" data_header length not a multiple of 4 bytes (required "
-		"for TCP/TSO compatibility");
+#define HOMA_STEER_BUCKETS 1024
 
 /**
- * struct grant_header - Wire format for GRANT packets, which are sent by
- * the receiver back to the sender to indicate that the sender may transmit
- * additional bytes in the message.
+ * define HOMA_WAIT_BUCKETS - Number of entries in the per-socket histogram
+ * of message wait times (homa_sock->wait_hist).
  */
-struct grant_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-
-	/**
-	 * @offset: Byte offset within the message.
-	 *
-	 * The sender should now transmit all data up to (but not including)
-	 * this offset ASAP, if it hasn't already.
-	 */
-	__be32 offset;
-
-	/**
-	 * @priority: The sender should use this priority level for all future
-	 * MESSAGE_FRAG packets for this message, until a GRANT is received
-	 * with higher offset. Larger numbers indicate higher priorities.
-	 */
-	__u8 priority;
-} __attribute__((packed));
-_Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
-		"grant_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
+#define HOMA_WAIT_BUCKETS 20
 
 /**
- * struct resend_header - Wire format for RESEND packets.
- *
- * A RESEND is sent by the receiver when it believes that message data may
- * have been lost in transmission (or if it is concerned that the sender may
- * have crashed). The receiver should resend the specified portion of the
- * message, even if it already sent it previously.
+ * define HOMA_WAIT_SAMPLES - A socket's poll duration is recomputed each
+ * time this many wait times have been recorded in its histogram.
  */
-struct resend_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-
-	/**
-	 * @offset: Offset within the message of the first byte of data that
-	 * should be retransmitted.
-	 */
-	__be32 offset;
-
-	/**
-	 * @length: Number of bytes of data to retransmit; this could specify
-	 * a range longer than the total message size. Zero is a special case
-	 * used by servers; in this case, there is no need to actually resend
-	 * anything; the purpose of this packet is to trigger an UNKNOWN
-	 * response if the client no longer cares about this RPC.
-	 */
-	__be32 length;
-
-	/**
-	 * @priority: Packet priority to use.
-	 *
-	 * The sender should transmit all the requested data using this
-	 * priority.
-	 */
-	__u8 priority;
-} __attribute__((packed));
-_Static_assert(sizeof(struct resend_header) <= HOMA_MAX_HEADER,
-		"resend_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
+#define HOMA_WAIT_SAMPLES 1000
 
 /**
- * struct unknown_header - Wire format for UNKNOWN packets.
- *
- * An UNKNOWN packet is sent by either server or client when it receives a
- * packet for an RPC that is unknown to it. When a client receives an
- * UNKNOWN packet it will typically restart the RPC from the beginning;
- * when a server receives an UNKNOWN packet it will typically discard its
- * state for the RPC.
- */
-struct unknown_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-} __attribute__((packed));
-_Static_assert(sizeof(struct unknown_header) <= HOMA_MAX_HEADER,
-		"unknown_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
-
-/**
- * struct busy_header - Wire format for BUSY packets.
- *
- * These packets tell the recipient that the sender is still alive (even if
- * it isn't sending data expected by the recipient).
+ * define HOMA_FILL_CHUNK_BYTES - When copying a large outgoing message
+ * from user space, the first chunk is at least this large (or rtt_bytes,
+ * if that is larger); it is transmitted before the rest of the message
+ * is copied in, in chunks of this size.
  */
-struct busy_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-} __attribute__((packed));
-_Static_assert(sizeof(struct busy_header) <= HOMA_MAX_HEADER,
-		"busy_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
+#define HOMA_FILL_CHUNK_BYTES 65536
 
 /**
- * struct cutoffs_header - Wire format for CUTOFFS packets.
- *
- * These packets tell the recipient how to assign priorities to
- * unscheduled packets.
+ * define HOMA_PACER_SLACK_NS - When the pacer thread sleeps waiting for
+ * the NIC queue to drain, the hrtimer may fire up to this many nanoseconds
+ * after the desired time (allows the kernel to coalesce timer interrupts).
  */
-struct cutoffs_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-
-	/**
-	 * @unsched_cutoffs: priorities to use for unscheduled packets
-	 * sent to the sender of this packet. See documentation for
-	 * @homa.unsched_cutoffs for the meanings of these values.
-	 */
-	__be32 unsched_cutoffs[HOMA_MAX_PRIORITIES];
-
-	/**
-	 * @cutoff_version: unique identifier associated with @unsched_cutoffs.
-	 * Must be included in future DATA packets sent to the sender of
-	 * this packet.
-	 */
-	__be16 cutoff_version;
-} __attribute__((packed));
-_Static_assert(sizeof(struct cutoffs_header) <= HOMA_MAX_HEADER,
-		"cutoffs_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
-
-/**
- * struct freeze_header - Wire format for FREEZE packets.
- *
- * These packets tell the recipient to freeze its timetrace; used
- * for debugging.
- */
-struct freeze_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-} __attribute__((packed));
-_Static_assert(sizeof(struct freeze_header) <= HOMA_MAX_HEADER,
-		"freeze_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
-
-/**
- * struct need_ack_header - Wire format for NEED_ACK packets.
- *
- * These packets ask the recipient (a client) to return an ACK message if
- * the packet's RPC is no longer active.
- */
-struct need_ack_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-} __attribute__((packed));
-_Static_assert(sizeof(struct need_ack_header) <= HOMA_MAX_HEADER,
-		"need_ack_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
-
-/**
- * struct ack_header - Wire format for ACK packets.
- *
- * These packets are sent from a client to a server to indicate that
- * a set of RPCs is no longer active on the client, so the server can
- * free any state it may have for them.
- */
-struct ack_header {
-	/** @common: Fields common to all packet types. */
-	struct common_header common;
-
-	/** @num_acks: number of (leading) elements in @acks that are valid. */
-	__be16 num_acks;
-
-	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
-} __attribute__((packed));
-_Static_assert(sizeof(struct ack_header) <= HOMA_MAX_HEADER,
-		"ack_header too large for HOMA_MAX_HEADER; must "
-		"adjust HOMA_MAX_HEADER");
+#define HOMA_PACER_SLACK_NS 500
 
 /**
  * struct homa_message_out - Describes a message (either request or response)
@@ -540,6 +234,14 @@ struct homa_message_out {
 	 */
 	int num_skbs;
 
+	/**
+	 * @copied: Number of bytes of message data that have been copied
+	 * into @packets so far. For large messages this may be less than
+	 * @length while the sender is still copying in the rest of the
+	 * message (see homa_message_out_fill).
+	 */
+	int copied;
+
 	/**
 	 * @next_packet: Pointer within @request of the next packet to transmit.
 	 *
@@ -637,6 +339,13 @@ struct homa_message_in {
 	 */
 	struct sk_buff *xfer_skb;
 
+	/**
+	 * @softirq_core: the core on which SoftIRQ processing was done for
+	 * the most recent data packet of this message; -1 means no packets
+	 * yet.
+	 */
+	int softirq_core;
+
 	/**
 	 * @birth: get_cycles time when this RPC was added to the grantable
 	 * list. Invalid if RPC isn't in the grantable list.
@@ -693,6 +402,14 @@ struct homa_interest {
 	 */
 	struct homa_rpc *reg_rpc;
 
+	/**
+	 * @polling: nonzero means this thread is (or will be) busy-waiting
+	 * for a message, and is counted in homa_sock.num_pollers. Polling
+	 * interests are kept at the front of the socket's interest lists
+	 * so that homa_rpc_ready prefers them over sleeping threads.
+	 */
+	int polling;
+
 	/**
 	 * @request_links: For linking this object into
 	 * &homa_sock.request_interests. The interest must not be linked
@@ -718,6 +435,7 @@ static void inline homa_interest_init(struct homa_interest *interest)
 	interest->ready_rpc = NULL;
 	atomic_long_set(&interest->id, 0);
 	interest->reg_rpc = NULL;
+	interest->polling = 0;
 	interest->request_links.next = LIST_POISON1;
 	interest->response_links.next = LIST_POISON1;
 }
@@ -732,8 +450,8 @@ struct homa_rpc {
 	struct homa_sock *hsk;
 
 	/** @lock: Used to synchronize modifications to this structure;
-	 * points to the lock in hsk->client_rpc_buckets or
-	 * hsk->server_rpc_buckets.
+	 * points to the lock in homa->client_rpc_buckets or
+	 * homa->server_rpc_buckets.
 	 */
 	struct spinlock *lock;
 
@@ -829,8 +547,8 @@ struct homa_rpc {
 
 	/**
 	 * @hash_links: Used to link this object into a hash bucket for
-	 * either @hsk->client_rpc_buckets (for a client RPC), or
-	 * @hsk->server_rpc_buckets (for a server RPC).
+	 * either homa->client_rpc_buckets (for a client RPC), or
+	 * homa->server_rpc_buckets (for a server RPC).
 	 */
 	struct hlist_node hash_links;
 
@@ -870,13 +588,30 @@ struct homa_rpc {
 	 */
 	struct list_head throttled_links;
 
+	/**
+	 * @timer_links: Used to link this RPC into one of the slots of
+	 * hsk->timer_wheel. If the RPC isn't in the wheel (it can't need
+	 * any attention from homa_timer in its current state), this is
+	 * unhashed. Protected by hsk->timer_lock.
+	 */
+	struct hlist_node timer_links;
+
 	/**
 	 * @silent_ticks: Number of times homa_timer has been invoked
 	 * since the last time a packet indicating progress was received
 	 * for this RPC, so we don't need to send a resend for a while.
+	 * This is only brought up to date when homa_timer visits the RPC;
+	 * between visits, the true value is @silent_ticks plus the ticks
+	 * since @silent_base.
 	 */
 	int silent_ticks;
 
+	/**
+	 * @silent_base: Value of homa->timer_ticks when @silent_ticks was
+	 * last brought up to date.
+	 */
+	__u32 silent_base;
+
 	/**
 	 * @resend_timer_ticks: Value of homa->timer_ticks the last time
 	 * we sent a RESEND for this RPC.
@@ -944,6 +679,13 @@ inline static void homa_rpc_validate(struct homa_rpc *rpc) {
 	BUG();
 }
 
+/**
+ * define HOMA_TIMER_SLOTS - Number of slots in each socket's timer wheel
+ * (homa_sock.timer_wheel). Must be a power of 2. RPCs can be scheduled
+ * at most HOMA_TIMER_SLOTS-1 ticks in the future.
+ */
+#define HOMA_TIMER_SLOTS 64
+
 /**
  * define HOMA_SOCKTAB_BUCKETS - Number of hash buckets in a homa_socktab.
  * Must be a power of 2.
@@ -1007,16 +749,16 @@ struct homa_socktab_scan {
 };
 
 /**
- * define HOMA_CLIENT_RPC_BUCKETS - Number of buckets in hash tables for
- * client RPCs. Must be a power of 2.
+ * define HOMA_CLIENT_RPC_BUCKETS - Number of buckets in the hash table for
+ * client RPCs (shared by all sockets). Must be a power of 2.
  */
-#define HOMA_CLIENT_RPC_BUCKETS 1024
+#define HOMA_CLIENT_RPC_BUCKETS 16384
 
 /**
- * define HOMA_SERVER_RPC_BUCKETS - Number of buckets in hash tables for
- * server RPCs. Must be a power of 2.
+ * define HOMA_SERVER_RPC_BUCKETS - Number of buckets in the hash table for
+ * server RPCs (shared by all sockets). Must be a power of 2.
  */
-#define HOMA_SERVER_RPC_BUCKETS 1024
+#define HOMA_SERVER_RPC_BUCKETS 16384
 
 struct homa_rpc_bucket {
 	/**
@@ -1052,8 +794,9 @@ struct homa_sock {
 	};
 
 	/**
-	 * @lock: Must be held when modifying fields such as interests
-	 * and lists of RPCs. This lock is used in place of sk->sk_lock
+	 * @lock: Must be held when modifying fields such as the lists
+	 * of RPCs (but not the ready queues and interests, which are
+	 * protected by @ready_lock). This lock is used in place of sk->sk_lock
 	 * because it's used differently (it's always used as a simple
 	 * spin lock).  See sync.txt for more on Homa's synchronization
 	 * strategy.
@@ -1081,6 +824,59 @@ struct homa_sock {
 	/** @shutdown: True means the socket is no longer usable. */
 	bool shutdown;
 
+	/**
+	 * @receiver_cpu: the core of the thread that most recently started
+	 * waiting for any incoming message on this socket, if it was the
+	 * only such thread; -1 otherwise. Used (as a hint) by the
+	 * HOMA_GRO_STEER policy.
+	 */
+	int receiver_cpu;
+
+	/**
+	 * @num_pollers: number of threads currently busy-waiting for
+	 * messages on this socket (never more than homa->max_pollers).
+	 */
+	atomic_t num_pollers;
+
+	/**
+	 * @poll_cycles: how long (in get_cycles units) a thread waiting for
+	 * a message on this socket busy-waits before sleeping. Adapted to
+	 * the socket's message arrival times by homa_sock_wait_adapt;
+	 * never larger than homa->poll_cycles.
+	 */
+	int poll_cycles;
+
+	/**
+	 * @wait_hist: histogram of how long threads on this socket had to
+	 * wait for a message to arrive (measured from the start of polling).
+	 * Entry 0 counts waits under 1 us; entry i counts waits of
+	 * [2^(i-1), 2^i) us; the last entry also counts all longer waits.
+	 * This and the other wait statistics below are protected by
+	 * @ready_lock.
+	 */
+	__u32 wait_hist[HOMA_WAIT_BUCKETS];
+
+	/** @wait_samples: sum of the entries in @wait_hist. */
+	int wait_samples;
+
+	/**
+	 * @fast_wakeups: number of times a message arrived for a thread
+	 * on this socket while it was polling.
+	 */
+	__u64 fast_wakeups;
+
+	/**
+	 * @slow_wakeups: number of times a thread on this socket had to
+	 * go to sleep while waiting for a message.
+	 */
+	__u64 slow_wakeups;
+
+	/**
+	 * @total_poll_cycles: total time (in get_cycles units) spent by
+	 * threads on this socket polling for messages.
+	 */
+	__u64 total_poll_cycles;
+
 	/**
 	 * @port: Port number: identifies this socket uniquely among all
 	 * those on this node.
@@ -1102,7 +898,7 @@ struct homa_sock {
 	/**
 	 * @active_rpcs: List of all existing RPCs related to this socket,
 	 * including both client and server RPCs. This list isn't strictly
-	 * needed, since RPCs are already in one of the hash tables below,
+	 * needed, since RPCs are already in one of the RPC hash tables,
 	 * but it's more efficient for homa_timer to have this list
 	 * (so it doesn't have to scan large numbers of hash buckets).
 	 * The list is sorted, with the oldest RPC first. Manipulate with
@@ -1119,6 +915,24 @@ struct homa_sock {
 	/** @dead_skbs: Total number of socket buffers in RPCs on dead_rpcs. */
 	int dead_skbs;
 
+	/**
+	 * @reap_work: Used to reap dead RPCs in the background (see
+	 * homa_sock_reap_work); queued by homa_rpc_free once @dead_skbs
+	 * reaches homa->reap_wake_buffs.
+	 */
+	struct work_struct reap_work;
+
+	/**
+	 * @ready_lock: Must be held when accessing @ready_requests,
+	 * @ready_responses, @request_interests, @response_interests,
+	 * homa_rpc.interest, and the list links and reg_rpc of interests.
+	 * It's separate from @lock (and on its own cache line) so that
+	 * SoftIRQ handing off messages to waiting threads doesn't serialize
+	 * with RPC creation, deletion, and reaping. If both locks are
+	 * needed, @lock must be acquired first.
+	 */
+	struct spinlock ready_lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
 	/**
 	 * @ready_requests: Contains server RPCs in RPC_READY state that
 	 * have not yet been claimed. The head is oldest, i.e. next to return.
@@ -1144,18 +958,28 @@ struct homa_sock {
 	struct list_head response_interests;
 
 	/**
-	 * @client_rpc_buckets: Hash table for fast lookup of client RPCs.
-	 * Modifications are synchronized with bucket locks, not
-	 * the socket lock.
+	 * @timer_lock: Protects @timer_tick, @timer_wheel, and the
+	 * timer_links fields of this socket's RPCs. This is a leaf lock:
+	 * no other lock may be acquired while holding it.
+	 */
+	struct spinlock timer_lock;
+
+	/**
+	 * @timer_tick: The value of homa->timer_ticks for the slot of
+	 * @timer_wheel that homa_timer processed most recently. All earlier
+	 * slots are empty.
 	 */
-	struct homa_rpc_bucket client_rpc_buckets[HOMA_CLIENT_RPC_BUCKETS];
+	__u32 timer_tick;
 
 	/**
-	 * @server_rpc_buckets: Hash table for fast lookup of server RPCs.
-	 * Modifications are synchronized with bucket locks, not
-	 * the socket lock.
+	 * @timer_wheel: Contains this socket's RPCs that homa_timer will
+	 * need to check, indexed by the tick when each RPC is next due
+	 * (modulo HOMA_TIMER_SLOTS). This allows homa_timer to skip RPCs
+	 * that can't possibly need a RESEND, NEED_ACK, or timeout yet.
+	 * The slots are hlists, which keeps the wheel's cost to 8 bytes
+	 * per slot in every socket.
 	 */
-	struct homa_rpc_bucket server_rpc_buckets[HOMA_SERVER_RPC_BUCKETS];
+	struct hlist_head timer_wheel[HOMA_TIMER_SLOTS];
 };
 
 /**
@@ -1179,32 +1003,98 @@ struct homa_dead_dst {
 };
 
 /**
- * define HOMA_PEERTAB_BUCKETS - Number of bits in the bucket index for a
- * homa_peertab.  Should be large enough to hold an entry for every server
- * in a datacenter without long hash chains.
+ * define HOMA_PEERTAB_MIN_BITS - log2 of the number of buckets in a new
+ * homa_peertab; the table never shrinks below this size.
  */
-#define HOMA_PEERTAB_BUCKET_BITS 20
+#define HOMA_PEERTAB_MIN_BITS 6
 
-/** define HOME_PEERTAB_BUCKETS - Number of buckets in a homa_peertab. */
-#define HOMA_PEERTAB_BUCKETS (1 << HOMA_PEERTAB_BUCKET_BITS)
+/**
+ * define HOMA_PEERTAB_MAX_BITS - log2 of the largest number of buckets
+ * a homa_peertab will grow to.
+ */
+#define HOMA_PEERTAB_MAX_BITS 24
+
+/**
+ * define HOMA_PEER_GC_BUCKETS - Number of peertab buckets examined by
+ * each call to homa_peertab_gc_peers (i.e. each homa_timer tick); a table
+ * with 1M buckets is scanned about once a second.
+ */
+#define HOMA_PEER_GC_BUCKETS 1024
+
+/**
+ * define HOMA_PEER_REHASH_BUCKETS - While the peer table is being resized,
+ * each call to homa_peertab_check_size (i.e. each homa_timer tick) moves
+ * this many chains from the old bucket array to the new one. This bounds
+ * the work done per tick; write_lock is held for only one chain at a time.
+ */
+#define HOMA_PEER_REHASH_BUCKETS 1024
+
+/**
+ * define HOMA_PEER_MIN_IDLE_SECS - A peer is never evicted unless it has
+ * been unused for at least this many seconds, even if the peer table is
+ * over homa->max_peers. This limits churn in the table; it is not what
+ * protects users of a peer (see struct homa_peertab).
+ */
+#define HOMA_PEER_MIN_IDLE_SECS 1
+
+/**
+ * define HOMA_PEER_ACKS - The number of acks for completed client RPCs
+ * that can be buffered in a struct homa_peer while waiting for a packet
+ * to piggyback them on. When the buffer fills, a batch of them is sent
+ * in an explicit ACK packet.
+ */
+#define HOMA_PEER_ACKS 32
+
+/**
+ * struct homa_peer_buckets - The bucket array for a homa_peertab. A new
+ * one of these is allocated whenever the table is resized.
+ */
+struct homa_peer_buckets {
+	/** @bits: log2 of the number of entries in @heads. */
+	int bits;
+
+	/** @rcu: Used to free this object once readers are done with it. */
+	struct rcu_head rcu;
+
+	/** @heads: Heads of the hash chains. */
+	struct hlist_head heads[];
+};
 
 /**
  * struct homa_peertab - A hash table that maps from IPv6 addresses
  * to homa_peer objects. IPv4 entries are encapsulated as IPv6 addresses.
- * Entries are gradually added to this table, but they are never removed
- * except when the entire table is deleted. We can't safely delete because
- * results returned by homa_peer_find may be retained indefinitely.
+ * Entries are added to this table as needed; idle entries are removed by
+ * homa_peertab_gc_peers. RPCs that refer to a peer hold a reference to
+ * it (homa_peer_hold), and so must any code in process context that
+ * uses a homa_peer_find result (it may sleep, e.g. copying from user
+ * space). Code running with BHs disabled (e.g. SoftIRQ) may use a peer
+ * without a reference until it reenables BHs, since evicted peers are
+ * freed with call_rcu.
  *
  * This table is managed exclusively by homa_peertab.c, using RCU to
- * permit efficient lookups.
+ * permit efficient lookups. The number of buckets grows and shrinks
+ * with the number of peers; peers are moved to a new bucket array
+ * incrementally (see homa_peertab_check_size).
  */
 struct homa_peertab {
 	/**
-	 * @write_lock: Synchronizes addition of new entries; not needed
-	 * for lookups (RCU is used instead).
+	 * @write_lock: Synchronizes addition and removal of entries; not
+	 * needed for lookups (RCU is used instead).
 	 */
 	struct spinlock write_lock;
 
+	/**
+	 * @num_peers: number of peers currently in the table. Hold
+	 * @write_lock when modifying.
+	 */
+	int num_peers;
+
+	/**
+	 * @gc_bucket: index of the next bucket to be examined by
+	 * homa_peertab_gc_peers.
+	 */
+	int gc_bucket;
+
 	/**
 	 * @dead_dsts: List of dst_entries that are waiting to be deleted.
 	 * Hold @write_lock when manipulating.
@@ -1212,11 +1102,31 @@ struct homa_peertab {
 	struct list_head dead_dsts;
 
 	/**
-	 * @buckets: Pointer to heads of chains of homa_peers for each bucket.
-	 * Malloc-ed, and must eventually be freed. NULL means this structure
-	 * has not been initialized.
+	 * @buckets: Hash chains of homa_peers. Replaced (under @write_lock)
+	 * when a resize completes; readers must use rcu_dereference. NULL
+	 * means this structure has not been initialized.
+	 */
+	struct homa_peer_buckets __rcu *buckets;
+
+	/**
+	 * @new_buckets: Non-NULL means a resize is in progress: chains
+	 * are being moved from @buckets to this array a few at a time,
+	 * and new peers are added here. Lookups must search both arrays.
+	 */
+	struct homa_peer_buckets __rcu *new_buckets;
+
+	/**
+	 * @rehash_bucket: During a resize, index of the next chain in
+	 * @buckets to move to @new_buckets. Used only by
+	 * homa_peertab_check_size.
 	 */
-	struct hlist_head *buckets;
+	int rehash_bucket;
+
+	/**
+	 * @hash_key: random key for the hash function, so that remote
+	 * hosts can't choose addresses that all land in the same bucket.
+	 */
+	siphash_key_t hash_key;
 };
 
 /**
@@ -1235,7 +1145,10 @@ struct homa_peer {
 
 	/**
 	 * @dst: Used to route packets to this peer; we own a reference
-	 * to this, which we must eventually release.
+	 * to this, which we must eventually release. Transmit paths attach
+	 * it to packets without taking their own references, so they must
+	 * read it (with READ_ONCE) and use it inside an RCU read-side
+	 * section.
 	 */
 	struct dst_entry *dst;
 
@@ -1255,6 +1168,16 @@ struct homa_peer {
 	 */
 	__be16 cutoff_version;
 
+	/**
+	 * @data_template: prebuilt header for DATA packets sent to this
+	 * peer, containing all of the fields that are the same for every
+	 * message (type, doff, cutoff_version, etc.). homa_fill_packets
+	 * copies this into each packet, then patches in per-message and
+	 * per-packet fields. Must be kept consistent with @cutoff_version.
+	 * The seg field is unused.
+	 */
+	struct data_header data_template;
+
 	/**
 	 * last_update_jiffies: time in jiffies when we sent the most
 	 * recent CUTOFFS packet to this peer.
@@ -1283,6 +1206,27 @@ struct homa_peer {
 	 */
 	struct hlist_node peertab_links;
 
+	/**
+	 * @refs: number of RPCs that refer to this peer (see homa_peer_hold
+	 * and homa_peer_put). -1 means the peer has been claimed for
+	 * eviction by homa_peertab_gc_peers and must not be used for new
+	 * RPCs.
+	 */
+	atomic_t refs;
+
+	/**
+	 * @access_jiffies: time (in jiffies) when this peer was most
+	 * recently returned by homa_peer_find or released by an RPC. Used
+	 * to find idle peers for eviction.
+	 */
+	unsigned long access_jiffies;
+
+	/**
+	 * @rcu: used to free this peer after an RCU grace period, once it
+	 * has been removed from the peer table.
+	 */
+	struct rcu_head rcu;
+
 	/**
 	 * @outstanding_resends: the number of resend requests we have
 	 * sent to this server (spaced @homa.resend_interval apart) since
@@ -1333,7 +1277,7 @@ struct homa_peer {
 	 * @acks: info about client RPCs whose results have been completely
 	 * received.
 	 */
-	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
+	struct homa_ack acks[HOMA_PEER_ACKS];
 
 	/**
 	 * @ack_lock: used to synchronize access to @num_acks and @acks.
@@ -1353,6 +1297,19 @@ enum homa_freeze_type {
 	PACKET_LOST        = 5,
 };
 
+/**
+ * struct homa_rx_steer - An entry in homa->rx_steer: records the core of
+ * a thread waiting for a particular RPC, so that SoftIRQ processing for
+ * the RPC's packets can be steered to that core.
+ */
+struct homa_rx_steer {
+	/** @id: Local id of the RPC; 0 means the entry is unused. */
+	__u64 id;
+
+	/** @cpu: Core on which the waiting thread last registered. */
+	int cpu;
+};
+
 /**
  * struct homa - Overall information about the Homa protocol implementation.
  *
@@ -1361,8 +1318,9 @@ enum homa_freeze_type {
  */
 struct homa {
 	/**
-	 * @next_outgoing_id: Id to use for next outgoing RPC request.
-	 * This is always even: it's used only to generate client-side ids.
+	 * @next_outgoing_id: First id of the next block of client RPC ids
+	 * to be reserved by a core (see homa_next_client_id). This is
+	 * always even: it's used only to generate client-side ids.
 	 * Accessed without locks.
 	 */
 	atomic64_t next_outgoing_id;
@@ -1373,7 +1331,9 @@ struct homa {
 	 * transmission will have been transmitted. May be in the past.
 	 * This estimate assumes that only Homa is transmitting data, so
 	 * it could be a severe underestimate if there is competing traffic
-	 * from, say, TCP. Access only with atomic ops.
+	 * from, say, TCP; if @nic_feedback_usecs is nonzero, it is
+	 * periodically corrected using the NIC's actual queue length (see
+	 * homa_nic_queue_feedback). Access only with atomic ops.
 	 */
 	atomic64_t link_idle_time __attribute__((aligned(CACHE_LINE_SIZE)));
 
@@ -1487,6 +1447,34 @@ struct homa {
 	 */
 	struct homa_peertab peers;
 
+	/**
+	 * @rpc_cache: Slab cache from which all struct homa_rpcs are
+	 * allocated.
+	 */
+	struct kmem_cache *rpc_cache;
+
+	/**
+	 * @reap_wq: Workqueue on which sockets' background reapers
+	 * (homa_sock.reap_work) run.
+	 */
+	struct workqueue_struct *reap_wq;
+
+	/**
+	 * @client_rpc_buckets: Hash table for fast lookup of client RPCs
+	 * (HOMA_CLIENT_RPC_BUCKETS entries). Shared by all sockets, so
+	 * that sockets don't each have to carry a large table; RPCs are
+	 * matched against their socket during lookups. Modifications are
+	 * synchronized with bucket locks, not socket locks.
+	 */
+	struct homa_rpc_bucket *client_rpc_buckets;
+
+	/**
+	 * @server_rpc_buckets: Hash table for fast lookup of server RPCs
+	 * (HOMA_SERVER_RPC_BUCKETS entries). Shared by all sockets, like
+	 * @client_rpc_buckets.
+	 */
+	struct homa_rpc_bucket *server_rpc_buckets;
+
 	/**
 	 * @rtt_bytes: An estimate of the amount of data that can be transmitted
          * over the wire in the time it takes to send a full-size data packet
@@ -1521,6 +1509,21 @@ struct homa {
 	 */
 	int poll_cycles;
 
+	/**
+	 * @poll_percentile: if nonzero, each socket picks its own polling
+	 * time (no larger than @poll_usecs) so that this percentage of
+	 * waits end while the thread is still polling. Zero means all
+	 * sockets use @poll_usecs. Set externally via sysctl.
+	 */
+	int poll_percentile;
+
+	/**
+	 * @max_pollers: maximum number of threads that may busy-wait for
+	 * messages on a single socket at once; additional threads go to
+	 * sleep immediately. Set externally via sysctl.
+	 */
+	int max_pollers;
+
 	/**
 	 * @num_priorities: The total number of priority levels available for
 	 * Homa's use. Internally, Homa will use priorities from 0 to
@@ -1622,6 +1625,21 @@ struct homa {
 	 */
 	int resend_interval;
 
+	/**
+	 * @peer_idle_secs: peers that have had no RPCs, grantable messages
+	 * or pending acks for this many seconds are deleted from the peer
+	 * table; 0 means idle peers are never deleted (unless @max_peers
+	 * is exceeded). Set externally via sysctl.
+	 */
+	int peer_idle_secs;
+
+	/**
+	 * @max_peers: if the peer table holds more than this many peers,
+	 * unused peers are deleted even if they haven't been idle for
+	 * @peer_idle_secs. 0 means no limit. Set externally via sysctl.
+	 */
+	int max_peers;
+
 	/**
 	 * @timeout_resends: Assume that a server is dead if it has not
 	 * responded after this many RESENDs have been sent to it.
@@ -1651,6 +1669,16 @@ struct homa {
 	 */
 	int dead_buffs_limit;
 
+	/**
+	 * @reap_wake_buffs: When the number of packet buffers in a socket's
+	 * dead RPCs reaches this value, homa_rpc_free queues the socket's
+	 * background reaper. This is a low watermark, well below
+	 * @dead_buffs_limit, so that homa_timer and homa_data_pkt rarely
+	 * need to reap. Zero disables background reaping. Set externally
+	 * via sysctl.
+	 */
+	int reap_wake_buffs;
+
 	/**
 	 * @max_dead_buffs: The largest aggregate number of packet buffers
 	 * in dead (but not yet reaped) RPCs that has existed so far in a
@@ -1693,6 +1721,29 @@ struct homa {
 	 */
 	__u32 cycles_per_kbyte;
 
+	/**
+	 * @nic_feedback_usecs: if nonzero, Homa samples the number of bytes
+	 * actually queued in the NIC (as reported by byte queue limits)
+	 * at most once every this many microseconds during transmission,
+	 * and uses it to correct @link_idle_time. Zero (the default)
+	 * disables the feedback. Set externally via sysctl.
+	 */
+	int nic_feedback_usecs;
+
+	/**
+	 * @nic_feedback_cycles: Same as nic_feedback_usecs, except in units
+	 * of get_cycles().
+	 */
+	int nic_feedback_cycles;
+
+	/**
+	 * @next_nic_feedback: get_cycles() time at or after which the next
+	 * NIC queue sample should be taken. The core that takes a sample
+	 * advances this with a cmpxchg, so only one core samples in each
+	 * interval.
+	 */
+	atomic64_t next_nic_feedback;
+
 	/**
 	 * @verbose: Nonzero enables additional logging. Set externally via
 	 * sysctl.
@@ -1733,6 +1784,10 @@ struct homa {
 	#define HOMA_GRO_NEXT            8
 	#define HOMA_GRO_IDLE_NEW       16
 	#define HOMA_GRO_FAST_GRANTS    32
+	#define HOMA_GRO_TOPOLOGY       64
+	#define HOMA_GRO_STEER         128
+	#define HOMA_GRO_COALESCE      256
+	#define HOMA_GRO_FAST_CONTROL  512
 	#define HOMA_GRO_NORMAL      (HOMA_GRO_SAME_CORE|HOMA_GRO_IDLE_NEW \
 			|HOMA_GRO_FAST_GRANTS)
 
@@ -1750,6 +1805,23 @@ struct homa {
 	 */
 	int gro_busy_cycles;
 
+	/**
+	 * @bundle_control: nonzero means that control packets generated
+	 * for the same peer during a single invocation of homa_softirq
+	 * may be combined into a single BUNDLE packet. Off by default,
+	 * since peers running older versions of Homa discard BUNDLE
+	 * packets. Set externally via sysctl.
+	 */
+	int bundle_control;
+
+	/**
+	 * @rx_steer: used by the HOMA_GRO_STEER policy to find the core of
+	 * a thread waiting for a specific RPC; indexed by
+	 * homa_steer_bucket(). Entries are only hints, so they are read and
+	 * written without synchronization.
+	 */
+	struct homa_rx_steer rx_steer[HOMA_STEER_BUCKETS];
+
 	/**
 	 * @timer_ticks: number of times that homa_timer has been invoked
 	 * (may wraparound, which is safe).
@@ -1826,6 +1898,7 @@ struct homa {
  */
 #define HOMA_NUM_SMALL_COUNTS 64
 #define HOMA_NUM_MEDIUM_COUNTS 128
+#define HOMA_SHORT_DELAY_BUCKETS 8
 struct homa_metrics {
 	/**
 	 * @small_msg_bytes: entry i holds the total number of bytes
@@ -1918,6 +1991,13 @@ struct homa_metrics {
 	 */
 	__u64 poll_cycles;
 
+	/**
+	 * @poll_skips: total number of times a thread in
+	 * homa_wait_for_message went to sleep without polling, because
+	 * its socket already had homa->max_pollers polling threads.
+	 */
+	__u64 poll_skips;
+
 	/**
 	 * @softirq_calls: total number of calls to homa_softirq (i.e.,
 	 * total number of GRO packets processed, each of which could contain
@@ -2027,6 +2107,13 @@ struct homa_metrics {
 	 */
 	__u64 data_pkt_reap_cycles;
 
+	/**
+	 * @bg_reap_cycles: total time spent by background reapers (see
+	 * homa_sock_reap_work) to reap dead RPCs, as measured with
+	 * get_cycles().
+	 */
+	__u64 bg_reap_cycles;
+
 	/**
 	 * @pacer_cycles: total time spent executing in homa_pacer_main
 	 * (not including blocked time), as measured with get_cycles().
@@ -2059,6 +2146,40 @@ struct homa_metrics {
 	 */
 	__u64 pacer_needed_help;
 
+	/**
+	 * @pacer_sleeps: total number of times that the pacer thread slept
+	 * on an hrtimer because the NIC queue was full, rather than
+	 * spinning until it drained.
+	 */
+	__u64 pacer_sleeps;
+
+	/**
+	 * @pacer_sleep_cycles: total time the pacer thread spent in those
+	 * hrtimer sleeps, as measured with get_cycles(). Before the pacer
+	 * slept, this time was spent spinning and counted in @pacer_cycles.
+	 */
+	__u64 pacer_sleep_cycles;
+
+	/**
+	 * @nic_queue_samples: total number of times the NIC's actual
+	 * queue length was sampled to correct homa->link_idle_time.
+	 */
+	__u64 nic_queue_samples;
+
+	/**
+	 * @nic_queue_underestimate_cycles: sum, over all NIC queue samples
+	 * where homa->link_idle_time underestimated the NIC queue, of the
+	 * amount of the error (in get_cycles() units).
+	 */
+	__u64 nic_queue_underestimate_cycles;
+
+	/**
+	 * @nic_queue_overestimate_cycles: sum, over all NIC queue samples
+	 * where homa->link_idle_time overestimated the NIC queue, of the
+	 * amount of the error (in get_cycles() units).
+	 */
+	__u64 nic_queue_overestimate_cycles;
+
 	/**
 	 * @throttled_cycles: total amount of time that @homa->throttled_rpcs
 	 * is nonempty, as measured with get_cycles().
@@ -2096,6 +2217,30 @@ struct homa_metrics {
 	 */
 	__u64 peer_route_errors;
 
+	/**
+	 * @peer_evictions: total number of idle peers deleted from the
+	 * peer table by homa_peertab_gc_peers.
+	 */
+	__u64 peer_evictions;
+
+	/**
+	 * @peer_forced_evictions: the subset of @peer_evictions that
+	 * happened only because the peer table exceeded homa->max_peers.
+	 */
+	__u64 peer_forced_evictions;
+
+	/**
+	 * @peer_gc_cycles: total time spent in homa_peertab_gc_peers, as
+	 * measured with get_cycles().
+	 */
+	__u64 peer_gc_cycles;
+
+	/**
+	 * @peertab_resizes: total number of times a resize of the peer
+	 * table's bucket array completed.
+	 */
+	__u64 peertab_resizes;
+
 	/**
 	 * @control_xmit_errors errors: total number of times ip_queue_xmit
 	 * failed when transmitting a control packet.
@@ -2193,6 +2338,12 @@ struct homa_metrics {
 	 */
 	__u64 server_lock_miss_cycles;
 
+	/**
+	 * @client_id_blocks: total number of times a core reserved a new
+	 * block of client RPC ids from homa->next_outgoing_id.
+	 */
+	__u64 client_id_blocks;
+
 	/**
 	 * @socket_lock_miss_cycles: total time spent waiting for socket
 	 * lock misses, measured by get_cycles().
@@ -2205,6 +2356,18 @@ struct homa_metrics {
 	 */
 	__u64 socket_lock_misses;
 
+	/**
+	 * @ready_lock_miss_cycles: total time spent waiting for socket
+	 * ready_lock misses, measured by get_cycles().
+	 */
+	__u64 ready_lock_miss_cycles;
+
+	/**
+	 * @ready_lock_misses: total number of times that Homa had to wait
+	 * to acquire a socket's ready_lock.
+	 */
+	__u64 ready_lock_misses;
+
 	/**
 	 * @throttle_lock_miss_cycles: total time spent waiting for throttle
 	 * lock misses, measured by get_cycles().
@@ -2302,17 +2465,216 @@ struct homa_metrics {
 	 */
 	__u64 ack_overflows;
 
+	/**
+	 * @piggybacked_acks: total number of acks sent in DATA, GRANT,
+	 * RESEND, and BUSY packets (rather than explicit ACKs).
+	 */
+	__u64 piggybacked_acks;
+
 	/**
 	 * @ignored_need_acks: total number of times that a NEED_ACK packet
 	 * was ignored because the RPC's result hadn't been fully received.
 	 */
 	__u64 ignored_need_acks;
 
+	/**
+	 * @bundled_control_pkts: total number of control packets that
+	 * were transmitted as part of a BUNDLE packet rather than in
+	 * packets of their own.
+	 */
+	__u64 bundled_control_pkts;
+
+	/**
+	 * @softirq_cross_node: total number of times that homa_gro_complete
+	 * assigned SoftIRQ processing to a core on a different NUMA node
+	 * than the core doing GRO processing.
+	 */
+	__u64 softirq_cross_node;
+
+	/**
+	 * @softirq_steered: total number of times that homa_gro_complete
+	 * steered SoftIRQ processing to the core of a thread waiting for
+	 * the message (or its hyperthread sibling).
+	 */
+	__u64 softirq_steered;
+
+	/**
+	 * @softirq_reordered_pkts: total number of packets that homa_softirq
+	 * moved ahead of earlier-arriving packets in the same batch, in
+	 * order to process packets in SRPT order.
+	 */
+	__u64 softirq_reordered_pkts;
+
+	/**
+	 * @softirq_reorder_depth: sum, over all packets counted in
+	 * @softirq_reordered_pkts, of the number of packets each was
+	 * moved ahead of.
+	 */
+	__u64 softirq_reorder_depth;
+
+	/**
+	 * @softirq_short_msgs: total number of single-packet messages
+	 * whose DATA packet was dispatched by homa_softirq.
+	 */
+	__u64 softirq_short_msgs;
+
+	/**
+	 * @softirq_grouped_pkts: total number of DATA packets that
+	 * homa_softirq moved within a batch so that they would be processed
+	 * immediately after other packets of the same message (each such
+	 * move typically saves one RPC lookup and lock acquisition).
+	 */
+	__u64 softirq_grouped_pkts;
+
+	/**
+	 * @gro_coalesced_pkts: total number of DATA packets whose data
+	 * homa_gro_receive merged into the preceding packet for the same
+	 * message (HOMA_GRO_COALESCE), so they never reached homa_softirq
+	 * as separate packets.
+	 */
+	__u64 gro_coalesced_pkts;
+
+	/**
+	 * @fast_acks: total number of ACK packets handled at NAPI level
+	 * because of HOMA_GRO_FAST_CONTROL.
+	 */
+	__u64 fast_acks;
+
+	/**
+	 * @fast_busys: total number of BUSY packets handled at NAPI level
+	 * because of HOMA_GRO_FAST_CONTROL.
+	 */
+	__u64 fast_busys;
+
+	/**
+	 * @fast_need_acks: total number of NEED_ACK packets handled at NAPI
+	 * level because of HOMA_GRO_FAST_CONTROL.
+	 */
+	__u64 fast_need_acks;
+
+	/**
+	 * @fast_control_lock_busy: total number of ACK packets that
+	 * HOMA_GRO_FAST_CONTROL left for normal SoftIRQ processing because
+	 * their socket's lock was held.
+	 */
+	__u64 fast_control_lock_busy;
+
+	/**
+	 * @busy_polls: total number of times that homa_wait_for_message
+	 * polled the NIC directly (via napi_busy_loop) because the socket
+	 * has SO_BUSY_POLL enabled.
+	 */
+	__u64 busy_polls;
+
+	/**
+	 * @busy_poll_wakeups: total number of times that a message
+	 * became ready for a thread during one of its @busy_polls.
+	 */
+	__u64 busy_poll_wakeups;
+
+	/**
+	 * @dispatch_rpc_locks: total number of times homa_pkt_dispatch had
+	 * to look up and lock an RPC because it wasn't already locked in
+	 * the lock cache. Dividing by the total packets received gives lock
+	 * acquisitions per packet; adding @softirq_grouped_pkts estimates
+	 * what that would have been without grouping.
+	 */
+	__u64 dispatch_rpc_locks;
+
+	/**
+	 * @softirq_short_delay_cycles: total time between the start of
+	 * homa_softirq and the dispatch of the packets counted in
+	 * @softirq_short_msgs (i.e. time spent waiting behind other packets
+	 * in the same batch), as measured with get_cycles().
+	 */
+	__u64 softirq_short_delay_cycles;
+
+	/**
+	 * @softirq_short_delay_hist: histogram of the delays summed in
+	 * @softirq_short_delay_cycles, for tail latency. Entry 0 counts
+	 * delays under 1 us; entry i counts delays of 2^(i-1) to 2^i - 1 us,
+	 * except that the last entry counts all larger delays.
+	 */
+	__u64 softirq_short_delay_hist[HOMA_SHORT_DELAY_BUCKETS];
+
+	/**
+	 * @copy_out_local_bytes: total bytes copied to user space by
+	 * homa_message_in_copy_data on the core (or a hyperthread sibling
+	 * of the core) that did SoftIRQ processing for the message.
+	 */
+	__u64 copy_out_local_bytes;
+
+	/**
+	 * @copy_out_local_cycles: total time spent in homa_message_in_copy_data
+	 * for the bytes in @copy_out_local_bytes, as measured with get_cycles().
+	 */
+	__u64 copy_out_local_cycles;
+
+	/**
+	 * @copy_out_remote_bytes: total bytes copied to user space by
+	 * homa_message_in_copy_data on a core unrelated to the one that did
+	 * SoftIRQ processing for the message.
+	 */
+	__u64 copy_out_remote_bytes;
+
+	/**
+	 * @copy_out_remote_cycles: total time spent in
+	 * homa_message_in_copy_data for the bytes in @copy_out_remote_bytes,
+	 * as measured with get_cycles().
+	 */
+	__u64 copy_out_remote_cycles;
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
 };
 
+/**
+ * struct homa_softirq_key - Determines the order in which homa_softirq
+ * processes the packets in a batch (see homa_softirq_key).
+ */
+struct homa_softirq_key {
+	/**
+	 * @msg: Identifies the packet's message; packets are sorted first
+	 * by this field. 0 for control packets.
+	 */
+	__u64 msg;
+
+	/** @offset: Offset of the packet's data within its message. */
+	__u32 offset;
+};
+
+/**
+ * struct homa_bundle - Accumulates control packets destined for a single
+ * peer, so that they can be transmitted together in one BUNDLE packet.
+ */
+struct homa_bundle {
+	/** @peer: Machine to which the control packets will be sent. */
+	struct homa_peer *peer;
+
+	/**
+	 * @hsk: Socket via which the bundle will be transmitted (the
+	 * socket that generated the first packet in the bundle).
+	 */
+	struct homa_sock *hsk;
+
+	/** @num_items: Number of control packets currently in @data. */
+	int num_items;
+
+	/**
+	 * @length: Number of bytes of @data that are currently occupied,
+	 * including space for the bundle_header.
+	 */
+	int length;
+
+	/**
+	 * @data: Contents of the BUNDLE packet: a bundle_header (filled in
+	 * at transmit time) followed by entries in the format described
+	 * for struct bundle_header.
+	 */
+	char data[sizeof(struct bundle_header) + HOMA_MAX_BUNDLE_BYTES];
+};
+
 /**
  * struct homa_core - Homa allocates one of these structures for each
  * core, to hold information that needs to be kept on a per-core basis.
@@ -2349,6 +2711,24 @@ struct homa_core {
 	 */
 	int softirq_offset;
 
+	/**
+	 * @numa_node: the NUMA node that this core belongs to.
+	 */
+	int numa_node;
+
+	/**
+	 * @topo_candidates: cores to consider for SoftIRQ processing of
+	 * packets that arrive at GRO level on this core, when the
+	 * HOMA_GRO_TOPOLOGY policy is selected; computed by
+	 * homa_gro_topology_init from the CPU topology, best first.
+	 */
+	int topo_candidates[CORES_TO_CHECK];
+
+	/**
+	 * @smt_sibling: a hyperthread sibling of this core, or -1 if none.
+	 */
+	int smt_sibling;
+
         /**
          * held_skb: last packet buffer known to be available for
          * merging other packets into on this core (note: may not still
@@ -2376,6 +2756,37 @@ struct homa_core {
 	 */
 	__u64 syscall_end_time;
 
+	/**
+	 * @bundling: nonzero means homa_softirq is running on this core
+	 * and control packets should be accumulated in @bundles rather
+	 * than transmitted immediately.
+	 */
+	int bundling;
+
+	/**
+	 * @next_client_id: id to assign to the next client RPC created
+	 * on this core; always even. Meaningless if it is equal to
+	 * @client_id_limit.
+	 */
+	__u64 next_client_id;
+
+	/**
+	 * @client_id_limit: the end (exclusive) of the block of ids
+	 * from which @next_client_id is allocated. When @next_client_id
+	 * reaches this value, a new block must be reserved from
+	 * homa->next_outgoing_id.
+	 */
+	__u64 client_id_limit;
+
+	/** @num_bundles: Number of entries in @bundles currently in use. */
+	int num_bundles;
+
+	/**
+	 * @bundles: control packets waiting to be transmitted at the end
+	 * of homa_softirq, grouped by peer.
+	 */
+	struct homa_bundle bundles[HOMA_BUNDLE_PEERS];
+
 	/** @metrics: performance statistics for this core. */
 	struct homa_metrics metrics;
 };
@@ -2424,9 +2835,9 @@ static inline struct homa_rpc_bucket *homa_client_rpc_bucket(
 		struct homa_sock *hsk, __u64 id)
 {
 	/* We can use a really simple hash function here because RPC ids
-	 * are allocated sequentially.
+	 * are allocated sequentially and are unique across all sockets.
 	 */
-	return &hsk->client_rpc_buckets[(id >> 1)
+	return &hsk->homa->client_rpc_buckets[(id >> 1)
 			& (HOMA_CLIENT_RPC_BUCKETS - 1)];
 }
 
@@ -2441,6 +2852,35 @@ static inline int homa_data_offset(struct sk_buff *skb)
 			->seg.offset);
 }
 
+/**
+ * homa_pkt_ack() - Find the piggybacked ack in an incoming GRANT, RESEND,
+ * or BUSY packet.
+ * @h:       Homa header of the packet.
+ * @length:  Number of bytes of the packet available starting at @h.
+ *
+ * Return:   The packet's ack (which is unused if its client_id is zero),
+ *           or NULL if the packet has no ack: either it is of another
+ *           type, or it came from a peer running an earlier version of
+ *           Homa, whose headers end just before the ack.
+ */
+static inline struct homa_ack *homa_pkt_ack(struct common_header *h,
+		int length)
+{
+	struct homa_ack *ack;
+
+	if (h->type == GRANT)
+		ack = &((struct grant_header *) h)->ack;
+	else if (h->type == RESEND)
+		ack = &((struct resend_header *) h)->ack;
+	else if (h->type == BUSY)
+		ack = &((struct busy_header *) h)->ack;
+	else
+		return NULL;
+	if (((char *) (ack + 1)) > (((char *) h) + length))
+		return NULL;
+	return ack;
+}
+
 /*
  * homa_interest_set() - Assign a particular RPC to a particular interest;
  * this synchronizes with a thread waiting for the RPC.
@@ -2492,18 +2932,25 @@ static inline int homa_port_hash(__u16 port)
  * homa_server_rpc_bucket() - Find the bucket containing a given
  * server RPC.
  * @hsk:         Socket associated with the RPC.
+ * @saddr:       Address of the client that issued the RPC.
  * @id:          Id of the desired RPC.
  *
  * Return:    The bucket in which this RPC will appear, if the RPC exists.
  */
 static inline struct homa_rpc_bucket *homa_server_rpc_bucket(
-		struct homa_sock *hsk, __u64 id)
+		struct homa_sock *hsk, const struct in6_addr *saddr, __u64 id)
 {
 	/* Each client allocates RPC ids sequentially, so they will
-	 * naturally distribute themselves across the hash space.
-	 * Thus we can use the id directly as hash.
+	 * naturally distribute themselves across the hash space. However,
+	 * different clients (and the same client talking to different
+	 * sockets) use similar id sequences, so the socket and client
+	 * address select a starting offset that the id is added to. Both
+	 * are fixed for the life of the RPC (the socket's port isn't: it
+	 * can change in homa_sock_bind).
 	 */
-	return &hsk->server_rpc_buckets[(id >> 1)
+	__u32 offset = hash_32(ipv6_addr_hash(saddr), 32) ^ hash_ptr(hsk, 32);
+
+	return &hsk->homa->server_rpc_buckets[(offset + (id >> 1))
 			& (HOMA_SERVER_RPC_BUCKETS - 1)];
 }
 
@@ -2517,6 +2964,36 @@ static inline void homa_set_doff(struct data_header *h)
 			- sizeof(struct data_segment)) << 2;
 }
 
+/**
+ * homa_steer_bucket() - Returns the entry in homa->rx_steer to use for
+ * a given RPC.
+ * @homa:   Overall data about the Homa protocol implementation.
+ * @id:     Local id of the RPC.
+ */
+static inline struct homa_rx_steer *homa_steer_bucket(struct homa *homa,
+		__u64 id)
+{
+	/* The low-order bit of an id only distinguishes client from
+	 * server, so skip it.
+	 */
+	return &homa->rx_steer[(id >> 1) & (HOMA_STEER_BUCKETS - 1)];
+}
+
+/**
+ * homa_set_csum_info() - Fills in the sk_buff fields that tell lower
+ * levels of the stack how to compute the checksum for an outgoing Homa
+ * packet. Invoked once, when the packet is created, rather than each time
+ * it is transmitted.
+ * @skb:   Outgoing packet; its transport header must already be set.
+ */
+static inline void homa_set_csum_info(struct sk_buff *skb)
+{
+	skb->ooo_okay = 1;
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct common_header, checksum);
+}
+
 static inline struct homa_sock *homa_sk(const struct sock *sk)
 {
 	return (struct homa_sock *)sk;
@@ -2546,6 +3023,25 @@ static inline void homa_sock_unlock(struct homa_sock *hsk) {
 	spin_unlock_bh(&hsk->lock);
 }
 
+/**
+ * homa_sock_ready_lock() - Acquire the ready_lock for a socket (which
+ * protects its ready queues and interests). If the lock isn't immediately
+ * available, record stats on the waiting time.
+ * @hsk:     Socket to lock.
+ */
+static inline void homa_sock_ready_lock(struct homa_sock *hsk) {
+	if (!spin_trylock_bh(&hsk->ready_lock))
+		homa_sock_ready_lock_slow(hsk);
+}
+
+/**
+ * homa_sock_ready_unlock() - Release the ready_lock for a socket.
+ * @hsk:   Socket to unlock.
+ */
+static inline void homa_sock_ready_unlock(struct homa_sock *hsk) {
+	spin_unlock_bh(&hsk->ready_lock);
+}
+
 /**
  * homa_peer_lock() - Acquire the lock for a peer's @unacked_lock. If the lock
  * isn't immediately available, record stats on the waiting time.
@@ -2567,6 +3063,33 @@ static inline void homa_peer_unlock(struct homa_peer *peer)
 	spin_unlock_bh(&peer->ack_lock);
 }
 
+/**
+ * homa_peer_hold() - Record that an RPC refers to a peer, so that the
+ * peer won't be evicted from the peer table.
+ * @peer:   Peer returned by homa_peer_find.
+ *
+ * Return:  Nonzero for success; zero means the peer is being evicted and
+ *          the caller must look it up again.
+ */
+static inline int homa_peer_hold(struct homa_peer *peer)
+{
+	return atomic_inc_unless_negative(&peer->refs);
+}
+
+/**
+ * homa_peer_put() - Release a reference acquired with homa_peer_hold.
+ * @peer:   Peer that is no longer used by an RPC.
+ */
+static inline void homa_peer_put(struct homa_peer *peer)
+{
+	/* Must update access_jiffies before the reference count, so that
+	 * homa_peertab_gc_peers won't evict the peer immediately.
+	 */
+	WRITE_ONCE(peer->access_jiffies, jiffies);
+	smp_mb__before_atomic();
+	atomic_dec(&peer->refs);
+}
+
 /**
  * homa_protect_rpcs() - Ensures that no RPCs will be reaped for a given
  * socket until until homa_sock_unprotect is called. Typically
@@ -2600,6 +3123,17 @@ static inline void homa_unprotect_rpcs(struct homa_sock *hsk)
 	atomic_dec(&hsk->protect_count);
 }
 
+/**
+ * homa_rpc_reset_silence() - Record that progress has just been made on
+ * an RPC, so that homa_timer won't need to send RESENDs for it for a while.
+ * @rpc:    RPC that has made progress; must be locked by caller.
+ */
+static inline void homa_rpc_reset_silence(struct homa_rpc *rpc)
+{
+	rpc->silent_ticks = 0;
+	rpc->silent_base = rpc->hsk->homa->timer_ticks;
+}
+
 /**
  * homa_grantable_lock() - Acquire the grantable lock. If the lock
  * isn't immediately available, record stats on the waiting time.
@@ -2752,6 +3286,12 @@ extern void     homa_append_metric(struct homa *homa, const char* format, ...);
 extern int      homa_backlog_rcv(struct sock *sk, struct sk_buff *skb);
 extern int      homa_bind(struct socket *sk, struct sockaddr *addr,
                     int addr_len);
+extern int      homa_bundle_add(void *contents, size_t length,
+                    struct homa_peer *peer, struct homa_sock *hsk);
+extern void     homa_bundle_flush(void);
+extern void     homa_bundle_start(void);
+extern struct sk_buff
+               *homa_bundle_unpack(struct sk_buff *skb);
 extern void     homa_check_grantable(struct homa *homa, struct homa_rpc *rpc);
 extern int      homa_check_rpc(struct homa_rpc *rpc);
 extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
@@ -2772,9 +3312,13 @@ extern void     homa_dst_refresh(struct homa_peertab *peertab,
 extern int      homa_err_handler_v4(struct sk_buff *skb, u32 info);
 extern int      homa_err_handler_v6(struct sk_buff *skb, struct inet6_skb_parm *
                     , u8,  u8,  int,  __be32);
+extern struct sk_buff
+               *homa_fill_chunk(struct homa_sock *hsk, struct homa_peer *peer,
+                    int dport, __u64 id, struct iov_iter *iter, int len,
+                    int max_bytes);
 extern struct sk_buff
                *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
-                    struct iov_iter *iter);
+                    int dport, __u64 id, struct iov_iter *iter);
 extern struct homa_rpc
                *homa_find_client_rpc(struct homa_sock *hsk, __u64 id);
 extern struct homa_rpc
@@ -2791,6 +3335,7 @@ extern int      homa_getsockopt(struct sock *sk, int level, int optname,
 extern int      homa_grant_fifo(struct homa *homa);
 extern void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 extern int      homa_gro_complete(struct sk_buff *skb, int thoff);
+extern void     homa_gro_topology_init(void);
 extern struct sk_buff
                *homa_gro_receive(struct list_head *gro_list,
                     struct sk_buff *skb);
@@ -2802,10 +3347,13 @@ extern enum hrtimer_restart
                 homa_hrtimer(struct hrtimer *timer);
 extern int      homa_init(struct homa *homa);
 extern void     homa_incoming_sysctl_changed(struct homa *homa);
+extern void     homa_interest_stop_polling(struct homa_sock *hsk,
+                    struct homa_interest *interest);
 extern int      homa_ioc_abort(struct sock *sk, unsigned long arg);
 extern int      homa_ioc_recv(struct sock *sk, unsigned long arg);
 extern int      homa_ioc_reply(struct sock *sk, unsigned long arg);
 extern int      homa_ioc_send(struct sock *sk, unsigned long arg);
+extern int      homa_ioc_wait_stats(struct sock *sk, unsigned long arg);
 extern int      homa_ioctl(struct sock *sk, int cmd, unsigned long arg);
 extern void     homa_log_grantable_list(struct homa *homa);
 extern void     homa_log_throttled(struct homa *homa);
@@ -2814,7 +3362,9 @@ extern int      homa_message_in_copy_data(struct homa_message_in *msgin,
 extern void     homa_message_in_init(struct homa_message_in *msgin, int length,
 		    int incoming);
 extern void     homa_message_out_destroy(struct homa_message_out *msgout);
-extern void     homa_message_out_init(struct homa_rpc *rpc, int sport,
+extern int      homa_message_out_fill(struct homa_rpc *rpc,
+                    struct iov_iter *iter);
+extern void     homa_message_out_init(struct homa_rpc *rpc,
                     struct sk_buff *skb, int len);
 extern loff_t   homa_metrics_lseek(struct file *file, loff_t offset,
 		    int whence);
@@ -2822,14 +3372,21 @@ extern int      homa_metrics_open(struct inode *inode, struct file *file);
 extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
                     size_t length, loff_t *offset);
 extern int      homa_metrics_release(struct inode *inode, struct file *file);
+extern int      homa_napi_poll(struct homa_sock *hsk,
+                    struct homa_interest *interest, __u64 end);
 extern void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc);
+extern __u64    homa_next_client_id(struct homa *homa);
+extern int      homa_nic_inflight(struct net_device *dev);
+extern void     homa_nic_queue_feedback(struct homa *homa, int inflight,
+                    __u64 now);
 extern int      homa_offload_end(void);
 extern int      homa_offload_init(void);
 extern void     homa_outgoing_sysctl_changed(struct homa *homa);
 extern int      homa_pacer_main(void *transportInfo);
+extern bool     homa_pacer_sleep(struct homa *homa, __u64 *deadline);
 extern void     homa_pacer_stop(struct homa *homa);
-extern void     homa_pacer_xmit(struct homa *homa);
+extern void     homa_pacer_xmit(struct homa *homa, bool force);
 extern void     homa_peertab_destroy(struct homa_peertab *peertab);
 extern int      homa_peertab_init(struct homa_peertab *peertab);
 extern void     homa_peer_add_ack(struct homa_rpc *rpc);
@@ -2838,12 +3395,16 @@ extern struct homa_peer
 			const struct in6_addr *addr, struct inet_sock *inet);
 extern int      homa_peer_get_acks(struct homa_peer *peer, int count,
 		    struct homa_ack *dst);
+extern int      homa_peer_get_ack_batch(struct homa_peer *peer,
+		    struct ack_batch *batch);
 extern struct dst_entry
                *homa_peer_get_dst(struct homa_peer *peer,
 			struct inet_sock *inet);
 extern void     homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1,
                     int c2, int c3, int c4, int c5, int c6, int c7);
 extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now);
+extern void     homa_peertab_check_size(struct homa_peertab *peertab);
+extern void     homa_peertab_gc_peers(struct homa *homa);
 extern void     homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_lcache *lcache, int *delta);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
@@ -2875,6 +3436,8 @@ extern void     homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 extern void     homa_rpc_abort(struct homa_rpc *crpc, int error);
 extern void     homa_rpc_acked(struct homa_sock *hsk,
 			const struct in6_addr *saddr, struct homa_ack *ack);
+extern void     homa_rpc_acked_trailer(struct sk_buff *skb,
+			struct homa_sock *hsk, int offset, int count);
 extern void     homa_rpc_free(struct homa_rpc *rpc);
 extern void     homa_rpc_free_rcu(struct rcu_head *rcu_head);
 extern void     homa_rpc_log(struct homa_rpc *rpc);
@@ -2905,6 +3468,9 @@ extern struct homa_sock *
                     homa_sock_find(struct homa_socktab *socktab, __u16 port);
 extern void     homa_sock_init(struct homa_sock *hsk, struct homa *homa);
 extern void     homa_sock_shutdown(struct homa_sock *hsk);
+extern void     homa_sock_wait_adapt(struct homa_sock *hsk);
+extern void     homa_sock_wait_record(struct homa_sock *hsk, int fast,
+                    __u64 poll_cycles, __s64 wait_cycles);
 extern int      homa_socket(struct sock *sk);
 extern void     homa_socktab_destroy(struct homa_socktab *socktab);
 extern void     homa_socktab_init(struct homa_socktab *socktab);
@@ -2914,11 +3480,16 @@ extern struct homa_sock
                *homa_socktab_start_scan(struct homa_socktab *socktab,
                     struct homa_socktab_scan *scan);
 extern int      homa_softirq(struct sk_buff *skb);
+extern void     __homa_softirq(struct sk_buff *skb);
 extern void     homa_spin(int usecs);
 extern char    *homa_symbol_for_state(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_type(uint8_t type);
 extern void     homa_timer(struct homa *homa);
+extern void     homa_timer_arm(struct homa_rpc *rpc, int ticks);
+extern void     homa_timer_disarm(struct homa_rpc *rpc);
 extern int      homa_timer_main(void *transportInfo);
+extern struct homa_rpc
+               *homa_timer_next_due(struct homa_sock *hsk);
 extern void     homa_unhash(struct sock *sk);
 extern void     homa_unknown_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 extern int      homa_unsched_priority(struct homa *homa,
@@ -2965,7 +3536,7 @@ static inline void homa_check_pacer(struct homa *homa, int softirq)
 			atomic64_read(&homa->link_idle_time))
 		return;
 	tt_record("homa_check_pacer calling homa_pacer_xmit");
-	homa_pacer_xmit(homa);
+	homa_pacer_xmit(homa, false);
 	INC_METRIC(pacer_needed_help, 1);
 }
 
@@ -38,6 +38,7 @@ void homa_message_in_init(struct homa_message_in *msgin, int length,
 	msgin->scheduled = length > incoming;
 	msgin->xfer_offset = 0;
 	msgin->xfer_skb = NULL;
+	msgin->softirq_core = -1;
 	if (length < HOMA_NUM_SMALL_COUNTS*64) {
 		INC_METRIC(small_msg_bytes[(length-1) >> 6], length);
 	} else if (length < HOMA_NUM_MEDIUM_COUNTS*1024) {
@@ -78,7 +79,7 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 	skb_queue_reverse_walk(&rpc->msgin.packets, skb2) {
 		struct data_header *h2 = (struct data_header *) skb2->data;
 		int offset2 = ntohl(h2->seg.offset);
-		int data_bytes2 = skb2->len - sizeof32(struct data_header);
+		int data_bytes2 = ntohl(h2->seg.segment_length);
 		if (offset2 < offset) {
 			floor = offset2 + data_bytes2;
 			break;
@@ -131,8 +132,11 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 int homa_message_in_copy_data(struct homa_message_in *msgin,
 		struct iov_iter *iter, int max_bytes)
 {
-	int err;
+	int err = 0;
 	int remaining = max_bytes;
+	int core = raw_smp_processor_id();
+	int softirq_core = msgin->softirq_core;
+	__u64 start = get_cycles();
 
 	/* Do the right thing even if packets have overlapping ranges.
 	 * In practice, this shouldn't ever be necessary.
@@ -156,7 +160,7 @@ int homa_message_in_copy_data(struct homa_message_in *msgin,
 				sizeof(*h) + (msgin->xfer_offset - this_offset),
 				iter, this_size);
 		if (err) {
-			return err;
+			break;
 		}
 		remaining -= this_size;
 		msgin->xfer_offset += this_size;
@@ -164,6 +168,21 @@ int homa_message_in_copy_data(struct homa_message_in *msgin,
 			break;
 		}
 	}
+
+	/* Measure how much faster copies are when the data was processed
+	 * at SoftIRQ level on this core (or a sibling), i.e. the benefit
+	 * of HOMA_GRO_STEER.
+	 */
+	if ((softirq_core == core) || ((softirq_core >= 0)
+			&& (homa_cores[core]->smt_sibling == softirq_core))) {
+		INC_METRIC(copy_out_local_bytes, max_bytes - remaining);
+		INC_METRIC(copy_out_local_cycles, get_cycles() - start);
+	} else {
+		INC_METRIC(copy_out_remote_bytes, max_bytes - remaining);
+		INC_METRIC(copy_out_remote_cycles, get_cycles() - start);
+	}
+	if (err)
+		return err;
 	return max_bytes - remaining;
 }
 
@@ -253,7 +272,7 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 	struct homa_rpc *rpc;
 	__u64 id = homa_local_id(h->sender_id);
 
-	/* If there is an ack in the packet, handle it. Must do this
+	/* If there are acks in the packet, handle them. Must do this
 	 * before locking the packet's RPC, since we may need to acquire
 	 * (other) RPC locks to handle the acks.
 	 */
@@ -266,6 +285,19 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 			homa_lcache_release(lcache);
 			homa_rpc_acked(hsk, &saddr, &dh->seg.ack);
 		}
+		if (dh->extra_acks) {
+			homa_lcache_release(lcache);
+			homa_rpc_acked_trailer(skb, hsk, sizeof32(*dh)
+					+ ntohl(dh->seg.segment_length),
+					dh->extra_acks);
+		}
+	} else {
+		struct homa_ack *ack = homa_pkt_ack(h, skb->len);
+
+		if (ack && (ack->client_id != 0)) {
+			homa_lcache_release(lcache);
+			homa_rpc_acked(hsk, &saddr, ack);
+		}
 	}
 
 	/* Find and lock the RPC for this packet. */
@@ -295,8 +327,10 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		} else {
 			rpc = homa_find_client_rpc(hsk, id);
 		}
-		if (rpc)
+		if (rpc) {
 			homa_lcache_save(lcache, rpc);
+			INC_METRIC(dispatch_rpc_locks, 1);
+		}
 	}
 	if (unlikely(!rpc)) {
 		if ((h->type != CUTOFFS) && (h->type != NEED_ACK)
@@ -313,7 +347,7 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 	} else {
 		if ((h->type == DATA) || (h->type == GRANT)
 				|| (h->type == BUSY))
-			rpc->silent_ticks = 0;
+			homa_rpc_reset_silence(rpc);
 		rpc->peer->outstanding_resends = 0;
 	}
 
@@ -423,20 +457,21 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 		*delta += rpc->msgin.incoming;
 	}
 
+	rpc->msgin.softirq_core = raw_smp_processor_id();
 	old_remaining = rpc->msgin.bytes_remaining;
 	homa_add_packet(rpc, skb);
 	*delta -= old_remaining - rpc->msgin.bytes_remaining;
 
 	if (rpc->msgin.bytes_remaining == 0) {
 		homa_remove_from_grantable(homa, rpc);
-		homa_sock_lock(rpc->hsk, "homa_data_pkt");
+		homa_sock_ready_lock(rpc->hsk);
 
 		/* This check is needed for the special case where
 		 * homa_rpc_new_server already made the RPC ready.
 		 */
 		if (rpc->state == RPC_INCOMING)
 			homa_rpc_ready(rpc);
-		homa_sock_unlock(rpc->hsk);
+		homa_sock_ready_unlock(rpc->hsk);
 	} else if (rpc->msgin.scheduled)
 		homa_check_grantable(homa, rpc);
 
@@ -533,14 +568,13 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 			goto done;
 		}
 	}
-	if (rpc->msgout.next_packet && (homa_data_offset(rpc->msgout.next_packet)
-			< rpc->msgout.granted)) {
-		/* We have chosen not to transmit data from this message;
-		 * send BUSY instead.
+	if (homa_rpc_send_offset(rpc) < rpc->msgout.granted) {
+		/* We have chosen not to transmit data from this message
+		 * (or haven't finished copying it in); send BUSY instead.
 		 */
 		tt_record3("sending BUSY from resend, id %d, offset %d, "
 				"granted %d", rpc->id,
-				homa_data_offset(rpc->msgout.next_packet),
+				homa_rpc_send_offset(rpc),
 				rpc->msgout.granted);
 		homa_xmit_control(BUSY, &busy, sizeof(busy), rpc);
 	} else {
@@ -636,6 +670,7 @@ void homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk)
 		for (i = 1; i <HOMA_MAX_PRIORITIES; i++)
 			peer->unsched_cutoffs[i] = ntohl(h->unsched_cutoffs[i]);
 		peer->cutoff_version = h->cutoff_version;
+		peer->data_template.cutoff_version = h->cutoff_version;
 	}
 	kfree_skb(skb);
 }
@@ -653,8 +688,9 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 {
 	struct common_header *h = (struct common_header *) skb->data;
 	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
-	struct ack_header ack;
 	struct homa_peer *peer;
+	struct ack_batch ack;
+	int length;
 
 	/* Return if it's not safe for the peer to purge its state
 	 * for this RPC, or if we can't find peer info.
@@ -678,16 +714,15 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	 * other acks available for the peer. Note: can't use rpc below,
 	 * since it may be NULL.
 	 */
-	ack.common.type = ACK;
-	ack.common.sport = h->dport;
-	ack.common.dport = h->sport;
-	ack.common.sender_id = be64_to_cpu(homa_local_id(h->sender_id));
-	ack.num_acks = htons(homa_peer_get_acks(peer,
-			NUM_PEER_UNACKED_IDS, ack.acks));
-	__homa_xmit_control(&ack, sizeof(ack), peer, hsk);
+	ack.header.common.type = ACK;
+	ack.header.common.sport = h->dport;
+	ack.header.common.dport = h->sport;
+	ack.header.common.sender_id = be64_to_cpu(homa_local_id(h->sender_id));
+	length = homa_peer_get_ack_batch(peer, &ack);
+	__homa_xmit_control(&ack, length, peer, hsk);
 	tt_record3("Responded to NEED_ACK for id %d, peer %0x%x with %d "
 			"other acks", homa_local_id(h->sender_id),
-			tt_addr(saddr), ntohs(ack.num_acks));
+			tt_addr(saddr), ntohs(ack.header.num_acks));
 
     done:
 	kfree_skb(skb);
@@ -708,6 +743,7 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 {
 	struct ack_header *h = (struct ack_header *) skb->data;
 	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
+	__u64 id = homa_local_id(h->common.sender_id);
 	int i, count;
 
 	if (rpc != NULL) {
@@ -716,14 +752,75 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	}
 
 	count = ntohs(h->num_acks);
-	for (i = 0; i < count; i++)
+	for (i = 0; (i < count) && (i < NUM_PEER_UNACKED_IDS); i++)
 		homa_rpc_acked(hsk, &saddr, &h->acks[i]);
+	if (count > NUM_PEER_UNACKED_IDS)
+		homa_rpc_acked_trailer(skb, hsk, sizeof32(*h),
+				count - NUM_PEER_UNACKED_IDS);
 	tt_record3("ACK received for id %d, peer 0x%x, with %d other acks",
-			homa_local_id(h->common.sender_id),
-			tt_addr(saddr), count);
+			id, tt_addr(saddr), count);
 	kfree_skb(skb);
 }
 
+/**
+ * homa_bundle_unpack() - Split an incoming BUNDLE packet into the individual
+ * control packets that it contains.
+ * @skb:     Incoming BUNDLE packet; the Homa header must be at skb->data
+ *           (i.e. the IP header has already been pulled). The caller
+ *           retains ownership of this packet.
+ *
+ * Return:   A list (linked through the next field) of newly allocated
+ *           packet buffers, one for each control packet in @skb, each
+ *           of which looks exactly as if it had arrived from the network
+ *           on its own (including IP header). NULL means the bundle didn't
+ *           contain any valid packets. The caller owns the buffers.
+ */
+struct sk_buff *homa_bundle_unpack(struct sk_buff *skb)
+{
+	struct bundle_header *h = (struct bundle_header *) skb->data;
+	int ip_length = skb_transport_header(skb) - skb_network_header(skb);
+	struct sk_buff *first = NULL;
+	struct sk_buff **link = &first;
+	struct sk_buff *item;
+	int offset, end, length, i;
+
+	end = sizeof32(*h) + ntohs(h->length);
+	if ((end > skb->len) || !pskb_may_pull(skb, end)) {
+		INC_METRIC(short_packets, 1);
+		return NULL;
+	}
+
+	/* pskb_may_pull may have moved the data. */
+	h = (struct bundle_header *) skb->data;
+	offset = sizeof32(*h);
+	for (i = 0; (i < h->num_items) && (offset < end); i++) {
+		length = skb->data[offset];
+		offset++;
+		if ((length < sizeof32(struct common_header))
+				|| ((offset + length) > end)) {
+			INC_METRIC(short_packets, 1);
+			break;
+		}
+		item = alloc_skb(HOMA_SKB_EXTRA + ip_length + length,
+				GFP_ATOMIC);
+		if (unlikely(!item))
+			break;
+		skb_reserve(item, HOMA_SKB_EXTRA);
+		skb_reset_network_header(item);
+		skb_put_data(item, skb_network_header(skb), ip_length);
+		__skb_pull(item, ip_length);
+		skb_reset_transport_header(item);
+		skb_put_data(item, skb->data + offset, length);
+		item->dev = skb->dev;
+		skb_dst_copy(item, skb);
+		*link = item;
+		link = &item->next;
+		offset += length;
+	}
+	tt_record2("unpacked BUNDLE with %d items, %d bytes", i, end);
+	return first;
+}
+
 /**
  * homa_check_grantable() - This function ensures that an RPC is on a
  * grantable list if appropriate, and not on one otherwise. It also adjusts
@@ -743,9 +840,9 @@ void homa_check_grantable(struct homa *homa, struct homa_rpc *rpc)
 	/* No need to do anything unless this message is ready for more
 	 * grants.
 	 */
-	if (((rpc->msgin.incoming - (rpc->msgin.total_length
-			- rpc->msgin.bytes_remaining)) >= homa->rtt_bytes)
-			|| (rpc->msgin.incoming >= rpc->msgin.total_length))
+	if (!homa_grant_needed(rpc->msgin.total_length,
+			rpc->msgin.total_length - rpc->msgin.bytes_remaining,
+			rpc->msgin.incoming, homa->rtt_bytes))
 		return;
 
 	homa_grantable_lock(homa);
@@ -766,8 +863,10 @@ void homa_check_grantable(struct homa *homa, struct homa_rpc *rpc)
 		rpc->msgin.birth = get_cycles();
 		list_for_each_entry(candidate, &peer->grantable_rpcs,
 				grantable_links) {
-			if (candidate->msgin.bytes_remaining
-					> msgin->bytes_remaining) {
+			if (homa_srpt_precedes(msgin->bytes_remaining,
+					msgin->birth,
+					candidate->msgin.bytes_remaining,
+					candidate->msgin.birth)) {
 				list_add_tail(&rpc->grantable_links,
 						&candidate->grantable_links);
 				goto position_peer;
@@ -781,15 +880,10 @@ void homa_check_grantable(struct homa *homa, struct homa_rpc *rpc)
 		 * adjust its position in the list.
 		 */
 		candidate = list_prev_entry(rpc, grantable_links);
-		/* Fewer remaining bytes wins: */
-		if (candidate->msgin.bytes_remaining < msgin->bytes_remaining)
+		if (!homa_srpt_precedes(msgin->bytes_remaining, msgin->birth,
+				candidate->msgin.bytes_remaining,
+				candidate->msgin.birth))
 			goto position_peer;
-		/* Tie-breaker: oldest wins */
-		if (candidate->msgin.bytes_remaining == msgin->bytes_remaining) {
-			if (candidate->msgin.birth <= msgin->birth) {
-				goto position_peer;
-			}
-		}
 		__list_del_entry(&candidate->grantable_links);
 		list_add(&candidate->grantable_links, &rpc->grantable_links);
 	}
@@ -806,12 +900,10 @@ void homa_check_grantable(struct homa *homa, struct homa_rpc *rpc)
 				grantable_links) {
 			candidate = list_first_entry(&peer_cand->grantable_rpcs,
 					struct homa_rpc, grantable_links);
-			if ((candidate->msgin.bytes_remaining
-					> msgin->bytes_remaining)
-					|| ((candidate->msgin.bytes_remaining
-					== msgin->bytes_remaining)
-					&& (candidate->msgin.birth
-					> msgin->birth))) {
+			if (homa_srpt_precedes(msgin->bytes_remaining,
+					msgin->birth,
+					candidate->msgin.bytes_remaining,
+					candidate->msgin.birth)) {
 				list_add_tail(&peer->grantable_links,
 						&peer_cand->grantable_links);
 				goto done;
@@ -827,10 +919,9 @@ void homa_check_grantable(struct homa *homa, struct homa_rpc *rpc)
 			peer, grantable_links);
 		candidate = list_first_entry(&prev_peer->grantable_rpcs,
 				struct homa_rpc, grantable_links);
-		if ((candidate->msgin.bytes_remaining < msgin->bytes_remaining)
-				|| ((candidate->msgin.bytes_remaining
-				== msgin->bytes_remaining)
-				&& (candidate->msgin.birth <= msgin->birth)))
+		if (!homa_srpt_precedes(msgin->bytes_remaining, msgin->birth,
+				candidate->msgin.bytes_remaining,
+				candidate->msgin.birth))
 			goto done;
 		__list_del_entry(&prev_peer->grantable_links);
 		list_add(&prev_peer->grantable_links, &peer->grantable_links);
@@ -896,33 +987,10 @@ void homa_send_grants(struct homa *homa)
 	}
 
 	/* Compute the window (how much granted-but-not-received data there
-	 * can be for each message. This will always be at least rtt_bytes,
-	 * but if there aren't enough messages to consume all of
-	 * max_incoming, then increase the window size to use it up
-	 * (except, keep rtt_bytes in reserve so we can fully grant
-	 * a new high-priority message).
+	 * can be for each message).
 	 */
-	if (homa->max_grant_window == 0) {
-		window = homa->rtt_bytes;
-	} else {
-		/* Experimental: compute the window (how much granted-but-not-
-		 * received data there can be for any given message. This will
-		 * always be at least rtt_bytes, but if there aren't enough
-		 * messages to consume all of max_incoming, then increase
-		 * the window size to use it up (except, keep rtt_bytes in
-		 * reserve so we can fully grant a new high-priority message).
-		 * This technique is risky because it could use up almost
-		 * all the grants on a single non-responsive host, which
-		 * could result in underutilization of our downlink if that
-		 * host stops responding.
-		 */
-		window = (homa->max_incoming
-				- homa->rtt_bytes)/num_grantable_peers;
-		if (window > homa->max_grant_window)
-			window = homa->max_grant_window;
-		if (window < homa->rtt_bytes)
-			window = homa->rtt_bytes;
-	}
+	window = homa_grant_window(homa->rtt_bytes, homa->max_incoming,
+			homa->max_grant_window, num_grantable_peers);
 
 	start = get_cycles();
 	homa_grantable_lock(homa);
@@ -933,7 +1001,7 @@ void homa_send_grants(struct homa *homa)
 	rank = 0;
 	list_for_each_entry_safe(peer, temp, &homa->grantable_peers,
 			grantable_links) {
-		int extra_levels, priority;
+		int priority;
 		int received, new_grant, increment;
 		struct grant_header *grant;
 
@@ -951,9 +1019,8 @@ void homa_send_grants(struct homa *homa)
 		 */
 		received = (candidate->msgin.total_length
 				- candidate->msgin.bytes_remaining);
-		new_grant = received + window;
-		if (new_grant > candidate->msgin.total_length)
-			new_grant = candidate->msgin.total_length;
+		new_grant = homa_grant_offset(candidate->msgin.total_length,
+				received, window);
 		increment = new_grant - candidate->msgin.incoming;
 		tt_record3("grant info: id %d, received %d, incoming %d",
 				candidate->id, received,
@@ -973,7 +1040,7 @@ void homa_send_grants(struct homa *homa)
 		 * resend (until we send the grant, timeouts won't occur
 		 * because there's no granted data).
 		 */
-		candidate->silent_ticks = 0;
+		homa_rpc_reset_silence(candidate);
 
 		/* Create a grant for this message. */
 		candidate->msgin.incoming = new_grant;
@@ -985,12 +1052,8 @@ void homa_send_grants(struct homa *homa)
 		grant = &grants[num_grants];
 		num_grants++;
 		grant->offset = htonl(new_grant);
-		priority = homa->max_sched_prio - (rank - 1);
-		extra_levels = homa->max_sched_prio + 1 - num_grantable_peers;
-		if (extra_levels >= 0)
-			priority -= extra_levels;
-		if (priority < 0)
-			priority = 0;
+		priority = homa_grant_priority(rank, homa->max_sched_prio,
+				num_grantable_peers);
 		grant->priority = priority;
 		tt_record4("sending grant for id %llu, offset %d, priority %d, "
 				"increment %d",
@@ -1076,7 +1139,7 @@ int homa_grant_fifo(struct homa *homa)
 			== oldest->msgin.incoming)
 		INC_METRIC(fifo_grants_no_incoming, 1);
 
-	oldest->silent_ticks = 0;
+	homa_rpc_reset_silence(oldest);
 	granted = homa->fifo_grant_increment;
 	oldest->msgin.incoming += granted;
 	if (oldest->msgin.incoming >= oldest->msgin.total_length) {
@@ -1182,42 +1245,59 @@ void homa_remove_from_grantable(struct homa *homa, struct homa_rpc *rpc)
  */
 void homa_log_grantable_list(struct homa *homa)
 {
-	int bucket, count;
+	int bucket, count, i;
+	struct homa_peer_buckets *table;
 	struct homa_peer *peer, *peer2;
 	struct homa_rpc *rpc;
 
 	printk(KERN_NOTICE "Logging Homa grantable list\n");
 	homa_grantable_lock(homa);
-	for (bucket = 0; bucket < HOMA_PEERTAB_BUCKETS; bucket++) {
-		hlist_for_each_entry_rcu(peer, &homa->peers.buckets[bucket],
-				peertab_links) {
-			printk(KERN_NOTICE "Checking peer %s\n",
-					homa_print_ipv6_addr(&peer->addr));
-			if (list_empty(&peer->grantable_rpcs))
-				continue;
-			count = 0;
-			list_for_each_entry(rpc, &peer->grantable_rpcs,
-					grantable_links) {
-				count++;
-				if (count > 10)
+	rcu_read_lock();
+	/* While the peer table is being resized, peers are split between
+	 * the old and new bucket arrays.
+	 */
+	for (i = 0; i < 2; i++) {
+		table = (i == 0) ? rcu_dereference(homa->peers.buckets)
+				: rcu_dereference(homa->peers.new_buckets);
+		if (!table)
+			continue;
+		for (bucket = 0; bucket < (1 << table->bits); bucket++) {
+			hlist_for_each_entry_rcu(peer, &table->heads[bucket],
+					peertab_links) {
+				printk(KERN_NOTICE "Checking peer %s\n",
+						homa_print_ipv6_addr(
+						&peer->addr));
+				if (list_empty(&peer->grantable_rpcs))
 					continue;
-				homa_rpc_log(rpc);
-			}
-			printk(KERN_NOTICE "Peer %s has %d grantable RPCs\n",
-					homa_print_ipv6_addr(&peer->addr),
-					count);
-			list_for_each_entry(peer2, &homa->grantable_peers,
-					grantable_links) {
-				if (peer2 == peer)
-					goto next_peer;
+				count = 0;
+				list_for_each_entry(rpc,
+						&peer->grantable_rpcs,
+						grantable_links) {
+					count++;
+					if (count > 10)
+						continue;
+					homa_rpc_log(rpc);
+				}
+				printk(KERN_NOTICE "Peer %s has %d grantable "
+						"RPCs\n", homa_print_ipv6_addr(
+						&peer->addr), count);
+				list_for_each_entry(peer2,
+						&homa->grantable_peers,
+						grantable_links) {
+					if (peer2 == peer)
+						goto next_peer;
+				}
+				printk(KERN_NOTICE "Peer %s has grantable "
+						"RPCs but isn't on "
+						"homa->grantable_peers\n",
+						homa_print_ipv6_addr(
+						&peer->addr));
+				next_peer:
+				continue;
 			}
-			printk(KERN_NOTICE "Peer %s has grantable RPCs but "
-					"isn't on homa->grantable_peers\n",
-					homa_print_ipv6_addr(&peer->addr));
-			next_peer:
-			continue;
 		}
 	}
+	rcu_read_unlock();
 	homa_grantable_unlock(homa);
 	printk(KERN_NOTICE "Finished logging Homa grantable list\n");
 }
@@ -1232,10 +1312,10 @@ void homa_rpc_abort(struct homa_rpc *crpc, int error)
 {
 	homa_remove_from_grantable(crpc->hsk->homa, crpc);
 	crpc->error = error;
-	homa_sock_lock(crpc->hsk, "homa_rpc_abort");
+	homa_sock_ready_lock(crpc->hsk);
 	if (!crpc->hsk->shutdown)
 		homa_rpc_ready(crpc);
-	homa_sock_unlock(crpc->hsk);
+	homa_sock_ready_unlock(crpc->hsk);
 }
 
 /**
@@ -1364,15 +1444,17 @@ int homa_register_interests(struct homa_interest *interest,
 {
 	struct homa_rpc *rpc = NULL;
 	struct in6_addr client_addr_as_ipv6 = canonical_ipv6_addr(client_addr);
+	int polling;
 
 	interest->thread = current;
 	interest->ready_rpc = NULL;
 	atomic_long_set(&interest->id, 0);
 	interest->reg_rpc = NULL;
+	interest->polling = 0;
 	interest->request_links.next = LIST_POISON1;
 	interest->response_links.next = LIST_POISON1;
 
-	/* Need both the RPC lock and the socket lock to avoid races. */
+	/* Need both the RPC lock and the ready lock to avoid races. */
 	if (id != 0) {
 		if (homa_is_client(id))
 			rpc = homa_find_client_rpc(hsk, id);
@@ -1387,9 +1469,9 @@ int homa_register_interests(struct homa_interest *interest,
 			return -EINVAL;
 		}
 	}
-	homa_sock_lock(hsk, "homa_register_interests");
+	homa_sock_ready_lock(hsk);
 	if (hsk->shutdown) {
-		homa_sock_unlock(hsk);
+		homa_sock_ready_unlock(hsk);
 		if (rpc)
 			homa_rpc_unlock(rpc);
 		return -ESHUTDOWN;
@@ -1401,7 +1483,7 @@ int homa_register_interests(struct homa_interest *interest,
 
 			/* Must also fill in interest->id; otherwise, some
 			 * other RPC might also get assigned to this interest
-			 * when we release the socket lock.
+			 * when we release the ready lock.
 			 */
 			goto claim_rpc;
 		}
@@ -1410,6 +1492,15 @@ int homa_register_interests(struct homa_interest *interest,
 		homa_rpc_unlock(rpc);
 	}
 
+	/* Only a limited number of threads may busy-wait on a socket at
+	 * once; the rest go to sleep right away. Polling threads are
+	 * placed at the front of the interest lists and the others at the
+	 * back, so that homa_rpc_ready hands messages to pollers first.
+	 */
+	polling = !(flags & HOMA_RECV_NONBLOCKING)
+			&& (atomic_read(&hsk->num_pollers)
+			< hsk->homa->max_pollers);
+
 	if (flags & HOMA_RECV_RESPONSE) {
 		if (!list_empty(&hsk->ready_responses)) {
 			rpc = list_first_entry(
@@ -1418,13 +1509,17 @@ int homa_register_interests(struct homa_interest *interest,
 					ready_links);
 			goto claim_rpc;
 		}
-		/* Insert this thread at the *front* of the list;
+		/* Insert a polling thread at the *front* of the list;
 		 * we'll get better cache locality if we reuse
 		 * the same thread over and over, rather than
 		 * round-robining between threads.  Same below.
 		 */
-		list_add(&interest->response_links,
-				&hsk->response_interests);
+		if (polling)
+			list_add(&interest->response_links,
+					&hsk->response_interests);
+		else
+			list_add_tail(&interest->response_links,
+					&hsk->response_interests);
 	}
 	if (flags & HOMA_RECV_REQUEST) {
 		if (!list_empty(&hsk->ready_requests)) {
@@ -1437,7 +1532,35 @@ int homa_register_interests(struct homa_interest *interest,
 				list_del(&interest->response_links);
 			goto claim_rpc;
 		}
-		list_add(&interest->request_links, &hsk->request_interests);
+		if (polling)
+			list_add(&interest->request_links,
+					&hsk->request_interests);
+		else
+			list_add_tail(&interest->request_links,
+					&hsk->request_interests);
+	}
+	if (polling) {
+		interest->polling = 1;
+		atomic_inc(&hsk->num_pollers);
+	}
+
+	/* Record this thread's core so that SoftIRQ processing for the
+	 * message(s) it is waiting for can be steered here (see
+	 * homa_steer_target). For a socket-wide wait this is only useful
+	 * if this thread is the only one waiting.
+	 */
+	if (id != 0) {
+		struct homa_rx_steer *steer = homa_steer_bucket(hsk->homa, id);
+
+		WRITE_ONCE(steer->cpu, raw_smp_processor_id());
+		WRITE_ONCE(steer->id, id);
+	} else if (((flags & HOMA_RECV_RESPONSE)
+			&& !list_is_singular(&hsk->response_interests))
+			|| ((flags & HOMA_RECV_REQUEST)
+			&& !list_is_singular(&hsk->request_interests))) {
+		WRITE_ONCE(hsk->receiver_cpu, -1);
+	} else {
+		WRITE_ONCE(hsk->receiver_cpu, raw_smp_processor_id());
 	}
 	goto done;
 
@@ -1451,8 +1574,94 @@ int homa_register_interests(struct homa_interest *interest,
 	}
 
     done:
-	homa_sock_unlock(hsk);
+	homa_sock_ready_unlock(hsk);
+	return 0;
+}
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/**
+ * struct homa_busy_poll_args - Passed to homa_busy_loop_end.
+ */
+struct homa_busy_poll_args {
+	/** @interest: Interest of the thread that is polling. */
+	struct homa_interest *interest;
+
+	/** @end: Polling must end at this time (in get_cycles units). */
+	__u64 end;
+};
+
+/**
+ * homa_busy_loop_end() - Invoked by napi_busy_loop to decide whether
+ * to stop polling.
+ * @p:           Points to a struct homa_busy_poll_args.
+ * @start_time:  Not used (polling is limited by homa->poll_cycles
+ *               instead of the socket's SO_BUSY_POLL value).
+ *
+ * Return:  True means polling should stop.
+ */
+static bool homa_busy_loop_end(void *p, unsigned long start_time)
+{
+	struct homa_busy_poll_args *args = p;
+
+	return atomic_long_read(&args->interest->id)
+			|| (get_cycles() >= args->end);
+}
+#endif
+
+/**
+ * homa_napi_poll() - If busy polling has been enabled for a socket (with
+ * SO_BUSY_POLL), poll the NIC queue on which the socket's packets
+ * arrive, so that incoming packets are processed on this core
+ * without waiting for an interrupt.
+ * @hsk:       Socket on which a thread is waiting.
+ * @interest:  Interest for the waiting thread.
+ * @end:       Time (in get_cycles units) when polling must end.
+ *
+ * Return:     Nonzero means that polling occurred; zero means busy
+ *             polling isn't enabled for @hsk (or no packets have arrived
+ *             yet, so it isn't known which queue to poll).
+ */
+int homa_napi_poll(struct homa_sock *hsk, struct homa_interest *interest,
+		__u64 end)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	struct homa_busy_poll_args args = {.interest = interest, .end = end};
+	unsigned int napi_id = READ_ONCE(hsk->sock.sk_napi_id);
+
+	if (!sk_can_busy_loop(&hsk->sock) || (napi_id < MIN_NAPI_ID))
+		return 0;
+	INC_METRIC(busy_polls, 1);
+	napi_busy_loop(napi_id, homa_busy_loop_end, &args, false,
+			BUSY_POLL_BUDGET);
+	if (atomic_long_read(&interest->id))
+		INC_METRIC(busy_poll_wakeups, 1);
+	return 1;
+#else
 	return 0;
+#endif
+}
+
+/**
+ * homa_interest_stop_polling() - Invoked when a thread stops busy-waiting
+ * for a message but hasn't yet received one: releases the thread's polling
+ * slot on the socket and moves its interest to the back of the socket's
+ * interest lists, so that messages go to threads that are still polling.
+ * @hsk:       Socket on which the thread is waiting; must not be locked.
+ * @interest:  The thread's interest; @interest->polling must be set.
+ */
+void homa_interest_stop_polling(struct homa_sock *hsk,
+		struct homa_interest *interest)
+{
+	homa_sock_ready_lock(hsk);
+	if (interest->request_links.next != LIST_POISON1)
+		list_move_tail(&interest->request_links,
+				&hsk->request_interests);
+	if (interest->response_links.next != LIST_POISON1)
+		list_move_tail(&interest->response_links,
+				&hsk->response_interests);
+	interest->polling = 0;
+	atomic_dec(&hsk->num_pollers);
+	homa_sock_ready_unlock(hsk);
 }
 
 /**
@@ -1475,7 +1684,7 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 {
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
-	uint64_t poll_start, now;
+	uint64_t poll_start, poll_cycles, now;
 	int error;
 
 	/* Normally this loop only gets executed once, but we may have
@@ -1521,9 +1730,20 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 
 		/* Busy-wait for a while before going to sleep; this avoids
-		 * context-switching overhead to wake up.
+		 * context-switching overhead to wake up. The polling time
+		 * is learned from this socket's recent waits (see
+		 * homa_sock_wait_adapt), capped by homa->poll_cycles.
 		 */
+		poll_cycles = hsk->homa->poll_cycles;
+		if (hsk->homa->poll_percentile
+				&& (READ_ONCE(hsk->poll_cycles) < poll_cycles))
+			poll_cycles = READ_ONCE(hsk->poll_cycles);
 		poll_start = get_cycles();
+		now = poll_start;
+		if (!interest.polling) {
+			INC_METRIC(poll_skips, 1);
+			goto sleep;
+		}
 		while (1) {
 			now = get_cycles();
 			if (atomic_long_read(&interest.id)) {
@@ -1533,16 +1753,22 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 						hsk->port, current->pid);
 				INC_METRIC(fast_wakeups, 1);
 				INC_METRIC(poll_cycles, now - poll_start);
+				homa_sock_wait_record(hsk, 1, now - poll_start,
+						now - poll_start);
 				goto got_error_or_rpc;
 			}
-			if (now >= (poll_start + hsk->homa->poll_cycles))
+			if (now >= (poll_start + poll_cycles))
 				break;
-			schedule();
+			if (!homa_napi_poll(hsk, &interest,
+					poll_start + poll_cycles))
+				schedule();
 		}
 		tt_record2("Poll ended unsuccessfully on socket %d, pid %d",
 				hsk->port, current->pid);
 		INC_METRIC(poll_cycles, now - poll_start);
+		homa_interest_stop_polling(hsk, &interest);
 
+sleep:
 		/* Now it's time to sleep. */
 		set_current_state(TASK_INTERRUPTIBLE);
 		tt_record1("homa_wait_for_message sleeping, pid %d",
@@ -1554,6 +1780,9 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 		__set_current_state(TASK_RUNNING);
 		INC_METRIC(slow_wakeups, 1);
+		homa_sock_wait_record(hsk, 0, now - poll_start,
+				atomic_long_read(&interest.id)
+				? (__s64) (get_cycles() - poll_start) : -1);
 		tt_record2("homa_wait_for_message woke up, id %d, "
 				"pid %d",
 				atomic_long_read(&interest.id),
@@ -1568,20 +1797,24 @@ got_error_or_rpc:
 		 * message could still be passed to us. Note: if we went to
 		 * sleep, then this info was already cleaned up by whoever
 		 * woke us up. Also, values in the interest may change between
-		 * when we test them below and when we acquire the socket lock.
+		 * when we test them below and when we acquire the ready lock.
 		 */
+		if (interest.polling) {
+			interest.polling = 0;
+			atomic_dec(&hsk->num_pollers);
+		}
 		if ((interest.reg_rpc)
 				|| (interest.request_links.next != LIST_POISON1)
 				|| (interest.response_links.next
 				!= LIST_POISON1)) {
-			homa_sock_lock(hsk, "homa_wait_for_message");
+			homa_sock_ready_lock(hsk);
 			if (interest.reg_rpc)
 				interest.reg_rpc->interest = NULL;
 			if (interest.request_links.next != LIST_POISON1)
 				list_del(&interest.request_links);
 			if (interest.response_links.next != LIST_POISON1)
 				list_del(&interest.response_links);
-			homa_sock_unlock(hsk);
+			homa_sock_ready_unlock(hsk);
 		}
 
 		/* Now check to see if we got a message to return (note that
@@ -1629,8 +1862,8 @@ got_error_or_rpc:
  * a waiting reader or queues the RPC. It also starts the process of acking
  * the RPC to its server.
  * @rpc:                RPC that now has a complete input message;
- *                      must be locked. The caller must also have
- *                      locked the socket for this RPC.
+ *                      must be locked. The caller must also hold
+ *                      the ready_lock for this RPC's socket.
  */
 void homa_rpc_ready(struct homa_rpc *rpc)
 {
@@ -1646,7 +1879,10 @@ void homa_rpc_ready(struct homa_rpc *rpc)
 		goto handoff;
 	}
 
-	/* Second, check the interest list for this type of RPC. */
+	/* Second, check the interest list for this type of RPC. Threads
+	 * that are still polling are at the front of these lists (see
+	 * homa_register_interests), so they are preferred.
+	 */
 	if (homa_is_client(rpc->id)) {
 		interest = list_first_entry_or_null(
 				&hsk->response_interests,
@@ -1677,14 +1913,14 @@ void homa_rpc_ready(struct homa_rpc *rpc)
 
 handoff:
 	/* We found a waiting thread. Wakeup the thread and cleanup its
-	 * interest info, so it won't have to acquire the socket lock
+	 * interest info, so it won't have to acquire the ready lock
 	 * again. This is also needed so no-one else attempts to give
 	 * this interest an RPC.
 	 */
 
 	/* The following line must be here, before resetting the interests,
 	 * in order to avoid a race with homa_wait_for_message (which
-	 * may not acquire the socket lock).
+	 * may not acquire the ready lock).
 	 */
 	homa_interest_set(interest, rpc);
 	wake_up_process(interest->thread);
@@ -67,6 +67,9 @@ static inline void homa_set_softirq_cpu(struct sk_buff *skb, int cpu)
 	struct rps_sock_flow_table *sock_flow_table;
 	int hash;
 
+	if (unlikely(homa_cores[cpu]->numa_node
+			!= homa_cores[raw_smp_processor_id()]->numa_node))
+		INC_METRIC(softirq_cross_node, 1);
 	sock_flow_table = rcu_dereference(rps_sock_flow_table);
 	if (sock_flow_table == NULL)
 		return;
@@ -80,6 +83,270 @@ static inline void homa_set_softirq_cpu(struct sk_buff *skb, int cpu)
 	__skb_set_sw_hash(skb, hash, false);
 }
 
+/**
+ * homa_topology_score() - Returns a measure of how desirable it is to
+ * perform SoftIRQ processing on one core for packets received at GRO
+ * level on another core.
+ * @core:   Core that performs GRO processing.
+ * @other:  Candidate core for SoftIRQ processing.
+ *
+ * Return:  Higher numbers are better. Cores on the same NUMA node are
+ *          preferred most strongly, then cores sharing a last-level
+ *          cache, and finally cores that are not hyperthread siblings
+ *          of @core (siblings compete with GRO for execution resources).
+ */
+static int homa_topology_score(int core, int other)
+{
+	int score = 0;
+	int same_package = (topology_physical_package_id(core)
+			== topology_physical_package_id(other));
+
+	if (cpu_to_node(core) == cpu_to_node(other))
+		score += 4;
+
+	/* The kernel doesn't export LLC masks to modules, so approximate
+	 * an LLC with a die.
+	 */
+	if (same_package && (topology_die_id(core) == topology_die_id(other)))
+		score += 2;
+	if (!same_package || (topology_core_id(core)
+			!= topology_core_id(other)))
+		score += 1;
+	return score;
+}
+
+/**
+ * homa_gro_topology_init() - Fill in the @topo_candidates array for each
+ * core, for use by the HOMA_GRO_TOPOLOGY policy. Must be invoked after
+ * homa_cores has been initialized.
+ */
+void homa_gro_topology_init(void)
+{
+	int core, i, j, n;
+
+	for (core = 0; core < nr_cpu_ids; core++) {
+		struct homa_core *hc = homa_cores[core];
+		int scores[CORES_TO_CHECK];
+
+		hc->numa_node = cpu_to_node(core);
+		hc->smt_sibling = -1;
+
+		/* Consider other cores in numeric order starting after
+		 * this one, so ties are broken the same way as the
+		 * non-topology policies. Keep the best CORES_TO_CHECK,
+		 * sorted by decreasing score.
+		 */
+		n = 0;
+		for (i = 1; i < nr_cpu_ids; i++) {
+			int other = (core + i) % nr_cpu_ids;
+			int score = homa_topology_score(core, other);
+
+			if ((hc->smt_sibling < 0)
+					&& (topology_physical_package_id(core)
+					== topology_physical_package_id(other))
+					&& (topology_core_id(core)
+					== topology_core_id(other)))
+				hc->smt_sibling = other;
+			for (j = n; j > 0; j--) {
+				if (scores[j-1] >= score)
+					break;
+				if (j < CORES_TO_CHECK) {
+					scores[j] = scores[j-1];
+					hc->topo_candidates[j] =
+							hc->topo_candidates[j-1];
+				}
+			}
+			if (j < CORES_TO_CHECK) {
+				scores[j] = score;
+				hc->topo_candidates[j] = other;
+				if (n < CORES_TO_CHECK)
+					n++;
+			}
+		}
+
+		/* With very few cores, some candidates must be repeated. */
+		if (n == 0)
+			hc->topo_candidates[n++] = core;
+		for (i = n; i < CORES_TO_CHECK; i++)
+			hc->topo_candidates[i] = hc->topo_candidates[i % n];
+	}
+}
+
+/**
+ * homa_steer_target() - Find the core of a thread that is waiting for
+ * the message in an incoming packet, for use by the HOMA_GRO_STEER policy.
+ * @h:      Header of the incoming packet.
+ *
+ * Return:  The core on which SoftIRQ processing should be done for the
+ *          packet (the waiting thread's core, or its hyperthread sibling
+ *          if the thread's core is already busy with SoftIRQ work), or
+ *          -1 if no waiting thread is known.
+ */
+static int homa_steer_target(struct common_header *h)
+{
+	__u64 id = homa_local_id(h->sender_id);
+	struct homa_rx_steer *steer = homa_steer_bucket(homa, id);
+	struct homa_sock *hsk;
+	int target = -1;
+	int sibling;
+
+	/* The entries consulted here are just hints: they are written
+	 * without synchronization and may be stale, in which case the
+	 * only consequence is a poor choice of core.
+	 */
+	if (READ_ONCE(steer->id) == id) {
+		target = READ_ONCE(steer->cpu);
+	} else {
+		hsk = homa_sock_find(&homa->port_map, ntohs(h->dport));
+		if (hsk)
+			target = READ_ONCE(hsk->receiver_cpu);
+	}
+	if ((target < 0) || (target >= nr_cpu_ids))
+		return -1;
+	sibling = homa_cores[target]->smt_sibling;
+	if ((atomic_read(&homa_cores[target]->softirq_backlog) > 0)
+			&& (sibling >= 0))
+		target = sibling;
+	return target;
+}
+
+/**
+ * homa_gro_fast_control() - Implements the HOMA_GRO_FAST_CONTROL policy:
+ * if an incoming packet is a small control packet that is cheap to handle,
+ * process it immediately at NAPI level rather than handing it off to
+ * SoftIRQ on another core.
+ * @skb:    Incoming packet.
+ *
+ * Return:  Nonzero means @skb was handled (and freed); zero means it
+ *          should take the normal GRO path.
+ */
+static int homa_gro_fast_control(struct sk_buff *skb)
+{
+	struct common_header *h = (struct common_header *)
+			skb_transport_header(skb);
+	struct homa_sock *hsk;
+
+	if ((h->type != ACK) && (h->type != BUSY) && (h->type != NEED_ACK))
+		return 0;
+	if (h->type == ACK) {
+		struct ack_header *ack = (struct ack_header *) h;
+		int i, count;
+
+		/* Only handle ACKs here whose work is bounded: no appended
+		 * acks (each of which could involve a different socket),
+		 * and all acks for the socket the packet was sent to.
+		 */
+		if ((skb_transport_header(skb) - skb->data + sizeof(*ack))
+				> skb_headlen(skb))
+			return 0;
+		count = ntohs(ack->num_acks);
+		if (count > NUM_PEER_UNACKED_IDS)
+			return 0;
+		for (i = 0; i < count; i++) {
+			if (ack->acks[i].server_port != h->dport)
+				return 0;
+		}
+
+		/* Freeing acked RPCs requires the socket and RPC locks,
+		 * and NAPI-level processing holds up every incoming packet
+		 * on this core. If the socket lock is busy right now, use
+		 * the normal path instead. This is only a heuristic: the
+		 * lock could be taken again before homa_softirq gets to it,
+		 * in which case we wait for it here.
+		 */
+		hsk = homa_sock_find(&homa->port_map, ntohs(h->dport));
+		if (hsk) {
+			if (!spin_trylock_bh(&hsk->lock)) {
+				INC_METRIC(fast_control_lock_busy, 1);
+				return 0;
+			}
+			spin_unlock_bh(&hsk->lock);
+		}
+		INC_METRIC(fast_acks, 1);
+	} else if (h->type == BUSY) {
+		struct homa_ack *ack = homa_pkt_ack(h, skb_headlen(skb)
+				- (skb_transport_header(skb) - skb->data));
+
+		/* A piggybacked ack needs RPC locks; leave it for SoftIRQ. */
+		if (ack && (ack->client_id != 0))
+			return 0;
+		INC_METRIC(fast_busys, 1);
+	} else {
+		INC_METRIC(fast_need_acks, 1);
+	}
+	__homa_softirq(skb);
+	return 1;
+}
+
+/**
+ * homa_gro_coalesce() - Try to merge the data of an incoming DATA packet
+ * into the previous packet of a GRO batch, for the HOMA_GRO_COALESCE
+ * policy.
+ * @prev:   The last packet currently on the held skb's frag_list (not
+ *          the held skb itself: its length must stay consistent with
+ *          its IP header).
+ * @skb:    Newly arrived packet.
+ *
+ * Return:  Nonzero means that @skb's data was appended to @prev (whose
+ *          header now describes the combined segment) and @skb has been
+ *          freed. Zero means nothing was done.
+ */
+static int homa_gro_coalesce(struct sk_buff *prev, struct sk_buff *skb)
+{
+	struct data_header *h_prev = (struct data_header *)
+			skb_transport_header(prev);
+	struct data_header *h_new = (struct data_header *)
+			skb_transport_header(skb);
+	int prev_hdr = skb_transport_header(prev) - prev->data
+			+ sizeof(*h_prev);
+	int new_hdr = skb_transport_header(skb) - skb->data + sizeof(*h_new);
+	int prev_length, new_length, delta;
+	struct in6_addr prev_addr, new_addr;
+	bool stolen;
+
+	if ((h_prev->common.type != DATA) || (h_new->common.type != DATA)
+			|| (prev_hdr > skb_headlen(prev))
+			|| (new_hdr > skb_headlen(skb)))
+		return 0;
+	prev_length = ntohl(h_prev->seg.segment_length);
+	new_length = ntohl(h_new->seg.segment_length);
+
+	/* The segments must be contiguous pieces of the same message, and
+	 * the new packet must not carry information (acks or a
+	 * retransmission marker) that would be lost in the merge. Neither
+	 * packet may have acks appended after its data.
+	 */
+	if ((h_prev->common.sender_id != h_new->common.sender_id)
+			|| (h_prev->common.sport != h_new->common.sport)
+			|| (h_prev->common.dport != h_new->common.dport)
+			|| (h_prev->message_length != h_new->message_length)
+			|| (h_prev->cutoff_version != h_new->cutoff_version)
+			|| (h_prev->retransmit != h_new->retransmit)
+			|| (h_new->seg.ack.client_id != 0)
+			|| h_prev->extra_acks || h_new->extra_acks
+			|| ((ntohl(h_prev->seg.offset) + prev_length)
+			!= ntohl(h_new->seg.offset))
+			|| ((prev->len - prev_hdr) != prev_length)
+			|| ((skb->len - new_hdr) != new_length))
+		return 0;
+	prev_addr = skb_canonical_ipv6_saddr(prev);
+	new_addr = skb_canonical_ipv6_saddr(skb);
+	if (!ipv6_addr_equal(&prev_addr, &new_addr))
+		return 0;
+
+	__skb_pull(skb, new_hdr);
+	if (!skb_try_coalesce(prev, skb, &stolen, &delta)) {
+		__skb_push(skb, new_hdr);
+		return 0;
+	}
+	h_prev->seg.segment_length = htonl(prev_length + new_length);
+	if (ntohl(h_new->incoming) > ntohl(h_prev->incoming))
+		h_prev->incoming = h_new->incoming;
+	kfree_skb_partial(skb, stolen);
+	INC_METRIC(gro_coalesced_pkts, 1);
+	return 1;
+}
+
 /**
  * homa_gso_segment() - Split up a large outgoing Homa packet (larger than MTU)
  * into multiple smaller packets.
@@ -159,6 +426,8 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 				saddr, homa_local_id(h_new->common.sender_id),
 				ntohl(h_new->seg.offset), priority);
 	else if (h_new->common.type == GRANT) {
+		struct homa_ack *ack;
+
 		tt_record4("homa_gro_receive got grant from 0x%x "
 				"id %llu, offset %d, priority %d",
 				saddr, homa_local_id(h_new->common.sender_id),
@@ -168,10 +437,15 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 		 * level, bypassing the SoftIRQ mechanism (and avoiding the
 		 * delay of handing off to a different core). This makes
 		 * a significant difference in throughput for large
-		 * messages, especially when the system is loaded.
+		 * messages, especially when the system is loaded. Grants
+		 * with piggybacked acks take the normal path, since
+		 * handling the ack may require waiting for other locks.
 		 */
-		if (homa->gro_policy & HOMA_GRO_FAST_GRANTS) {
-			homa_softirq(skb);
+		ack = homa_pkt_ack(&h_new->common, skb_headlen(skb)
+				- (skb_transport_header(skb) - skb->data));
+		if ((homa->gro_policy & HOMA_GRO_FAST_GRANTS)
+				&& (!ack || (ack->client_id == 0))) {
+			__homa_softirq(skb);
 
 			/* Indicates that we have freed skb. */
 			return ERR_PTR(-EINPROGRESS);
@@ -184,8 +458,15 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 
 	core->last_active = get_cycles();
 
+	/* Like fast grants, this avoids a core handoff for tiny control
+	 * packets whose processing is latency-sensitive.
+	 */
+	if ((homa->gro_policy & HOMA_GRO_FAST_CONTROL)
+			&& homa_gro_fast_control(skb))
+		return ERR_PTR(-EINPROGRESS);
+
 	if (homa->gro_policy & HOMA_GRO_BYPASS) {
-		homa_softirq(skb);
+		__homa_softirq(skb);
 
 		/* This return value indicates that we have freed skb. */
 		return ERR_PTR(-EINPROGRESS);
@@ -213,6 +494,19 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			if (held_skb != core->held_skb)
 				continue;
 
+			/* If possible, merge skb's data into the previous
+			 * packet, so homa_softirq will handle the combined
+			 * segment as a single packet.
+			 */
+			if ((homa->gro_policy & HOMA_GRO_COALESCE)
+					&& (NAPI_GRO_CB(held_skb)->last
+					!= held_skb)
+					&& homa_gro_coalesce(
+					NAPI_GRO_CB(held_skb)->last, skb)) {
+				result = ERR_PTR(-EINPROGRESS);
+				goto done;
+			}
+
 			/* Aggregate skb into held_skb. We don't update the
 			 * length of held_skb because we'll eventually split
 			 * it up and process each skb independently.
@@ -285,24 +579,52 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 //			h->type, homa_local_id(h->sender_id), ntohl(d->seg.offset),
 //			NAPI_GRO_CB(skb)->count);
 
-#define CORES_TO_CHECK 4
+	if ((homa->gro_policy & HOMA_GRO_STEER) && (h->type == DATA)) {
+		/* If a thread is known to be waiting for this message, do
+		 * SoftIRQ processing on its core (or a sibling), so that the
+		 * message's data will be in that core's cache when the
+		 * thread copies it out to user space.
+		 */
+		int target = homa_steer_target(h);
+
+		if (target >= 0) {
+			tt_record3("homa_gro_complete chose core %d for id %d "
+					"offset %d with STEER policy",
+					target, homa_local_id(h->sender_id),
+					ntohl(d->seg.offset));
+			atomic_inc(&homa_cores[target]->softirq_backlog);
+			homa_set_softirq_cpu(skb, target);
+			INC_METRIC(softirq_steered, 1);
+			return 0;
+		}
+	}
+
 	if (homa->gro_policy & HOMA_GRO_IDLE_NEW) {
 		/* Pick a specific core to handle SoftIRQ processing for this
 		 * group of packets. This policy scans the next several cores
 		 * in order after this, trying to find one that is not
 		 * already busy with SoftIRQ processing, and that doesn't appear
 		 * to be active with NAPI/GRO processing either. If there
-		 * is no such core, just rotate among the next cores.
+		 * is no such core, just rotate among the next cores. With
+		 * HOMA_GRO_TOPOLOGY, the cores scanned are chosen from the
+		 * CPU topology (see homa_gro_topology_init) instead of being
+		 * the next ones in numeric order.
 		 */
 		int i;
 		int this_core = raw_smp_processor_id();
 		int candidate = this_core;
+		int topology = homa->gro_policy & HOMA_GRO_TOPOLOGY;
 		__u64 now = get_cycles();
 		struct homa_core *core;
 		for (i = CORES_TO_CHECK; i > 0; i--) {
-			candidate++;
-			if (unlikely(candidate >= nr_cpu_ids))
-				candidate = 0;
+			if (topology) {
+				candidate = homa_cores[this_core]
+					->topo_candidates[CORES_TO_CHECK - i];
+			} else {
+				candidate++;
+				if (unlikely(candidate >= nr_cpu_ids))
+					candidate = 0;
+			}
 			core = homa_cores[candidate];
 			if (atomic_read(&core->softirq_backlog)  > 0)
 				continue;
@@ -323,9 +645,14 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 			if (offset > CORES_TO_CHECK)
 				offset = 1;
 			homa_cores[this_core]->softirq_offset = offset;
-			candidate = this_core + offset;
-			while (candidate >= nr_cpu_ids) {
-				candidate -= nr_cpu_ids;
+			if (topology) {
+				candidate = homa_cores[this_core]
+						->topo_candidates[offset - 1];
+			} else {
+				candidate = this_core + offset;
+				while (candidate >= nr_cpu_ids) {
+					candidate -= nr_cpu_ids;
+				}
 			}
 			tt_record3("homa_gro_complete chose core %d for id %d "
 					"offset %d with IDLE_NEW policy "
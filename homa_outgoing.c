@@ -45,16 +45,46 @@ inline static void set_priority(struct sk_buff *skb, struct homa_sock *hsk,
  * @hsk:       Socket via which these packets will be sent.
  * @peer:      Peer to which the packets will be sent (needed for things like
  *             the MTU).
+ * @dport:     Port number on @peer to which the packets will be sent.
+ * @id:        Id of the RPC that the message belongs to.
  * @iter:      Describes the location(s) of message data in user space.
  *
  * Return:   Address of the first packet in a list of packets linked through
- *           homa_next_skb, or a negative errno if there was an error. No
- *           fields are set in the packet headers except for type, incoming,
- *           offset, and length information. homa_message_out_init will fill
- *           in the other fields.
+ *           homa_next_skb, or a negative errno if there was an error. The
+ *           packet headers are completely filled in, starting from
+ *           @peer->data_template.
  */
 struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
-		struct iov_iter *iter)
+		int dport, __u64 id, struct iov_iter *iter)
+{
+	if (unlikely(iter->count > HOMA_MAX_MESSAGE_LENGTH))
+		return ERR_PTR(-EINVAL);
+	return homa_fill_chunk(hsk, peer, dport, id, iter, iter->count,
+			iter->count);
+}
+
+/**
+ * homa_fill_chunk() - Create packets for a range of a message, starting
+ * at the current position of @iter, and fill them with data from user space.
+ * @hsk:       Socket via which these packets will be sent.
+ * @peer:      Peer to which the packets will be sent (needed for things like
+ *             the MTU).
+ * @dport:     Port number on @peer to which the packets will be sent.
+ * @id:        Id of the RPC that the message belongs to.
+ * @iter:      Describes the location(s) of the rest of the message data in
+ *             user space; the first byte is at offset @len - iter->count
+ *             in the message.
+ * @len:       Total length of the message.
+ * @max_bytes: Stop creating packets once at least this many bytes have been
+ *             copied (chunks always end on a packet boundary, so more
+ *             bytes than this may be copied).
+ *
+ * Return:   Address of the first packet in a list of packets linked through
+ *           homa_next_skb, or a negative errno if there was an error.
+ */
+struct sk_buff *homa_fill_chunk(struct homa_sock *hsk, struct homa_peer *peer,
+		int dport, __u64 id, struct iov_iter *iter, int len,
+		int max_bytes)
 {
 	/* Note: this function is separate from homa_message_out_init
 	 * because it must be invoked without holding an RPC lock, and
@@ -67,10 +97,11 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
 	int err, mtu, max_pkt_data, gso_size, max_gso_data;
 	struct sk_buff **last_link;
 	struct dst_entry *dst;
-	size_t len = iter->count;
+	struct data_header template;
+	int start_left = iter->count;
 
-	if (unlikely((iter->count > HOMA_MAX_MESSAGE_LENGTH)
-			|| (iter->count == 0))) {
+	if (unlikely((len > HOMA_MAX_MESSAGE_LENGTH) || (len <= 0)
+			|| (start_left <= 0) || (start_left > len))) {
 		err = -EINVAL;
 		goto error;
 	}
@@ -101,18 +132,26 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
 		gso_size = bufs_per_gso * mtu;
 
 		/* Round unscheduled bytes *up* to an even number of gsos. */
-		unsched = hsk->homa->rtt_bytes + max_gso_data - 1;
-		unsched -= unsched % max_gso_data;
-		if (unsched > len)
-			unsched = len;
+		unsched = homa_unsched_bytes(hsk->homa->rtt_bytes,
+				max_gso_data, len);
 	}
 
+	/* Fill in the message-specific fields of the header once, so that
+	 * each packet's header is just a copy plus a few patches.
+	 */
+	template = peer->data_template;
+	template.common.sport = htons(hsk->port);
+	template.common.dport = htons(dport);
+	template.common.sender_id = cpu_to_be64(id);
+	template.message_length = htonl(len);
+
 	/* Copy message data from user space and form sk_buffs. Each
 	 * sk_buff may contain multiple data_segments, each of which will
 	 * turn into a separate packet, using either TSO in the NIC or
 	 * GSO in software.
 	 */
-	for (bytes_left = len, last_link = &first; bytes_left > 0; ) {
+	for (bytes_left = start_left, last_link = &first; (bytes_left > 0)
+			&& ((start_left - bytes_left) < max_bytes); ) {
 		struct data_header *h;
 		struct data_segment *seg;
 		int available;
@@ -135,10 +174,9 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
 
 		skb_reserve(skb, hsk->ip_header_length + HOMA_SKB_EXTRA);
 		skb_reset_transport_header(skb);
-		h = (struct data_header *) skb_put(skb,
+		h = (struct data_header *) skb_put_data(skb, &template,
 				sizeof(*h) - sizeof(struct data_segment));
-		h->common.type = DATA;
-		h->message_length = htonl(len);
+		homa_set_csum_info(skb);
 		available = max_gso_data;
 
 		/* Each iteration of the following loop adds one segment
@@ -154,7 +192,8 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
 				seg_size = max_pkt_data;
 			seg->segment_length = htonl(seg_size);
 			seg->ack.client_id = 0;
-			homa_peer_get_acks(peer, 1, &seg->ack);
+			if (homa_peer_get_acks(peer, 1, &seg->ack))
+				INC_METRIC(piggybacked_acks, 1);
 			if (copy_from_iter(skb_put(skb, seg_size), seg_size,
 					iter) != seg_size) {
 				err = -EFAULT;
@@ -165,6 +204,28 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
 			(skb_shinfo(skb)->gso_segs)++;
 			available -= seg_size;
 		} while ((available > 0) && (bytes_left > 0));
+
+		/* If there are still acks left for the peer, append as
+		 * many as will fit after the data (only possible if there
+		 * is a single segment).
+		 */
+		if ((skb_shinfo(skb)->gso_segs == 1)
+				&& (seg->ack.client_id != 0)) {
+			struct homa_ack acks[HOMA_MAX_ACK_BATCH];
+			int room, count;
+
+			room = (max_pkt_data - ntohl(seg->segment_length))
+					/ sizeof32(struct homa_ack);
+			if (room > HOMA_MAX_ACK_BATCH)
+				room = HOMA_MAX_ACK_BATCH;
+			count = (room > 0) ? homa_peer_get_acks(peer, room, acks)
+					: 0;
+			if (count > 0) {
+				skb_put_data(skb, acks, count * sizeof32(acks[0]));
+				h->extra_acks = count;
+				INC_METRIC(piggybacked_acks, count);
+			}
+		}
 		h->incoming = htonl(((len - bytes_left) > unsched) ?
 				(len - bytes_left) : unsched);
 		*last_link = skb;
@@ -183,16 +244,15 @@ struct sk_buff *homa_fill_packets(struct homa_sock *hsk, struct homa_peer *peer,
  * send any packets.
  * @rpc:     RPC whose msgout is to be initialized; current contents of
  *           msgout are assumed to be garbage.
- * @sport:   Source port number to use for the message.
  * @skb:     First in a list of packets returned by homa_fill_packets
  * @len:     Total length of the message.
  */
-void homa_message_out_init(struct homa_rpc *rpc, int sport, struct sk_buff *skb,
-		int len)
+void homa_message_out_init(struct homa_rpc *rpc, struct sk_buff *skb, int len)
 {
 	rpc->msgout.length = len;
 	rpc->msgout.packets = skb;
 	rpc->msgout.num_skbs = 0;
+	rpc->msgout.copied = len;
 	rpc->msgout.next_packet = skb;
 	rpc->msgout.unscheduled = rpc->hsk->homa->rtt_bytes;
 	rpc->msgout.granted = rpc->msgout.unscheduled;
@@ -201,25 +261,91 @@ void homa_message_out_init(struct homa_rpc *rpc, int sport, struct sk_buff *skb,
 	rpc->msgout.sched_priority = 0;
 	rpc->msgout.init_cycles = get_cycles();
 
-	/* Must scan the packets to fill in header fields that weren't
-	 * known when the packets were allocated.
+	/* Headers were completely filled in by homa_fill_packets, so we
+	 * only need to count the packets.
 	 */
-	while (skb) {
-		struct data_header *h = (struct data_header *)
-				skb_transport_header(skb);
+	for ( ; skb != NULL; skb = *homa_next_skb(skb))
 		rpc->msgout.num_skbs++;
-		h->common.sport = htons(sport);
-		h->common.dport = htons(rpc->dport);
-		homa_set_doff(h);
-		h->common.sender_id = cpu_to_be64(rpc->id);
-		h->message_length = htonl(len);
-		h->cutoff_version = rpc->peer->cutoff_version;
-		h->retransmit = 0;
-		skb = *homa_next_skb(skb);
-	}
 	INC_METRIC(sent_msg_bytes, len);
 }
 
+/**
+ * homa_message_out_fill() - Copy the remainder of a large outgoing message
+ * from user space, a chunk at a time, transmitting each chunk as soon as it
+ * has been copied. This allows the beginning of the message to be on the
+ * wire while the rest of it is still being copied.
+ * @rpc:     RPC whose msgout was initialized with only a prefix of the
+ *           message (msgout.copied < msgout.length). Must be locked by the
+ *           caller; the lock is released while copying data.
+ * @iter:    Describes the location(s) of the rest of the message data in
+ *           user space.
+ *
+ * Return:   0 means success, in which case the RPC is still locked on
+ *           return. Otherwise the return value is a negative errno; in
+ *           this case the RPC has been freed and is unlocked.
+ */
+int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter)
+{
+	struct sk_buff **last_link, *skb, *chunk;
+	int err;
+
+	for (skb = rpc->msgout.packets; *homa_next_skb(skb) != NULL;
+			skb = *homa_next_skb(skb)) {}
+	last_link = homa_next_skb(skb);
+
+	while (iter->count > 0) {
+		/* Must release the RPC lock while copying from user space
+		 * (see sync.txt); dont_reap keeps the RPC from being freed
+		 * out from under us.
+		 */
+		rpc->dont_reap = true;
+		homa_rpc_unlock(rpc);
+		chunk = homa_fill_chunk(rpc->hsk, rpc->peer, rpc->dport,
+				rpc->id, iter, rpc->msgout.length,
+				HOMA_FILL_CHUNK_BYTES);
+		homa_rpc_lock(rpc);
+		if (unlikely(IS_ERR(chunk))) {
+			err = PTR_ERR(chunk);
+			goto error;
+		}
+		if (unlikely(rpc->state != RPC_OUTGOING)) {
+			homa_free_skbs(chunk);
+			if (rpc->state != RPC_DEAD) {
+				/* The response has already started to
+				 * arrive, so there's no point in sending
+				 * the rest of the request.
+				 */
+				rpc->dont_reap = false;
+				return 0;
+			}
+			err = rpc->hsk->shutdown ? -ESHUTDOWN : -ECANCELED;
+			goto error;
+		}
+		rpc->dont_reap = false;
+
+		*last_link = chunk;
+		if (!rpc->msgout.next_packet)
+			rpc->msgout.next_packet = chunk;
+		for (skb = chunk; ; skb = *homa_next_skb(skb)) {
+			rpc->msgout.num_skbs++;
+			if (*homa_next_skb(skb) == NULL)
+				break;
+		}
+		last_link = homa_next_skb(skb);
+		rpc->msgout.copied = rpc->msgout.length - iter->count;
+		tt_record2("homa_message_out_fill copied %d bytes for id %d",
+				rpc->msgout.copied, rpc->id);
+		homa_xmit_data(rpc, false);
+	}
+	return 0;
+
+    error:
+	homa_rpc_free(rpc);
+	homa_rpc_unlock(rpc);
+	rpc->dont_reap = false;
+	return err;
+}
+
 /**
  * homa_message_out_destroy() - Destructor for homa_message_out.
  * @msgout:       Structure to clean up.
@@ -241,7 +367,8 @@ void homa_message_out_destroy(struct homa_message_out *msgout)
  * @type:      Packet type, such as DATA.
  * @contents:  Address of buffer containing the contents of the packet.
  *             Only information after the common header must be valid;
- *             the common header will be filled in by this function.
+ *             the common header (and the ack, for GRANT, RESEND, and
+ *             BUSY packets) will be filled in by this function.
  * @length:    Length of @contents (including the common header).
  * @rpc:       The packet will go to the socket that handles the other end
  *             of this RPC. Addressing info for the packet, including all of
@@ -254,10 +381,25 @@ int homa_xmit_control(enum homa_packet_type type, void *contents,
 	size_t length, struct homa_rpc *rpc)
 {
 	struct common_header *h = (struct common_header *) contents;
+	struct homa_ack *ack = NULL;
+
 	h->type = type;
 	h->sport = htons(rpc->hsk->port);
 	h->dport = htons(rpc->dport);
 	h->sender_id = cpu_to_be64(rpc->id);
+
+	/* Piggyback an ack on the packet, if the peer has one pending. */
+	if (type == GRANT)
+		ack = &((struct grant_header *) contents)->ack;
+	else if (type == RESEND)
+		ack = &((struct resend_header *) contents)->ack;
+	else if (type == BUSY)
+		ack = &((struct busy_header *) contents)->ack;
+	if (ack && ((void *) (ack + 1) <= contents + length)) {
+		ack->client_id = 0;
+		if (homa_peer_get_acks(rpc->peer, 1, ack))
+			INC_METRIC(piggybacked_acks, 1);
+	}
 	return __homa_xmit_control(contents, length, rpc->peer, rpc->hsk);
 }
 
@@ -283,6 +425,10 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 	struct dst_entry *dst;
 	struct sk_buff *skb;
 
+	if (unlikely(homa_cores[raw_smp_processor_id()]->bundling)
+			&& in_softirq() && (length <= HOMA_MAX_BUNDLE_ITEM))
+		return homa_bundle_add(contents, length, peer, hsk);
+
 	/* Allocate the same size sk_buffs as for the smallest data
          * packets (better reuse of sk_buffs?).
 	 */
@@ -291,8 +437,12 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 			GFP_KERNEL);
 	if (unlikely(!skb))
 		return -ENOBUFS;
-	dst_hold(dst);
-	skb_dst_set(skb, dst);
+
+	/* See __homa_xmit_data for why it's safe not to hold a reference
+	 * to the dst.
+	 */
+	rcu_read_lock();
+	skb_dst_set_noref(skb, READ_ONCE(peer->dst));
 
 	skb_reserve(skb, hsk->ip_header_length + HOMA_SKB_EXTRA);
 	skb_reset_transport_header(skb);
@@ -315,6 +465,7 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 		hsk->inet.tos = hsk->homa->priority_map[priority]<<5;
 		result = ip_queue_xmit(&hsk->inet.sk, skb, &peer->flow);
 	}
+	rcu_read_unlock();
 	if (unlikely(result != 0)) {
 		INC_METRIC(control_xmit_errors, 1);
 
@@ -345,6 +496,127 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 	return result;
 }
 
+/**
+ * homa_bundle_start() - Invoked by homa_softirq to indicate that control
+ * packets generated on this core should be accumulated in per-peer bundles
+ * (rather than transmitted immediately) until homa_bundle_flush is invoked.
+ * Must be invoked at SoftIRQ level.
+ */
+void homa_bundle_start(void)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+
+	core->num_bundles = 0;
+	core->bundling = 1;
+}
+
+/**
+ * homa_bundle_xmit() - Transmit the control packets accumulated in a
+ * bundle, and reset the bundle to empty. If the bundle contains only
+ * a single packet, it is sent as is (no BUNDLE packet).
+ * @bundle:   Bundle to transmit; must contain at least one packet.
+ */
+static void homa_bundle_xmit(struct homa_bundle *bundle)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	struct bundle_header *h = (struct bundle_header *) bundle->data;
+	int bundling = core->bundling;
+
+	/* Must disable bundling temporarily so that __homa_xmit_control
+	 * will actually transmit.
+	 */
+	core->bundling = 0;
+	if (bundle->num_items == 1) {
+		__homa_xmit_control(bundle->data + sizeof(*h) + 1,
+				bundle->length - sizeof32(*h) - 1,
+				bundle->peer, bundle->hsk);
+	} else {
+		memset(&h->common, 0, sizeof(h->common));
+		h->common.type = BUNDLE;
+		h->common.sport = htons(bundle->hsk->port);
+		h->num_items = bundle->num_items;
+		h->length = htons(bundle->length - sizeof32(*h));
+		tt_record2("sending BUNDLE with %d items, %d bytes",
+				bundle->num_items, bundle->length);
+		__homa_xmit_control(bundle->data, bundle->length, bundle->peer,
+				bundle->hsk);
+		INC_METRIC(bundled_control_pkts, bundle->num_items);
+	}
+	core->bundling = bundling;
+	bundle->num_items = 0;
+	bundle->length = sizeof32(*h);
+}
+
+/**
+ * homa_bundle_add() - Add a control packet to the current core's bundle
+ * for its peer, rather than transmitting it immediately; the packet will
+ * be transmitted by homa_bundle_flush. Invoked by __homa_xmit_control
+ * when bundling is enabled.
+ * @contents:  Address of buffer containing the contents of the packet.
+ *             The caller must have filled in all of the information,
+ *             including the common header.
+ * @length:    Length of @contents; must not exceed HOMA_MAX_BUNDLE_ITEM.
+ * @peer:      Destination to which the packet will be sent.
+ * @hsk:       Socket via which the packet would have been sent.
+ *
+ * Return:     Either zero (for success), or a negative errno value if there
+ *             was a problem.
+ */
+int homa_bundle_add(void *contents, size_t length, struct homa_peer *peer,
+		struct homa_sock *hsk)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	struct homa_bundle *bundle;
+	int i;
+
+	for (i = 0; i < core->num_bundles; i++) {
+		bundle = &core->bundles[i];
+		if ((bundle->peer == peer) && (bundle->hsk->inet.sk.sk_family
+				== hsk->inet.sk.sk_family))
+			goto found;
+	}
+
+	/* No existing bundle for this peer; start a new one. If all the
+	 * bundles are in use, flush the oldest one to make room.
+	 */
+	if (core->num_bundles >= HOMA_BUNDLE_PEERS) {
+		bundle = &core->bundles[0];
+		homa_bundle_xmit(bundle);
+	} else {
+		bundle = &core->bundles[core->num_bundles];
+		core->num_bundles++;
+	}
+	bundle->peer = peer;
+	bundle->hsk = hsk;
+	bundle->num_items = 0;
+	bundle->length = sizeof32(struct bundle_header);
+
+    found:
+	if ((bundle->length + 1 + length) > sizeof(bundle->data))
+		homa_bundle_xmit(bundle);
+	bundle->data[bundle->length] = length;
+	memcpy(bundle->data + bundle->length + 1, contents, length);
+	bundle->length += 1 + length;
+	bundle->num_items++;
+	return 0;
+}
+
+/**
+ * homa_bundle_flush() - Transmit all of the control packets that have
+ * accumulated on this core since the last call to homa_bundle_start,
+ * and disable bundling. Invoked at the end of homa_softirq.
+ */
+void homa_bundle_flush(void)
+{
+	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	int i;
+
+	core->bundling = 0;
+	for (i = 0; i < core->num_bundles; i++)
+		homa_bundle_xmit(&core->bundles[i]);
+	core->num_bundles = 0;
+}
+
 /**
  * homa_xmit_unknown() - Send an UNKNOWN packet to a peer.
  * @skb:         Buffer containing an incoming packet; identifies the peer to
@@ -388,6 +660,8 @@ void homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk)
  */
 void homa_xmit_data(struct homa_rpc *rpc, bool force)
 {
+	bool sent = false;
+
 	while (rpc->msgout.next_packet) {
 		int priority;
 		struct sk_buff *skb = rpc->msgout.next_packet;
@@ -429,6 +703,19 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		skb_get(skb);
 		__homa_xmit_data(skb, rpc, priority);
 		force = false;
+		sent = true;
+	}
+	if (sent) {
+		/* homa_timer doesn't count silence while there is granted
+		 * data waiting to be sent, so silence starts now.
+		 */
+		homa_rpc_reset_silence(rpc);
+
+		/* If this was the last packet of a response, make sure the
+		 * timer notices promptly so it can request an ack.
+		 */
+		if (!rpc->msgout.next_packet && !homa_is_client(rpc->id))
+			homa_timer_arm(rpc, 1);
 	}
 	tt_record("homa_xmit_data returning");
 }
@@ -446,6 +733,7 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	int err;
 	struct data_header *h = (struct data_header *)
 			skb_transport_header(skb);
+	struct homa *homa = rpc->hsk->homa;
 	struct dst_entry *dst;
 
 	/* Update info that may have changed since the message was initially
@@ -453,14 +741,21 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	 */
 	h->cutoff_version = rpc->peer->cutoff_version;
 
-	dst = homa_get_dst(rpc->peer, rpc->hsk);
-	dst_hold(dst);
-	skb_dst_set(skb, dst);
+	/* Attach the peer's dst to the packet without taking a reference,
+	 * to avoid contention for the dst's reference count when many
+	 * cores transmit to the same peer. This is safe as long as we stay
+	 * in an RCU read-side section: obsolete dsts aren't released until
+	 * long after homa_dst_refresh replaces them, and dst_release frees
+	 * them via RCU. If the packet outlives this function (e.g., it gets
+	 * queued in a qdisc), the IP layer takes a reference with
+	 * skb_dst_force. Any refresh must happen before rcu_read_lock,
+	 * since it may sleep.
+	 */
+	homa_get_dst(rpc->peer, rpc->hsk);
+	rcu_read_lock();
+	dst = READ_ONCE(rpc->peer->dst);
+	skb_dst_set_noref(skb, dst);
 
-	skb->ooo_okay = 1;
-	skb->ip_summed = CHECKSUM_PARTIAL;
-	skb->csum_start = skb_transport_header(skb) - skb->head;
-	skb->csum_offset = offsetof(struct common_header, checksum);
 	if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
 		tt_record4("calling ip6_xmit: skb->len %d, peer 0x%x, id %d, "
 				"offset %d",
@@ -485,6 +780,20 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	if (err) {
 		INC_METRIC(data_xmit_errors, 1);
 	}
+	if (homa->nic_feedback_cycles != 0) {
+		__u64 now = get_cycles();
+		__u64 next = atomic64_read(&homa->next_nic_feedback);
+
+		if ((now >= next) && (atomic64_cmpxchg_relaxed(
+				&homa->next_nic_feedback, next,
+				now + homa->nic_feedback_cycles) == next)) {
+			int inflight = homa_nic_inflight(dst->dev);
+
+			if (inflight >= 0)
+				homa_nic_queue_feedback(homa, inflight, now);
+		}
+	}
+	rcu_read_unlock();
 	INC_METRIC(packets_sent[0], 1);
 	INC_METRIC(priority_bytes[priority], skb->len);
 	INC_METRIC(priority_packets[priority], 1);
@@ -555,7 +864,9 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 					- sizeof32(struct data_segment));
 			__skb_put_data(new_skb, seg, sizeof32(*seg) + length);
 			h = ((struct data_header *) skb_transport_header(new_skb));
+			homa_set_csum_info(new_skb);
 			h->retransmit = 1;
+			h->extra_acks = 0;
 			if ((offset + length) <= rpc->msgout.granted)
 				h->incoming = htonl(rpc->msgout.granted);
 			else if ((offset + length) > rpc->msgout.length)
@@ -580,14 +891,14 @@ void homa_outgoing_sysctl_changed(struct homa *homa)
 {
 	__u64 tmp;
 
-	/* Code below is written carefully to avoid integer underflow or
-	 * overflow under expected usage patterns. Be careful when changing!
-	 */
-	homa->cycles_per_kbyte = (8*(__u64) cpu_khz)/homa->link_mbps;
-	homa->cycles_per_kbyte = (101*homa->cycles_per_kbyte)/100;
+	homa->cycles_per_kbyte = homa_ticks_per_kbyte(cpu_khz,
+			homa->link_mbps);
 	tmp = homa->max_nic_queue_ns;
 	tmp = (tmp*cpu_khz)/1000000;
 	homa->max_nic_queue_cycles = tmp;
+	tmp = homa->nic_feedback_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->nic_feedback_cycles = tmp;
 }
 
 /**
@@ -612,30 +923,22 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 	int cycles_for_packet, segs, bytes;
 
 	segs = skb_shinfo(skb)->gso_segs;
-	bytes = skb->tail - skb->transport_header;
-	bytes += HOMA_IPV6_HEADER_LENGTH + HOMA_ETH_OVERHEAD;
-	if (segs > 0)
-		bytes += (segs - 1) * (sizeof32(struct data_header)
-				- sizeof32(struct data_segment)
-				+ HOMA_IPV6_HEADER_LENGTH + HOMA_ETH_OVERHEAD);
-	cycles_for_packet = (bytes*homa->cycles_per_kbyte)/1000;
+	bytes = homa_wire_bytes(skb->tail - skb->transport_header, segs);
+	cycles_for_packet = homa_link_ticks(bytes, homa->cycles_per_kbyte);
 	while (1) {
 		clock = get_cycles();
 		idle = atomic64_read(&homa->link_idle_time);
-		if (((clock + homa->max_nic_queue_cycles) < idle) && !force
+		if (homa_nic_queue_full(clock, idle, homa->max_nic_queue_cycles)
+				&& !force
 				&& !(homa->flags & HOMA_FLAG_DONT_THROTTLE))
 			return 0;
 		if (!list_empty(&homa->throttled_rpcs))
 			INC_METRIC(pacer_bytes, bytes);
-		if (idle < clock) {
-			if (!list_empty(&homa->throttled_rpcs)) {
-				INC_METRIC(pacer_lost_cycles, clock - idle);
-				tt_record1("pacer lost %d cycles",
-						clock - idle);
-			}
-			new_idle = clock + cycles_for_packet;
-		} else
-			new_idle = idle + cycles_for_packet;
+		if ((idle < clock) && !list_empty(&homa->throttled_rpcs)) {
+			INC_METRIC(pacer_lost_cycles, clock - idle);
+			tt_record1("pacer lost %d cycles", clock - idle);
+		}
+		new_idle = homa_link_idle_after(clock, idle, cycles_for_packet);
 
 		/* This method must be thread-safe. */
 		if (atomic64_cmpxchg_relaxed(&homa->link_idle_time, idle,
@@ -645,6 +948,79 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 	return 1;
 }
 
+/**
+ * homa_nic_inflight() - Returns the number of bytes currently queued in a
+ * NIC for transmission (summed over all of its transmit queues), as
+ * reported by the driver through byte queue limits (BQL). All queues are
+ * counted, including ones Homa doesn't use: link_idle_time models the
+ * whole link, so bytes queued by other protocols (e.g. TCP) delay Homa's
+ * packets too.
+ * @dev:    Network device whose transmit queues should be examined.
+ *
+ * Return:  The number of bytes queued in @dev, or -1 if this information
+ *          isn't available (either the kernel wasn't built with BQL or
+ *          the driver doesn't report transmissions and completions).
+ */
+int homa_nic_inflight(struct net_device *dev)
+{
+#ifdef CONFIG_BQL
+	unsigned int queued = 0;
+	int i, inflight = 0;
+
+	for (i = 0; i < dev->real_num_tx_queues; i++) {
+		struct dql *dql = &netdev_get_tx_queue(dev, i)->dql;
+		unsigned int num_queued = READ_ONCE(dql->num_queued);
+
+		queued |= num_queued;
+		inflight += num_queued - READ_ONCE(dql->num_completed);
+	}
+
+	/* Drivers without BQL support never update num_queued. */
+	if (queued == 0)
+		return -1;
+	return inflight;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * homa_nic_queue_feedback() - Correct homa->link_idle_time using the
+ * actual number of bytes queued in the NIC. The estimate in link_idle_time
+ * is computed purely from link_mbps, so it drifts if other protocols share
+ * the link or the NIC transmits more slowly (or quickly) than expected.
+ * Underestimates are corrected immediately (we must not overfill the NIC
+ * queue); overestimates are corrected gradually, since link_idle_time also
+ * accounts for packets that have been passed to Linux but haven't yet
+ * reached the NIC.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @inflight:  Number of bytes currently queued in the NIC.
+ * @now:       Current time, in get_cycles() units.
+ */
+void homa_nic_queue_feedback(struct homa *homa, int inflight, __u64 now)
+{
+	__u64 idle, estimate, measured, new_idle;
+
+	measured = (((__u64) inflight) * homa->cycles_per_kbyte)/1000;
+	idle = atomic64_read(&homa->link_idle_time);
+	estimate = (idle > now) ? idle - now : 0;
+	INC_METRIC(nic_queue_samples, 1);
+	if (measured > estimate) {
+		INC_METRIC(nic_queue_underestimate_cycles, measured - estimate);
+		new_idle = now + measured;
+	} else {
+		INC_METRIC(nic_queue_overestimate_cycles, estimate - measured);
+		new_idle = idle - (estimate - measured)/2;
+	}
+	tt_record3("NIC queue feedback: %d bytes in NIC, estimated %d cycles, "
+			"measured %d cycles", inflight, estimate, measured);
+
+	/* If this fails, someone else just updated link_idle_time; just
+	 * skip this sample.
+	 */
+	atomic64_cmpxchg_relaxed(&homa->link_idle_time, idle, new_idle);
+}
+
 /**
  * homa_pacer_main() - Top-level function for the pacer thread.
  * @transportInfo:  Pointer to struct homa.
@@ -654,6 +1030,8 @@ int homa_check_nic_queue(struct homa *homa, struct sk_buff *skb, bool force)
 int homa_pacer_main(void *transportInfo)
 {
 	cycles_t start;
+	__u64 deadline = 0;
+	bool force = false;
 	struct homa *homa = (struct homa *) transportInfo;
 
 	while (1) {
@@ -662,28 +1040,84 @@ int homa_pacer_main(void *transportInfo)
 		}
 
 		start = get_cycles();
-		homa_pacer_xmit(homa);
+		homa_pacer_xmit(homa, force);
 
-		/* Sleep this thread if the throttled list is empty. Even
-		 * if the throttled list isn't empty, call the scheduler
-		 * to give other processes a chance to run (if we don't,
-		 * softirq handlers can get locked out, which prevents
-		 * incoming packets from being handled).
-		 */
+		/* Sleep this thread if the throttled list is empty. */
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (list_first_or_null_rcu(&homa->throttled_rpcs,
-				struct homa_rpc, throttled_links) == NULL)
+				struct homa_rpc, throttled_links) == NULL) {
 			tt_record("pacer sleeping");
-		else
+			INC_METRIC(pacer_cycles, get_cycles() - start);
+			deadline = 0;
+			force = false;
+			schedule();
 			__set_current_state(TASK_RUNNING);
+			continue;
+		}
 		INC_METRIC(pacer_cycles, get_cycles() - start);
-		schedule();
+		force = homa_pacer_sleep(homa, &deadline);
 		__set_current_state(TASK_RUNNING);
 	}
 	kthread_complete_and_exit(&homa_pacer_kthread_done, 0);
 	return 0;
 }
 
+/**
+ * homa_pacer_sleep() - Invoked by homa_pacer_main when there is throttled
+ * output. If the NIC queue is too long for the pacer to transmit, sleep
+ * until the queue should have drained enough; otherwise just give other
+ * threads a chance to run. The caller must have set the task state to
+ * TASK_INTERRUPTIBLE.
+ * @homa:      Overall data about the Homa protocol implementation.
+ * @deadline:  get_cycles() time at which the pacer will transmit even if
+ *             the NIC queue still appears too long, or 0 if no deadline
+ *             has been set yet. Maintained here across calls.
+ *
+ * Return:     True means the deadline has passed, so the caller must
+ *             transmit a packet without checking the NIC queue.
+ */
+bool homa_pacer_sleep(struct homa *homa, __u64 *deadline)
+{
+	__u64 now = get_cycles();
+	__u64 idle_time = atomic64_read(&homa->link_idle_time);
+	ktime_t wakeup;
+
+	if (!homa_nic_queue_full(now, idle_time,
+			homa->max_nic_queue_cycles)) {
+		/* Call the scheduler to give other processes a chance to
+		 * run (if we don't, softirq handlers can get locked out,
+		 * which prevents incoming packets from being handled).
+		 */
+		*deadline = 0;
+		__set_current_state(TASK_RUNNING);
+		schedule();
+		return false;
+	}
+
+	/* The deadline is computed only the first time the queue is found
+	 * to be too long. Other threads can keep pushing link_idle_time
+	 * forward while we sleep; if we waited for it again after each
+	 * sleep, the pacer could starve. Instead, when the original deadline
+	 * arrives we transmit regardless (see perf.txt).
+	 */
+	if (*deadline == 0)
+		*deadline = idle_time - homa->max_nic_queue_cycles;
+	if (now < *deadline) {
+		wakeup = ns_to_ktime(((*deadline - now) * 1000000)/cpu_khz);
+		tt_record1("pacer sleeping for %d ns", ktime_to_ns(wakeup));
+		schedule_hrtimeout_range(&wakeup, HOMA_PACER_SLACK_NS,
+				HRTIMER_MODE_REL);
+		INC_METRIC(pacer_sleeps, 1);
+		INC_METRIC(pacer_sleep_cycles, get_cycles() - now);
+
+		/* homa_add_to_throttled may have woken us early. */
+		if (get_cycles() < *deadline)
+			return false;
+	}
+	*deadline = 0;
+	return true;
+}
+
 /**
  * homa_pacer_xmit() - Transmit packets from  the throttled list. Note:
  * this function may be invoked from either process context or softirq (BH)
@@ -696,8 +1130,12 @@ int homa_pacer_main(void *transportInfo)
  * likelihood that we keep the link busy. Those other invocations are not
  * guaranteed to happen, so the pacer thread provides a backstop.
  * @homa:    Overall data about the Homa protocol implementation.
+ * @force:   True means transmit the first packet even if the NIC queue is
+ *           too long. The pacer thread uses this once it has waited for
+ *           the queue to drain, so that it can't be starved by other
+ *           threads that keep the queue full.
  */
-void homa_pacer_xmit(struct homa *homa)
+void homa_pacer_xmit(struct homa *homa, bool force)
 {
 	struct homa_rpc *rpc;
         int i;
@@ -717,23 +1155,18 @@ void homa_pacer_xmit(struct homa *homa)
 		__u64 idle_time, now;
 		int offset;
 
-		/* If the NIC queue is too long, wait until it gets shorter. */
-		now = get_cycles();
-		idle_time = atomic64_read(&homa->link_idle_time);
-		while ((now + homa->max_nic_queue_cycles) < idle_time) {
-			/* If we've xmitted at least one packet then
-			 * return (this helps with testing and also
-			 * allows homa_pacer_main to yield the core).
-			 */
-			if (i != 0)
-				goto done;
-			now = get_cycles();
-		}
-		/* Note: when we get here, it's possible that the NIC queue is
+		/* If the NIC queue is too long, return rather than spinning
+		 * until it gets shorter: homa_pacer_main will sleep until
+		 * the queue should have drained, then call us again with
+		 * @force. At that point we transmit even if the queue is
 		 * still too long because other threads have queued packets,
-		 * but we transmit anyway so we don't starve (see perf.text
-		 * for more info).
+		 * so we don't starve (see perf.txt for more info).
 		 */
+		now = get_cycles();
+		idle_time = atomic64_read(&homa->link_idle_time);
+		if (!(force && (i == 0)) && homa_nic_queue_full(now,
+				idle_time, homa->max_nic_queue_cycles))
+			goto done;
 
 		/* Lock the first throttled RPC. This may not be possible
 		 * because we have to hold throttle_lock while locking
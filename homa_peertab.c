@@ -19,6 +19,84 @@
 
 #include "homa_impl.h"
 
+/**
+ * homa_peer_buckets_alloc() - Allocate and initialize a bucket array for
+ * a homa_peertab.
+ * @bits:     log2 of the number of buckets.
+ *
+ * Return:    The new array, or NULL if memory couldn't be allocated.
+ */
+static struct homa_peer_buckets *homa_peer_buckets_alloc(int bits)
+{
+	struct homa_peer_buckets *table;
+	int i;
+
+	table = (struct homa_peer_buckets *) vmalloc(sizeof(*table)
+			+ (sizeof(table->heads[0]) << bits));
+	if (!table)
+		return NULL;
+	table->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&table->heads[i]);
+	return table;
+}
+
+/**
+ * homa_peer_buckets_free_rcu() - RCU callback that frees a bucket array
+ * after the table has been resized.
+ * @head:    The @rcu field of the array to free.
+ */
+static void homa_peer_buckets_free_rcu(struct rcu_head *head)
+{
+	vfree(container_of(head, struct homa_peer_buckets, rcu));
+}
+
+/**
+ * homa_peer_bucket() - Find the hash chain for an address.
+ * @peertab:  Table containing the chain.
+ * @table:    Bucket array for @peertab.
+ * @addr:     Address of the desired host.
+ *
+ * Return:    The head of the chain that holds @addr (if it is present).
+ */
+static inline struct hlist_head *homa_peer_bucket(
+		struct homa_peertab *peertab, struct homa_peer_buckets *table,
+		const struct in6_addr *addr)
+{
+	const __u32 *a = addr->in6_u.u6_addr32;
+	__u64 hash = siphash_2u64((((__u64) a[0]) << 32) | a[1],
+			(((__u64) a[2]) << 32) | a[3], &peertab->hash_key);
+
+	return &table->heads[hash & ((1 << table->bits) - 1)];
+}
+
+/**
+ * homa_peer_lookup() - Search one bucket array of a peer table for an
+ * address. The caller must be in an RCU read-side section or hold
+ * @peertab->write_lock.
+ * @peertab:  Table to search.
+ * @table:    Bucket array to search; may be NULL.
+ * @addr:     Address of the desired host.
+ *
+ * Return:    The peer for @addr, or NULL if it isn't in @table.
+ */
+static struct homa_peer *homa_peer_lookup(struct homa_peertab *peertab,
+		struct homa_peer_buckets *table, const struct in6_addr *addr)
+{
+	struct homa_peer *peer;
+
+	if (!table)
+		return NULL;
+	hlist_for_each_entry_rcu(peer, homa_peer_bucket(peertab, table, addr),
+			peertab_links) {
+		if (ipv6_addr_equal(&peer->addr, addr)
+				&& (atomic_read(&peer->refs) >= 0))
+			return peer;
+		INC_METRIC(peer_hash_links, 1);
+	}
+	return NULL;
+}
+
 /**
  * homa_peertab_init() - Constructor for homa_peertabs.
  * @peertab:  The object to initialize; previous contents are discarded.
@@ -31,16 +109,17 @@ int homa_peertab_init(struct homa_peertab *peertab)
 	 * safe to call homa_peertab_destroy, even if this function returns
 	 * an error.
 	 */
-	int i;
 	spin_lock_init(&peertab->write_lock);
 	INIT_LIST_HEAD(&peertab->dead_dsts);
-	peertab->buckets = (struct hlist_head *) vmalloc(
-			HOMA_PEERTAB_BUCKETS * sizeof(*peertab->buckets));
-	if (!peertab->buckets)
+	peertab->num_peers = 0;
+	peertab->gc_bucket = 0;
+	peertab->rehash_bucket = 0;
+	RCU_INIT_POINTER(peertab->new_buckets, NULL);
+	get_random_bytes(&peertab->hash_key, sizeof(peertab->hash_key));
+	RCU_INIT_POINTER(peertab->buckets,
+			homa_peer_buckets_alloc(HOMA_PEERTAB_MIN_BITS));
+	if (!rcu_access_pointer(peertab->buckets))
 		return -ENOMEM;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		INIT_HLIST_HEAD(&peertab->buckets[i]);
-	}
 	return 0;
 }
 
@@ -53,21 +132,132 @@ int homa_peertab_init(struct homa_peertab *peertab)
  */
 void homa_peertab_destroy(struct homa_peertab *peertab)
 {
-	int i;
+	int i, j;
 	struct homa_peer *peer;
 	struct hlist_node *next;
-	if (!peertab->buckets)
+	struct homa_peer_buckets *tables[2];
+
+	tables[0] = rcu_dereference_protected(peertab->buckets, 1);
+	if (!tables[0])
 		return;
+	tables[1] = rcu_dereference_protected(peertab->new_buckets, 1);
 
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
-				peertab_links) {
-			dst_release(peer->dst);
-			kfree(peer);
+	for (j = 0; j < 2; j++) {
+		if (!tables[j])
+			continue;
+		for (i = 0; i < (1 << tables[j]->bits); i++) {
+			hlist_for_each_entry_safe(peer, next,
+					&tables[j]->heads[i], peertab_links) {
+				dst_release(peer->dst);
+				kfree(peer);
+			}
 		}
+		vfree(tables[j]);
 	}
-	vfree(peertab->buckets);
+	RCU_INIT_POINTER(peertab->buckets, NULL);
+	RCU_INIT_POINTER(peertab->new_buckets, NULL);
 	homa_peertab_gc_dsts(peertab, ~0);
+
+	/* Wait for peers evicted by homa_peertab_gc_peers to be freed. */
+	rcu_barrier();
+}
+
+/**
+ * homa_peertab_rehash() - Move a few chains (HOMA_PEER_REHASH_BUCKETS) of
+ * a peer table that is being resized to the new bucket array; once all of
+ * them have been moved, make the new array the table's only one.
+ * @peertab:  Table being resized.
+ * @old:      The table's current bucket array.
+ * @new:      The bucket array being filled.
+ */
+static void homa_peertab_rehash(struct homa_peertab *peertab,
+		struct homa_peer_buckets *old, struct homa_peer_buckets *new)
+{
+	struct homa_peer *peer;
+	struct hlist_node *next;
+	struct hlist_head *head;
+	int i;
+
+	for (i = 0; (i < HOMA_PEER_REHASH_BUCKETS)
+			&& (peertab->rehash_bucket < (1 << old->bits)); i++) {
+		/* Chains in @old are modified only here (new peers go in
+		 * @new, and homa_peertab_gc_peers scans @new), so it's safe
+		 * to skip empty chains without the lock.
+		 */
+		head = &old->heads[peertab->rehash_bucket];
+		peertab->rehash_bucket++;
+		if (hlist_empty(head))
+			continue;
+
+		/* Lookups running concurrently may miss a peer while it is
+		 * being moved; homa_peer_find will then search again after
+		 * acquiring write_lock.
+		 */
+		spin_lock_bh(&peertab->write_lock);
+		hlist_for_each_entry_safe(peer, next, head, peertab_links) {
+			hlist_del_rcu(&peer->peertab_links);
+			hlist_add_head_rcu(&peer->peertab_links,
+					homa_peer_bucket(peertab, new,
+					&peer->addr));
+		}
+		spin_unlock_bh(&peertab->write_lock);
+	}
+	if (peertab->rehash_bucket < (1 << old->bits))
+		return;
+
+	spin_lock_bh(&peertab->write_lock);
+	rcu_assign_pointer(peertab->buckets, new);
+
+	/* Pairs with smp_rmb in homa_peer_find. */
+	smp_wmb();
+	RCU_INIT_POINTER(peertab->new_buckets, NULL);
+	spin_unlock_bh(&peertab->write_lock);
+	tt_record3("homa_peertab_rehash finished resizing peer table from %d "
+			"to %d bits, %d peers", old->bits, new->bits,
+			peertab->num_peers);
+	call_rcu(&old->rcu, homa_peer_buckets_free_rcu);
+	INC_METRIC(peertab_resizes, 1);
+}
+
+/**
+ * homa_peertab_check_size() - Start growing the bucket array for a peer
+ * table if it has more peers than buckets, or shrinking it if it is less
+ * than 1/4 full; if a resize is already in progress, continue it. Peers
+ * are moved to the new array incrementally (see homa_peertab_rehash), so
+ * the cost of a resize is spread across many calls. Must be invoked in
+ * process context; only one invocation may run at a time (it is called
+ * from homa_timer, which also serializes it with homa_peertab_gc_peers).
+ * @peertab:  Table to check.
+ */
+void homa_peertab_check_size(struct homa_peertab *peertab)
+{
+	struct homa_peer_buckets *old, *new;
+	int bits;
+
+	old = rcu_dereference_protected(peertab->buckets, 1);
+	new = rcu_dereference_protected(peertab->new_buckets, 1);
+	if (!new) {
+		bits = old->bits;
+		while ((peertab->num_peers > (1 << bits))
+				&& (bits < HOMA_PEERTAB_MAX_BITS))
+			bits++;
+		while ((peertab->num_peers < (1 << bits)/4)
+				&& (bits > HOMA_PEERTAB_MIN_BITS))
+			bits--;
+		if (bits == old->bits)
+			return;
+
+		/* Allocate before locking: vmalloc may sleep. */
+		new = homa_peer_buckets_alloc(bits);
+		if (!new)
+			return;
+		spin_lock_bh(&peertab->write_lock);
+		peertab->rehash_bucket = 0;
+		peertab->gc_bucket = 0;
+		rcu_assign_pointer(peertab->new_buckets, new);
+		spin_unlock_bh(&peertab->write_lock);
+	}
+	homa_peertab_rehash(peertab, old, new);
 }
 
 /**
@@ -92,6 +282,113 @@ void homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now)
 	}
 }
 
+/**
+ * homa_peer_free_rcu() - RCU callback that frees a peer once no RCU
+ * readers can still be using it.
+ * @head:    The @rcu field of the peer to free.
+ */
+static void homa_peer_free_rcu(struct rcu_head *head)
+{
+	struct homa_peer *peer = container_of(head, struct homa_peer, rcu);
+
+	dst_release(peer->dst);
+	kfree(peer);
+}
+
+/**
+ * homa_peertab_gc_peers() - Delete idle peers from the peer table. Each
+ * call examines only a few buckets (HOMA_PEER_GC_BUCKETS), picking up
+ * where the previous call left off; it is invoked from homa_timer.
+ * A peer can be deleted only if no RPCs refer to it, it has no grantable
+ * messages or unsent acks, and it hasn't been used for homa->peer_idle_secs
+ * (or HOMA_PEER_MIN_IDLE_SECS, if the table is over homa->max_peers).
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_peertab_gc_peers(struct homa *homa)
+{
+	struct homa_peertab *peertab = &homa->peers;
+	unsigned long now = jiffies;
+	unsigned long idle, min_idle;
+	struct homa_peer_buckets *table;
+	struct homa_peer *peer;
+	struct hlist_node *next;
+	__u64 start;
+	int i, bucket, forced, idle_enough, count;
+
+	forced = (homa->max_peers > 0)
+			&& (peertab->num_peers > homa->max_peers);
+	if ((homa->peer_idle_secs <= 0) && !forced)
+		return;
+	start = get_cycles();
+	min_idle = HOMA_PEER_MIN_IDLE_SECS * HZ;
+	idle = homa->peer_idle_secs * HZ;
+	if (idle < min_idle)
+		idle = min_idle;
+
+	/* The bucket arrays can only be replaced by homa_peertab_check_size,
+	 * which runs in the same thread as this function. During a resize,
+	 * only peers that have already been moved to the new array are
+	 * considered.
+	 */
+	table = rcu_dereference_protected(peertab->new_buckets, 1);
+	if (!table)
+		table = rcu_dereference_protected(peertab->buckets, 1);
+	count = 1 << table->bits;
+	if (count > HOMA_PEER_GC_BUCKETS)
+		count = HOMA_PEER_GC_BUCKETS;
+	for (i = 0; i < count; i++) {
+		bucket = peertab->gc_bucket;
+		peertab->gc_bucket = (bucket + 1) & ((1 << table->bits) - 1);
+		if (hlist_empty(&table->heads[bucket]))
+			continue;
+		spin_lock_bh(&peertab->write_lock);
+		hlist_for_each_entry_safe(peer, next,
+				&table->heads[bucket], peertab_links) {
+			unsigned long unused = now
+					- READ_ONCE(peer->access_jiffies);
+			int num_acks;
+
+			if ((atomic_read(&peer->refs) != 0)
+					|| !list_empty(&peer->grantable_rpcs)
+					|| (unused < min_idle))
+				continue;
+
+			/* Acks are only added by RPCs, which hold references,
+			 * so once the check above passes this can't go from
+			 * zero to nonzero before the peer is claimed below.
+			 */
+			homa_peer_lock(peer);
+			num_acks = peer->num_acks;
+			homa_peer_unlock(peer);
+			if (num_acks != 0)
+				continue;
+			idle_enough = (unused >= idle)
+					&& (homa->peer_idle_secs > 0);
+			if (!idle_enough && !forced)
+				continue;
+
+			/* Claim the peer, so that no new RPCs can refer
+			 * to it (this will fail if an RPC got a reference
+			 * since we checked above).
+			 */
+			if (atomic_cmpxchg(&peer->refs, 0, -1) != 0)
+				continue;
+			tt_record1("homa_peertab_gc_peers evicting peer 0x%x",
+					tt_addr(peer->addr));
+			hlist_del_rcu(&peer->peertab_links);
+			peertab->num_peers--;
+			call_rcu(&peer->rcu, homa_peer_free_rcu);
+			INC_METRIC(peer_evictions, 1);
+			if (!idle_enough)
+				INC_METRIC(peer_forced_evictions, 1);
+			forced = (homa->max_peers > 0)
+					&& (peertab->num_peers > homa->max_peers);
+		}
+		spin_unlock_bh(&peertab->write_lock);
+	}
+	INC_METRIC(peer_gc_cycles, get_cycles() - start);
+}
+
 /**
  * homa_peer_find() - Returns the peer associated with a given host; creates
  * a new homa_peer if one doesn't already exist.
@@ -101,9 +398,11 @@ void homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now)
  * @inet:       Socket that will be used for sending packets.
  *
  * Return:      The peer associated with @addr, or a negative errno if an
- *              error occurred. The caller can retain this pointer
- *              indefinitely: peer entries are never deleted except in
- *              homa_peertab_destroy.
+ *              error occurred. Idle peers may be deleted by
+ *              homa_peertab_gc_peers: a caller in process context, or
+ *              one that retains this pointer (e.g. in an RPC), must call
+ *              homa_peer_hold; see the documentation for struct
+ *              homa_peertab.
  */
 struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 		const struct in6_addr *addr, struct inet_sock *inet)
@@ -111,33 +410,47 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	/* Note: this function uses RCU operators to ensure safety even
 	 * if a concurrent call is adding a new entry.
 	 */
+	struct homa_peer_buckets *table, *new;
 	struct homa_peer *peer;
 	struct dst_entry *dst;
-	// Should use siphash or jhash here:
-	__u32 bucket = hash_32(addr->in6_u.u6_addr32[0], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[1], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[2], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[3], HOMA_PEERTAB_BUCKET_BITS);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
-		if (ipv6_addr_equal(&peer->addr, addr)) {
-			return peer;
-		}
-		INC_METRIC(peer_hash_links, 1);
+
+	/* During a resize a peer may be in either bucket array. Fetch
+	 * new_buckets first: if the resize finishes concurrently, buckets
+	 * will then refer to the array holding every peer. A miss caused
+	 * by a concurrent move is caught by the check under write_lock.
+	 */
+	rcu_read_lock();
+	new = rcu_dereference(peertab->new_buckets);
+	smp_rmb();
+	table = rcu_dereference(peertab->buckets);
+	peer = homa_peer_lookup(peertab, table, addr);
+	if (!peer)
+		peer = homa_peer_lookup(peertab, new, addr);
+	if (peer) {
+		if (READ_ONCE(peer->access_jiffies) != jiffies)
+			WRITE_ONCE(peer->access_jiffies, jiffies);
+		rcu_read_unlock();
+		return peer;
 	}
+	rcu_read_unlock();
 
 	/* No existing entry; create a new one.
 	 *
 	 * Note: after we acquire the lock, we have to check again to
 	 * make sure the entry still doesn't exist (it might have been
-	 * created by a concurrent invocation of this function).
+	 * created by a concurrent invocation of this function, or been
+	 * missed above because it was being moved by a resize).
 	 */
 	spin_lock_bh(&peertab->write_lock);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
-		if (ipv6_addr_equal(&peer->addr, addr))
-			goto done;
-	}
+	table = rcu_dereference_protected(peertab->buckets,
+			lockdep_is_held(&peertab->write_lock));
+	new = rcu_dereference_protected(peertab->new_buckets,
+			lockdep_is_held(&peertab->write_lock));
+	peer = homa_peer_lookup(peertab, table, addr);
+	if (!peer)
+		peer = homa_peer_lookup(peertab, new, addr);
+	if (peer)
+		goto done;
 	peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
 	if (!peer) {
 		peer = (struct homa_peer *) ERR_PTR(-ENOMEM);
@@ -156,10 +469,12 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-1] = 0;
 	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-2] = INT_MAX;
 	peer->cutoff_version = 0;
+	memset(&peer->data_template, 0, sizeof(peer->data_template));
+	peer->data_template.common.type = DATA;
+	homa_set_doff(&peer->data_template);
 	peer->last_update_jiffies = 0;
 	INIT_LIST_HEAD(&peer->grantable_rpcs);
 	INIT_LIST_HEAD(&peer->grantable_links);
-	hlist_add_head_rcu(&peer->peertab_links, &peertab->buckets[bucket]);
 	peer->outstanding_resends = 0;
 	peer->most_recent_resend = 0;
 	peer->least_recent_rpc = NULL;
@@ -168,6 +483,11 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->resend_rpc = NULL;
 	peer->num_acks = 0;
 	spin_lock_init(&peer->ack_lock);
+	atomic_set(&peer->refs, 0);
+	peer->access_jiffies = jiffies;
+	peertab->num_peers++;
+	hlist_add_head_rcu(&peer->peertab_links,
+			homa_peer_bucket(peertab, new ? new : table, addr));
 	INC_METRIC(peer_new_entries, 1);
 
     done:
@@ -212,7 +532,10 @@ void homa_dst_refresh(struct homa_peertab *peertab, struct homa_peer *peer,
 			list_add_tail(&dead->dst_links, &peertab->dead_dsts);
 			homa_peertab_gc_dsts(peertab, now);
 		}
-		peer->dst = dst;
+		/* Transmitters read peer->dst without a lock (and use it
+		 * without a reference, under RCU; see __homa_xmit_data).
+		 */
+		WRITE_ONCE(peer->dst, dst);
 	}
 	spin_unlock_bh(&peertab->write_lock);
 }
@@ -229,12 +552,8 @@ void homa_dst_refresh(struct homa_peertab *peertab, struct homa_peer *peer,
 int homa_unsched_priority(struct homa *homa, struct homa_peer *peer,
 		int length)
 {
-	int i;
-	for (i = homa->num_priorities-1; ; i--) {
-		if (peer->unsched_cutoffs[i] >= length)
-			return i;
-	}
-	/* Can't ever get here */
+	return homa_cutoff_priority(peer->unsched_cutoffs,
+			homa->num_priorities, length);
 }
 
 /**
@@ -337,10 +656,11 @@ void homa_peer_lock_slow(struct homa_peer *peer)
 void homa_peer_add_ack(struct homa_rpc *rpc)
 {
 	struct homa_peer *peer = rpc->peer;
-	struct ack_header ack;
+	struct ack_batch ack;
+	int length;
 
 	homa_peer_lock(peer);
-	if (peer->num_acks < NUM_PEER_UNACKED_IDS) {
+	if (peer->num_acks < HOMA_PEER_ACKS) {
 		peer->acks[peer->num_acks].client_id = cpu_to_be64(rpc->id);
 		peer->acks[peer->num_acks].client_port = htons(rpc->hsk->port);
 		peer->acks[peer->num_acks].server_port = htons(rpc->dport);
@@ -349,15 +669,14 @@ void homa_peer_add_ack(struct homa_rpc *rpc)
 		return;
 	}
 
-	/* The peer has filled up; send an ACK message to empty it. The
-	 * RPC in the message header will also be considered ACKed.
+	/* The peer has filled up; send an ACK message with a batch of
+	 * acks to make room. The RPC in the message header will also be
+	 * considered ACKed.
 	 */
 	INC_METRIC(ack_overflows, 1);
-	memcpy(ack.acks, peer->acks, sizeof(peer->acks));
-	ack.num_acks = htons(peer->num_acks);
-	peer->num_acks = 0;
 	homa_peer_unlock(peer);
-	homa_xmit_control(ACK, &ack, sizeof(ack), rpc);
+	length = homa_peer_get_ack_batch(peer, &ack);
+	homa_xmit_control(ACK, &ack, length, rpc);
 }
 
 /**
@@ -386,3 +705,29 @@ int homa_peer_get_acks(struct homa_peer *peer, int count, struct homa_ack *dst)
 	homa_peer_unlock(peer);
 	return count;
 }
+
+/**
+ * homa_peer_get_ack_batch() - Fill in the acks for an ACK packet, taking
+ * as many as possible (up to HOMA_MAX_ACK_BATCH) from a peer.
+ * @peer:    Peer whose unacked RPCs should be included in the packet.
+ * @batch:   The acks (and num_acks) will be filled in here; the caller
+ *           must fill in the common header.
+ *
+ * Return:   The number of bytes of @batch that must be transmitted.
+ */
+int homa_peer_get_ack_batch(struct homa_peer *peer, struct ack_batch *batch)
+{
+	struct homa_ack acks[HOMA_MAX_ACK_BATCH];
+	int count, in_header;
+
+	count = homa_peer_get_acks(peer, HOMA_MAX_ACK_BATCH, acks);
+	batch->header.num_acks = htons(count);
+	in_header = (count < NUM_PEER_UNACKED_IDS) ? count
+			: NUM_PEER_UNACKED_IDS;
+	memcpy(batch->header.acks, acks, in_header * sizeof(acks[0]));
+	if (count <= NUM_PEER_UNACKED_IDS)
+		return sizeof(batch->header);
+	memcpy(batch->extra, &acks[in_header],
+			(count - in_header) * sizeof(acks[0]));
+	return sizeof(batch->header) + (count - in_header) * sizeof(acks[0]);
+}
@@ -220,6 +220,13 @@ static struct proc_dir_entry *metrics_dir_entry = NULL;
 
 /* Used to configure sysctl access to Homa configuration parameters.*/
 static struct ctl_table homa_ctl_table[] = {
+	{
+		.procname	= "bundle_control",
+		.data		= &homa_data.bundle_control,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "cutoff_version",
 		.data		= &homa_data.cutoff_version,
@@ -346,6 +353,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "max_peers",
+		.data		= &homa_data.max_peers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "max_pollers",
+		.data		= &homa_data.max_pollers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "max_sched_prio",
 		.data		= &homa_data.max_sched_prio,
@@ -353,6 +374,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0444,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "nic_feedback_usecs",
+		.data		= &homa_data.nic_feedback_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "num_priorities",
 		.data		= &homa_data.num_priorities,
@@ -360,6 +388,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "peer_idle_secs",
+		.data		= &homa_data.peer_idle_secs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "poll_usecs",
 		.data		= &homa_data.poll_usecs,
@@ -367,6 +402,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "poll_percentile",
+		.data		= &homa_data.poll_percentile,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "priority_map",
 		.data		= &homa_data.priority_map,
@@ -381,6 +423,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "reap_wake_buffs",
+		.data		= &homa_data.reap_wake_buffs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "request_ack_ticks",
 		.data		= &homa_data.request_ack_ticks,
@@ -454,17 +503,21 @@ static struct ctl_table homa_ctl_table[] = {
 	{}
 };
 
-/* Sizes of the headers for each Homa packet type, in bytes. */
+/* Minimum sizes of the headers for each Homa packet type, in bytes.
+ * The ack at the end of GRANT, RESEND, and BUSY headers is optional:
+ * peers running earlier versions of Homa don't send it (see homa_pkt_ack).
+ */
 static __u16 header_lengths[] = {
 	sizeof32(struct data_header),
-	sizeof32(struct grant_header),
-	sizeof32(struct resend_header),
+	offsetof(struct grant_header, ack),
+	offsetof(struct resend_header, ack),
 	sizeof32(struct unknown_header),
-	sizeof32(struct busy_header),
+	offsetof(struct busy_header, ack),
 	sizeof32(struct cutoffs_header),
 	sizeof32(struct freeze_header),
 	sizeof32(struct need_ack_header),
-	sizeof32(struct ack_header)
+	sizeof32(struct ack_header),
+	sizeof32(struct bundle_header)
 };
 
 /* Used to remove sysctl values when the module is unloaded. */
@@ -891,12 +944,20 @@ int homa_ioc_reply(struct sock *sk, unsigned long arg) {
 	err = 0;
 	length = iter.count;
 
-	peer = homa_peer_find(&hsk->homa->peers, &canonical_dest, &hsk->inet);
-	if (IS_ERR(peer)) {
-		err = PTR_ERR(peer);
-		goto done;
-	}
-	skbs = homa_fill_packets(hsk, peer, &iter);
+	/* Copying the message from user space can sleep for arbitrarily
+	 * long, so we need a reference to keep the peer from being evicted.
+	 */
+	do {
+		peer = homa_peer_find(&hsk->homa->peers, &canonical_dest,
+				&hsk->inet);
+		if (IS_ERR(peer)) {
+			err = PTR_ERR(peer);
+			goto done;
+		}
+	} while (!homa_peer_hold(peer));
+	skbs = homa_fill_packets(hsk, peer,
+			ntohs(args.dest_addr.in6.sin6_port), args.id, &iter);
+	homa_peer_put(peer);
 	if (IS_ERR(skbs)) {
 		err = PTR_ERR(skbs);
 		goto done;
@@ -916,8 +977,10 @@ int homa_ioc_reply(struct sock *sk, unsigned long arg) {
 		goto unlock;
 	}
 	srpc->state = RPC_OUTGOING;
+	homa_rpc_reset_silence(srpc);
+	homa_timer_arm(srpc, 1);
 
-	homa_message_out_init(srpc, hsk->port, skbs, length);
+	homa_message_out_init(srpc, skbs, length);
 	tt_record1("homa_ioc_reply calling homa_xmit_data for id %u",
 			srpc->id);
 	homa_xmit_data(srpc, false);
@@ -1002,6 +1065,13 @@ int homa_ioc_send(struct sock *sk, unsigned long arg) {
 			crpc->id, crpc->msgout.length);
 	crpc->completion_cookie = args.completion_cookie;
 	homa_xmit_data(crpc, false);
+	if (crpc->msgout.copied < crpc->msgout.length) {
+		err = homa_message_out_fill(crpc, &iter);
+		if (err) {
+			crpc = NULL;
+			goto error;
+		}
+	}
 
 	if (unlikely(copy_to_user(&((struct homa_send_args *) arg)->id,
 			&crpc->id, sizeof(crpc->id)))) {
@@ -1063,6 +1133,33 @@ int homa_ioc_abort(struct sock *sk, unsigned long arg) {
 	return ret;
 }
 
+/**
+ * homa_ioc_wait_stats() - The top-level function for the ioctl that
+ * returns information about message waits on a socket.
+ * @sk:       Socket for this request.
+ * @arg:      Used to return a struct homa_wait_stats to user space.
+ *
+ * Return: 0 on success, otherwise a negative errno.
+ */
+int homa_ioc_wait_stats(struct sock *sk, unsigned long arg) {
+	struct homa_sock *hsk = homa_sk(sk);
+	struct homa_wait_stats stats;
+	int budget;
+
+	homa_sock_ready_lock(hsk);
+	budget = hsk->homa->poll_cycles;
+	if (hsk->homa->poll_percentile && (hsk->poll_cycles < budget))
+		budget = hsk->poll_cycles;
+	stats.fast_wakeups = hsk->fast_wakeups;
+	stats.slow_wakeups = hsk->slow_wakeups;
+	stats.poll_usecs = (hsk->total_poll_cycles * 1000) / cpu_khz;
+	homa_sock_ready_unlock(hsk);
+	stats.poll_budget_usecs = (budget * 1000ULL) / cpu_khz;
+	if (unlikely(copy_to_user((void *) arg, &stats, sizeof(stats))))
+		return -EFAULT;
+	return 0;
+}
+
 /**
  * homa_ioctl() - Implements the ioctl system call for Homa sockets.
  * @sk:    Socket on which the system call was invoked.
@@ -1108,6 +1205,9 @@ int homa_ioctl(struct sock *sk, int cmd, unsigned long arg) {
 		INC_METRIC(abort_calls, 1);
 		INC_METRIC(abort_cycles, core->syscall_end_time - start);
 		break;
+	case HOMAIOCWAITSTATS:
+		result = homa_ioc_wait_stats(sk, arg);
+		break;
 	case HOMAIOCFREEZE:
 		tt_record1("Freezing timetrace because of HOMAIOCFREEZE ioctl, "
 				"pid %d", current->pid);
@@ -1289,16 +1389,106 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
 	return 0;
 }
 
+/**
+ * homa_softirq_key() - Computes the order in which homa_softirq should
+ * process a packet within a batch.
+ * @skb:    Incoming packet; the Homa header may not have been pulled yet.
+ * @key:    Filled in with the packet's key; packets with smaller keys
+ *          should be processed first (see homa_softirq_before). For a
+ *          DATA packet, @key->msg holds the length of its message in the
+ *          high-order 32 bits (so shorter messages go first) and bits
+ *          identifying the RPC in the low-order bits (so packets of the
+ *          same message end up together), and @key->offset holds the
+ *          packet's offset. Control packets, and packets whose header
+ *          isn't in the linear part of the buffer, get a key of 0.
+ */
+static inline void homa_softirq_key(struct sk_buff *skb,
+		struct homa_softirq_key *key)
+{
+	struct data_header *h = (struct data_header *)
+			skb_transport_header(skb);
+	__u64 id;
+
+	key->msg = 0;
+	key->offset = 0;
+	if ((skb_transport_header(skb) - skb->data + sizeof(*h))
+			> skb_headlen(skb))
+		return;
+	if (h->common.type != DATA)
+		return;
+
+	/* Distinct messages of the same length may occasionally get the
+	 * same key; their packets will then be interleaved by offset,
+	 * which costs some extra RPC lookups but is otherwise harmless.
+	 */
+	id = be64_to_cpu(h->common.sender_id);
+	key->msg = (((__u64) ntohl(h->message_length)) << 32)
+			| (((__u32) id) ^ (ntohs(h->common.sport) << 16));
+	key->offset = ntohl(h->seg.offset);
+}
+
+/**
+ * homa_softirq_before() - Returns nonzero if a packet with key @a should
+ * be processed before one with key @b.
+ * @a:      Key for the first packet (from homa_softirq_key).
+ * @b:      Key for the second packet.
+ */
+static inline int homa_softirq_before(struct homa_softirq_key *a,
+		struct homa_softirq_key *b)
+{
+	return (a->msg < b->msg) || ((a->msg == b->msg)
+			&& (a->offset < b->offset));
+}
+
+/**
+ * homa_softirq_short_delay() - Record in the metrics how long a
+ * single-packet message waited behind other packets in a SoftIRQ batch.
+ * @cycles:   The delay, in get_cycles() units.
+ */
+static inline void homa_softirq_short_delay(__u64 cycles)
+{
+	__u64 usecs = (cycles * 1000)/cpu_khz;
+	int bucket = fls64(usecs);
+
+	if (bucket >= HOMA_SHORT_DELAY_BUCKETS)
+		bucket = HOMA_SHORT_DELAY_BUCKETS - 1;
+	INC_METRIC(softirq_short_msgs, 1);
+	INC_METRIC(softirq_short_delay_cycles, cycles);
+	INC_METRIC(softirq_short_delay_hist[bucket], 1);
+}
+
 /**
  * homa_softirq() - This function is invoked at SoftIRQ level to handle
  * incoming packets.
  * @skb:   The incoming packet.
  * Return: Always 0
  */
-int homa_softirq(struct sk_buff *skb) {
+int homa_softirq(struct sk_buff *skb)
+{
+	__homa_softirq(skb);
+
+	/* Matches the increment in homa_gro_complete when this batch was
+	 * assigned to this core.
+	 */
+	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
+	return 0;
+}
+
+/**
+ * __homa_softirq() - Does all of the work of homa_softirq except for
+ * updating softirq_backlog. Invoked directly for packets handled at NAPI
+ * level (e.g. by homa_gro_receive), which were never counted in
+ * softirq_backlog.
+ * @skb:   The incoming packet.
+ */
+void __homa_softirq(struct sk_buff *skb)
+{
 	struct common_header *h;
-	struct sk_buff *packets, *short_packets, *next;
-	struct sk_buff **prev_link, **short_link;
+	struct sk_buff *packets, *tail, *next, *other;
+	struct sk_buff **link;
+	struct homa_softirq_key key, tail_key, other_key;
+	__u64 prev_msg;
+	int depth;
 	__u16 dport;
 	static __u64 last = 0;
 	__u64 start;
@@ -1318,6 +1508,8 @@ int homa_softirq(struct sk_buff *skb) {
 	INC_METRIC(softirq_calls, 1);
 	homa_cores[raw_smp_processor_id()]->last_active = start;
 	homa_lcache_init(&lcache);
+	if (homa->bundle_control)
+		homa_bundle_start();
 	if ((start - last) > 1000000) {
 		int scaled_ms = (int) (10*(start-last)/cpu_khz);
 		if ((scaled_ms >= 50) && (scaled_ms < 10000)) {
@@ -1333,28 +1525,48 @@ int homa_softirq(struct sk_buff *skb) {
 	last = start;
 
 	/* skb may actually contain many distinct packets, linked through
-	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism. First, pull
-	 * out all the short packets into a separate list, then splice this
-	 * list into the front of the packet list, so that all the short
-	 * packets will get served first.
+	 * skb_shinfo(skb)->frag_list by the Homa GRO mechanism. Sort them
+	 * (stably) by homa_softirq_key, so that control packets are served
+	 * first, followed by data packets in SRPT order; packets that
+	 * complete short messages will then be processed (and their
+	 * waiting threads woken) as early as possible. The key also keeps
+	 * the packets of each message together and in offset order, so
+	 * homa_pkt_dispatch can process them with a single RPC lookup and
+	 * lock acquisition (via lcache). Batches are small and usually
+	 * arrive nearly sorted, so insertion sort is fine.
 	 */
-
-	skb->next = skb_shinfo(skb)->frag_list;
+	next = skb_shinfo(skb)->frag_list;
 	skb_shinfo(skb)->frag_list = NULL;
-	packets = skb;
-	prev_link = &packets;
-	short_packets = NULL;
-	short_link = &short_packets;
-	for (skb = packets; skb != NULL; skb = skb->next) {
-		if (skb->len < 1400) {
-			*prev_link = skb->next;
-			*short_link = skb;
-			short_link = &skb->next;
-		} else
-			prev_link = &skb->next;
+	skb->next = NULL;
+	packets = tail = skb;
+	homa_softirq_key(skb, &tail_key);
+	for (skb = next; skb != NULL; skb = next) {
+		next = skb->next;
+		homa_softirq_key(skb, &key);
+		if (!homa_softirq_before(&key, &tail_key)) {
+			tail->next = skb;
+			skb->next = NULL;
+			tail = skb;
+			tail_key = key;
+			continue;
+		}
+		prev_msg = 0;
+		for (link = &packets; ; link = &(*link)->next) {
+			homa_softirq_key(*link, &other_key);
+			if (homa_softirq_before(&key, &other_key))
+				break;
+			prev_msg = other_key.msg;
+		}
+		skb->next = *link;
+		*link = skb;
+		depth = 0;
+		for (other = skb->next; other != NULL; other = other->next)
+			depth++;
+		INC_METRIC(softirq_reordered_pkts, 1);
+		INC_METRIC(softirq_reorder_depth, depth);
+		if ((key.msg != 0) && (key.msg == prev_msg))
+			INC_METRIC(softirq_grouped_pkts, 1);
 	}
-	*short_link = packets;
-	packets = short_packets;
 
 	for (skb = packets; skb != NULL; skb = next) {
 		const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
@@ -1423,6 +1635,20 @@ int homa_softirq(struct sk_buff *skb) {
 			}
 			goto discard;
 		}
+		if (h->type == BUNDLE) {
+			/* Splice the unpacked control packets into the list
+			 * so they will be processed next.
+			 */
+			struct sk_buff *unpacked, **link;
+
+			INC_METRIC(packets_received[BUNDLE - DATA], 1);
+			unpacked = homa_bundle_unpack(skb);
+			for (link = &unpacked; *link != NULL;
+					link = &(*link)->next) {}
+			*link = next;
+			next = unpacked;
+			goto discard;
+		}
 
 		dport = ntohs(h->dport);
 		hsk = homa_sock_find(&homa->port_map, dport);
@@ -1440,6 +1666,20 @@ int homa_softirq(struct sk_buff *skb) {
 			goto discard;
 		}
 
+		if (h->type == DATA) {
+			struct data_header *d = (struct data_header *) h;
+
+			/* Measure how long single-packet messages wait
+			 * behind other packets in the batch.
+			 */
+			if ((d->seg.offset == 0) && (ntohl(d->message_length)
+					<= ntohl(d->seg.segment_length)))
+				homa_softirq_short_delay(get_cycles() - start);
+		}
+		/* Remember which NIC queue the socket's packets arrive on,
+		 * for use by busy polling (see homa_napi_poll).
+		 */
+		sk_mark_napi_id(&hsk->sock, skb);
 		homa_pkt_dispatch(skb, hsk, &lcache, &incoming_delta);
 		continue;
 
@@ -1450,9 +1690,8 @@ discard:
 	homa_lcache_release(&lcache);
 	atomic_add(incoming_delta, &homa->total_incoming);
 	homa_send_grants(homa);
-	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
+	homa_bundle_flush();
 	INC_METRIC(softirq_cycles, get_cycles() - start);
-	return 0;
 }
 
 /**
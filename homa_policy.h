@@ -0,0 +1,295 @@
+/* Copyright (c) 2019-2022 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file contains the decisions at the heart of Homa's transport
+ * policy: which messages to grant to, how much, and at what priority;
+ * what priority to use for unscheduled packets; and when the pacer must
+ * hold packets back to keep the NIC queue short. The functions here are
+ * pure computations on values passed in by the caller; all locking,
+ * lists, and clocks stay with the caller. Like homa_wire.h, this file
+ * depends only on <linux/types.h> (and homa_wire.h), so the kernel module
+ * and the user-space endpoint in util/homa_xdp.c make exactly the same
+ * decisions.
+ *
+ * Times are expressed in "ticks", whose unit is chosen by the caller:
+ * the kernel uses get_cycles(), the user-space endpoint uses nanoseconds.
+ */
+
+#ifndef _HOMA_POLICY_H
+#define _HOMA_POLICY_H
+
+#include <linux/types.h>
+
+#include "homa_wire.h"
+
+/**
+ * define HOMA_ETH_OVERHEAD - Number of bytes per Ethernet packet for CRC,
+ * preamble, and inter-packet gap.
+ */
+#define HOMA_ETH_OVERHEAD 24
+
+/**
+ * homa_srpt_precedes() - Determines the order of two messages under SRPT:
+ * the message with fewer bytes remaining goes first, and ties go to the
+ * older message.
+ * @remaining:        Bytes remaining in the first message.
+ * @birth:            Time when the first message was first considered.
+ * @other_remaining:  Bytes remaining in the second message.
+ * @other_birth:      Time when the second message was first considered.
+ *
+ * Return:  Nonzero means the first message strictly precedes the second.
+ */
+static inline int homa_srpt_precedes(int remaining, __u64 birth,
+		int other_remaining, __u64 other_birth)
+{
+	if (remaining != other_remaining)
+		return remaining < other_remaining;
+	return birth < other_birth;
+}
+
+/**
+ * homa_grant_needed() - Determines whether an incoming message is ready
+ * for more grants.
+ * @total_length:  Total number of bytes in the message.
+ * @received:      Number of bytes of the message received so far.
+ * @incoming:      Offset up to which the sender has been authorized to
+ *                 transmit (unscheduled bytes plus grants).
+ * @rtt_bytes:     The amount of granted-but-not-received data that keeps
+ *                 the link busy for one round trip.
+ *
+ * Return:  Nonzero means the message should be on the grantable list.
+ */
+static inline int homa_grant_needed(int total_length, int received,
+		int incoming, int rtt_bytes)
+{
+	return ((incoming - received) < rtt_bytes)
+			&& (incoming < total_length);
+}
+
+/**
+ * homa_grant_window() - Computes how much granted-but-not-received data
+ * there can be for each message. This is always rtt_bytes unless
+ * @max_grant_window is set (experimental), in which case the window grows
+ * to use up @max_incoming when there are few grantable messages (keeping
+ * rtt_bytes in reserve so a new high-priority message can be fully granted).
+ * @rtt_bytes:         See homa_grant_needed.
+ * @max_incoming:      Limit on the total granted-but-not-received bytes
+ *                     across all messages.
+ * @max_grant_window:  Upper limit on the window; 0 disables the
+ *                     experimental variable window.
+ * @num_grantable:     Number of peers with grantable messages (> 0).
+ *
+ * Return:  The window, in bytes.
+ */
+static inline int homa_grant_window(int rtt_bytes, int max_incoming,
+		int max_grant_window, int num_grantable)
+{
+	int window;
+
+	if (max_grant_window == 0)
+		return rtt_bytes;
+
+	/* This technique is risky because it could use up almost all the
+	 * grants on a single non-responsive host, which could result in
+	 * underutilization of our downlink if that host stops responding.
+	 */
+	window = (max_incoming - rtt_bytes)/num_grantable;
+	if (window > max_grant_window)
+		window = max_grant_window;
+	if (window < rtt_bytes)
+		window = rtt_bytes;
+	return window;
+}
+
+/**
+ * homa_grant_offset() - Computes the offset that a new grant for a message
+ * should authorize, before the limit on total incoming bytes is applied.
+ * @total_length:  Total number of bytes in the message.
+ * @received:      Number of bytes of the message received so far.
+ * @window:        Value returned by homa_grant_window.
+ *
+ * Return:  The new grant offset; if it isn't larger than the message's
+ *          current incoming offset, no grant is needed.
+ */
+static inline int homa_grant_offset(int total_length, int received,
+		int window)
+{
+	int offset = received + window;
+
+	if (offset > total_length)
+		offset = total_length;
+	return offset;
+}
+
+/**
+ * homa_grant_priority() - Computes the priority to assign in a grant.
+ * Ideally each granted message gets its own level, with the fewest bytes
+ * remaining getting the highest; if there are more messages than levels,
+ * the lowest level is shared. If there are fewer messages than levels,
+ * the lowest levels are used, so that new higher-priority messages can
+ * use the higher levels for instantaneous preemption.
+ * @rank:            Position of the message's peer in SRPT order,
+ *                   starting at 1.
+ * @max_sched_prio:  Highest priority level available for scheduled
+ *                   packets.
+ * @num_grantable:   Number of peers with grantable messages.
+ *
+ * Return:  The priority level for the grant.
+ */
+static inline int homa_grant_priority(int rank, int max_sched_prio,
+		int num_grantable)
+{
+	int extra_levels, priority;
+
+	priority = max_sched_prio - (rank - 1);
+	extra_levels = max_sched_prio + 1 - num_grantable;
+	if (extra_levels >= 0)
+		priority -= extra_levels;
+	if (priority < 0)
+		priority = 0;
+	return priority;
+}
+
+/**
+ * homa_cutoff_priority() - Returns the priority level to use for the
+ * unscheduled packets of a message.
+ * @cutoffs:         Unscheduled cutoffs received from the destination in
+ *                   a CUTOFFS packet (host byte order); entry 0 must be
+ *                   larger than any message length.
+ * @num_priorities:  Number of priority levels in use.
+ * @length:          Number of bytes in the message.
+ *
+ * Return:  A priority level.
+ */
+static inline int homa_cutoff_priority(const int *cutoffs,
+		int num_priorities, int length)
+{
+	int i;
+
+	for (i = num_priorities - 1; i > 0; i--) {
+		if (cutoffs[i] >= length)
+			break;
+	}
+	return i;
+}
+
+/**
+ * homa_unsched_bytes() - Returns how many bytes of a message can be sent
+ * before any grants arrive: rtt_bytes, rounded up to a whole number of
+ * transmission units so that no unit is split between unscheduled and
+ * scheduled data.
+ * @rtt_bytes:  See homa_grant_needed.
+ * @unit:       Message bytes in each transmission unit (a GSO packet
+ *              in the kernel, a single packet in user space).
+ * @length:     Number of bytes in the message.
+ *
+ * Return:  The number of unscheduled bytes (never more than @length).
+ */
+static inline int homa_unsched_bytes(int rtt_bytes, int unit, int length)
+{
+	int unsched = rtt_bytes + unit - 1;
+
+	unsched -= unsched % unit;
+	if (unsched > length)
+		unsched = length;
+	return unsched;
+}
+
+/**
+ * homa_wire_bytes() - Returns the number of bytes a DATA packet occupies
+ * on the link, including IP and Ethernet overheads. The IPv6 header length
+ * is used for all packets (a slight overestimate for IPv4).
+ * @bytes:  Length of the packet starting at the Homa header.
+ * @segs:   Number of segments in the packet (1 unless it is a GSO packet);
+ *          each additional segment is sent with its own headers.
+ *
+ * Return:  The number of bytes on the wire.
+ */
+static inline int homa_wire_bytes(int bytes, int segs)
+{
+	bytes += HOMA_IPV6_HEADER_LENGTH + HOMA_ETH_OVERHEAD;
+	if (segs > 1)
+		bytes += (segs - 1) * ((int) (sizeof(struct data_header)
+				- sizeof(struct data_segment))
+				+ HOMA_IPV6_HEADER_LENGTH + HOMA_ETH_OVERHEAD);
+	return bytes;
+}
+
+/**
+ * homa_ticks_per_kbyte() - Returns the time to transmit 1000 bytes on the
+ * link, padded by 1% so the pacer doesn't quite run the link at line rate.
+ * @ticks_per_msec:  Number of ticks per millisecond (cpu_khz for
+ *                   get_cycles(), 1000000 for nanoseconds).
+ * @link_mbps:       Bandwidth of the link, in Mbps.
+ *
+ * Return:  Ticks per 1000 bytes.
+ */
+static inline __u32 homa_ticks_per_kbyte(__u64 ticks_per_msec, int link_mbps)
+{
+	/* Written carefully to avoid integer underflow or overflow under
+	 * expected usage patterns. Be careful when changing!
+	 */
+	__u32 ticks = (8*ticks_per_msec)/link_mbps;
+
+	return (101*ticks)/100;
+}
+
+/**
+ * homa_link_ticks() - Returns how long a packet occupies the link.
+ * @wire_bytes:       Value returned by homa_wire_bytes.
+ * @ticks_per_kbyte:  Value returned by homa_ticks_per_kbyte.
+ *
+ * Return:  The transmission time, in ticks.
+ */
+static inline int homa_link_ticks(int wire_bytes, __u32 ticks_per_kbyte)
+{
+	return (wire_bytes*ticks_per_kbyte)/1000;
+}
+
+/**
+ * homa_nic_queue_full() - Determines whether the NIC queue is too long to
+ * accept another packet.
+ * @now:            Current time.
+ * @link_idle:      Time when the link is expected to become idle, given
+ *                  everything transmitted so far.
+ * @max_nic_queue:  Longest the NIC queue may be, in ticks.
+ *
+ * Return:  Nonzero means the caller should hold its packet back.
+ */
+static inline int homa_nic_queue_full(__u64 now, __u64 link_idle,
+		__u64 max_nic_queue)
+{
+	return (now + max_nic_queue) < link_idle;
+}
+
+/**
+ * homa_link_idle_after() - Returns the new time at which the link will
+ * become idle once a packet has been queued.
+ * @now:           Current time.
+ * @link_idle:     Time when the link was expected to become idle before
+ *                 this packet.
+ * @packet_ticks:  Value returned by homa_link_ticks for the packet.
+ *
+ * Return:  The updated idle time.
+ */
+static inline __u64 homa_link_idle_after(__u64 now, __u64 link_idle,
+		int packet_ticks)
+{
+	if (link_idle < now)
+		link_idle = now;
+	return link_idle + packet_ticks;
+}
+
+#endif /* _HOMA_POLICY_H */
@@ -146,20 +146,24 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	INIT_LIST_HEAD(&hsk->active_rpcs);
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
+	INIT_WORK(&hsk->reap_work, homa_sock_reap_work);
+	spin_lock_init(&hsk->ready_lock);
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
 	INIT_LIST_HEAD(&hsk->request_interests);
 	INIT_LIST_HEAD(&hsk->response_interests);
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->server_rpc_buckets[i];
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-	}
+	spin_lock_init(&hsk->timer_lock);
+	hsk->timer_tick = homa->timer_ticks;
+	for (i = 0; i < HOMA_TIMER_SLOTS; i++)
+		INIT_HLIST_HEAD(&hsk->timer_wheel[i]);
+	hsk->receiver_cpu = -1;
+	atomic_set(&hsk->num_pollers, 0);
+	hsk->poll_cycles = homa->poll_cycles;
+	memset(hsk->wait_hist, 0, sizeof(hsk->wait_hist));
+	hsk->wait_samples = 0;
+	hsk->fast_wakeups = 0;
+	hsk->slow_wakeups = 0;
+	hsk->total_poll_cycles = 0;
 	spin_unlock_bh(&socktab->write_lock);
 }
 
@@ -204,13 +208,15 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 		homa_rpc_unlock(rpc);
 	}
 
-	homa_sock_lock(hsk, "homa_socket_shutdown #2");
+	homa_sock_ready_lock(hsk);
 	list_for_each_entry(interest, &hsk->request_interests, request_links)
 		wake_up_process(interest->thread);
 	list_for_each_entry(interest, &hsk->response_interests, response_links)
 		wake_up_process(interest->thread);
-	homa_sock_unlock(hsk);
+	homa_sock_ready_unlock(hsk);
 
+	/* @shutdown keeps homa_rpc_free from queueing the reaper again. */
+	cancel_work_sync(&hsk->reap_work);
 	while (!list_empty(&hsk->dead_rpcs))
 		homa_rpc_reap(hsk, 1000);
 }
@@ -313,3 +319,103 @@ void homa_sock_lock_slow(struct homa_sock *hsk)
 	INC_METRIC(socket_lock_misses, 1);
 	INC_METRIC(socket_lock_miss_cycles, get_cycles() - start);
 }
+
+/**
+ * homa_sock_ready_lock_slow() - This function implements the slow path for
+ * acquiring a socket's ready_lock. It is invoked when the lock isn't
+ * immediately available. It waits for the lock, but also records statistics
+ * about the waiting time.
+ * @hsk:    socket whose ready_lock is needed.
+ */
+void homa_sock_ready_lock_slow(struct homa_sock *hsk)
+{
+	__u64 start = get_cycles();
+	tt_record("beginning wait for socket ready_lock");
+	spin_lock_bh(&hsk->ready_lock);
+	tt_record("ending wait for socket ready_lock");
+	INC_METRIC(ready_lock_misses, 1);
+	INC_METRIC(ready_lock_miss_cycles, get_cycles() - start);
+}
+
+/**
+ * homa_sock_wait_record() - Record statistics about one wait for a message
+ * on a socket, and occasionally use the accumulated data to recompute the
+ * socket's polling time.
+ * @hsk:          Socket on which the thread waited.
+ * @fast:         Nonzero means a message arrived while the thread was
+ *                polling; zero means the thread went to sleep.
+ * @poll_cycles:  How long the thread polled, in get_cycles units.
+ * @wait_cycles:  Time from when the thread began polling until a message
+ *                arrived, in get_cycles units; negative means no message
+ *                arrived (e.g. the wait was interrupted by a signal).
+ */
+void homa_sock_wait_record(struct homa_sock *hsk, int fast,
+		__u64 poll_cycles, __s64 wait_cycles)
+{
+	int bucket = 0;
+
+	if (wait_cycles >= 0) {
+		__u64 usecs = (wait_cycles * 1000) / cpu_khz;
+
+		bucket = (usecs == 0) ? 0 : fls64(usecs);
+		if (bucket >= HOMA_WAIT_BUCKETS)
+			bucket = HOMA_WAIT_BUCKETS - 1;
+	}
+
+	/* Several threads may be waiting on the socket; the lock keeps
+	 * the counters exact and ensures that only one of them adapts
+	 * the histogram when it fills.
+	 */
+	homa_sock_ready_lock(hsk);
+	if (fast)
+		hsk->fast_wakeups++;
+	else
+		hsk->slow_wakeups++;
+	hsk->total_poll_cycles += poll_cycles;
+	if (wait_cycles >= 0) {
+		hsk->wait_hist[bucket]++;
+		hsk->wait_samples++;
+		if (hsk->wait_samples >= HOMA_WAIT_SAMPLES)
+			homa_sock_wait_adapt(hsk);
+	}
+	homa_sock_ready_unlock(hsk);
+}
+
+/**
+ * homa_sock_wait_adapt() - Recompute the polling time for a socket: pick
+ * the shortest time that would allow homa->poll_percentile percent of
+ * the waits in the socket's histogram to end while polling, but don't
+ * exceed homa->poll_usecs (the CPU budget for polling). Then age the
+ * histogram, so that it tracks changes in the socket's behavior.
+ * @hsk:     Socket whose polling time should be recomputed. The caller
+ *           must hold its ready_lock.
+ */
+void homa_sock_wait_adapt(struct homa_sock *hsk)
+{
+	struct homa *homa = hsk->homa;
+	int target = (hsk->wait_samples * homa->poll_percentile) / 100;
+	int i, count, usecs;
+
+	count = 0;
+	for (i = 0; i < HOMA_WAIT_BUCKETS - 1; i++) {
+		count += hsk->wait_hist[i];
+		if (count >= target)
+			break;
+	}
+
+	/* Entry i holds waits shorter than 2^i usecs. */
+	usecs = 1 << i;
+	if (usecs > homa->poll_usecs)
+		usecs = homa->poll_usecs;
+	WRITE_ONCE(hsk->poll_cycles, (usecs * cpu_khz) / 1000);
+	tt_record3("homa_sock_wait_adapt set poll time for port %d to "
+			"%d usecs (percentile %d)", hsk->port, usecs,
+			homa->poll_percentile);
+
+	count = 0;
+	for (i = 0; i < HOMA_WAIT_BUCKETS; i++) {
+		hsk->wait_hist[i] /= 2;
+		count += hsk->wait_hist[i];
+	}
+	hsk->wait_samples = count;
+}
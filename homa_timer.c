@@ -19,8 +19,8 @@
 #include "homa_impl.h"
 
 /**
- * homa_check_rpc() -  Invoked for each RPC during each timer pass; does
- * most of the work of checking for time-related actions such as sending
+ * homa_check_rpc() -  Invoked for each RPC that is due during a timer pass;
+ * does most of the work of checking for time-related actions such as sending
  * resends, declaring a host dead, and sending requests for acks. Itt is
  * separate from homa_timer because homa_timer got too long and deeply
  * indented.
@@ -178,6 +178,79 @@ int homa_check_rpc(struct homa_rpc *rpc)
 	return 0;
 }
 
+/**
+ * homa_timer_arm() - Arrange for homa_timer to check an RPC a given number
+ * of ticks in the future. If the RPC was already scheduled, the old
+ * schedule is replaced.
+ * @rpc:     RPC to schedule. Must be locked by caller.
+ * @ticks:   How many ticks from now the RPC should be checked; will be
+ *           limited to the range 1 to HOMA_TIMER_SLOTS-1.
+ */
+void homa_timer_arm(struct homa_rpc *rpc, int ticks)
+{
+	struct homa_sock *hsk = rpc->hsk;
+
+	if (ticks < 1)
+		ticks = 1;
+	else if (ticks >= HOMA_TIMER_SLOTS)
+		ticks = HOMA_TIMER_SLOTS - 1;
+	spin_lock_bh(&hsk->timer_lock);
+	hlist_del_init(&rpc->timer_links);
+	hlist_add_head(&rpc->timer_links, &hsk->timer_wheel[
+			(hsk->timer_tick + ticks) & (HOMA_TIMER_SLOTS - 1)]);
+	spin_unlock_bh(&hsk->timer_lock);
+}
+
+/**
+ * homa_timer_disarm() - Remove an RPC from its socket's timer wheel, so
+ * that homa_timer will no longer check it.
+ * @rpc:     RPC to remove. Must be locked by caller.
+ */
+void homa_timer_disarm(struct homa_rpc *rpc)
+{
+	spin_lock_bh(&rpc->hsk->timer_lock);
+	hlist_del_init(&rpc->timer_links);
+	spin_unlock_bh(&rpc->hsk->timer_lock);
+}
+
+/**
+ * homa_timer_next_due() - Advance through the slots of a socket's timer
+ * wheel, up to the current tick, and return the first RPC found.
+ * @hsk:     Socket whose timer wheel should be checked. The caller must
+ *           have invoked homa_protect_rpcs for this socket.
+ *
+ * Return:   An RPC that is due for checking (it has been removed from
+ *           the wheel and is not locked), or NULL if no more RPCs are due
+ *           in this tick.
+ */
+struct homa_rpc *homa_timer_next_due(struct homa_sock *hsk)
+{
+	__u32 now = hsk->homa->timer_ticks;
+	struct homa_rpc *rpc;
+
+	spin_lock_bh(&hsk->timer_lock);
+	if ((now - hsk->timer_tick) > HOMA_TIMER_SLOTS)
+		/* We've fallen more than a full rotation behind (e.g. the
+		 * socket had no RPCs for a while); there's no need to visit
+		 * any slot more than once.
+		 */
+		hsk->timer_tick = now - HOMA_TIMER_SLOTS;
+	while (1) {
+		rpc = hlist_entry_safe(hsk->timer_wheel[
+				hsk->timer_tick & (HOMA_TIMER_SLOTS - 1)].first,
+				struct homa_rpc, timer_links);
+		if (rpc) {
+			hlist_del_init(&rpc->timer_links);
+			break;
+		}
+		if (hsk->timer_tick == now)
+			break;
+		hsk->timer_tick++;
+	}
+	spin_unlock_bh(&hsk->timer_lock);
+	return rpc;
+}
+
 /**
  * homa_timer() - This function is invoked at regular intervals ("ticks")
  * to implement retries and aborts for Homa.
@@ -192,6 +265,7 @@ void homa_timer(struct homa *homa)
 	struct homa_peer *dead_peer = NULL;
 	int rpc_count = 0;
 	int total_rpcs = 0;
+	int ticks;
 
 	start = get_cycles();
 	homa->timer_ticks++;
@@ -218,18 +292,50 @@ void homa_timer(struct homa *homa)
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+
+		/* Only RPCs that are due in the socket's timer wheel are
+		 * checked. The protection above keeps RPCs from being
+		 * reaped between removal from the wheel and locking.
+		 */
+		while ((rpc = homa_timer_next_due(hsk)) != NULL) {
 			total_rpcs++;
 			homa_rpc_lock(rpc);
+			if (rpc->state == RPC_DEAD) {
+				homa_rpc_unlock(rpc);
+				continue;
+			}
 			if ((rpc->state == RPC_READY)
 					|| (rpc->state == RPC_IN_SERVICE)) {
-				rpc->silent_ticks = 0;
+				/* Nothing can go wrong with this RPC until
+				 * homa_ioc_reply returns it to RPC_OUTGOING,
+				 * which will put it back in the wheel.
+				 */
+				homa_rpc_reset_silence(rpc);
 				homa_rpc_unlock(rpc);
 				continue;
 			}
-			rpc->silent_ticks++;
+			rpc->silent_ticks += homa->timer_ticks
+					- rpc->silent_base;
+			rpc->silent_base = homa->timer_ticks;
 			if (homa_check_rpc(rpc))
 				dead_peer = rpc->peer;
+
+			/* Reschedule the RPC for when it could next need
+			 * a RESEND (or timeout), or a NEED_ACK. Events that
+			 * indicate progress reset the silence but don't
+			 * reschedule; that happens lazily here.
+			 */
+			ticks = homa->resend_ticks - 1 - rpc->silent_ticks;
+			if (rpc->done_timer_ticks && !homa_is_client(rpc->id)
+					&& (rpc->state == RPC_OUTGOING)
+					&& (rpc->msgout.next_packet == NULL)) {
+				int ack_ticks = rpc->done_timer_ticks
+						+ homa->request_ack_ticks
+						- homa->timer_ticks;
+				if (ack_ticks < ticks)
+					ticks = ack_ticks;
+			}
+			homa_timer_arm(rpc, ticks);
 			homa_rpc_unlock(rpc);
 			rpc_count++;
 			if (rpc_count >= 10) {
@@ -258,7 +364,10 @@ void homa_timer(struct homa *homa)
 	}
 
 	if (total_rpcs > 0)
-		tt_record1("homa_timer finished scanning %d RPCs", total_rpcs);
+		tt_record1("homa_timer finished checking %d RPCs", total_rpcs);
+
+	homa_peertab_gc_peers(homa);
+	homa_peertab_check_size(&homa->peers);
 
 	end = get_cycles();
 	INC_METRIC(timer_cycles, end-start);
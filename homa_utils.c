@@ -67,8 +67,13 @@ int homa_init(struct homa *homa)
 			core->held_bucket = 0;
 			core->thread = NULL;
 			core->syscall_end_time = 0;
+			core->bundling = 0;
+			core->next_client_id = 0;
+			core->client_id_limit = 0;
+			core->num_bundles = 0;
 			memset(&core->metrics, 0, sizeof(core->metrics));
 		}
+		homa_gro_topology_init();
 	}
 
 	homa->pacer_kthread = NULL;
@@ -97,11 +102,48 @@ int homa_init(struct homa *homa)
 		return err;
 	}
 
+	/* RPCs are allocated and freed at a very high rate, so they get
+	 * their own slab cache: this avoids rounding each one up to a
+	 * kmalloc size class, and the slab allocator's per-CPU freelists
+	 * recycle recently freed (cache-hot) RPCs.
+	 */
+	homa->rpc_cache = kmem_cache_create("homa_rpc",
+			sizeof(struct homa_rpc), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!homa->rpc_cache) {
+		printk(KERN_ERR "Couldn't create slab cache for RPCs\n");
+		return -ENOMEM;
+	}
+	homa->reap_wq = alloc_workqueue("homa_reap", WQ_UNBOUND, 0);
+	if (!homa->reap_wq) {
+		printk(KERN_ERR "Couldn't create workqueue for reaping\n");
+		return -ENOMEM;
+	}
+	homa->client_rpc_buckets = (struct homa_rpc_bucket *) vmalloc(
+			HOMA_CLIENT_RPC_BUCKETS * sizeof(struct homa_rpc_bucket));
+	homa->server_rpc_buckets = (struct homa_rpc_bucket *) vmalloc(
+			HOMA_SERVER_RPC_BUCKETS * sizeof(struct homa_rpc_bucket));
+	if (!homa->client_rpc_buckets || !homa->server_rpc_buckets) {
+		printk(KERN_ERR "Couldn't allocate RPC hash tables\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
+		struct homa_rpc_bucket *bucket = &homa->client_rpc_buckets[i];
+		spin_lock_init(&bucket->lock);
+		INIT_HLIST_HEAD(&bucket->rpcs);
+	}
+	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
+		struct homa_rpc_bucket *bucket = &homa->server_rpc_buckets[i];
+		spin_lock_init(&bucket->lock);
+		INIT_HLIST_HEAD(&bucket->rpcs);
+	}
+
 	/* Wild guesses to initialize configuration values... */
 	homa->rtt_bytes = 10000;
 	homa->max_grant_window = 0;
 	homa->link_mbps = 10000;
 	homa->poll_usecs = 50;
+	homa->poll_percentile = 90;
+	homa->max_pollers = 4;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
@@ -126,10 +168,13 @@ int homa_init(struct homa *homa)
 	homa->max_incoming = 0;
 	homa->resend_ticks = 15;
 	homa->resend_interval = 10;
+	homa->peer_idle_secs = 300;
+	homa->max_peers = 100000;
 	homa->timeout_resends = 5;
 	homa->request_ack_ticks = 2;
 	homa->reap_limit = 10;
 	homa->dead_buffs_limit = 5000;
+	homa->reap_wake_buffs = 1000;
 	homa->max_dead_buffs = 0;
 	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
 			"homa_pacer");
@@ -143,11 +188,15 @@ int homa_init(struct homa *homa)
 	homa->pacer_exit = false;
 	homa->max_nic_queue_ns = 2000;
 	homa->cycles_per_kbyte = 0;
+	homa->nic_feedback_usecs = 0;
+	atomic64_set(&homa->next_nic_feedback, 0);
 	homa->verbose = 0;
 	homa->max_gso_size = 10000;
 	homa->max_gro_skbs = 20;
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->gro_busy_usecs = 10;
+	homa->bundle_control = 0;
+	memset(homa->rx_steer, 0, sizeof(homa->rx_steer));
 	homa->timer_ticks = 0;
 	spin_lock_init(&homa->metrics_lock);
 	homa->metrics = NULL;
@@ -177,6 +226,22 @@ void homa_destroy(struct homa *homa)
 	/* The order of the following 2 statements matters! */
 	homa_socktab_destroy(&homa->port_map);
 	homa_peertab_destroy(&homa->peers);
+	if (homa->rpc_cache) {
+		kmem_cache_destroy(homa->rpc_cache);
+		homa->rpc_cache = NULL;
+	}
+	if (homa->reap_wq) {
+		destroy_workqueue(homa->reap_wq);
+		homa->reap_wq = NULL;
+	}
+	if (homa->client_rpc_buckets) {
+		vfree(homa->client_rpc_buckets);
+		homa->client_rpc_buckets = NULL;
+	}
+	if (homa->server_rpc_buckets) {
+		vfree(homa->server_rpc_buckets);
+		homa->server_rpc_buckets = NULL;
+	}
 	if (core_memory) {
 		vfree(core_memory);
 		core_memory = NULL;
@@ -210,44 +275,60 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	size_t length = iter->count;
 	struct in6_addr dest_addr_as_ipv6 = canonical_ipv6_addr(dest);
 
-	crpc = (struct homa_rpc *) kmalloc(sizeof(*crpc), GFP_KERNEL);
+	crpc = kmem_cache_alloc(hsk->homa->rpc_cache, GFP_KERNEL);
 	if (unlikely(!crpc))
 		return ERR_PTR(-ENOMEM);
 
 	/* Initialize fields that don't require the socket lock. */
 	crpc->hsk = hsk;
-	crpc->id = atomic64_fetch_add(2, &hsk->homa->next_outgoing_id);
+	crpc->id = homa_next_client_id(hsk->homa);
 	bucket = homa_client_rpc_bucket(hsk, crpc->id);
 	crpc->lock = &bucket->lock;
 	crpc->state = RPC_OUTGOING;
 	crpc->dont_reap = false;
 	atomic_set(&crpc->grants_in_progress, 0);
-	crpc->peer = homa_peer_find(&hsk->homa->peers, &dest_addr_as_ipv6,
-			&hsk->inet);
-	if (unlikely(IS_ERR(crpc->peer))) {
-		tt_record("error in homa_peer_find");
-		err = PTR_ERR(crpc->peer);
-		goto error;
-	}
+	do {
+		crpc->peer = homa_peer_find(&hsk->homa->peers,
+				&dest_addr_as_ipv6, &hsk->inet);
+		if (unlikely(IS_ERR(crpc->peer))) {
+			tt_record("error in homa_peer_find");
+			err = PTR_ERR(crpc->peer);
+			goto error;
+		}
+	} while (!homa_peer_hold(crpc->peer));
 	crpc->dport = ntohs(dest->in6.sin6_port);
 	crpc->completion_cookie = 0;
 	crpc->error = 0;
 	crpc->msgin.total_length = -1;
 	crpc->msgin.num_skbs = 0;
-	skb = homa_fill_packets(hsk, crpc->peer, iter);
+	if (unlikely(length > HOMA_MAX_MESSAGE_LENGTH)) {
+		err = -EINVAL;
+		goto error;
+	}
+
+	/* For large messages, only copy in the first part of the message
+	 * here, so that it can be transmitted while the rest is copied
+	 * (see homa_message_out_fill).
+	 */
+	skb = homa_fill_chunk(hsk, crpc->peer, crpc->dport, crpc->id, iter,
+			length, max(hsk->homa->rtt_bytes,
+			HOMA_FILL_CHUNK_BYTES));
 	if (IS_ERR(skb)) {
 		err = PTR_ERR(skb);
-		tt_record1("error in homa_fill_packets: %d", err);
+		tt_record1("error in homa_fill_chunk: %d", err);
 		skb = NULL;
 		goto error;
 	}
-	homa_message_out_init(crpc, hsk->port, skb, length);
+	homa_message_out_init(crpc, skb, length);
+	crpc->msgout.copied = length - iter->count;
 	INIT_LIST_HEAD(&crpc->ready_links);
 	INIT_LIST_HEAD(&crpc->dead_links);
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->grantable_links);
 	INIT_LIST_HEAD(&crpc->throttled_links);
+	INIT_HLIST_NODE(&crpc->timer_links);
 	crpc->silent_ticks = 0;
+	crpc->silent_base = hsk->homa->timer_ticks;
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	crpc->done_timer_ticks = 0;
 	crpc->magic = HOMA_RPC_MAGIC;
@@ -268,13 +349,16 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	}
 	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
 	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
+	homa_timer_arm(crpc, 1);
 	homa_sock_unlock(hsk);
 
 	return crpc;
 
 error:
 	homa_free_skbs(skb);
-	kfree(crpc);
+	if (!IS_ERR(crpc->peer))
+		homa_peer_put(crpc->peer);
+	kmem_cache_free(hsk->homa->rpc_cache, crpc);
 	return ERR_PTR(err);
 }
 
@@ -299,14 +383,15 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	int err;
 	struct homa_rpc *srpc = NULL;
 	__u64 id = homa_local_id(h->common.sender_id);
-	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, source,
+			id);
 
 	/* Lock the bucket, and make sure no-one else has already created
 	 * the desired RPC.
 	 */
 	homa_bucket_lock(bucket, server);
 	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
-		if ((srpc->id == id) &&
+		if ((srpc->id == id) && (srpc->hsk == hsk) &&
 				(srpc->dport == ntohs(h->common.sport)) &&
 				ipv6_addr_equal(&srpc->peer->addr, source)) {
 			/* RPC already exists; just return it instead
@@ -317,7 +402,10 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 
 	/* Initialize fields that don't require the socket lock. */
-	srpc = (struct homa_rpc *) kmalloc(sizeof(*srpc), GFP_KERNEL);
+	/* Note: this function runs in SoftIRQ context with the bucket
+	 * locked, so it can't sleep to allocate memory.
+	 */
+	srpc = kmem_cache_alloc(hsk->homa->rpc_cache, GFP_ATOMIC);
 	if (!srpc) {
 		err = -ENOMEM;
 		goto error;
@@ -327,11 +415,14 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->state = RPC_INCOMING;
 	srpc->dont_reap = false;
 	atomic_set(&srpc->grants_in_progress, 0);
-	srpc->peer = homa_peer_find(&hsk->homa->peers, source, &hsk->inet);
-	if (unlikely(IS_ERR(srpc->peer))) {
-		err = PTR_ERR(srpc->peer);
-		goto error;
-	}
+	do {
+		srpc->peer = homa_peer_find(&hsk->homa->peers, source,
+				&hsk->inet);
+		if (unlikely(IS_ERR(srpc->peer))) {
+			err = PTR_ERR(srpc->peer);
+			goto error;
+		}
+	} while (!homa_peer_hold(srpc->peer));
 	srpc->dport = ntohs(h->common.sport);
 	srpc->id = id;
 	srpc->completion_cookie = 0;
@@ -345,7 +436,9 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->grantable_links);
 	INIT_LIST_HEAD(&srpc->throttled_links);
+	INIT_HLIST_NODE(&srpc->timer_links);
 	srpc->silent_ticks = 0;
+	srpc->silent_base = hsk->homa->timer_ticks;
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->done_timer_ticks = 0;
 	srpc->magic = HOMA_RPC_MAGIC;
@@ -360,16 +453,23 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
 	list_add_tail_rcu(&srpc->active_links, &hsk->active_rpcs);
-	if (ntohl(h->seg.segment_length) >= ntohl(h->message_length))
+	homa_timer_arm(srpc, 1);
+	if (ntohl(h->seg.segment_length) >= ntohl(h->message_length)) {
+		homa_sock_ready_lock(hsk);
 		homa_rpc_ready(srpc);
+		homa_sock_ready_unlock(hsk);
+	}
 	homa_sock_unlock(hsk);
 	INC_METRIC(requests_received, 1);
 	return srpc;
 
 error:
 	spin_unlock_bh(&bucket->lock);
-	if (srpc)
-		kfree(srpc);
+	if (srpc) {
+		if (!IS_ERR(srpc->peer))
+			homa_peer_put(srpc->peer);
+		kmem_cache_free(hsk->homa->rpc_cache, srpc);
+	}
 	return ERR_PTR(err);
 }
 
@@ -431,6 +531,41 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 		rcu_read_unlock();
 }
 
+/**
+ * homa_rpc_acked_trailer() - Handle acks that a sender appended to the
+ * end of an incoming packet (after a DATA packet's data or after an
+ * ack_header).
+ * @skb:     Incoming packet; skb->data refers to the Homa header. The
+ *           acks are read with skb_header_pointer, so a DATA packet's
+ *           payload doesn't get linearized just to reach them.
+ * @hsk:     Socket on which the packet was received.
+ * @offset:  Offset within the packet of the first appended ack.
+ * @count:   Number of acks appended to the packet.
+ */
+void homa_rpc_acked_trailer(struct sk_buff *skb, struct homa_sock *hsk,
+		int offset, int count)
+{
+	const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
+	struct homa_ack buffer, *ack;
+	int i;
+
+	if (count > HOMA_MAX_ACK_BATCH)
+		count = HOMA_MAX_ACK_BATCH;
+	if (offset + count * sizeof32(buffer) > skb->len) {
+		INC_METRIC(short_packets, 1);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		ack = skb_header_pointer(skb, offset + i * sizeof32(buffer),
+				sizeof(buffer), &buffer);
+		if (unlikely(!ack)) {
+			INC_METRIC(short_packets, 1);
+			return;
+		}
+		homa_rpc_acked(hsk, &saddr, ack);
+	}
+}
+
 /**
  * homa_rpc_free() - Destructor for homa_rpc; will arrange for all resources
  * associated with the RPC to be released (eventually).
@@ -455,6 +590,7 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	homa_sock_lock(rpc->hsk, "homa_rpc_free");
 	__hlist_del(&rpc->hash_links);
 	list_del_rcu(&rpc->active_links);
+	homa_timer_disarm(rpc);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
 	rpc->hsk->dead_skbs += rpc->msgin.num_skbs + rpc->msgout.num_skbs;
 	if (rpc->hsk->dead_skbs > rpc->hsk->homa->max_dead_buffs)
@@ -463,12 +599,23 @@ void homa_rpc_free(struct homa_rpc *rpc)
 		 * missed.
 		 */
 		rpc->hsk->homa->max_dead_buffs = rpc->hsk->dead_skbs;
+	if (rpc->hsk->homa->reap_wake_buffs && !rpc->hsk->shutdown
+			&& (rpc->hsk->dead_skbs
+			>= rpc->hsk->homa->reap_wake_buffs))
+		/* Reap on a core in this NUMA node: most of the dead
+		 * buffers were probably allocated nearby.
+		 */
+		queue_work_node(homa_cores[raw_smp_processor_id()]->numa_node,
+				rpc->hsk->homa->reap_wq,
+				&rpc->hsk->reap_work);
+	homa_sock_ready_lock(rpc->hsk);
 	__list_del_entry(&rpc->ready_links);
 	if (rpc->interest != NULL) {
 		rpc->interest->reg_rpc = NULL;
 		wake_up_process(rpc->interest->thread);
 		rpc->interest = NULL;
 	}
+	homa_sock_ready_unlock(rpc->hsk);
 //	tt_record3("Freeing rpc id %d, socket %d, dead_skbs %d", rpc->id,
 //			rpc->hsk->client_port,
 //			rpc->hsk->dead_skbs);
@@ -602,7 +749,8 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 			homa_rpc_lock(rpcs[i]);
 			homa_rpc_unlock(rpcs[i]);
 			rpcs[i]->state = 0;
-			kfree(rpcs[i]);
+			homa_peer_put(rpcs[i]->peer);
+			kmem_cache_free(hsk->homa->rpc_cache, rpcs[i]);
 		}
 		tt_record4("reaped %d skbs, %d rpcs; %d skbs remain for port %d",
 				num_skbs, num_rpcs, hsk->dead_skbs, hsk->port);
@@ -612,14 +760,35 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 	return result;
 }
 
+/**
+ * homa_sock_reap_work() - Work item function that reaps dead RPCs for a
+ * socket in the background, so that homa_timer and homa_pkt_dispatch
+ * rarely have to reap (which delays other work). See reap.txt.
+ * @work:   The reap_work field of a homa_sock.
+ */
+void homa_sock_reap_work(struct work_struct *work)
+{
+	struct homa_sock *hsk = container_of(work, struct homa_sock,
+			reap_work);
+	__u64 start = get_cycles();
+
+	tt_record2("homa_sock_reap_work starting, port %d, dead_skbs %d",
+			hsk->port, hsk->dead_skbs);
+	while (homa_rpc_reap(hsk, hsk->homa->reap_limit) != 0) {
+		/* Don't monopolize the core. */
+		cond_resched();
+	}
+	INC_METRIC(bg_reap_cycles, get_cycles() - start);
+}
+
 /**
  * homa_rpc_send_offset() - Return the offset of the first unsent byte of a
  * message.
  * @rpc:      RPC whose msgout will be examined.
  *
  * Return:    The first unsent byte for rpc->msgout (0 if the msgout
- *            hasn't been initialized, message length if all bytes have been
- *            sent).
+ *            hasn't been initialized, msgout.copied if all of the packets
+ *            created so far have been sent).
  */
 int homa_rpc_send_offset(struct homa_rpc *rpc)
 {
@@ -628,10 +797,39 @@ int homa_rpc_send_offset(struct homa_rpc *rpc)
 	if (rpc->msgout.length < 0)
 		return 0;
 	if (!pkt)
-		return rpc->msgout.length;
+		return rpc->msgout.copied;
 	return homa_data_offset(pkt);
 }
 
+/**
+ * homa_next_client_id() - Allocate an id for a new client RPC. Ids are
+ * handed out from a block reserved by the current core, so the shared
+ * counter in @homa is only touched once every HOMA_CLIENT_ID_BLOCK RPCs.
+ * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   A new id, unique across all cores (and even, marking it as a
+ *           client id).
+ */
+__u64 homa_next_client_id(struct homa *homa)
+{
+	struct homa_core *core;
+	__u64 id;
+
+	preempt_disable();
+	core = homa_cores[raw_smp_processor_id()];
+	if (unlikely(core->next_client_id == core->client_id_limit)) {
+		core->next_client_id = atomic64_fetch_add(
+				2*HOMA_CLIENT_ID_BLOCK, &homa->next_outgoing_id);
+		core->client_id_limit = core->next_client_id
+				+ 2*HOMA_CLIENT_ID_BLOCK;
+		INC_METRIC(client_id_blocks, 1);
+	}
+	id = core->next_client_id;
+	core->next_client_id += 2;
+	preempt_enable();
+	return id;
+}
+
 /**
  * homa_find_client_rpc() - Locate client-side information about the RPC that
  * a packet belongs to, if there is any. Thread-safe without socket lock.
@@ -648,7 +846,7 @@ struct homa_rpc *homa_find_client_rpc(struct homa_sock *hsk, __u64 id)
 	struct homa_rpc_bucket *bucket = homa_client_rpc_bucket(hsk, id);
 	homa_bucket_lock(bucket, client);
 	hlist_for_each_entry_rcu(crpc, &bucket->rpcs, hash_links) {
-		if (crpc->id == id) {
+		if ((crpc->id == id) && (crpc->hsk == hsk)) {
 			return crpc;
 		}
 	}
@@ -672,10 +870,12 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 		const struct in6_addr *saddr, __u16 sport, __u64 id)
 {
 	struct homa_rpc *srpc;
-	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, saddr,
+			id);
 	homa_bucket_lock(bucket, server);
 	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
-		if ((srpc->id == id) && (srpc->dport == sport) &&
+		if ((srpc->id == id) && (srpc->hsk == hsk) &&
+				(srpc->dport == sport) &&
 				ipv6_addr_equal(&srpc->peer->addr, saddr)) {
 			return srpc;
 		}
@@ -873,6 +1073,9 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		if (h->retransmit)
 			used = homa_snprintf(buffer, buf_len, used,
 					", RETRANSMIT");
+		if (h->extra_acks)
+			used = homa_snprintf(buffer, buf_len, used,
+					", extra_acks %d", h->extra_acks);
 		bytes_left = skb->len - sizeof32(*h) - seg_length;
 		if (skb_shinfo(skb)->gso_segs <= 1)
 			break;
@@ -893,6 +1096,12 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		used = homa_snprintf(buffer, buf_len, used,
 				", offset %d, grant_prio %u",
 				ntohl(h->offset), h->priority);
+		if (h->ack.client_id != 0)
+			used = homa_snprintf(buffer, buf_len, used,
+					", ack [cp %d, sp %d, id %llu]",
+					ntohs(h->ack.client_port),
+					ntohs(h->ack.server_port),
+					be64_to_cpu(h->ack.client_id));
 		break;
 	}
 	case RESEND: {
@@ -901,14 +1110,27 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 				", offset %d, length %d, resend_prio %u",
 				ntohl(h->offset), ntohl(h->length),
 				h->priority);
+		if (h->ack.client_id != 0)
+			used = homa_snprintf(buffer, buf_len, used,
+					", ack [cp %d, sp %d, id %llu]",
+					ntohs(h->ack.client_port),
+					ntohs(h->ack.server_port),
+					be64_to_cpu(h->ack.client_id));
 		break;
 	}
 	case UNKNOWN:
 		/* Nothing to add here. */
 		break;
-	case BUSY:
-		/* Nothing to add here. */
+	case BUSY: {
+		struct busy_header *h = (struct busy_header *) skb->data;
+		if (h->ack.client_id != 0)
+			used = homa_snprintf(buffer, buf_len, used,
+					", ack [cp %d, sp %d, id %llu]",
+					ntohs(h->ack.client_port),
+					ntohs(h->ack.server_port),
+					be64_to_cpu(h->ack.client_id));
 		break;
+	}
 	case CUTOFFS: {
 		struct cutoffs_header *h = (struct cutoffs_header *) skb->data;
 		used = homa_snprintf(buffer, buf_len, used,
@@ -932,15 +1154,37 @@ char *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len)
 		break;
 	case ACK: {
 		struct ack_header *h = (struct ack_header *) skb->data;
-		int i, count;
+		struct homa_ack *acks = h->acks;
+		int i, count, max;
 		count = ntohs(h->num_acks);
+		max = (skb->len - ((char *) acks - (char *) h))
+				/ sizeof32(*acks);
+		if (count > max)
+			count = max;
 		used = homa_snprintf(buffer, buf_len, used, ", acks");
 		for (i = 0; i < count; i++) {
 			used = homa_snprintf(buffer, buf_len, used,
 					" [cp %d, sp %d, id %llu]",
-					ntohs(h->acks[i].client_port),
-					ntohs(h->acks[i].server_port),
-					be64_to_cpu(h->acks[i].client_id));
+					ntohs(acks[i].client_port),
+					ntohs(acks[i].server_port),
+					be64_to_cpu(acks[i].client_id));
+		}
+		break;
+	}
+	case BUNDLE: {
+		struct bundle_header *h = (struct bundle_header *) skb->data;
+		int i, offset = sizeof32(*h);
+		int end = offset + ntohs(h->length);
+		used = homa_snprintf(buffer, buf_len, used, ", items");
+		for (i = 0; (i < h->num_items) && (offset < end); i++) {
+			struct common_header *item = (struct common_header *)
+					(skb->data + offset + 1);
+			used = homa_snprintf(buffer, buf_len, used,
+					" [%s, dport %d, id %llu]",
+					homa_symbol_for_type(item->type),
+					ntohs(item->dport),
+					be64_to_cpu(item->sender_id));
+			offset += 1 + skb->data[offset];
 		}
 		break;
 	}
@@ -1018,6 +1262,11 @@ char *homa_print_packet_short(struct sk_buff *skb, char *buffer, int buf_len)
 	case ACK:
 		snprintf(buffer, buf_len, "ACK");
 		break;
+	case BUNDLE: {
+		struct bundle_header *h = (struct bundle_header *) common;
+		snprintf(buffer, buf_len, "BUNDLE %d items", h->num_items);
+		break;
+	}
 	default:
 		snprintf(buffer, buf_len, "unknown packet type 0x%x",
 				common->type);
@@ -1119,6 +1368,8 @@ char *homa_symbol_for_type(uint8_t type)
 		return "NEED_ACK";
 	case ACK:
 		return "ACK";
+	case BUNDLE:
+		return "BUNDLE";
 	}
 
 	/* Using a static buffer can produce garbled text under concurrency,
@@ -1302,6 +1553,10 @@ char *homa_print_metrics(struct homa *homa)
 				"poll_cycles               %15llu  "
 				"Time spent polling for incoming messages\n",
 				m->poll_cycles);
+		homa_append_metric(homa,
+				"poll_skips                %15llu  "
+				"Waits that slept at once (max_pollers reached)\n",
+				m->poll_skips);
 		homa_append_metric(homa,
 				"softirq_calls             %15llu  "
 				"Calls to homa_softirq (i.e. # GRO pkts "
@@ -1375,6 +1630,10 @@ char *homa_print_metrics(struct homa *homa)
 				"data_pkt_reap_cycles      %15llu  "
 				"Time in homa_data_pkt spent reaping RPCs\n",
 				m->data_pkt_reap_cycles);
+		homa_append_metric(homa,
+				"bg_reap_cycles            %15llu  "
+				"Time spent reaping RPCs in background reapers\n",
+				m->bg_reap_cycles);
 		homa_append_metric(homa,
 				"pacer_cycles              %15llu  "
 				"Time spent in homa_pacer_main\n",
@@ -1404,6 +1663,30 @@ char *homa_print_metrics(struct homa *homa)
 				"homa_pacer_xmit invocations from "
 				"homa_check_pacer\n",
 				m->pacer_needed_help);
+		homa_append_metric(homa,
+				"pacer_sleeps              %15llu  "
+				"Times pacer slept waiting for NIC queue "
+				"to drain\n",
+				m->pacer_sleeps);
+		homa_append_metric(homa,
+				"pacer_sleep_cycles        %15llu  "
+				"Time pacer spent sleeping for NIC queue "
+				"to drain\n",
+				m->pacer_sleep_cycles);
+		homa_append_metric(homa,
+				"nic_queue_samples         %15llu  "
+				"Samples of actual NIC queue length\n",
+				m->nic_queue_samples);
+		homa_append_metric(homa,
+				"nic_queue_underestimate_cycles %10llu  "
+				"Total error in NIC queue estimates "
+				"that were too low\n",
+				m->nic_queue_underestimate_cycles);
+		homa_append_metric(homa,
+				"nic_queue_overestimate_cycles %11llu  "
+				"Total error in NIC queue estimates "
+				"that were too high\n",
+				m->nic_queue_overestimate_cycles);
 		homa_append_metric(homa,
 				"throttled_cycles          %15llu  "
 				"Time when the throttled queue was nonempty\n",
@@ -1430,6 +1713,22 @@ char *homa_print_metrics(struct homa *homa)
 				"Routing failures creating peer table "
 				"entries\n",
 				m->peer_route_errors);
+		homa_append_metric(homa,
+				"peer_evictions            %15llu  "
+				"Idle peers deleted from peer table\n",
+				m->peer_evictions);
+		homa_append_metric(homa,
+				"peer_forced_evictions     %15llu  "
+				"Peers deleted early because of max_peers\n",
+				m->peer_forced_evictions);
+		homa_append_metric(homa,
+				"peer_gc_cycles            %15llu  "
+				"Time spent deleting idle peers\n",
+				m->peer_gc_cycles);
+		homa_append_metric(homa,
+				"peertab_resizes           %15llu  "
+				"Peer table bucket array resizes\n",
+				m->peertab_resizes);
 		homa_append_metric(homa,
 				"control_xmit_errors       %15llu  "
 				"Errors sending control packets\n",
@@ -1495,6 +1794,10 @@ char *homa_print_metrics(struct homa *homa)
 				"server_lock_miss_cycles   %15llu  "
 				"Time lost waiting for server bucket locks\n",
 				m->server_lock_miss_cycles);
+		homa_append_metric(homa,
+				"client_id_blocks          %15llu  "
+				"Blocks of client RPC ids reserved by cores\n",
+				m->client_id_blocks);
 		homa_append_metric(homa,
 				"socket_lock_misses        %15llu  "
 				"Socket lock misses\n",
@@ -1503,6 +1806,14 @@ char *homa_print_metrics(struct homa *homa)
 				"socket_lock_miss_cycles   %15llu  "
 				"Time lost waiting for socket locks\n",
 				m->socket_lock_miss_cycles);
+		homa_append_metric(homa,
+				"ready_lock_misses         %15llu  "
+				"Socket ready_lock misses\n",
+				m->ready_lock_misses);
+		homa_append_metric(homa,
+				"ready_lock_miss_cycles    %15llu  "
+				"Time lost waiting for socket ready_locks\n",
+				m->ready_lock_miss_cycles);
 		homa_append_metric(homa,
 				"throttle_lock_misses      %15llu  "
 				"Throttle lock misses\n",
@@ -1571,11 +1882,122 @@ char *homa_print_metrics(struct homa *homa)
 				"Explicit ACKs sent because peer->acks was "
 				"full\n",
 				m->ack_overflows);
+		homa_append_metric(homa,
+				"piggybacked_acks          %15llu  "
+				"Acks sent in DATA, GRANT, RESEND, and BUSY "
+				"packets\n",
+				m->piggybacked_acks);
 		homa_append_metric(homa,
 				"ignored_need_acks         %15llu  "
 				"NEED_ACKs ignored because RPC result not "
 				"yet received\n",
 				m->ignored_need_acks);
+		homa_append_metric(homa,
+				"bundled_control_pkts      %15llu  "
+				"Control packets sent as part of a BUNDLE\n",
+				m->bundled_control_pkts);
+		homa_append_metric(homa,
+				"softirq_cross_node        %15llu  "
+				"SoftIRQ handoffs to a different NUMA "
+				"node\n",
+				m->softirq_cross_node);
+		homa_append_metric(homa,
+				"softirq_steered           %15llu  "
+				"SoftIRQ handoffs to the core of a waiting "
+				"receiver\n",
+				m->softirq_steered);
+		homa_append_metric(homa,
+				"softirq_reordered_pkts    %15llu  "
+				"Packets moved earlier in a SoftIRQ batch "
+				"for SRPT\n",
+				m->softirq_reordered_pkts);
+		homa_append_metric(homa,
+				"softirq_reorder_depth     %15llu  "
+				"Total positions moved by "
+				"softirq_reordered_pkts\n",
+				m->softirq_reorder_depth);
+		homa_append_metric(homa,
+				"softirq_short_msgs        %15llu  "
+				"Single-packet messages processed by "
+				"homa_softirq\n",
+				m->softirq_short_msgs);
+		homa_append_metric(homa,
+				"softirq_grouped_pkts      %15llu  "
+				"DATA packets moved next to others of the "
+				"same message in a SoftIRQ batch\n",
+				m->softirq_grouped_pkts);
+		homa_append_metric(homa,
+				"gro_coalesced_pkts        %15llu  "
+				"DATA packets merged into the previous packet "
+				"during GRO\n",
+				m->gro_coalesced_pkts);
+		homa_append_metric(homa,
+				"fast_acks                 %15llu  "
+				"ACK packets handled at NAPI level\n",
+				m->fast_acks);
+		homa_append_metric(homa,
+				"fast_busys                %15llu  "
+				"BUSY packets handled at NAPI level\n",
+				m->fast_busys);
+		homa_append_metric(homa,
+				"fast_need_acks            %15llu  "
+				"NEED_ACK packets handled at NAPI level\n",
+				m->fast_need_acks);
+		homa_append_metric(homa,
+				"fast_control_lock_busy    %15llu  "
+				"ACKs not handled at NAPI level because "
+				"socket was locked\n",
+				m->fast_control_lock_busy);
+		homa_append_metric(homa,
+				"busy_polls                %15llu  "
+				"Calls to napi_busy_loop while waiting for "
+				"messages\n",
+				m->busy_polls);
+		homa_append_metric(homa,
+				"busy_poll_wakeups         %15llu  "
+				"Messages that arrived during a "
+				"napi_busy_loop\n",
+				m->busy_poll_wakeups);
+		homa_append_metric(homa,
+				"dispatch_rpc_locks        %15llu  "
+				"RPC lookups and lock acquisitions in "
+				"homa_pkt_dispatch\n",
+				m->dispatch_rpc_locks);
+		homa_append_metric(homa,
+				"softirq_short_delay_cycles %14llu  "
+				"Time single-packet messages waited in "
+				"SoftIRQ batches\n",
+				m->softirq_short_delay_cycles);
+		for (i = 0; i < HOMA_SHORT_DELAY_BUCKETS - 1; i++)
+			homa_append_metric(homa,
+				"softirq_short_delay_%-6d%15llu  "
+				"Single-packet messages that waited < %d us "
+				"in SoftIRQ batches\n",
+				1 << i, m->softirq_short_delay_hist[i],
+				1 << i);
+		homa_append_metric(homa,
+				"softirq_short_delay_max   %15llu  "
+				"Single-packet messages that waited >= %d us "
+				"in SoftIRQ batches\n",
+				m->softirq_short_delay_hist[i], 1 << (i-1));
+		homa_append_metric(homa,
+				"copy_out_local_bytes      %15llu  "
+				"Bytes copied to user space on the "
+				"SoftIRQ core\n",
+				m->copy_out_local_bytes);
+		homa_append_metric(homa,
+				"copy_out_local_cycles     %15llu  "
+				"Time spent copying copy_out_local_bytes\n",
+				m->copy_out_local_cycles);
+		homa_append_metric(homa,
+				"copy_out_remote_bytes     %15llu  "
+				"Bytes copied to user space on a core other "
+				"than the SoftIRQ core\n",
+				m->copy_out_remote_bytes);
+		homa_append_metric(homa,
+				"copy_out_remote_cycles    %15llu  "
+				"Time spent copying copy_out_remote_bytes\n",
+				m->copy_out_remote_cycles);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			homa_append_metric(homa,
 					"temp%-2d                  %15llu  "
@@ -0,0 +1,518 @@
+/* Copyright (c) 2019-2022 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file defines the on-the-wire format of Homa packets. It depends
+ * only on <linux/types.h>, so it can be included by user-space code
+ * (e.g. packet generators or a user-level Homa endpoint) as well as by
+ * the kernel module.
+ */
+
+#ifndef _HOMA_WIRE_H
+#define _HOMA_WIRE_H
+
+#include <linux/types.h>
+
+/**
+ * enum homa_packet_type - Defines the possible types of Homa packets.
+ *
+ * See the xxx_header structs below for more information about each type.
+ */
+enum homa_packet_type {
+	DATA               = 0x10,
+	GRANT              = 0x11,
+	RESEND             = 0x12,
+	UNKNOWN            = 0x13,
+	BUSY               = 0x14,
+	CUTOFFS            = 0x15,
+	FREEZE             = 0x16,
+	NEED_ACK           = 0x17,
+	ACK                = 0x18,
+	BUNDLE             = 0x19,
+	BOGUS              = 0x1A,      /* Used only in unit tests. */
+	/* If you add a new type here, you must also do the following:
+	 * 1. Change BOGUS so it is the highest opcode
+	 * 2. Add support for the new opcode in homa_print_packet,
+	 *    homa_print_packet_short, homa_symbol_for_type, and mock_skb_new.
+	 * 3. Add the header length to header_lengths in homa_plumbing.c.
+	 */
+};
+
+/** define HOMA_IPV6_HEADER_LENGTH - Size of IP header (V6). */
+#define HOMA_IPV6_HEADER_LENGTH 40
+
+/** define HOMA_IPV4_HEADER_LENGTH - Size of IP header (V4). */
+#define HOMA_IPV4_HEADER_LENGTH 20
+
+/**
+ * define HOMA_MIN_PKT_LENGTH - Every Homa packet must be padded to at least
+ * this length to meet Ethernet frame size limitations. This number includes
+ * Homa headers and data, but not IP or Ethernet headers.
+ */
+#define HOMA_MIN_PKT_LENGTH 26
+
+/**
+ * define HOMA_MAX_HEADER - Number of bytes in the largest Homa header.
+ */
+#define HOMA_MAX_HEADER 90
+
+/**
+ * define ETHERNET_MAX_PAYLOAD - Maximum length of an Ethernet packet,
+ * excluding preamble, frame delimeter, VLAN header, CRC, and interpacket gap;
+ * i.e. all of this space is available for Homa.
+ */
+#define ETHERNET_MAX_PAYLOAD 1500
+
+/**
+ * define HOMA_MAX_PRIORITIES - The maximum number of priority levels that
+ * Homa can use (the actual number can be restricted to less than this at
+ * runtime). Changing this value will affect packet formats.
+ */
+#define HOMA_MAX_PRIORITIES 8
+
+/**
+ * define NUM_PEER_UNACKED_IDS - The number of acks that fit in the
+ * fixed part of an ack_header.
+ */
+#define NUM_PEER_UNACKED_IDS 5
+
+/**
+ * define HOMA_MAX_ACK_BATCH - The largest number of acks that will be
+ * sent in a single ACK packet (the ones that don't fit in the ack_header
+ * follow it in the packet), or appended to a single DATA packet. Must be
+ * small enough that the largest ACK packet fits in a BUNDLE entry.
+ */
+#define HOMA_MAX_ACK_BATCH 16
+
+/**
+ * define HOMA_MAX_BUNDLE_BYTES - The maximum number of bytes of control
+ * packets (not including the bundle_header) that can be combined into a
+ * single BUNDLE packet.
+ */
+#define HOMA_MAX_BUNDLE_BYTES 512
+
+/**
+ * define HOMA_MAX_BUNDLE_ITEM - The largest control packet that can be
+ * carried in a BUNDLE packet (each item's length is stored in a single
+ * byte). Larger control packets are always transmitted individually.
+ */
+#define HOMA_MAX_BUNDLE_ITEM 255
+
+/**
+ * struct common_header - Wire format for the first bytes in every Homa
+ * packet. This must partially match the format of a TCP header so that
+ * Homa can piggyback on TCP segmentation offload (and possibly other
+ * features, such as RSS).
+ */
+struct common_header {
+	/**
+	 * @sport: Port on source machine from which packet was sent.
+	 * Must be in the same position as in a TCP header.
+	 */
+	__be16 sport;
+
+	/**
+	 * @dport: Port on destination that is to receive packet. Must be
+	 * in the same position as in a TCP header.
+	 */
+	__be16 dport;
+
+	/**
+	 * @unused1: corresponds to the sequence number field in TCP headers;
+	 * must not be used by Homa, in case it gets incremented during TCP
+	 * offload.
+	 */
+	__be32 unused1;
+
+	__be32 unused2;
+
+	/**
+	 * @doff: High order 4 bits holds the number of 4-byte chunks in a
+	 * data_header (low-order bits unused). Used only for DATA packets;
+	 * must be in the same position as the data offset in a TCP header.
+	 */
+	__u8 doff;
+
+	/** @type: One of the values of &enum packet_type. */
+	__u8 type;
+
+	__u16 unused3;
+
+	/**
+	 * @checksum: not used by Homa, but must occupy the same bytes as
+	 * the checksum in a TCP header (TSO may modify this?).*/
+	__be16 checksum;
+
+	__u16 unused4;
+
+	/**
+	 * @sender_id: the identifier of this RPC as used on the sender (i.e.,
+	 * if the low-order bit is set, then the sender is the server for
+	 * this RPC).
+	 */
+	__be64 sender_id;
+} __attribute__((packed));
+
+/**
+ * struct homa_ack - Identifies an RPC that can be safely deleted by its
+ * server. After sending the response for an RPC, the server must retain its
+ * state for the RPC until it knows that the client has successfully
+ * received the entire response. An ack indicates this. Clients will
+ * piggyback acks on future DATA, GRANT, RESEND, and BUSY packets, but if a
+ * client doesn't send any packets to the server, the server will eventually
+ * request an ack explicitly with a NEED_ACK packet, in which case the client
+ * will return an explicit ACK.
+ */
+struct homa_ack {
+	/**
+	 * @id: The client's identifier for the RPC. 0 means this ack
+	 * is invalid.
+	 */
+	__be64 client_id;
+
+	/** @client_port: The client-side port for the RPC. */
+	__be16 client_port;
+
+	/** @server_port: The server-side port for the RPC. */
+	__be16 server_port;
+} __attribute__((packed));
+
+/**
+ * struct data_segment - Wire format for a chunk of data that is part of
+ * a DATA packet. A single sk_buff can hold multiple data_segments in order
+ * to enable send and receive offload (the idea is to carry many network
+ * packets of info in a single traversal of the Linux networking stack).
+ * A DATA sk_buff contains a data_header followed by any number of
+ * data_segments.
+ */
+struct data_segment {
+	/**
+	 * @offset: Offset within message of the first byte of data in
+	 * this segment. Segments within an sk_buff are not guaranteed
+	 * to be in order.
+	 */
+	__be32 offset;
+
+	/** @segment_length: Number of bytes of data in this segment. */
+	__be32 segment_length;
+
+	/** @ack: If the @client_id field is nonzero, provides info about
+	 * an RPC that the recipient can now safely free.
+	 */
+	struct homa_ack ack;
+
+	/** @data: the payload of this segment. */
+	char data[0];
+} __attribute__((packed));
+
+/* struct data_header - Overall header format for a DATA sk_buff, which
+ * contains this header followed by any number of data_segments.
+ */
+struct data_header {
+	struct common_header common;
+
+	/** @message_length: Total #bytes in the *message* */
+	__be32 message_length;
+
+	/**
+	 * @incoming: The receiver can expect the sender to send all of the
+	 * bytes in the message up to at least this offset (exclusive),
+	 * even without additional grants. This includes unscheduled
+	 * bytes, granted bytes, plus any additional bytes the sender
+	 * transmits unilaterally (e.g., to send batches, such as with GSO).
+	 */
+	__be32 incoming;
+
+	/**
+	 * @cutoff_version: The cutoff_version from the most recent
+	 * CUTOFFS packet that the source of this packet has received
+	 * from the destination of this packet, or 0 if the source hasn't
+	 * yet received a CUTOFFS packet.
+	 */
+	__be16 cutoff_version;
+
+	/**
+	 * @retransmit: 1 means this packet was sent in response to a RESEND
+	 * (it has already been sent previously).
+	 */
+	__u8 retransmit;
+
+	/**
+	 * @extra_acks: The number of additional struct homa_acks that follow
+	 * the data of @seg at the end of the packet. Only used in packets
+	 * with a single segment (a GSO packet can't carry them, since
+	 * there is no room after each segment).
+	 */
+	__u8 extra_acks;
+
+	/** @seg: First of possibly many segments */
+	struct data_segment seg;
+} __attribute__((packed));
+_Static_assert(sizeof(struct data_header) <= HOMA_MAX_HEADER,
+		"data_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+_Static_assert(sizeof(struct data_header) >= HOMA_MIN_PKT_LENGTH,
+		"data_header too small: Homa doesn't currently have code"
+		"to pad data packets");
+_Static_assert(((sizeof(struct data_header) - sizeof(struct data_segment))
+		& 0x3) == 0,
+		" data_header length not a multiple of 4 bytes (required "
+		"for TCP/TSO compatibility");
+
+/**
+ * struct grant_header - Wire format for GRANT packets, which are sent by
+ * the receiver back to the sender to indicate that the sender may transmit
+ * additional bytes in the message.
+ */
+struct grant_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @offset: Byte offset within the message.
+	 *
+	 * The sender should now transmit all data up to (but not including)
+	 * this offset ASAP, if it hasn't already.
+	 */
+	__be32 offset;
+
+	/**
+	 * @priority: The sender should use this priority level for all future
+	 * MESSAGE_FRAG packets for this message, until a GRANT is received
+	 * with higher offset. Larger numbers indicate higher priorities.
+	 */
+	__u8 priority;
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free. Always sent,
+	 * but optional on receipt: packets from earlier versions of Homa
+	 * end just before this field.
+	 */
+	struct homa_ack ack;
+} __attribute__((packed));
+_Static_assert(sizeof(struct grant_header) <= HOMA_MAX_HEADER,
+		"grant_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct resend_header - Wire format for RESEND packets.
+ *
+ * A RESEND is sent by the receiver when it believes that message data may
+ * have been lost in transmission (or if it is concerned that the sender may
+ * have crashed). The receiver should resend the specified portion of the
+ * message, even if it already sent it previously.
+ */
+struct resend_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @offset: Offset within the message of the first byte of data that
+	 * should be retransmitted.
+	 */
+	__be32 offset;
+
+	/**
+	 * @length: Number of bytes of data to retransmit; this could specify
+	 * a range longer than the total message size. Zero is a special case
+	 * used by servers; in this case, there is no need to actually resend
+	 * anything; the purpose of this packet is to trigger an UNKNOWN
+	 * response if the client no longer cares about this RPC.
+	 */
+	__be32 length;
+
+	/**
+	 * @priority: Packet priority to use.
+	 *
+	 * The sender should transmit all the requested data using this
+	 * priority.
+	 */
+	__u8 priority;
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free. Always sent,
+	 * but optional on receipt: packets from earlier versions of Homa
+	 * end just before this field.
+	 */
+	struct homa_ack ack;
+} __attribute__((packed));
+_Static_assert(sizeof(struct resend_header) <= HOMA_MAX_HEADER,
+		"resend_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct unknown_header - Wire format for UNKNOWN packets.
+ *
+ * An UNKNOWN packet is sent by either server or client when it receives a
+ * packet for an RPC that is unknown to it. When a client receives an
+ * UNKNOWN packet it will typically restart the RPC from the beginning;
+ * when a server receives an UNKNOWN packet it will typically discard its
+ * state for the RPC.
+ */
+struct unknown_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+} __attribute__((packed));
+_Static_assert(sizeof(struct unknown_header) <= HOMA_MAX_HEADER,
+		"unknown_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct busy_header - Wire format for BUSY packets.
+ *
+ * These packets tell the recipient that the sender is still alive (even if
+ * it isn't sending data expected by the recipient).
+ */
+struct busy_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @ack: If the @client_id field of this is nonzero, provides info
+	 * about an RPC that the recipient can now safely free. Always sent,
+	 * but optional on receipt: packets from earlier versions of Homa
+	 * end just before this field.
+	 */
+	struct homa_ack ack;
+} __attribute__((packed));
+_Static_assert(sizeof(struct busy_header) <= HOMA_MAX_HEADER,
+		"busy_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct cutoffs_header - Wire format for CUTOFFS packets.
+ *
+ * These packets tell the recipient how to assign priorities to
+ * unscheduled packets.
+ */
+struct cutoffs_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @unsched_cutoffs: priorities to use for unscheduled packets
+	 * sent to the sender of this packet. See documentation for
+	 * @homa.unsched_cutoffs for the meanings of these values.
+	 */
+	__be32 unsched_cutoffs[HOMA_MAX_PRIORITIES];
+
+	/**
+	 * @cutoff_version: unique identifier associated with @unsched_cutoffs.
+	 * Must be included in future DATA packets sent to the sender of
+	 * this packet.
+	 */
+	__be16 cutoff_version;
+} __attribute__((packed));
+_Static_assert(sizeof(struct cutoffs_header) <= HOMA_MAX_HEADER,
+		"cutoffs_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct freeze_header - Wire format for FREEZE packets.
+ *
+ * These packets tell the recipient to freeze its timetrace; used
+ * for debugging.
+ */
+struct freeze_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+} __attribute__((packed));
+_Static_assert(sizeof(struct freeze_header) <= HOMA_MAX_HEADER,
+		"freeze_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct need_ack_header - Wire format for NEED_ACK packets.
+ *
+ * These packets ask the recipient (a client) to return an ACK message if
+ * the packet's RPC is no longer active.
+ */
+struct need_ack_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+} __attribute__((packed));
+_Static_assert(sizeof(struct need_ack_header) <= HOMA_MAX_HEADER,
+		"need_ack_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct ack_header - Wire format for ACK packets.
+ *
+ * These packets are sent from a client to a server to indicate that
+ * a set of RPCs is no longer active on the client, so the server can
+ * free any state it may have for them.
+ */
+struct ack_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/**
+	 * @num_acks: number of valid acks in the packet. The first
+	 * NUM_PEER_UNACKED_IDS of them are in @acks; any others
+	 * immediately follow this header.
+	 */
+	__be16 num_acks;
+
+	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
+} __attribute__((packed));
+_Static_assert(sizeof(struct ack_header) <= HOMA_MAX_HEADER,
+		"ack_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+
+/**
+ * struct ack_batch - The largest ACK packet that Homa will send: an
+ * ack_header followed by additional acks.
+ */
+struct ack_batch {
+	/** @header: The fixed part of the packet. */
+	struct ack_header header;
+
+	/** @extra: Acks that didn't fit in @header.acks. */
+	struct homa_ack extra[HOMA_MAX_ACK_BATCH - NUM_PEER_UNACKED_IDS];
+} __attribute__((packed));
+_Static_assert(sizeof(struct ack_batch) <= HOMA_MAX_BUNDLE_ITEM,
+		"ack_batch too large to fit in a BUNDLE entry; must "
+		"reduce HOMA_MAX_ACK_BATCH");
+
+/**
+ * struct bundle_header - Wire format for BUNDLE packets.
+ *
+ * A BUNDLE packet carries several control packets (GRANTs, ACKs, BUSYs,
+ * etc.) for the same peer, so they only pay for one trip through the IP
+ * stack. The header is followed by @num_items entries, each consisting
+ * of a single byte giving the entry's length, followed by a complete
+ * control packet (starting with its common_header) of that length. The
+ * receiver unpacks each entry and handles it as if it had arrived in a
+ * packet of its own. Only the type field of @common is meaningful.
+ */
+struct bundle_header {
+	/** @common: Fields common to all packet types. */
+	struct common_header common;
+
+	/** @num_items: number of control packets in this bundle. */
+	__u8 num_items;
+
+	/** @length: total bytes of entries following this header. */
+	__be16 length;
+} __attribute__((packed));
+_Static_assert(sizeof(struct bundle_header) <= HOMA_MAX_HEADER,
+		"bundle_header too large for HOMA_MAX_HEADER; must "
+		"adjust HOMA_MAX_HEADER");
+_Static_assert(HOMA_MAX_BUNDLE_BYTES + sizeof(struct bundle_header)
+		<= ETHERNET_MAX_PAYLOAD - HOMA_IPV6_HEADER_LENGTH,
+		"HOMA_MAX_BUNDLE_BYTES too large for a single packet");
+
+#endif /* _HOMA_WIRE_H */
@@ -68,6 +68,9 @@ void (*mock_schedule_hook)(void) = NULL;
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending = 0;
 
+/* The return value from calls to in_softirq(). */
+int mock_in_softirq = 0;
+
 /* Used as current task during tests. */
 struct task_struct mock_task;
 
@@ -205,6 +208,19 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	func(head);
+}
+
+void rcu_barrier(void) {}
+
+u64 siphash_2u64(const u64 first, const u64 second, const siphash_key_t *key)
+{
+	return (first * 0x9e3779b97f4a7c15ULL) ^ (second * 0xc2b2ae3d27d4eb4fULL)
+			^ key->key[0];
+}
+
 void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 {
 	if (mock_log_rcu_sched)
@@ -214,6 +230,15 @@ void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,18,0)
+int _cond_resched(void)
+#else
+int __cond_resched(void)
+#endif
+{
+	return 0;
+}
+
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 {
 	size_t bytes_left = bytes;
@@ -558,7 +583,7 @@ unsigned int ip6_mtu(const struct dst_entry *dst)
 int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 	     __u32 mark, struct ipv6_txoptions *opt, int tclass, u32 priority)
 {
-	char buffer[200];
+	char buffer[1000];
 	const char *prefix = " ";
 	if (mock_check_error(&mock_ip6_xmit_errors)) {
 		kfree_skb(skb);
@@ -581,7 +606,7 @@ int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 
 int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 {
-	char buffer[200];
+	char buffer[1000];
 	const char *prefix = " ";
 	if (mock_check_error(&mock_ip_queue_xmit_errors)) {
 		/* Latest data (as of 1/2019) suggests that ip_queue_xmit
@@ -671,6 +696,11 @@ void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 	free(skb);
 }
 
+void kfree_skb_partial(struct sk_buff *skb, bool head_stolen)
+{
+	kfree_skb(skb);
+}
+
 void *mock_kmalloc(size_t size, gfp_t flags)
 {
 	if (mock_check_error(&mock_kmalloc_errors))
@@ -686,6 +716,80 @@ void *mock_kmalloc(size_t size, gfp_t flags)
 	return block;
 }
 
+/**
+ * mock_kmem_cache_alloc() - Called instead of kmem_cache_alloc when Homa
+ * is compiled for unit testing. Objects are really allocated with
+ * mock_kmalloc, so they are subject to mock_kmalloc_errors.
+ * @cache:   Cache returned by kmem_cache_create.
+ * @flags:   Ignored.
+ *
+ * Return:   The new object, or NULL.
+ */
+void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return mock_kmalloc(*(unsigned int *) cache, flags);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+		unsigned int align, slab_flags_t flags, void (*ctor)(void *))
+{
+	/* The "cache" just records the object size. */
+	unsigned int *cache = malloc(sizeof(*cache));
+	*cache = size;
+	return (struct kmem_cache *) cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *block)
+{
+	kfree(block);
+}
+
+/**
+ * mock_alloc_workqueue() - Called instead of alloc_workqueue when Homa
+ * is compiled for unit testing.
+ * @name:    Name for the workqueue (ignored).
+ *
+ * Return:   A dummy workqueue, or NULL if mock_kmalloc_errors says to fail.
+ */
+struct workqueue_struct *mock_alloc_workqueue(const char *name)
+{
+	if (mock_check_error(&mock_kmalloc_errors))
+		return NULL;
+	return (struct workqueue_struct *) malloc(1);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	free(wq);
+}
+
+/**
+ * mock_queue_work_node() - Called instead of queue_work_node when Homa
+ * is compiled for unit testing. The work isn't actually executed; this
+ * just logs the call.
+ * @node:    NUMA node on which the work should run.
+ * @wq:      Workqueue (ignored).
+ * @work:    Work to queue (ignored).
+ *
+ * Return:   Always true.
+ */
+bool mock_queue_work_node(int node, struct workqueue_struct *wq,
+		struct work_struct *work)
+{
+	unit_log_printf("; ", "queue_work_node %d", node);
+	return true;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	return false;
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -743,6 +847,16 @@ void mutex_unlock(struct mutex *lock)
 	mock_active_locks--;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+void napi_busy_loop(unsigned int napi_id,
+		bool (*loop_end)(void *, unsigned long),
+		void *loop_end_arg, bool prefer_busy_poll, u16 budget)
+{
+	unit_log_printf("; ", "napi_busy_loop napi_id %u, loop_end %d",
+			napi_id, loop_end(loop_end_arg, 0));
+}
+#endif
+
 int netif_receive_skb(struct sk_buff *skb)
 {
 	struct data_header *h = (struct data_header *)
@@ -870,6 +984,15 @@ void schedule(void)
 		unit_log_printf("; ", "schedule");
 }
 
+int schedule_hrtimeout_range(ktime_t *expires, u64 delta,
+		const enum hrtimer_mode mode)
+{
+	unit_log_printf("; ", "schedule_hrtimeout_range");
+	if (mock_schedule_hook)
+		mock_schedule_hook();
+	return 0;
+}
+
 void security_sk_classify_flow(struct sock *sk, struct flowi_common *flic) {}
 
 void sk_common_release(struct sock *sk) {}
@@ -910,6 +1033,14 @@ int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 	return 0;
 }
 
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	if ((offset < 0) || ((offset + len) > skb->len))
+		return -EFAULT;
+	memcpy(to, skb->data + offset, len);
+	return 0;
+}
+
 struct sk_buff *skb_dequeue(struct sk_buff_head *list)
 {
 	return __skb_dequeue(list);
@@ -931,6 +1062,21 @@ void *skb_put(struct sk_buff *skb, unsigned int len)
 	return result;
 }
 
+bool skb_try_coalesce(struct sk_buff *to, struct sk_buff *from,
+		bool *fragstolen, int *delta_truesize)
+{
+	if (mock_check_error(&mock_copy_data_errors))
+		return false;
+
+	/* Pretend that from's data was added to to's frags. */
+	unit_log_printf("; ", "skb_try_coalesce %d bytes", from->len);
+	to->len += from->len;
+	to->data_len += from->len;
+	*fragstolen = false;
+	*delta_truesize = 0;
+	return true;
+}
+
 struct sk_buff *skb_segment(struct sk_buff *head_skb,
 		netdev_features_t features)
 {
@@ -1069,6 +1215,17 @@ void mock_clear_xmit_prios()
 	mock_xmit_prios[0] = 0;
 }
 
+/**
+ * mock_cpu_to_node() - Replacement for cpu_to_node. The mock topology
+ * has two NUMA nodes (one package each) of 4 cores, and cores are paired
+ * as hyperthreads: (0,1), (2,3), etc.
+ * @cpu:   Core whose node is desired.
+ */
+int mock_cpu_to_node(int cpu)
+{
+	return cpu/4;
+}
+
 /**
  * mock_data_ready() - Invoked through sk->sk_data_ready; logs a message
  * to indicate that it was invoked.
@@ -1172,6 +1329,9 @@ struct sk_buff *mock_skb_new(struct in6_addr *saddr, struct common_header *h,
 	case ACK:
 		header_size = sizeof(struct ack_header);
 		break;
+	case BUNDLE:
+		header_size = sizeof(struct bundle_header);
+		break;
 	default:
 		header_size = sizeof(struct common_header);
 		break;
@@ -1258,6 +1418,36 @@ void mock_spin_unlock(spinlock_t *lock)
 	mock_active_locks--;
 }
 
+/**
+ * mock_topology_core_id() - Replacement for topology_core_id; see
+ * mock_cpu_to_node for the mock topology.
+ * @cpu:   Core whose physical core id is desired.
+ */
+int mock_topology_core_id(int cpu)
+{
+	return (cpu%4)/2;
+}
+
+/**
+ * mock_topology_die_id() - Replacement for topology_die_id; see
+ * mock_cpu_to_node for the mock topology.
+ * @cpu:   Core whose die id is desired.
+ */
+int mock_topology_die_id(int cpu)
+{
+	return 0;
+}
+
+/**
+ * mock_topology_package_id() - Replacement for
+ * topology_physical_package_id; see mock_cpu_to_node for the mock topology.
+ * @cpu:   Core whose package id is desired.
+ */
+int mock_topology_package_id(int cpu)
+{
+	return cpu/4;
+}
+
 /**
  * mock_teardown() - Invoked at the end of each unit test to check for
  * consistency issues with all of the information managed by this file.
@@ -1291,6 +1481,7 @@ void mock_teardown(void)
 	memset(&mock_task, 0, sizeof(mock_task));
 	mock_schedule_hook = NULL;
 	mock_signal_pending = 0;
+	mock_in_softirq = 0;
 	mock_spin_lock_hook = NULL;
 	mock_xmit_log_verbose = 0;
 	mock_mtu = 0;
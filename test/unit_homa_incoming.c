@@ -236,6 +236,28 @@ TEST_F(homa_incoming, homa_add_packet__basics)
 	EXPECT_STREQ("DATA 1400@0; DATA 1400@1400; DATA 1400@2800; "
 			"DATA 800@4200", unit_log_get());
 }
+TEST_F(homa_incoming, homa_add_packet__extra_acks_arent_data)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+	homa_message_in_init(&crpc->msgin, 10000, 0);
+	unit_log_clear();
+
+	/* The first packet carries 2 acks after its 1400 bytes of data. */
+	self->data.seg.offset = 0;
+	self->data.seg.segment_length = htonl(1400);
+	self->data.extra_acks = 2;
+	homa_add_packet(crpc, mock_skb_new(self->client_ip,
+			&self->data.common,
+			1400 + 2*sizeof(struct homa_ack), 0));
+
+	self->data.seg.offset = htonl(1400);
+	self->data.extra_acks = 0;
+	homa_add_packet(crpc, mock_skb_new(self->client_ip,
+			&self->data.common, 1400, 1400));
+	EXPECT_EQ(7200, crpc->msgin.bytes_remaining);
+}
 TEST_F(homa_incoming, homa_add_packet__varying_sizes)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -365,6 +387,31 @@ TEST_F(homa_incoming, homa_message_in_copy_data__multiple_calls)
 	EXPECT_STREQ("skb_copy_datagram_iter: 800 bytes to 10000: 100200-100999",
 			unit_log_get());
 }
+TEST_F(homa_incoming, homa_message_in_copy_data__local_and_remote_metrics)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	homa_gro_topology_init();
+	cpu_number = 5;
+	self->data.message_length = htonl(2000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			600, 1400), crpc, NULL, &self->incoming_delta);
+	EXPECT_EQ(5, crpc->msgin.softirq_core);
+
+	cpu_number = 4;
+	EXPECT_EQ(500, homa_message_in_copy_data(&crpc->msgin,
+			unit_iov_iter((void *) 10000, 5000), 500));
+	EXPECT_EQ(500, homa_cores[4]->metrics.copy_out_local_bytes);
+	cpu_number = 2;
+	EXPECT_EQ(1000, homa_message_in_copy_data(&crpc->msgin,
+			unit_iov_iter((void *) 10000, 5000), 1000));
+	EXPECT_EQ(1000, homa_cores[2]->metrics.copy_out_remote_bytes);
+	EXPECT_EQ(0, homa_cores[2]->metrics.copy_out_local_bytes);
+}
 
 TEST_F(homa_incoming, homa_get_resend_range__uninitialized_rpc)
 {
@@ -483,6 +530,78 @@ TEST_F(homa_incoming, homa_pkt_dispatch__handle_ack)
 			&self->incoming_delta);
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 }
+TEST_F(homa_incoming, homa_pkt_dispatch__extra_acks_in_data)
+{
+	struct homa_sock hsk;
+	struct sk_buff *skb;
+	struct homa_ack ack = {.client_port = htons(self->client_port),
+		       .server_port = htons(self->server_port),
+		       .client_id = cpu_to_be64(self->client_id)};
+	mock_sock_init(&hsk, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	self->data.extra_acks = 1;
+	self->data.common.sender_id = cpu_to_be64(self->client_id+10);
+	skb = mock_skb_new(self->client_ip, &self->data.common,
+			1400 + sizeof(ack), 0);
+	memcpy(skb->data + sizeof(self->data) + 1400, &ack, sizeof(ack));
+	homa_pkt_dispatch(skb, &self->hsk, &self->lcache,
+			&self->incoming_delta);
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+}
+TEST_F(homa_incoming, homa_pkt_dispatch__ack_in_grant)
+{
+	struct homa_sock hsk;
+	mock_sock_init(&hsk, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	struct grant_header h = {.common = {
+			.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id+10),
+			.type = GRANT},
+			.offset = htonl(1000),
+			.priority = 3,
+			.ack = {.client_port = htons(self->client_port),
+		       .server_port = htons(self->server_port),
+		       .client_id = cpu_to_be64(self->client_id)}};
+	homa_pkt_dispatch(mock_skb_new(self->client_ip, &h.common, 0, 0),
+			&self->hsk, &self->lcache, &self->incoming_delta);
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+}
+TEST_F(homa_incoming, homa_pkt_dispatch__grant_without_ack_field)
+{
+	struct homa_sock hsk;
+	struct sk_buff *skb;
+	mock_sock_init(&hsk, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 3000);
+	ASSERT_NE(NULL, srpc);
+	struct grant_header h = {.common = {
+			.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id+10),
+			.type = GRANT},
+			.offset = htonl(1000),
+			.priority = 3,
+			.ack = {.client_port = htons(self->client_port),
+		       .server_port = htons(self->server_port),
+		       .client_id = cpu_to_be64(self->client_id)}};
+
+	/* Header from an older peer: the bytes where the ack would be
+	 * aren't part of the packet, so they must be ignored.
+	 */
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = offsetof(struct grant_header, ack);
+	homa_pkt_dispatch(skb, &self->hsk, &self->lcache,
+			&self->incoming_delta);
+	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc));
+}
 TEST_F(homa_incoming, homa_pkt_dispatch__new_server_rpc)
 {
 	homa_pkt_dispatch(mock_skb_new(self->client_ip, &self->data.common,
@@ -1204,6 +1323,7 @@ TEST_F(homa_incoming, homa_cutoffs_pkt_basics)
 	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
 			&self->hsk, &self->lcache, &self->incoming_delta);
 	EXPECT_EQ(400, crpc->peer->cutoff_version);
+	EXPECT_EQ(400, crpc->peer->data_template.cutoff_version);
 	EXPECT_EQ(9, crpc->peer->unsched_cutoffs[1]);
 	EXPECT_EQ(3, crpc->peer->unsched_cutoffs[7]);
 }
@@ -1343,6 +1463,54 @@ TEST_F(homa_incoming, homa_ack_pkt__target_rpc_doesnt_exist)
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc2));
 }
 
+TEST_F(homa_incoming, homa_ack_pkt__extra_acks)
+{
+	struct homa_sock hsk1;
+	struct sk_buff *skb;
+	mock_sock_init(&hsk1, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk1, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 5000);
+	ASSERT_NE(NULL, srpc);
+	struct ack_header h = {.common = {
+			.sport = htons(self->client_port + 1),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = ACK},
+			.num_acks = htons(NUM_PEER_UNACKED_IDS + 1)};
+	struct homa_ack ack = {.client_port = htons(self->client_port),
+	              .server_port = htons(self->server_port),
+	              .client_id = cpu_to_be64(self->client_id)};
+	skb = mock_skb_new(self->client_ip, &h.common, sizeof(ack), 0);
+	memcpy(skb->data + sizeof(h), &ack, sizeof(ack));
+	homa_pkt_dispatch(skb, &hsk1, &self->lcache, &self->incoming_delta);
+	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
+}
+TEST_F(homa_incoming, homa_ack_pkt__extra_acks_truncated)
+{
+	struct homa_sock hsk1;
+	struct sk_buff *skb;
+	mock_sock_init(&hsk1, &self->homa, self->server_port);
+	struct homa_rpc *srpc = unit_server_rpc(&hsk1, RPC_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 5000);
+	ASSERT_NE(NULL, srpc);
+	struct ack_header h = {.common = {
+			.sport = htons(self->client_port + 1),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = ACK},
+			.num_acks = htons(NUM_PEER_UNACKED_IDS + 2)};
+	struct homa_ack ack = {.client_port = htons(self->client_port),
+	              .server_port = htons(self->server_port),
+	              .client_id = cpu_to_be64(self->client_id)};
+	skb = mock_skb_new(self->client_ip, &h.common, sizeof(ack), 0);
+	memcpy(skb->data + sizeof(h), &ack, sizeof(ack));
+	homa_pkt_dispatch(skb, &hsk1, &self->lcache, &self->incoming_delta);
+	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+}
+
 TEST_F(homa_incoming, homa_check_grantable__not_ready_for_grant)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
@@ -2533,6 +2701,133 @@ TEST_F(homa_incoming, homa_register_interests__call_sk_data_ready)
 	EXPECT_STREQ("", unit_log_get());
 }
 
+TEST_F(homa_incoming, homa_register_interests__steer_to_rpc_waiter)
+{
+	struct homa_rx_steer *steer = homa_steer_bucket(&self->homa,
+			self->client_id);
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	cpu_number = 3;
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			0, self->client_id, NULL);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(self->client_id, steer->id);
+	EXPECT_EQ(3, steer->cpu);
+	EXPECT_EQ(-1, self->hsk.receiver_cpu);
+	crpc->interest = NULL;
+}
+TEST_F(homa_incoming, homa_register_interests__steer_to_only_waiter)
+{
+	struct homa_interest interest2;
+
+	cpu_number = 6;
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECV_REQUEST|HOMA_RECV_RESPONSE, 0, NULL);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(6, self->hsk.receiver_cpu);
+
+	// A second thread is waiting; no single core to steer to.
+	cpu_number = 2;
+	result = homa_register_interests(&interest2, &self->hsk,
+			HOMA_RECV_RESPONSE, 0, NULL);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(-1, self->hsk.receiver_cpu);
+	list_del(&interest2.response_links);
+	list_del(&self->interest.response_links);
+	list_del(&self->interest.request_links);
+}
+TEST_F(homa_incoming, homa_register_interests__limit_pollers)
+{
+	struct homa_interest interest2, interest3;
+
+	self->homa.max_pollers = 1;
+	EXPECT_EQ(0, homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECV_REQUEST, 0, NULL));
+	EXPECT_EQ(1, self->interest.polling);
+	EXPECT_EQ(1, atomic_read(&self->hsk.num_pollers));
+
+	// Too many pollers: this thread goes at the end of the list.
+	EXPECT_EQ(0, homa_register_interests(&interest2, &self->hsk,
+			HOMA_RECV_REQUEST, 0, NULL));
+	EXPECT_EQ(0, interest2.polling);
+	EXPECT_EQ(1, atomic_read(&self->hsk.num_pollers));
+
+	// Nonblocking threads never poll.
+	self->homa.max_pollers = 2;
+	EXPECT_EQ(0, homa_register_interests(&interest3, &self->hsk,
+			HOMA_RECV_REQUEST|HOMA_RECV_NONBLOCKING, 0, NULL));
+	EXPECT_EQ(0, interest3.polling);
+	list_del(&interest3.request_links);
+
+	EXPECT_EQ(0, homa_register_interests(&interest3, &self->hsk,
+			HOMA_RECV_REQUEST, 0, NULL));
+	EXPECT_EQ(1, interest3.polling);
+	EXPECT_EQ(2, atomic_read(&self->hsk.num_pollers));
+	EXPECT_EQ(&interest3, list_first_entry(&self->hsk.request_interests,
+			struct homa_interest, request_links));
+	EXPECT_EQ(&interest2, list_last_entry(&self->hsk.request_interests,
+			struct homa_interest, request_links));
+	list_del(&interest3.request_links);
+	list_del(&interest2.request_links);
+	list_del(&self->interest.request_links);
+}
+
+TEST_F(homa_incoming, homa_interest_stop_polling)
+{
+	struct homa_interest interest2;
+
+	EXPECT_EQ(0, homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECV_REQUEST|HOMA_RECV_RESPONSE, 0, NULL));
+	self->homa.max_pollers = 1;
+	EXPECT_EQ(0, homa_register_interests(&interest2, &self->hsk,
+			HOMA_RECV_REQUEST|HOMA_RECV_RESPONSE, 0, NULL));
+	EXPECT_EQ(&self->interest, list_first_entry(
+			&self->hsk.request_interests,
+			struct homa_interest, request_links));
+
+	homa_interest_stop_polling(&self->hsk, &self->interest);
+	EXPECT_EQ(0, self->interest.polling);
+	EXPECT_EQ(0, atomic_read(&self->hsk.num_pollers));
+	EXPECT_EQ(&interest2, list_first_entry(&self->hsk.request_interests,
+			struct homa_interest, request_links));
+	EXPECT_EQ(&interest2, list_first_entry(&self->hsk.response_interests,
+			struct homa_interest, response_links));
+	list_del(&interest2.request_links);
+	list_del(&interest2.response_links);
+	list_del(&self->interest.request_links);
+	list_del(&self->interest.response_links);
+}
+
+TEST_F(homa_incoming, homa_napi_poll)
+{
+	EXPECT_EQ(0, homa_napi_poll(&self->hsk, &self->interest, 0));
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	atomic_long_set(&self->interest.id, 0);
+	self->hsk.sock.sk_ll_usec = 50;
+
+	// No packets received yet, so NAPI id unknown.
+	EXPECT_EQ(0, homa_napi_poll(&self->hsk, &self->interest, 0));
+
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID + 3;
+	mock_cycles = 1000;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_napi_poll(&self->hsk, &self->interest, 2000));
+	EXPECT_SUBSTR("napi_busy_loop napi_id", unit_log_get());
+	EXPECT_SUBSTR("loop_end 0", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.busy_polls);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.busy_poll_wakeups);
+
+	atomic_long_set(&self->interest.id, 44);
+	unit_log_clear();
+	EXPECT_EQ(1, homa_napi_poll(&self->hsk, &self->interest, 2000));
+	EXPECT_SUBSTR("loop_end 1", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.busy_poll_wakeups);
+#endif
+}
+
 TEST_F(homa_incoming, homa_wait_for_message__rpc_from_register_interests)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2593,6 +2888,25 @@ TEST_F(homa_incoming, homa_wait_for_message__id_arrives_while_polling)
 	EXPECT_EQ(0, self->hsk.dead_skbs);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__too_many_pollers)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	self->homa.max_pollers = 0;
+	hook_rpc = crpc;
+	mock_schedule_hook = ready_hook;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECV_RESPONSE|HOMA_RECV_REQUEST, 0, &self->addr);
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_skips);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.poll_cycles);
+	EXPECT_EQ(0, atomic_read(&self->hsk.num_pollers));
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__id_not_ready_nonblocking)
 {
 	struct homa_rpc *rpc;
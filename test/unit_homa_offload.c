@@ -124,6 +124,75 @@ TEST_F(homa_offload, homa_gro_receive__fast_grant_optimization)
 	EXPECT_STREQ("", unit_log_get());
 	kfree_skb(skb);
 }
+TEST_F(homa_offload, homa_gro_receive__fast_control)
+{
+	struct in6_addr client_ip = unit_get_in_addr("196.168.0.1");
+	struct in6_addr server_ip = unit_get_in_addr("1.2.3.4");
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING,
+			&client_ip, &server_ip, 40000, 1235, 100, 20000);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+
+	struct ack_header h = {.common = {
+			.sport = htons(40000),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(1234),
+			.type = ACK},
+			.num_acks = htons(0)};
+	self->homa.gro_policy = HOMA_GRO_FAST_CONTROL;
+
+	// Socket lock busy: use normal path.
+	struct sk_buff *skb = mock_skb_new(&client_ip, &h.common, 0, 0);
+	mock_trylock_errors = 1;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.fast_control_lock_busy);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	homa_cores[cpu_number]->held_skb = NULL;
+	kfree_skb(skb);
+
+	atomic_set(&homa_cores[cpu_number]->softirq_backlog, 2);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(&self->empty_list,
+			mock_skb_new(&client_ip, &h.common, 0, 0))));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.fast_acks);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+
+	// Fast-pathed packets were never counted in softirq_backlog.
+	EXPECT_EQ(2, atomic_read(&homa_cores[cpu_number]->softirq_backlog));
+
+	h.common.type = BUSY;
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(&self->empty_list,
+			mock_skb_new(&client_ip, &h.common, 0, 0))));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.fast_busys);
+}
+TEST_F(homa_offload, homa_gro_receive__fast_control_ack_too_complex)
+{
+	struct in6_addr client_ip = unit_get_in_addr("196.168.0.1");
+	struct ack_header h = {.common = {
+			.sport = htons(40000),
+	                .dport = htons(self->hsk.port),
+			.sender_id = cpu_to_be64(1234),
+			.type = ACK},
+			.num_acks = htons(NUM_PEER_UNACKED_IDS + 1)};
+	struct sk_buff *skb;
+	self->homa.gro_policy = HOMA_GRO_FAST_CONTROL;
+
+	// Appended acks.
+	skb = mock_skb_new(&client_ip, &h.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	homa_cores[cpu_number]->held_skb = NULL;
+	kfree_skb(skb);
+
+	// Ack for a different socket.
+	h.num_acks = htons(1);
+	h.acks[0].client_id = cpu_to_be64(5000);
+	h.acks[0].client_port = htons(40000);
+	h.acks[0].server_port = htons(self->hsk.port + 1);
+	skb = mock_skb_new(&client_ip, &h.common, 0, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	homa_cores[cpu_number]->held_skb = NULL;
+	kfree_skb(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.fast_acks);
+}
 TEST_F(homa_offload, homa_gro_receive__no_held_skb)
 {
 	struct sk_buff *skb;
@@ -190,6 +259,41 @@ TEST_F(homa_offload, homa_gro_receive__merge)
 			"data_length 1400, incoming 10000",
 			unit_log_get());
 }
+TEST_F(homa_offload, homa_gro_receive__coalesce_data)
+{
+	struct sk_buff *skb, *skb2, *skb3;
+	struct data_header *h;
+
+	homa->gro_policy = HOMA_GRO_COALESCE;
+	homa_cores[cpu_number]->held_skb = self->skb2;
+	homa_cores[cpu_number]->held_bucket = 2;
+
+	// First packet can't be merged into held_skb itself.
+	self->header.seg.offset = htonl(6000);
+	self->header.common.sender_id = cpu_to_be64(1002);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	EXPECT_EQ(2, NAPI_GRO_CB(self->skb2)->count);
+
+	// Contiguous data for the same RPC: merge.
+	self->header.seg.offset = htonl(7400);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	unit_log_clear();
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb2)));
+	EXPECT_STREQ("skb_try_coalesce 1400 bytes", unit_log_get());
+	EXPECT_EQ(2, NAPI_GRO_CB(self->skb2)->count);
+	h = (struct data_header *) skb_transport_header(skb);
+	EXPECT_EQ(2800, ntohl(h->seg.segment_length));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_coalesced_pkts);
+
+	// Not contiguous: add to frag_list.
+	self->header.seg.offset = htonl(9000);
+	skb3 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb3));
+	EXPECT_EQ(3, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_coalesced_pkts);
+}
 TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 {
 	struct sk_buff *skb;
@@ -234,6 +338,91 @@ TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 	kfree_skb(self->skb);
 }
 
+TEST_F(homa_offload, homa_gro_topology_init__basics)
+{
+	homa_gro_topology_init();
+	EXPECT_EQ(1, homa_cores[5]->numa_node);
+	EXPECT_EQ(6, homa_cores[5]->topo_candidates[0]);
+	EXPECT_EQ(7, homa_cores[5]->topo_candidates[1]);
+	EXPECT_EQ(4, homa_cores[5]->topo_candidates[2]);
+	EXPECT_EQ(0, homa_cores[5]->topo_candidates[3]);
+	EXPECT_EQ(2, homa_cores[0]->topo_candidates[0]);
+	EXPECT_EQ(3, homa_cores[0]->topo_candidates[1]);
+	EXPECT_EQ(1, homa_cores[0]->topo_candidates[2]);
+	EXPECT_EQ(4, homa_cores[0]->topo_candidates[3]);
+}
+TEST_F(homa_offload, homa_gro_topology_init__few_cores)
+{
+	int saved = nr_cpu_ids;
+	nr_cpu_ids = 2;
+	homa_gro_topology_init();
+	nr_cpu_ids = saved;
+	EXPECT_EQ(1, homa_cores[0]->topo_candidates[0]);
+	EXPECT_EQ(1, homa_cores[0]->topo_candidates[3]);
+	homa_gro_topology_init();
+}
+TEST_F(homa_offload, homa_gro_topology_init__smt_sibling)
+{
+	homa_gro_topology_init();
+	EXPECT_EQ(4, homa_cores[5]->smt_sibling);
+	EXPECT_EQ(1, homa_cores[0]->smt_sibling);
+	nr_cpu_ids = 1;
+	homa_gro_topology_init();
+	nr_cpu_ids = 8;
+	EXPECT_EQ(-1, homa_cores[0]->smt_sibling);
+	homa_gro_topology_init();
+}
+
+TEST_F(homa_offload, homa_gro_complete__GRO_STEER_by_rpc_id)
+{
+	struct homa_rx_steer *steer = homa_steer_bucket(homa, 1001);
+
+	homa->gro_policy = HOMA_GRO_STEER|HOMA_GRO_NEXT;
+	homa_gro_topology_init();
+	cpu_number = 5;
+	steer->id = 1001;
+	steer->cpu = 2;
+	self->hsk.receiver_cpu = 7;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(2, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[2]->softirq_backlog));
+	EXPECT_EQ(1, homa_cores[5]->metrics.softirq_steered);
+
+	// Stale entry for a different RPC; use the socket's receiver.
+	steer->id = 2001;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(7, self->skb->hash - 32);
+	EXPECT_EQ(2, homa_cores[5]->metrics.softirq_steered);
+}
+TEST_F(homa_offload, homa_gro_complete__GRO_STEER_no_receiver)
+{
+	homa->gro_policy = HOMA_GRO_STEER|HOMA_GRO_NEXT;
+	cpu_number = 5;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(6, self->skb->hash - 32);
+	EXPECT_EQ(0, homa_cores[5]->metrics.softirq_steered);
+
+	/* Unknown socket. */
+	self->header.common.dport = htons(77);
+	struct sk_buff *skb = mock_skb_new(&self->ip, &self->header.common,
+			1400, 0);
+	homa_gro_complete(skb, 0);
+	EXPECT_EQ(6, skb->hash - 32);
+	EXPECT_EQ(0, homa_cores[5]->metrics.softirq_steered);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_complete__GRO_STEER_use_sibling)
+{
+	homa->gro_policy = HOMA_GRO_STEER;
+	homa_gro_topology_init();
+	cpu_number = 0;
+	self->hsk.receiver_cpu = 5;
+	atomic_set(&homa_cores[5]->softirq_backlog, 1);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(4, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[4]->softirq_backlog));
+}
+
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE_NEW)
 {
 	homa->gro_policy = HOMA_GRO_IDLE_NEW;
@@ -271,6 +460,35 @@ TEST_F(homa_offload, homa_gro_complete__GRO_IDLE_NEW)
 	EXPECT_EQ(1, homa_cores[5]->softirq_offset);
 }
 
+TEST_F(homa_offload, homa_gro_complete__GRO_IDLE_NEW_with_topology)
+{
+	homa->gro_policy = HOMA_GRO_IDLE_NEW|HOMA_GRO_TOPOLOGY;
+	mock_cycles = 1000;
+	homa->gro_busy_cycles = 100;
+	cpu_number = 5;
+	atomic_set(&homa_cores[6]->softirq_backlog, 1);
+	atomic_set(&homa_cores[7]->softirq_backlog, 0);
+	homa_cores[7]->last_gro = 0;
+
+	// Prefer idle core on the same node.
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(7, self->skb->hash - 32);
+	EXPECT_EQ(0, homa_cores[5]->metrics.softirq_cross_node);
+
+	// All cores busy; rotate among candidates.
+	atomic_set(&homa_cores[4]->softirq_backlog, 1);
+	atomic_set(&homa_cores[0]->softirq_backlog, 1);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(6, self->skb->hash - 32);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(7, self->skb->hash - 32);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(4, self->skb->hash - 32);
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(0, self->skb->hash - 32);
+	EXPECT_EQ(1, homa_cores[5]->metrics.softirq_cross_node);
+}
+
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 {
 	homa->gro_policy = HOMA_GRO_IDLE;
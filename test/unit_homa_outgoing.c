@@ -79,6 +79,7 @@ TEST_F(homa_outgoing, set_priority__priority_mapping)
 TEST_F(homa_outgoing, homa_fill_packets__message_too_long)
 {
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((void *) 1000,
 			HOMA_MAX_MESSAGE_LENGTH+100));
 	EXPECT_TRUE(IS_ERR(skb));
@@ -89,6 +90,7 @@ TEST_F(homa_outgoing, homa_fill_packets__max_gso_size_limit)
 	mock_net_device.gso_max_size = 10000;
 	self->homa.max_gso_size = 3000;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((void *) 1000, 5000));
 	ASSERT_FALSE(IS_ERR(skb));
 	unit_log_clear();
@@ -133,6 +135,7 @@ TEST_F(homa_outgoing, homa_fill_packets__cant_alloc_small_skb)
 {
 	mock_alloc_skb_errors = 1;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((void *) 1000, 500));
 	EXPECT_TRUE(IS_ERR(skb));
 	EXPECT_EQ(ENOMEM, -PTR_ERR(skb));
@@ -142,6 +145,7 @@ TEST_F(homa_outgoing, homa_fill_packets__cant_alloc_large_skb)
 	mock_alloc_skb_errors = 1;
 	mock_net_device.gso_max_size = 5000;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((void *) 1000, 5000));
 	EXPECT_TRUE(IS_ERR(skb));
 	EXPECT_EQ(ENOMEM, -PTR_ERR(skb));
@@ -182,6 +186,7 @@ TEST_F(homa_outgoing, homa_fill_packets__cant_copy_data)
 {
 	mock_copy_data_errors = 2;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((char *) 1000, 3000));
 	EXPECT_TRUE(IS_ERR(skb));
 	EXPECT_EQ(EFAULT, -PTR_ERR(skb));
@@ -194,6 +199,7 @@ TEST_F(homa_outgoing, homa_fill_packets__include_ack)
 		.client_id = cpu_to_be64(1000)};
 	self->peer->num_acks = 1;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((char *) 1000, 500));
 	EXPECT_FALSE(IS_ERR(skb));
 	struct data_header *h = (struct data_header *) skb->data;
@@ -201,10 +207,78 @@ TEST_F(homa_outgoing, homa_fill_packets__include_ack)
 			unit_ack_string(&h->seg.ack));
 	homa_free_skbs(skb);
 }
+TEST_F(homa_outgoing, homa_fill_packets__extra_acks)
+{
+	struct homa_ack *acks;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		self->peer->acks[i] = (struct homa_ack) {
+			.client_port = htons(100),
+			.server_port = htons(200),
+			.client_id = cpu_to_be64(1000 + i)};
+	self->peer->num_acks = 3;
+	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
+			unit_iov_iter((char *) 1000, 500));
+	ASSERT_FALSE(IS_ERR(skb));
+	struct data_header *h = (struct data_header *) skb->data;
+	EXPECT_STREQ("client_port 100, server_port 200, client_id 1002",
+			unit_ack_string(&h->seg.ack));
+	EXPECT_EQ(2, h->extra_acks);
+	EXPECT_EQ(sizeof(*h) + 500 + 2*sizeof(struct homa_ack), skb->len);
+	acks = (struct homa_ack *) (skb->data + sizeof(*h) + 500);
+	EXPECT_STREQ("client_port 100, server_port 200, client_id 1000",
+			unit_ack_string(&acks[0]));
+	EXPECT_STREQ("client_port 100, server_port 200, client_id 1001",
+			unit_ack_string(&acks[1]));
+	EXPECT_EQ(0, self->peer->num_acks);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.piggybacked_acks);
+	homa_free_skbs(skb);
+}
+TEST_F(homa_outgoing, homa_fill_packets__no_room_for_extra_acks)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		self->peer->acks[i] = (struct homa_ack) {
+			.client_port = htons(100),
+			.server_port = htons(200),
+			.client_id = cpu_to_be64(1000 + i)};
+	self->peer->num_acks = 3;
+	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
+			unit_iov_iter((char *) 1000, UNIT_TEST_DATA_PER_PACKET));
+	ASSERT_FALSE(IS_ERR(skb));
+	struct data_header *h = (struct data_header *) skb->data;
+	EXPECT_EQ(0, h->extra_acks);
+	EXPECT_EQ(sizeof(*h) + UNIT_TEST_DATA_PER_PACKET, skb->len);
+	EXPECT_EQ(2, self->peer->num_acks);
+	homa_free_skbs(skb);
+}
+TEST_F(homa_outgoing, homa_fill_packets__header_from_template)
+{
+	self->peer->data_template.cutoff_version = htons(7);
+	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
+			unit_iov_iter((char *) 1000, 500));
+	ASSERT_FALSE(IS_ERR(skb));
+	struct data_header *h = (struct data_header *) skb->data;
+	EXPECT_EQ(DATA, h->common.type);
+	EXPECT_EQ(self->client_port, ntohs(h->common.sport));
+	EXPECT_EQ(self->server_port, ntohs(h->common.dport));
+	EXPECT_EQ(self->client_id, be64_to_cpu(h->common.sender_id));
+	EXPECT_EQ(500, ntohl(h->message_length));
+	EXPECT_EQ(7, ntohs(h->cutoff_version));
+	EXPECT_EQ(0, h->retransmit);
+	EXPECT_EQ(CHECKSUM_PARTIAL, skb->ip_summed);
+	homa_free_skbs(skb);
+}
 TEST_F(homa_outgoing, homa_fill_packets__multiple_segs_per_skbuff)
 {
 	mock_net_device.gso_max_size = 5000;
 	struct sk_buff *skb = homa_fill_packets(&self->hsk, self->peer,
+			self->server_port, self->client_id,
 			unit_iov_iter((void *) 1000, 10000));
 	ASSERT_FALSE(IS_ERR(skb));
 	EXPECT_STREQ("_copy_from_iter 1400 bytes at 1000; "
@@ -282,6 +356,52 @@ TEST_F(homa_outgoing, homa_message_out_init__basics)
 	EXPECT_EQ(3, crpc->msgout.num_skbs);
 }
 
+TEST_F(homa_outgoing, homa_message_out_fill__basics)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 1000, 100000);
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, iter);
+	ASSERT_FALSE(IS_ERR(crpc));
+	EXPECT_EQ(65800, crpc->msgout.copied);
+	EXPECT_EQ(47, crpc->msgout.num_skbs);
+	homa_xmit_data(crpc, false);
+	EXPECT_EQ(11200, homa_rpc_send_offset(crpc));
+	unit_log_clear();
+	EXPECT_EQ(0, homa_message_out_fill(crpc, iter));
+	EXPECT_EQ(100000, crpc->msgout.copied);
+	EXPECT_EQ(72, crpc->msgout.num_skbs);
+	EXPECT_EQ(0, crpc->dont_reap);
+	unit_log_clear();
+	unit_log_message_out_packets(&crpc->msgout, 0);
+	EXPECT_SUBSTR("DATA 1400@64400; DATA 1400@65800; DATA 1400@67200",
+			unit_log_get());
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__copy_error)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 1000, 100000);
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, iter);
+	ASSERT_FALSE(IS_ERR(crpc));
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_message_out_fill(crpc, iter));
+	EXPECT_EQ(RPC_DEAD, crpc->state);
+	EXPECT_EQ(47, crpc->msgout.num_skbs);
+	EXPECT_EQ(0, crpc->dont_reap);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__response_arrived)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 1000, 100000);
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, iter);
+	ASSERT_FALSE(IS_ERR(crpc));
+	crpc->state = RPC_INCOMING;
+	EXPECT_EQ(0, homa_message_out_fill(crpc, iter));
+	EXPECT_EQ(65800, crpc->msgout.copied);
+	EXPECT_EQ(47, crpc->msgout.num_skbs);
+	homa_rpc_unlock(crpc);
+}
+
 
 TEST_F(homa_outgoing, homa_xmit_control__server_request)
 {
@@ -325,6 +445,30 @@ TEST_F(homa_outgoing, homa_xmit_control__client_response)
 	EXPECT_STREQ("7", mock_xmit_prios);
 }
 
+TEST_F(homa_outgoing, homa_xmit_control__piggyback_ack)
+{
+	struct homa_rpc *crpc;
+	struct busy_header h;
+
+	crpc = unit_client_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 10000);
+	ASSERT_NE(NULL, crpc);
+	crpc->peer->acks[0] = (struct homa_ack) {
+		.client_port = htons(100),
+		.server_port = htons(200),
+		.client_id = cpu_to_be64(1000)};
+	crpc->peer->num_acks = 1;
+	unit_log_clear();
+
+	mock_xmit_log_verbose = 1;
+	EXPECT_EQ(0, homa_xmit_control(BUSY, &h, sizeof(h), crpc));
+	EXPECT_STREQ("xmit BUSY from 0.0.0.0:40000, dport 99, id 1234, "
+			"ack [cp 100, sp 200, id 1000]",
+			unit_log_get());
+	EXPECT_EQ(0, crpc->peer->num_acks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.piggybacked_acks);
+}
 TEST_F(homa_outgoing, __homa_xmit_control__cant_alloc_skb)
 {
 	struct homa_rpc *srpc;
@@ -357,6 +501,19 @@ TEST_F(homa_outgoing, __homa_xmit_control__pad_packet)
 			"xmit unknown packet type 0x0",
 			unit_log_get());
 }
+TEST_F(homa_outgoing, __homa_xmit_control__dst_not_held)
+{
+	struct dst_entry *dst = self->peer->dst;
+	int old_refcount = dst->__refcnt.counter;
+	struct grant_header h;
+
+	memset(&h, 0, sizeof(h));
+	h.common.type = GRANT;
+	EXPECT_EQ(0, __homa_xmit_control(&h, sizeof(h), self->peer,
+			&self->hsk));
+	EXPECT_STREQ("xmit GRANT 0@0", unit_log_get());
+	EXPECT_EQ(old_refcount, dst->__refcnt.counter);
+}
 TEST_F(homa_outgoing, __homa_xmit_control__ipv4_error)
 {
 	struct homa_rpc *srpc;
@@ -402,6 +559,126 @@ TEST_F(homa_outgoing, __homa_xmit_control__ipv6_error)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.control_xmit_errors);
 }
 
+TEST_F(homa_outgoing, __homa_xmit_control__not_in_softirq)
+{
+	struct homa_rpc *srpc;
+	struct grant_header h;
+
+	srpc = unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	h.offset = htonl(12345);
+	h.priority = 4;
+	homa_bundle_start();
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_STREQ("xmit GRANT 12345@4", unit_log_get());
+	homa_bundle_flush();
+	EXPECT_STREQ("xmit GRANT 12345@4", unit_log_get());
+}
+TEST_F(homa_outgoing, __homa_xmit_control__too_long_to_bundle)
+{
+	char buffer[HOMA_MAX_BUNDLE_ITEM + 1];
+	struct grant_header *h = (struct grant_header *) buffer;
+
+	memset(buffer, 0, sizeof(buffer));
+	h->common.type = GRANT;
+	h->offset = htonl(12345);
+	h->priority = 4;
+	mock_in_softirq = 1;
+	homa_bundle_start();
+	EXPECT_EQ(0, __homa_xmit_control(buffer, sizeof(buffer), self->peer,
+			&self->hsk));
+	EXPECT_STREQ("xmit GRANT 12345@4", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->num_bundles);
+	homa_bundle_flush();
+}
+
+TEST_F(homa_outgoing, homa_bundle_add__basics)
+{
+	struct homa_rpc *srpc;
+	struct grant_header h;
+
+	srpc = unit_server_rpc(&self->hsk, RPC_INCOMING, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	h.offset = htonl(12345);
+	h.priority = 4;
+	mock_in_softirq = 1;
+	homa_bundle_start();
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	h.offset = htonl(20000);
+	EXPECT_EQ(0, homa_xmit_control(GRANT, &h, sizeof(h), srpc));
+	EXPECT_STREQ("", unit_log_get());
+	mock_xmit_log_verbose = 1;
+	homa_bundle_flush();
+	EXPECT_STREQ("xmit BUNDLE from 0.0.0.0:40000, dport 0, id 0, items "
+			"[GRANT, dport 40000, id 1111] "
+			"[GRANT, dport 40000, id 1111]",
+			unit_log_get());
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bundled_control_pkts);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.packets_sent[
+			BUNDLE - DATA]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->bundling);
+}
+TEST_F(homa_outgoing, homa_bundle_add__too_many_peers)
+{
+	struct homa_peer *peer;
+	struct in6_addr addr;
+	struct grant_header h;
+	char addr_string[20];
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	h.common.type = GRANT;
+	h.priority = 4;
+	mock_in_softirq = 1;
+	homa_bundle_start();
+	for (i = 0; i <= HOMA_BUNDLE_PEERS; i++) {
+		snprintf(addr_string, sizeof(addr_string), "1.2.3.%d", 10+i);
+		addr = unit_get_in_addr(addr_string);
+		peer = homa_peer_find(&self->homa.peers, &addr,
+				&self->hsk.inet);
+		ASSERT_FALSE(IS_ERR(peer));
+		h.offset = htonl(100*(i+1));
+		EXPECT_EQ(0, __homa_xmit_control(&h, sizeof(h), peer,
+				&self->hsk));
+	}
+	EXPECT_STREQ("xmit GRANT 100@4", unit_log_get());
+	EXPECT_EQ(HOMA_BUNDLE_PEERS, homa_cores[cpu_number]->num_bundles);
+	unit_log_clear();
+	homa_bundle_flush();
+	EXPECT_STREQ("xmit GRANT 500@4; xmit GRANT 200@4; xmit GRANT 300@4; "
+			"xmit GRANT 400@4", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_bundle_add__bundle_full)
+{
+	struct grant_header h;
+	int i, fit = HOMA_MAX_BUNDLE_BYTES/(1 + sizeof(h));
+	char expected[100];
+
+	memset(&h, 0, sizeof(h));
+	h.common.type = GRANT;
+	h.offset = htonl(1000);
+	h.priority = 2;
+	mock_in_softirq = 1;
+	homa_bundle_start();
+	for (i = 0; i < fit; i++)
+		EXPECT_EQ(0, __homa_xmit_control(&h, sizeof(h), self->peer,
+				&self->hsk));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, __homa_xmit_control(&h, sizeof(h), self->peer,
+			&self->hsk));
+	snprintf(expected, sizeof(expected), "xmit BUNDLE %d items", fit);
+	EXPECT_STREQ(expected, unit_log_get());
+	unit_log_clear();
+	homa_bundle_flush();
+	EXPECT_STREQ("xmit GRANT 1000@2", unit_log_get());
+}
+
 TEST_F(homa_outgoing, homa_xmit_unknown)
 {
 	struct sk_buff *skb;
@@ -550,7 +827,8 @@ TEST_F(homa_outgoing, __homa_xmit_data__fill_dst)
 	__homa_xmit_data(crpc->msgout.packets, crpc, 6);
 	EXPECT_STREQ("xmit DATA 1000@0", unit_log_get());
 	EXPECT_EQ(dst, skb_dst(crpc->msgout.packets));
-	EXPECT_EQ(old_refcount+1, dst->__refcnt.counter);
+	EXPECT_TRUE(skb_dst_is_noref(crpc->msgout.packets));
+	EXPECT_EQ(old_refcount, dst->__refcnt.counter);
 }
 TEST_F(homa_outgoing, __homa_xmit_data__ipv4_transmit_error)
 {
@@ -767,8 +1045,132 @@ TEST_F(homa_outgoing, homa_check_nic_queue__queue_empty)
 	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
 }
 
+TEST_F(homa_outgoing, homa_nic_inflight__no_tx_queues)
+{
+	EXPECT_EQ(-1, homa_nic_inflight(&mock_net_device));
+}
+#ifdef CONFIG_BQL
+TEST_F(homa_outgoing, homa_nic_inflight__all_queues)
+{
+	struct netdev_queue queues[3];
+
+	memset(queues, 0, sizeof(queues));
+	queues[0].dql.num_queued = 5000;
+	queues[0].dql.num_completed = 4000;
+	queues[1].dql.num_queued = 9000;
+	queues[1].dql.num_completed = 1000;
+	queues[2].dql.num_queued = 3000;
+	queues[2].dql.num_completed = 1000;
+	mock_net_device._tx = queues;
+	mock_net_device.real_num_tx_queues = 3;
+	EXPECT_EQ(11000, homa_nic_inflight(&mock_net_device));
+	mock_net_device._tx = NULL;
+	mock_net_device.real_num_tx_queues = 0;
+}
+#endif
+
+TEST_F(homa_outgoing, homa_nic_queue_feedback__underestimate)
+{
+	atomic64_set(&self->homa.link_idle_time, 11000);
+	homa_nic_queue_feedback(&self->homa, 3000, 10000);
+	EXPECT_EQ(13000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.nic_queue_samples);
+	EXPECT_EQ(2000, homa_cores[cpu_number]
+			->metrics.nic_queue_underestimate_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]
+			->metrics.nic_queue_overestimate_cycles);
+}
+TEST_F(homa_outgoing, homa_nic_queue_feedback__link_idle_in_past)
+{
+	atomic64_set(&self->homa.link_idle_time, 5000);
+	homa_nic_queue_feedback(&self->homa, 500, 10000);
+	EXPECT_EQ(10500, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(500, homa_cores[cpu_number]
+			->metrics.nic_queue_underestimate_cycles);
+}
+TEST_F(homa_outgoing, homa_nic_queue_feedback__overestimate)
+{
+	atomic64_set(&self->homa.link_idle_time, 20000);
+	homa_nic_queue_feedback(&self->homa, 2000, 10000);
+	EXPECT_EQ(16000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(0, homa_cores[cpu_number]
+			->metrics.nic_queue_underestimate_cycles);
+	EXPECT_EQ(8000, homa_cores[cpu_number]
+			->metrics.nic_queue_overestimate_cycles);
+}
+
 /* Don't know how to unit test homa_pacer_main... */
 
+/* Used via mock_schedule_hook: simulates time passing while the pacer
+ * sleeps, during which other threads keep the NIC queue full.
+ */
+static struct homa *hook_homa;
+static __u64 hook_cycles;
+static void pacer_sleep_hook(void)
+{
+	mock_cycles = hook_cycles;
+	atomic64_add(3000, &hook_homa->link_idle_time);
+}
+
+TEST_F(homa_outgoing, homa_pacer_sleep__queue_has_room)
+{
+	__u64 deadline = 5000;
+
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 12000);
+	EXPECT_FALSE(homa_pacer_sleep(&self->homa, &deadline));
+	EXPECT_STREQ("schedule", unit_log_get());
+	EXPECT_EQ(0, deadline);
+}
+TEST_F(homa_outgoing, homa_pacer_sleep__link_idle_time_keeps_advancing)
+{
+	__u64 deadline = 0;
+
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 15000);
+	hook_homa = &self->homa;
+	hook_cycles = 13000;
+	mock_schedule_hook = pacer_sleep_hook;
+	EXPECT_TRUE(homa_pacer_sleep(&self->homa, &deadline));
+	EXPECT_STREQ("schedule_hrtimeout_range", unit_log_get());
+	EXPECT_EQ(18000, atomic64_read(&self->homa.link_idle_time));
+	EXPECT_EQ(0, deadline);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_sleeps);
+}
+TEST_F(homa_outgoing, homa_pacer_sleep__woken_early)
+{
+	__u64 deadline = 0;
+
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 15000);
+	hook_homa = &self->homa;
+	hook_cycles = 11000;
+	mock_schedule_hook = pacer_sleep_hook;
+	EXPECT_FALSE(homa_pacer_sleep(&self->homa, &deadline));
+	EXPECT_EQ(13000, deadline);
+
+	/* The deadline doesn't move, even though link_idle_time did. */
+	hook_cycles = 13000;
+	unit_log_clear();
+	EXPECT_TRUE(homa_pacer_sleep(&self->homa, &deadline));
+	EXPECT_STREQ("schedule_hrtimeout_range", unit_log_get());
+	EXPECT_EQ(0, deadline);
+}
+TEST_F(homa_outgoing, homa_pacer_sleep__deadline_already_passed)
+{
+	__u64 deadline = 9000;
+
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 20000);
+	EXPECT_TRUE(homa_pacer_sleep(&self->homa, &deadline));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, deadline);
+}
+
 TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 {
 	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
@@ -789,7 +1191,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__basics)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 	unit_log_clear();
@@ -827,7 +1229,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	atomic64_set(&self->homa.link_idle_time, 10000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -839,7 +1241,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__xmit_fifo)
 	/* Second attempt: pacer_fifo_count reaches zero. */
 	atomic64_set(&self->homa.link_idle_time, 10000);
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -859,7 +1261,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__pacer_busy)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	mock_trylock_errors = 1;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -870,7 +1272,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__queue_empty)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
@@ -886,7 +1288,42 @@ TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_fills)
 	atomic64_set(&self->homa.link_idle_time, 12000);
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
+	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request 2, next_offset 1400", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_pacer_xmit__nic_queue_already_full)
+{
+	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, unit_iov_iter((void *) 1000, 10000));
+	ASSERT_FALSE(IS_ERR(crpc1));
+	homa_rpc_unlock(crpc1);
+	homa_add_to_throttled(crpc1);
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 12001);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa, false);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request 2, next_offset 0", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_pacer_xmit__force)
+{
+	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
+			&self->server_addr, unit_iov_iter((void *) 1000, 10000));
+	ASSERT_FALSE(IS_ERR(crpc1));
+	homa_rpc_unlock(crpc1);
+	homa_add_to_throttled(crpc1);
+	self->homa.max_nic_queue_cycles = 2000;
+	mock_cycles = 10000;
+	atomic64_set(&self->homa.link_idle_time, 20000);
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	unit_log_clear();
+	homa_pacer_xmit(&self->homa, true);
 	EXPECT_STREQ("xmit DATA 1400@0", unit_log_get());
 	unit_log_clear();
 	unit_log_throttled(&self->homa);
@@ -903,12 +1340,12 @@ TEST_F(homa_outgoing, homa_pacer_xmit__rpc_locked)
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
 	mock_trylock_errors = ~1;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pacer_skipped_rpcs);
 	unit_log_clear();
 	mock_trylock_errors = 0;
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 1400@1400",
 		unit_log_get());
 }
@@ -927,7 +1364,7 @@ TEST_F(homa_outgoing, homa_pacer_xmit__remove_from_queue)
 	self->homa.max_nic_queue_cycles = 2000;
 	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
 	unit_log_clear();
-	homa_pacer_xmit(&self->homa);
+	homa_pacer_xmit(&self->homa, false);
 	EXPECT_STREQ("xmit DATA 1000@0; xmit DATA 1400@0",
 			unit_log_get());
 	unit_log_clear();
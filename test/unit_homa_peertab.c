@@ -104,6 +104,128 @@ TEST_F(homa_peertab, homa_peertab_init__vmalloc_failed)
 	homa_peertab_destroy(&table);
 }
 
+TEST_F(homa_peertab, homa_peertab_check_size)
+{
+	struct homa_peer *peers[200];
+	struct in6_addr addr;
+	int i;
+
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, self->peertab.buckets->bits);
+	for (i = 0; i < 200; i++) {
+		addr = unit_get_in_addr("10.0.0.0");
+		addr.in6_u.u6_addr32[3] = htonl(0x0a000000 + i);
+		peers[i] = homa_peer_find(&self->peertab, &addr,
+				&self->hsk.inet);
+		ASSERT_FALSE(IS_ERR(peers[i]));
+	}
+	EXPECT_EQ(200, self->peertab.num_peers);
+
+	// Grow to 256 buckets; all peers must still be found.
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(8, self->peertab.buckets->bits);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+	for (i = 0; i < 200; i++) {
+		addr = peers[i]->addr;
+		EXPECT_EQ(peers[i], homa_peer_find(&self->peertab, &addr,
+				&self->hsk.inet));
+	}
+	EXPECT_EQ(200, homa_cores[cpu_number]->metrics.peer_new_entries);
+
+	// No change needed.
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+
+	// Shrink back to the minimum size.
+	self->peertab.num_peers = 10;
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, self->peertab.buckets->bits);
+	addr = peers[150]->addr;
+	EXPECT_EQ(peers[150], homa_peer_find(&self->peertab, &addr,
+			&self->hsk.inet));
+	self->peertab.num_peers = 200;
+}
+TEST_F(homa_peertab, homa_peertab_check_size__incremental)
+{
+	struct homa_peer *peers[2100];
+	struct in6_addr addr;
+	int i;
+
+	for (i = 0; i < 2100; i++) {
+		addr = unit_get_in_addr("10.0.0.0");
+		addr.in6_u.u6_addr32[3] = htonl(0x0a000000 + i);
+		peers[i] = homa_peer_find(&self->peertab, &addr,
+				&self->hsk.inet);
+		ASSERT_FALSE(IS_ERR(peers[i]));
+		if (i == 1099) {
+			homa_peertab_check_size(&self->peertab);
+			EXPECT_EQ(11, self->peertab.buckets->bits);
+		}
+	}
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+
+	// First call moves only some of the 2048 chains; every peer must
+	// still be found while both arrays are live.
+	homa_peertab_check_size(&self->peertab);
+	ASSERT_NE(NULL, self->peertab.new_buckets);
+	EXPECT_EQ(12, self->peertab.new_buckets->bits);
+	EXPECT_EQ(HOMA_PEER_REHASH_BUCKETS, self->peertab.rehash_bucket);
+	EXPECT_EQ(11, self->peertab.buckets->bits);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peertab_resizes);
+	for (i = 0; i < 2100; i++) {
+		addr = peers[i]->addr;
+		EXPECT_EQ(peers[i], homa_peer_find(&self->peertab, &addr,
+				&self->hsk.inet));
+	}
+	EXPECT_EQ(2100, homa_cores[cpu_number]->metrics.peer_new_entries);
+
+	// New peers go into the new array.
+	addr = unit_get_in_addr("10.0.0.0");
+	addr.in6_u.u6_addr32[3] = htonl(0x0b000000);
+	EXPECT_FALSE(IS_ERR(homa_peer_find(&self->peertab, &addr,
+			&self->hsk.inet)));
+
+	// Second call finishes the resize.
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(NULL, self->peertab.new_buckets);
+	EXPECT_EQ(12, self->peertab.buckets->bits);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peertab_resizes);
+	for (i = 0; i < 2100; i++) {
+		addr = peers[i]->addr;
+		EXPECT_EQ(peers[i], homa_peer_find(&self->peertab, &addr,
+				&self->hsk.inet));
+	}
+	addr.in6_u.u6_addr32[3] = htonl(0x0b000000);
+	homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	EXPECT_EQ(2101, homa_cores[cpu_number]->metrics.peer_new_entries);
+}
+TEST_F(homa_peertab, homa_peertab_destroy__during_resize)
+{
+	struct in6_addr addr;
+	int i;
+
+	for (i = 0; i < 2100; i++) {
+		addr = unit_get_in_addr("10.0.0.0");
+		addr.in6_u.u6_addr32[3] = htonl(0x0a000000 + i);
+		homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+		if (i == 1099)
+			homa_peertab_check_size(&self->peertab);
+	}
+	homa_peertab_check_size(&self->peertab);
+	ASSERT_NE(NULL, self->peertab.new_buckets);
+
+	// Teardown destroys the table; the memory checker verifies that
+	// peers in both arrays were freed.
+}
+TEST_F(homa_peertab, homa_peertab_check_size__vmalloc_failed)
+{
+	self->peertab.num_peers = 100;
+	mock_vmalloc_errors = 1;
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BITS, self->peertab.buckets->bits);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peertab_resizes);
+	self->peertab.num_peers = 0;
+}
+
 TEST_F(homa_peertab, homa_peertab_gc_dsts)
 {
 	struct homa_peer *peer;
@@ -122,6 +244,23 @@ TEST_F(homa_peertab, homa_peertab_gc_dsts)
 	EXPECT_EQ(0, dead_count(&self->peertab));
 }
 
+TEST_F(homa_peertab, homa_peer_find__skip_evicted_peer)
+{
+	struct homa_peer *peer, *peer2;
+
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer));
+	atomic_set(&peer->refs, -1);
+	peer2 = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	ASSERT_FALSE(IS_ERR(peer2));
+	EXPECT_NE(peer, peer2);
+	EXPECT_EQ(0, homa_peer_hold(peer));
+	EXPECT_EQ(1, homa_peer_hold(peer2));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_new_entries);
+	EXPECT_EQ(2, self->peertab.num_peers);
+	homa_peer_put(peer2);
+}
+
 TEST_F(homa_peertab, homa_peer_find__conflicting_creates)
 {
 	struct homa_peer *peer;
@@ -153,6 +292,81 @@ TEST_F(homa_peertab, homa_peer_find__route_error)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_route_errors);
 }
 
+static void gc_all_buckets(struct homa *homa)
+{
+	int i;
+
+	for (i = 0; i <= (1 << homa->peers.buckets->bits)/HOMA_PEER_GC_BUCKETS;
+			i++)
+		homa_peertab_gc_peers(homa);
+}
+
+TEST_F(homa_peertab, homa_peertab_gc_peers__evict_idle_peers)
+{
+	struct homa_peer *peer1, *peer2, *peer3, *peer4;
+	unsigned long old = jiffies - (self->homa.peer_idle_secs + 1)*HZ;
+
+	peer1 = homa_peer_find(&self->homa.peers, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->homa.peers, ip2222, &self->hsk.inet);
+	peer3 = homa_peer_find(&self->homa.peers, ip3333, &self->hsk.inet);
+	peer4 = homa_peer_find(&self->homa.peers, self->server_ip,
+			&self->hsk.inet);
+	EXPECT_EQ(4, self->homa.peers.num_peers);
+	peer1->access_jiffies = old;
+	peer2->access_jiffies = old;
+	EXPECT_EQ(1, homa_peer_hold(peer2));
+	peer2->access_jiffies = old;
+	peer3->access_jiffies = old;
+	peer3->num_acks = 1;
+
+	// Only peer1 is idle and unreferenced; peer4 was used recently.
+	gc_all_buckets(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_evictions);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_forced_evictions);
+	EXPECT_EQ(3, self->homa.peers.num_peers);
+
+	// Releasing the last reference makes the peer recently used.
+	homa_peer_put(peer2);
+	peer3->num_acks = 0;
+	gc_all_buckets(&self->homa);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_evictions);
+	EXPECT_EQ(2, self->homa.peers.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_gc_peers__disabled)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->homa.peers, ip1111, &self->hsk.inet);
+	peer->access_jiffies = jiffies - 1000*HZ;
+	self->homa.peer_idle_secs = 0;
+	gc_all_buckets(&self->homa);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_evictions);
+	EXPECT_EQ(1, self->homa.peers.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_gc_peers__too_many_peers)
+{
+	struct homa_peer *peer1, *peer2, *peer3;
+
+	peer1 = homa_peer_find(&self->homa.peers, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->homa.peers, ip2222, &self->hsk.inet);
+	peer3 = homa_peer_find(&self->homa.peers, ip3333, &self->hsk.inet);
+	peer1->access_jiffies = jiffies - 2*HZ;
+	peer2->access_jiffies = jiffies - 2*HZ;
+	peer3->access_jiffies = jiffies - 2*HZ;
+
+	// Not over the limit: no peers are old enough to evict.
+	self->homa.max_peers = 3;
+	gc_all_buckets(&self->homa);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_evictions);
+
+	// Evict just enough peers to get back under the limit.
+	self->homa.max_peers = 1;
+	gc_all_buckets(&self->homa);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_evictions);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_forced_evictions);
+	EXPECT_EQ(1, self->homa.peers.num_peers);
+}
+
 TEST_F(homa_peertab, homa_dst_refresh__basics)
 {
 	struct homa_peer *peer;
@@ -298,47 +512,40 @@ TEST_F(homa_peertab, homa_peer_add_ack)
 		self->client_ip, self->server_ip, self->server_port,
 		103, 100, 100);
 	struct homa_peer *peer = crpc1->peer;
+	int i;
 	EXPECT_EQ(0, peer->num_acks);
 
-	/* Initialize 3 acks in the peer. */
-	peer->acks[0] = (struct homa_ack) {
-			.client_port = htons(1000),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(90)};
-	peer->acks[1] = (struct homa_ack) {
-			.client_port = htons(1001),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(91)};
-	peer->acks[2] = (struct homa_ack) {
-			.client_port = htons(1002),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(92)};
-	peer->num_acks = 3;
+	/* Fill all but 2 of the slots in the peer. */
+	for (i = 0; i < HOMA_PEER_ACKS - 2; i++)
+		peer->acks[i] = (struct homa_ack) {
+				.client_port = htons(1000 + i),
+				.server_port = htons(self->server_port),
+				.client_id = cpu_to_be64(90)};
+	peer->num_acks = HOMA_PEER_ACKS - 2;
 
 	/* Add one RPC to unacked (fits). */
 	homa_peer_add_ack(crpc1);
-	EXPECT_EQ(4, peer->num_acks);
+	EXPECT_EQ(HOMA_PEER_ACKS - 1, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 101",
-			unit_ack_string(&peer->acks[3]));
+			unit_ack_string(&peer->acks[HOMA_PEER_ACKS - 2]));
 
 	/* Add another RPC to unacked (also fits). */
 	homa_peer_add_ack(crpc2);
-	EXPECT_EQ(5, peer->num_acks);
+	EXPECT_EQ(HOMA_PEER_ACKS, peer->num_acks);
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 102",
-			unit_ack_string(&peer->acks[4]));
+			unit_ack_string(&peer->acks[HOMA_PEER_ACKS - 1]));
 
-	/* Third RPC overflows, triggers ACK transmission. */
+	/* Third RPC overflows, triggers transmission of a batch of acks. */
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
 	homa_peer_add_ack(crpc3);
-	EXPECT_EQ(0, peer->num_acks);
-	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
-			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 91] "
-			"[cp 1002, sp 99, id 92] [cp 32768, sp 99, id 101] "
-			"[cp 32768, sp 99, id 102]",
-			unit_log_get());
+	EXPECT_EQ(HOMA_PEER_ACKS - HOMA_MAX_ACK_BATCH, peer->num_acks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ack_overflows);
+	EXPECT_SUBSTR("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
+			"[cp 1016, sp 99, id 90]", unit_log_get());
+	EXPECT_SUBSTR("[cp 1029, sp 99, id 90] [cp 32768, sp 99, id 101] "
+			"[cp 32768, sp 99, id 102]", unit_log_get());
 }
-
 TEST_F(homa_peertab, homa_peer_get_acks)
 {
 	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
@@ -376,3 +583,36 @@ TEST_F(homa_peertab, homa_peer_get_acks)
 	EXPECT_STREQ("client_port 4000, server_port 5000, client_id 100",
 			unit_ack_string(&acks[0]));
 }
+TEST_F(homa_peertab, homa_peer_get_ack_batch)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
+			&self->hsk.inet);
+	struct ack_batch batch;
+	int i;
+
+	for (i = 0; i < NUM_PEER_UNACKED_IDS + 2; i++)
+		peer->acks[i] = (struct homa_ack) {
+				.client_port = htons(4000 + i),
+				.server_port = htons(5000),
+				.client_id = cpu_to_be64(100 + i)};
+	peer->num_acks = 3;
+
+	// First call: all acks fit in the header.
+	EXPECT_EQ(sizeof(struct ack_header),
+			homa_peer_get_ack_batch(peer, &batch));
+	EXPECT_EQ(3, ntohs(batch.header.num_acks));
+	EXPECT_STREQ("client_port 4002, server_port 5000, client_id 102",
+			unit_ack_string(&batch.header.acks[2]));
+	EXPECT_EQ(0, peer->num_acks);
+
+	// Second call: some acks must follow the header.
+	peer->num_acks = NUM_PEER_UNACKED_IDS + 2;
+	EXPECT_EQ(sizeof(struct ack_header) + 2*sizeof(struct homa_ack),
+			homa_peer_get_ack_batch(peer, &batch));
+	EXPECT_EQ(NUM_PEER_UNACKED_IDS + 2, ntohs(batch.header.num_acks));
+	EXPECT_STREQ("client_port 4000, server_port 5000, client_id 100",
+			unit_ack_string(&batch.header.acks[0]));
+	EXPECT_STREQ("client_port 4006, server_port 5000, client_id 106",
+			unit_ack_string(&batch.extra[1]));
+	EXPECT_EQ(0, peer->num_acks);
+}
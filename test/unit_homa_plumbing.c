@@ -405,6 +405,7 @@ TEST_F(homa_plumbing, homa_ioc_reply__basics)
 			(unsigned long) &self->reply_args));
 	EXPECT_NE(RPC_IN_SERVICE, srpc->state);
 	EXPECT_SUBSTR("xmit DATA 1000@0", unit_log_get());
+	EXPECT_EQ(1, atomic_read(&srpc->peer->refs));
 }
 TEST_F(homa_plumbing, homa_ioc_reply__cant_read_user_args)
 {
@@ -447,6 +448,7 @@ TEST_F(homa_plumbing, homa_ioc_reply__cant_find_rpc)
 	EXPECT_EQ(EINVAL, -homa_ioc_reply(&self->hsk.inet.sk,
 			(unsigned long) &self->reply_args));
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	EXPECT_EQ(1, atomic_read(&srpc->peer->refs));
 }
 TEST_F(homa_plumbing, homa_ioc_reply__error_in_homa_message_out_init)
 {
@@ -509,7 +511,7 @@ TEST_F(homa_plumbing, homa_ioc_send__error_in_homa_rpc_new_client)
 TEST_F(homa_plumbing, homa_ioc_send__cant_update_user_arguments)
 {
 	mock_copy_to_user_errors = 1;
-	atomic64_set(&self->homa.next_outgoing_id, 1234);
+	unit_set_next_id(&self->homa, 1234);
 	EXPECT_EQ(EFAULT, -homa_ioc_send(&self->hsk.inet.sk,
 			(unsigned long) &self->send_args));
 	EXPECT_SUBSTR("xmit DATA 200@0", unit_log_get());
@@ -517,7 +519,7 @@ TEST_F(homa_plumbing, homa_ioc_send__cant_update_user_arguments)
 }
 TEST_F(homa_plumbing, homa_ioc_send__successful_send)
 {
-	atomic64_set(&self->homa.next_outgoing_id, 1234);
+	unit_set_next_id(&self->homa, 1234);
 	EXPECT_EQ(0, homa_ioc_send(&self->hsk.inet.sk,
 			(unsigned long) &self->send_args));
 	EXPECT_SUBSTR("xmit DATA 200@0", unit_log_get());
@@ -584,6 +586,41 @@ TEST_F(homa_plumbing, homa_ioc_abort__nonexistent_rpc)
 			(unsigned long) &args));
 }
 
+TEST_F(homa_plumbing, homa_ioc_wait_stats__basics)
+{
+	struct {
+		struct homa_wait_stats stats;
+		char pad[8];
+	} buf;
+	self->homa.poll_usecs = 50;
+	homa_incoming_sysctl_changed(&self->homa);
+	self->hsk.fast_wakeups = 7;
+	self->hsk.slow_wakeups = 3;
+	self->hsk.total_poll_cycles = 123000;
+	self->hsk.poll_cycles = 8000;
+	EXPECT_EQ(0, homa_ioc_wait_stats(&self->hsk.inet.sk,
+			(unsigned long) &buf.stats));
+	EXPECT_EQ(7, buf.stats.fast_wakeups);
+	EXPECT_EQ(3, buf.stats.slow_wakeups);
+	EXPECT_EQ(123, buf.stats.poll_usecs);
+	EXPECT_EQ(8, buf.stats.poll_budget_usecs);
+
+	self->homa.poll_percentile = 0;
+	EXPECT_EQ(0, homa_ioc_wait_stats(&self->hsk.inet.sk,
+			(unsigned long) &buf.stats));
+	EXPECT_EQ(50, buf.stats.poll_budget_usecs);
+}
+TEST_F(homa_plumbing, homa_ioc_wait_stats__cant_copy_to_user)
+{
+	struct {
+		struct homa_wait_stats stats;
+		char pad[8];
+	} buf;
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_ioc_wait_stats(&self->hsk.inet.sk,
+			(unsigned long) &buf.stats));
+}
+
 TEST_F(homa_plumbing, homa_softirq__basics)
 {
 	struct sk_buff *skb;
@@ -659,6 +696,116 @@ TEST_F(homa_plumbing, homa_softirq__nothing_to_reorder)
 	unit_log_active_ids(&self->hsk);
 	EXPECT_STREQ("2001 3001 5001", unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__srpt_order_and_metrics)
+{
+	struct sk_buff *skb, *skb2, *skb3, *skb4;
+
+	self->data.common.sender_id = cpu_to_be64(900000);
+	self->data.message_length = htonl(900000);
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(2000);
+	self->data.seg.offset = htonl(1400);
+	self->data.seg.segment_length = htonl(600);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 600, 0);
+	self->data.common.sender_id = cpu_to_be64(5000);
+	self->data.message_length = htonl(5000);
+	self->data.seg.offset = 0;
+	self->data.seg.segment_length = htonl(1400);
+	skb3 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(100);
+	self->data.message_length = htonl(100);
+	self->data.seg.segment_length = htonl(100);
+	skb4 = mock_skb_new(self->client_ip, &self->data.common, 100, 0);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = skb3;
+	skb3->next = skb4;
+	skb4->next = NULL;
+	homa_softirq(skb);
+	unit_log_active_ids(&self->hsk);
+	EXPECT_STREQ("101 2001 5001 900001", unit_log_get());
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.softirq_reordered_pkts);
+	EXPECT_EQ(5, homa_cores[cpu_number]->metrics.softirq_reorder_depth);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_short_msgs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics
+			.softirq_short_delay_hist[0]);
+}
+TEST_F(homa_plumbing, homa_softirq__packets_of_one_message_stay_in_order)
+{
+	struct sk_buff *skb, *skb2, *skb3, *skb4;
+
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(5000);
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.seg.offset = htonl(1400);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.seg.offset = htonl(2800);
+	skb3 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(300);
+	self->data.message_length = htonl(300);
+	self->data.seg.offset = 0;
+	self->data.seg.segment_length = htonl(300);
+	skb4 = mock_skb_new(self->client_ip, &self->data.common, 300, 0);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = skb3;
+	skb3->next = skb4;
+	skb4->next = NULL;
+	homa_softirq(skb);
+	unit_log_active_ids(&self->hsk);
+	EXPECT_STREQ("301 2001", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_reordered_pkts);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.softirq_reorder_depth);
+}
+TEST_F(homa_plumbing, homa_softirq__group_packets_by_rpc)
+{
+	struct sk_buff *skb, *skb2, *skb3;
+
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(5000);
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(3000);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.seg.offset = htonl(1400);
+	skb3 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = skb3;
+	skb3->next = NULL;
+	homa_softirq(skb);
+	unit_log_active_ids(&self->hsk);
+	EXPECT_STREQ("2001 3001", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_grouped_pkts);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.dispatch_rpc_locks);
+}
+TEST_F(homa_plumbing, homa_softirq__control_packet_doesnt_group_data)
+{
+	struct sk_buff *skb, *skb2, *skb3;
+	struct busy_header busy;
+
+	self->data.common.sender_id = cpu_to_be64(2000);
+	self->data.message_length = htonl(5000);
+	self->data.seg.segment_length = htonl(1400);
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(200);
+	self->data.message_length = htonl(200);
+	self->data.seg.segment_length = htonl(200);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 200, 0);
+	memset(&busy, 0, sizeof(busy));
+	busy.common = self->data.common;
+	busy.common.type = BUSY;
+	busy.common.sender_id = cpu_to_be64(2000);
+	skb3 = mock_skb_new(self->client_ip, &busy.common, 0, 0);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = skb3;
+	skb3->next = NULL;
+	homa_softirq(skb);
+	unit_log_active_ids(&self->hsk);
+	EXPECT_STREQ("201 2001", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.softirq_grouped_pkts);
+}
 TEST_F(homa_plumbing, homa_softirq__cant_pull_header)
 {
 	struct sk_buff *skb;
@@ -686,6 +833,22 @@ TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
 }
+TEST_F(homa_plumbing, homa_softirq__grant_without_ack_field)
+{
+	struct sk_buff *skb;
+	struct grant_header h;
+	memset(&h, 0, sizeof(h));
+	h.common.type = GRANT;
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = offsetof(struct grant_header, ack);
+	homa_softirq(skb);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.short_packets);
+
+	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb->len = offsetof(struct grant_header, ack) - 1;
+	homa_softirq(skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+}
 TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 {
 	struct sk_buff *skb;
@@ -725,6 +888,85 @@ TEST_F(homa_plumbing, homa_softirq__unknown_socket_ipv6)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_STREQ("icmp6_send type 1, code 4", unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__unpack_bundle)
+{
+	struct grant_header grant = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(12000),
+			.priority = 3};
+	int entry_length = 1 + sizeof(grant);
+	struct homa_rpc *srpc1, *srpc2;
+	struct bundle_header bundle;
+	struct sk_buff *skb;
+	char *p;
+
+	srpc1 = unit_server_rpc(&self->hsk, RPC_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 20000);
+	ASSERT_NE(NULL, srpc1);
+	srpc2 = unit_server_rpc(&self->hsk, RPC_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id+2,
+			100, 20000);
+	ASSERT_NE(NULL, srpc2);
+
+	memset(&bundle, 0, sizeof(bundle));
+	bundle.common.type = BUNDLE;
+	bundle.num_items = 2;
+	bundle.length = htons(2*entry_length);
+	skb = mock_skb_new(self->client_ip, &bundle.common, 2*entry_length, 0);
+	p = (char *) skb->data + sizeof(bundle);
+	p[0] = sizeof(grant);
+	memcpy(p + 1, &grant, sizeof(grant));
+	grant.common.sender_id = cpu_to_be64(self->client_id + 2);
+	grant.offset = htonl(15000);
+	p[entry_length] = sizeof(grant);
+	memcpy(p + entry_length + 1, &grant, sizeof(grant));
+
+	homa_softirq(skb);
+	EXPECT_EQ(12000, srpc1->msgout.granted);
+	EXPECT_EQ(15000, srpc2->msgout.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.packets_received[
+			BUNDLE - DATA]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.packets_received[
+			GRANT - DATA]);
+}
+TEST_F(homa_plumbing, homa_softirq__bundle_with_bad_entry)
+{
+	struct grant_header grant = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = GRANT},
+		        .offset = htonl(12000),
+			.priority = 3};
+	int entry_length = 1 + sizeof(grant);
+	struct homa_rpc *srpc;
+	struct bundle_header bundle;
+	struct sk_buff *skb;
+	char *p;
+
+	srpc = unit_server_rpc(&self->hsk, RPC_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 20000);
+	ASSERT_NE(NULL, srpc);
+
+	memset(&bundle, 0, sizeof(bundle));
+	bundle.common.type = BUNDLE;
+	bundle.num_items = 2;
+	bundle.length = htons(2*entry_length);
+	skb = mock_skb_new(self->client_ip, &bundle.common, 2*entry_length, 0);
+	p = (char *) skb->data + sizeof(bundle);
+	p[0] = sizeof(grant);
+	memcpy(p + 1, &grant, sizeof(grant));
+
+	/* Second entry claims to extend past the end of the bundle. */
+	p[entry_length] = sizeof(grant) + 1;
+
+	homa_softirq(skb);
+	EXPECT_EQ(12000, srpc->msgout.granted);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.short_packets);
+}
 TEST_F(homa_plumbing, homa_softirq__multiple_packets_different_sockets)
 {
 	struct sk_buff *skb, *skb2;
@@ -297,4 +297,68 @@ TEST_F(homa_socktab, homa_sock_lock_slow)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.socket_lock_misses);
 	EXPECT_NE(0, homa_cores[cpu_number]->metrics.socket_lock_miss_cycles);
 	homa_sock_unlock(&self->hsk);
-}
\ No newline at end of file
+}
+TEST_F(homa_socktab, homa_sock_ready_lock_slow)
+{
+	mock_cycles = ~0;
+
+	homa_sock_ready_lock(&self->hsk);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.ready_lock_misses);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.ready_lock_miss_cycles);
+	homa_sock_ready_unlock(&self->hsk);
+
+	mock_trylock_errors = 1;
+	homa_sock_ready_lock(&self->hsk);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ready_lock_misses);
+	EXPECT_NE(0, homa_cores[cpu_number]->metrics.ready_lock_miss_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_lock_misses);
+	homa_sock_ready_unlock(&self->hsk);
+}
+TEST_F(homa_socktab, homa_sock_wait_record__buckets)
+{
+	homa_sock_wait_record(&self->hsk, 1, 0, 0);
+	homa_sock_wait_record(&self->hsk, 1, 0, 1000);
+	homa_sock_wait_record(&self->hsk, 1, 0, 5000);
+	homa_sock_wait_record(&self->hsk, 1, 0, 1000000000);
+	EXPECT_EQ(1, self->hsk.wait_hist[0]);
+	EXPECT_EQ(1, self->hsk.wait_hist[1]);
+	EXPECT_EQ(1, self->hsk.wait_hist[3]);
+	EXPECT_EQ(1, self->hsk.wait_hist[HOMA_WAIT_BUCKETS-1]);
+	EXPECT_EQ(4, self->hsk.wait_samples);
+}
+TEST_F(homa_socktab, homa_sock_wait_record__counters)
+{
+	homa_sock_wait_record(&self->hsk, 1, 300, 300);
+	homa_sock_wait_record(&self->hsk, 0, 2000, 9000);
+	homa_sock_wait_record(&self->hsk, 0, 2000, -1);
+	EXPECT_EQ(1, self->hsk.fast_wakeups);
+	EXPECT_EQ(2, self->hsk.slow_wakeups);
+	EXPECT_EQ(4300, self->hsk.total_poll_cycles);
+	EXPECT_EQ(2, self->hsk.wait_samples);
+}
+TEST_F(homa_socktab, homa_sock_wait_record__adapt_after_enough_samples)
+{
+	int i;
+
+	self->homa.poll_usecs = 50;
+	self->homa.poll_percentile = 90;
+	for (i = 0; i < HOMA_WAIT_SAMPLES - 1; i++)
+		homa_sock_wait_record(&self->hsk, 1, 0,
+				(i % 10) == 0 ? 40000 : 3000);
+	EXPECT_EQ(HOMA_WAIT_SAMPLES - 1, self->hsk.wait_samples);
+	homa_sock_wait_record(&self->hsk, 1, 0, 3000);
+	EXPECT_EQ(4000, self->hsk.poll_cycles);
+	EXPECT_EQ(450, self->hsk.wait_hist[2]);
+	EXPECT_EQ(50, self->hsk.wait_hist[6]);
+	EXPECT_EQ(500, self->hsk.wait_samples);
+}
+TEST_F(homa_socktab, homa_sock_wait_adapt__limited_by_poll_usecs)
+{
+	self->homa.poll_usecs = 20;
+	self->homa.poll_percentile = 90;
+	self->hsk.wait_hist[10] = 100;
+	self->hsk.wait_samples = 100;
+	homa_sock_wait_adapt(&self->hsk);
+	EXPECT_EQ(20000, self->hsk.poll_cycles);
+	EXPECT_EQ(50, self->hsk.wait_samples);
+}
@@ -305,6 +305,45 @@ TEST_F(homa_timer, homa_check_timeout__send_resend)
 	EXPECT_EQ(NULL, srpc->peer->least_recent_rpc);
 }
 
+TEST_F(homa_timer, homa_timer_arm__limit_ticks)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+	ASSERT_NE(NULL, crpc);
+	homa_timer_arm(crpc, 0);
+	EXPECT_EQ(1, unit_hlist_length(&self->hsk.timer_wheel[101 & 63]));
+	homa_timer_arm(crpc, 1000);
+	EXPECT_EQ(0, unit_hlist_length(&self->hsk.timer_wheel[101 & 63]));
+	EXPECT_EQ(1, unit_hlist_length(&self->hsk.timer_wheel[163 & 63]));
+}
+
+TEST_F(homa_timer, homa_timer_next_due__advance_to_current_tick)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+	ASSERT_NE(NULL, crpc);
+	self->homa.timer_ticks = 105;
+	EXPECT_EQ(crpc, homa_timer_next_due(&self->hsk));
+	EXPECT_EQ(101, self->hsk.timer_tick);
+	EXPECT_TRUE(hlist_unhashed(&crpc->timer_links));
+	EXPECT_EQ(NULL, homa_timer_next_due(&self->hsk));
+	EXPECT_EQ(105, self->hsk.timer_tick);
+}
+TEST_F(homa_timer, homa_timer_next_due__far_behind)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+	ASSERT_NE(NULL, crpc);
+	self->homa.timer_ticks = 1000;
+	EXPECT_EQ(crpc, homa_timer_next_due(&self->hsk));
+	EXPECT_EQ(997, self->hsk.timer_tick);
+	EXPECT_EQ(NULL, homa_timer_next_due(&self->hsk));
+	EXPECT_EQ(1000, self->hsk.timer_tick);
+}
+
 TEST_F(homa_timer, homa_timer__basics)
 {
 	self->homa.timeout_resends = 2;
@@ -337,6 +376,48 @@ TEST_F(homa_timer, homa_timer__basics)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_timeouts);
 	EXPECT_EQ(RPC_READY, crpc->state);
 }
+TEST_F(homa_timer, homa_timer__rpc_not_due)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 10;
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+
+	/* Not checked again until just before a RESEND is needed. */
+	for (int i = 0; i < 7; i++)
+		homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+	homa_timer(&self->homa);
+	EXPECT_EQ(9, crpc->silent_ticks);
+}
+TEST_F(homa_timer, homa_timer__progress_defers_check)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_INCOMING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 10;
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, crpc->silent_ticks);
+	self->homa.timer_ticks += 4;
+	homa_rpc_reset_silence(crpc);
+	for (int i = 0; i < 3; i++)
+		homa_timer(&self->homa);
+	EXPECT_EQ(0, crpc->silent_ticks);
+
+	/* Next check finds that less silence has elapsed than expected,
+	 * so the RPC is rescheduled for later.
+	 */
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_EQ(4, crpc->silent_ticks);
+	EXPECT_EQ(1, unit_hlist_length(&self->hsk.timer_wheel[
+			(self->homa.timer_ticks + 5) & 63]));
+	EXPECT_STREQ("", unit_log_get());
+}
 TEST_F(homa_timer, homa_timer__reap_dead_rpcs)
 {
 	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
@@ -377,6 +458,7 @@ TEST_F(homa_timer, homa_timer__rpc_in_service)
 	unit_log_clear();
 	homa_timer(&self->homa);
 	EXPECT_EQ(0, srpc->silent_ticks);
+	EXPECT_TRUE(hlist_unhashed(&srpc->timer_links));
 	EXPECT_STREQ("", unit_log_get());
 }
 TEST_F(homa_timer, homa_timer__abort_server_rpc)
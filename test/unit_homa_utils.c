@@ -333,6 +333,7 @@ TEST_F(homa_utils, homa_rpc_free__basics)
 	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, crpc->id));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
+	EXPECT_TRUE(hlist_unhashed(&crpc->timer_links));
 }
 TEST_F(homa_utils, homa_rpc_free__already_dead)
 {
@@ -375,6 +376,35 @@ TEST_F(homa_utils, homa_rpc_free__dead_buffs)
 	EXPECT_EQ(14, self->homa.max_dead_buffs);
 	EXPECT_EQ(14, self->hsk.dead_skbs);
 }
+TEST_F(homa_utils, homa_rpc_free__wake_reaper)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 1000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	self->homa.reap_wake_buffs = 10;
+	unit_log_clear();
+	homa_rpc_free(crpc1);
+	EXPECT_STREQ("homa_remove_from_grantable invoked", unit_log_get());
+	unit_log_clear();
+	homa_rpc_free(crpc2);
+	EXPECT_SUBSTR("queue_work_node", unit_log_get());
+}
+TEST_F(homa_utils, homa_rpc_free__reaper_disabled)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.reap_wake_buffs = 0;
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_STREQ("homa_remove_from_grantable invoked", unit_log_get());
+}
 TEST_F(homa_utils, homa_rpc_free__wakeup_interest)
 {
 	struct homa_interest interest = {};
@@ -528,6 +558,26 @@ TEST_F(homa_utils, homa_rpc_reap__nothing_to_reap)
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
 }
 
+TEST_F(homa_utils, homa_sock_reap_work)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			RPC_READY, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 1000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	EXPECT_EQ(14, self->hsk.dead_skbs);
+	unit_log_clear();
+	homa_sock_reap_work(&self->hsk.reap_work);
+	EXPECT_STREQ("reaped 1234; reaped 1236", unit_log_get());
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.dead_rpcs));
+}
+
 TEST_F(homa_utils, homa_rpc_send_offset__no_msgout)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
@@ -557,14 +607,39 @@ TEST_F(homa_utils, homa_rpc_send_offset__msgout_partly_transmitted)
 	EXPECT_EQ(2800, homa_rpc_send_offset(crpc));
 }
 
+TEST_F(homa_utils, homa_next_client_id__basics)
+{
+	unit_set_next_id(&self->homa, 100);
+	EXPECT_EQ(100, homa_next_client_id(&self->homa));
+	EXPECT_EQ(102, homa_next_client_id(&self->homa));
+	EXPECT_EQ(100 + 2*HOMA_CLIENT_ID_BLOCK,
+			atomic64_read(&self->homa.next_outgoing_id));
+	cpu_number = 2;
+	EXPECT_EQ(100 + 2*HOMA_CLIENT_ID_BLOCK,
+			homa_next_client_id(&self->homa));
+	cpu_number = 1;
+	EXPECT_EQ(104, homa_next_client_id(&self->homa));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.client_id_blocks
+			+ homa_cores[2]->metrics.client_id_blocks);
+}
+TEST_F(homa_utils, homa_next_client_id__block_exhausted)
+{
+	unit_set_next_id(&self->homa, 100);
+	homa_cores[cpu_number]->next_client_id = 200;
+	homa_cores[cpu_number]->client_id_limit = 202;
+	EXPECT_EQ(200, homa_next_client_id(&self->homa));
+	EXPECT_EQ(100, homa_next_client_id(&self->homa));
+	EXPECT_EQ(102, homa_next_client_id(&self->homa));
+}
+
 TEST_F(homa_utils, homa_find_client_rpc)
 {
-	atomic64_set(&self->homa.next_outgoing_id, 3);
+	unit_set_next_id(&self->homa, 3);
 	struct homa_rpc *crpc1 = homa_rpc_new_client(&self->hsk,
 			&self->server_addr, &self->iter);
 	ASSERT_FALSE(IS_ERR(crpc1));
 	homa_rpc_unlock(crpc1);
-	atomic64_set(&self->homa.next_outgoing_id, 3 + 3*HOMA_CLIENT_RPC_BUCKETS);
+	unit_set_next_id(&self->homa, 3 + 3*HOMA_CLIENT_RPC_BUCKETS);
 	self->iovec.iov_base = (void *) 2000;
 	self->iovec.iov_len = 1000;
 	iov_iter_init(&self->iter, WRITE, &self->iovec, 1, self->iovec.iov_len);
@@ -572,7 +647,7 @@ TEST_F(homa_utils, homa_find_client_rpc)
 			&self->server_addr, &self->iter);
 	ASSERT_FALSE(IS_ERR(crpc2));
 	homa_rpc_unlock(crpc2);
-	atomic64_set(&self->homa.next_outgoing_id,
+	unit_set_next_id(&self->homa,
 			3 + 10*HOMA_CLIENT_RPC_BUCKETS);
 	self->iovec.iov_base = (void *) 2000;
 	self->iovec.iov_len = 1000;
@@ -581,7 +656,7 @@ TEST_F(homa_utils, homa_find_client_rpc)
 			&self->server_addr, &self->iter);
 	ASSERT_FALSE(IS_ERR(crpc3));
 	homa_rpc_unlock(crpc3);
-	atomic64_set(&self->homa.next_outgoing_id, 40);
+	unit_set_next_id(&self->homa, 40);
 	self->iovec.iov_base = (void *) 2000;
 	self->iovec.iov_len = 1000;
 	iov_iter_init(&self->iter, WRITE, &self->iovec, 1, self->iovec.iov_len);
@@ -639,6 +714,45 @@ TEST_F(homa_utils, homa_find_server_rpc)
 	EXPECT_EQ(NULL, homa_find_server_rpc(&self->hsk, self->client_ip,
 			self->client_port, 3));
 }
+TEST_F(homa_utils, homa_find_server_rpc__wrong_socket)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, RPC_INCOMING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 10000, 100);
+	ASSERT_NE(NULL, srpc);
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(NULL, homa_find_server_rpc(&hsk2, self->client_ip,
+			self->client_port, srpc->id));
+	EXPECT_EQ(srpc, homa_find_server_rpc(&self->hsk, self->client_ip,
+			self->client_port, srpc->id));
+	homa_rpc_unlock(srpc);
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_utils, homa_server_rpc_bucket__mixes_in_client_and_socket)
+{
+	struct homa_rpc_bucket *bucket;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	bucket = homa_server_rpc_bucket(&self->hsk, self->client_ip, 1235);
+
+	/* Consecutive ids from one client use consecutive buckets. */
+	EXPECT_EQ(((bucket - self->homa.server_rpc_buckets) + 1)
+			& (HOMA_SERVER_RPC_BUCKETS - 1),
+			homa_server_rpc_bucket(&self->hsk, self->client_ip, 1237)
+			- self->homa.server_rpc_buckets);
+
+	/* The same id from a different client or on a different socket
+	 * usually lands elsewhere.
+	 */
+	EXPECT_NE(bucket, homa_server_rpc_bucket(&self->hsk, self->server_ip,
+			1235));
+	EXPECT_NE(bucket, homa_server_rpc_bucket(&hsk2, self->client_ip,
+			1235));
+	homa_sock_destroy(&hsk2);
+}
 
 TEST_F(homa_utils, homa_print_ipv4_addr)
 {
@@ -49,21 +49,28 @@ struct homa_rpc *unit_client_rpc(struct homa_sock *hsk, int state,
 {
 	int bytes_received;
 	sockaddr_in_union server_addr;
-	int saved_id = atomic64_read(&hsk->homa->next_outgoing_id);
+	struct homa_core *core = homa_cores[cpu_number];
+	__u64 saved_next = core->next_client_id;
+	__u64 saved_limit = core->client_id_limit;
 	int incoming_delta = 0;
 
 	server_addr.in6.sin6_family = AF_INET6;
 	server_addr.in6.sin6_addr = *server_ip;
 	server_addr.in6.sin6_port =  htons(server_port);
-	if (id != 0)
-		atomic64_set(&hsk->homa->next_outgoing_id, id);
+	if (id != 0) {
+		/* Make this core's block of ids consist of just @id. */
+		core->next_client_id = id;
+		core->client_id_limit = id + 2;
+	}
 	struct homa_rpc *crpc = homa_rpc_new_client(hsk, &server_addr,
 			unit_iov_iter(NULL, req_length));
+	if (id != 0) {
+		core->next_client_id = saved_next;
+		core->client_id_limit = saved_limit;
+	}
 	if (IS_ERR(crpc))
 		return NULL;
 	homa_rpc_unlock(crpc);
-	if (id != 0)
-		atomic64_set(&hsk->homa->next_outgoing_id, saved_id);
 	EXPECT_EQ(RPC_OUTGOING, crpc->state);
 	if (state == RPC_OUTGOING)
 		return crpc;
@@ -147,6 +154,20 @@ struct in6_addr unit_get_in_addr(char *s)
 	return ret;
 }
 
+/**
+ * unit_hlist_length() - Return the number of entries in an hlist.
+ * @head:   Header for the list.
+ */
+int unit_hlist_length(struct hlist_head *head)
+{
+	struct hlist_node *pos;
+	int count = 0;
+	hlist_for_each(pos, head) {
+		count++;
+	}
+	return count;
+}
+
 /**
  * unit_list_length() - Return the number of entries in a list (not including
  * the list header.
@@ -184,15 +205,19 @@ void unit_log_hashed_rpcs(struct homa_sock *hsk)
 	int i;
 	struct homa_rpc *rpc;
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->client_rpc_buckets[i].rpcs,
+		hlist_for_each_entry_rcu(rpc,
+				&hsk->homa->client_rpc_buckets[i].rpcs,
 				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
+			if (rpc->hsk == hsk)
+				unit_log_printf(" ", "%llu", rpc->id);
 		}
 	}
 	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->server_rpc_buckets[i].rpcs,
+		hlist_for_each_entry_rcu(rpc,
+				&hsk->homa->server_rpc_buckets[i].rpcs,
 				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
+			if (rpc->hsk == hsk)
+				unit_log_printf(" ", "%llu", rpc->id);
 		}
 	}
 }
@@ -422,12 +447,12 @@ struct homa_rpc *unit_server_rpc(struct homa_sock *hsk, int state,
 	srpc->state = RPC_IN_SERVICE;
 	if (srpc->state == state)
 		return srpc;
-	struct sk_buff *skb = homa_fill_packets(
-		hsk, srpc->peer, unit_iov_iter((void *) 2000, resp_length));
+	struct sk_buff *skb = homa_fill_packets(hsk, srpc->peer, srpc->dport,
+		srpc->id, unit_iov_iter((void *) 2000, resp_length));
 	if (IS_ERR(skb)) {
 		goto error;
 	}
-	homa_message_out_init(srpc, hsk->port, skb, resp_length);
+	homa_message_out_init(srpc, skb, resp_length);
 	srpc->state = RPC_OUTGOING;
 	if (srpc->state == state)
 		return srpc;
@@ -438,6 +463,24 @@ struct homa_rpc *unit_server_rpc(struct homa_sock *hsk, int state,
 	return NULL;
 }
 
+/**
+ * unit_set_next_id() - Arrange for the next client RPC created (on any
+ * core) to get a particular id.
+ * @homa:    Overall information about the Homa transport.
+ * @id:      Id for the next client RPC; subsequent RPCs get ids
+ *           following this one.
+ */
+void unit_set_next_id(struct homa *homa, __u64 id)
+{
+	int i;
+
+	atomic64_set(&homa->next_outgoing_id, id);
+	for (i = 0; i < nr_cpu_ids; i++) {
+		homa_cores[i]->next_client_id = 0;
+		homa_cores[i]->client_id_limit = 0;
+	}
+}
+
 /**
  * unit_teardown() - This function should be invoked at the end of every test.
  * It performs various cleanup operations, and it also performs a set of
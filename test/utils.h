@@ -32,6 +32,7 @@ extern struct in6_addr
                      unit_get_in_addr(char *s);
 extern struct iov_iter
                     *unit_iov_iter(void *buffer, size_t length);
+extern int           unit_hlist_length(struct hlist_head *head);
 extern int           unit_list_length(struct list_head *head);
 extern void          unit_log_active_ids(struct homa_sock *hsk);
 extern void          unit_log_filled_skbs(struct sk_buff *skb, int verbose);
@@ -45,6 +46,7 @@ extern struct homa_rpc
                         struct in6_addr *server_ip, struct in6_addr *client_ip,
 			int client_port, int id, int req_length,
 		        int resp_length);
+extern void          unit_set_next_id(struct homa *homa, __u64 id);
 extern void          unit_log_skb_list(struct sk_buff_head *packets,
                         int verbose);
 extern void          unit_log_throttled(struct homa *homa);
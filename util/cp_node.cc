@@ -53,6 +53,7 @@
 
 #include "dist.h"
 #include "homa.h"
+#include "homa_xdp.h"
 #include "test_utils.h"
 #include "time_trace.h"
 
@@ -81,7 +82,9 @@ const char *workload = "100";
 int unloaded = 0;
 bool client_iovec = false;
 bool server_iovec = false;
+int busy_poll_usecs = 0;
 int inet_family = AF_INET;
+std::string xdp_ifname;
 
 /** @rand_gen: random number generator. */
 std::mt19937 rand_gen(
@@ -262,6 +265,9 @@ void print_help(const char *name)
 		"commands are supported, each followed by a list of options supported\n"
 		"by that command:\n\n"
 		"client [options]      Start one or more client threads\n"
+		"    --busy-poll       Set SO_BUSY_POLL to this many microseconds on\n"
+		"                      Homa sockets, so waiting threads poll the NIC\n"
+		"                      (default: 0, meaning no busy polling)\n"
 		"    --client-max      Maximum number of outstanding requests from a single\n"
 		"                      client machine (divided equally among client ports)\n"
 		"                      (default: %d)\n"
@@ -287,7 +293,9 @@ void print_help(const char *name)
 		"                      baseline data, with the given number of measurements\n"
 		"                      per length in the distribution (Homa only, default: 0)\n"
 		"    --workload        Name of distribution for request lengths (e.g., 'w1')\n"
-		"                      or integer for fixed length (default: %s)\n\n"                "debug value value ... Set one or more int64_t values that may be used for\n"
+		"                      or integer for fixed length (default: %s)\n"
+		"    --xdp             Use the user-space Homa endpoint (homa_xdp.c) on\n"
+		"                      this network interface instead of the kernel module\n\n"                "debug value value ... Set one or more int64_t values that may be used for\n"
 		"                      various debugging purposes\n\n"
 		"dump_times file       Log RTT times (and lengths) to file\n\n"
 		"exit                  Exit the application\n\n"
@@ -299,13 +307,17 @@ void print_help(const char *name)
 		"                      means use standard output)\n"
 		"    --level           Log level: either normal or verbose\n\n"
 		"server [options]      Start serving requests on one or more ports\n"
+		"    --busy-poll       Set SO_BUSY_POLL to this many microseconds on\n"
+		"                      Homa sockets (default: 0)\n"
 		"    --first-port      Lowest port number to use (default: %d)\n"
                 "    --iovec           Use homa_replyv instead of homa_reply\n"
                 "    --ipv6            Use IPv6 instead of IPv4\n"
 		"    --protocol        Transport protocol to use: homa or tcp (default: %s)\n"
 		"    --port-threads    Number of server threads to service each port\n"
 		"                      (Homa only, default: %d)\n"
-		"    --ports           Number of ports to listen on (default: %d)\n\n"
+		"    --ports           Number of ports to listen on (default: %d)\n"
+		"    --xdp             Use the user-space Homa endpoint (homa_xdp.c) on\n"
+		"                      this network interface instead of the kernel module\n\n"
 		"stop [options]        Stop existing client and/or server threads; each\n"
 		"                      option must be either 'clients' or 'servers'\n\n"
 		" tt [options]         Manage time tracing:\n"
@@ -434,6 +446,86 @@ void kfreeze()
 	close(fd);
 }
 
+/**
+ * set_busy_poll() - If requested with --busy-poll, enable SO_BUSY_POLL
+ * on a Homa socket, so that threads waiting for messages poll the NIC
+ * directly instead of waiting for interrupts.
+ * @fd:   Homa socket.
+ */
+void set_busy_poll(int fd)
+{
+	if (busy_poll_usecs <= 0)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usecs,
+			sizeof(busy_poll_usecs)) != 0)
+		log(NORMAL, "ERROR: couldn't set SO_BUSY_POLL: %s\n",
+				strerror(errno));
+}
+
+/**
+ * open_homa_socket() - Open a Homa socket: a kernel socket normally, or a
+ * user-space endpoint if --xdp was specified. Exits the program if the
+ * socket can't be opened.
+ * @port:   Homa port to bind to, or 0 for a client socket.
+ *
+ * Return:  File descriptor for the socket.
+ */
+int open_homa_socket(int port)
+{
+	sockaddr_in_union addr_in;
+	int fd;
+
+	if (!xdp_ifname.empty()) {
+		fd = homa_xdp_socket(xdp_ifname.c_str(), 0, port);
+		if (fd < 0) {
+			log(NORMAL, "FATAL: couldn't open XDP Homa endpoint "
+					"on %s: %s\n", xdp_ifname.c_str(),
+					strerror(errno));
+			exit(1);
+		}
+		return fd;
+	}
+
+	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		log(NORMAL, "FATAL: couldn't open Homa socket: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+	set_busy_poll(fd);
+	if (port == 0)
+		return fd;
+	memset(&addr_in, 0, sizeof(addr_in));
+	if (inet_family == AF_INET) {
+		addr_in.in4.sin_family = AF_INET;
+		addr_in.in4.sin_port = htons(port);
+	} else {
+		addr_in.in6.sin6_family = AF_INET6;
+		addr_in.in6.sin6_port = htons(port);
+	}
+	if (bind(fd, &addr_in.sa, sizeof(addr_in)) != 0) {
+		log(NORMAL, "FATAL: couldn't bind socket to Homa port %d: %s\n",
+				port, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/**
+ * close_homa_socket() - Close a socket opened by open_homa_socket; any
+ * threads waiting in homa_recv on the socket will return with an error.
+ * @fd:   File descriptor for the socket.
+ */
+void close_homa_socket(int fd)
+{
+	if (!xdp_ifname.empty()) {
+		homa_xdp_close(fd);
+		return;
+	}
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
+
 /**
  * struct message_header - The first few bytes of each message (request or
  * response) have the structure defined here. The client initially specifies
@@ -946,8 +1038,7 @@ homa_server::homa_server(int fd, int id)
  */
 homa_server::~homa_server()
 {
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
+	close_homa_socket(fd);
 	delete[] buffer;
 	thread.join();
 }
@@ -1776,11 +1867,7 @@ homa_client::homa_client(int id)
         , receiving_threads()
         , sending_thread()
 {
-	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
-	if (fd < 0) {
-		log(NORMAL, "Couldn't open Homa socket: %s\n", strerror(errno));
-		exit(1);
-	}
+	fd = open_homa_socket(0);
 
 	if (unloaded) {
 		measure_unloaded(unloaded);
@@ -1815,8 +1902,7 @@ homa_client::~homa_client()
 		if (to_seconds(rdtsc() - start) > 2.0)
 			break;
 	}
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
+	close_homa_socket(fd);
 	delete[] sender_buffer;
 	if (sending_thread)
 		sending_thread->join();
@@ -2619,6 +2705,7 @@ void log_stats()
  */
 int client_cmd(std::vector<string> &words)
 {
+	busy_poll_usecs = 0;
 	client_iovec = false;
 	client_max = 1;
 	client_ports = 1;
@@ -2632,10 +2719,16 @@ int client_cmd(std::vector<string> &words)
 	tcp_trunc = true;
 	unloaded = 0;
 	workload = "100";
+	xdp_ifname.clear();
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
 
-		if (strcmp(option, "--client-max") == 0) {
+		if (strcmp(option, "--busy-poll") == 0) {
+			if (!parse(words, i+1, &busy_poll_usecs, option,
+					"integer"))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--client-max") == 0) {
 			if (!parse(words, i+1, (int *) &client_max,
 					option, "integer"))
 				return 0;
@@ -2701,6 +2794,14 @@ int client_cmd(std::vector<string> &words)
 			workload_string = words[i+1];
 			workload = workload_string.c_str();
 			i++;
+		} else if (strcmp(option, "--xdp") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			xdp_ifname = words[i+1];
+			i++;
 		} else {
 			printf("Unknown option '%s'\n", option);
 			return 0;
@@ -2920,11 +3021,18 @@ int server_cmd(std::vector<string> &words)
 	port_threads = 1;
 	server_ports = 1;
 	server_iovec = false;
+	busy_poll_usecs = 0;
+	xdp_ifname.clear();
 
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
 
-		if (strcmp(option, "--first-port") == 0) {
+		if (strcmp(option, "--busy-poll") == 0) {
+			if (!parse(words, i+1, &busy_poll_usecs, option,
+					"integer"))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--first-port") == 0) {
 			if (!parse(words, i+1, &first_port, option, "integer"))
 				return 0;
 			i++;
@@ -2949,6 +3057,14 @@ int server_cmd(std::vector<string> &words)
 			protocol_string = words[i+1];
 			protocol = protocol_string.c_str();
 			i++;
+		} else if (strcmp(option, "--xdp") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			xdp_ifname = words[i+1];
+			i++;
 		} else {
 			printf("Unknown option '%s'\n", option);
 			return 0;
@@ -2957,32 +3073,10 @@ int server_cmd(std::vector<string> &words)
 
 	if (strcmp(protocol, "homa") == 0) {
 		for (int i = 0; i < server_ports; i++) {
-			sockaddr_in_union addr_in;
 			int fd, j, port;
 
-			fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
-			if (fd < 0) {
-				log(NORMAL, "FATAL: couldn't open Homa socket: "
-						"%s\n",
-						strerror(errno));
-				exit(1);
-			}
-
 			port = first_port + i;
-			memset(&addr_in, 0, sizeof(addr_in));
-			if (inet_family == AF_INET) {
-				addr_in.in4.sin_family = AF_INET;
-				addr_in.in4.sin_port = htons(port);
-			} else {
-				addr_in.in6.sin6_family = AF_INET6;
-				addr_in.in6.sin6_port = htons(port);
-			}
-			if (bind(fd, &addr_in.sa, sizeof(addr_in)) != 0) {
-				log(NORMAL, "FATAL: couldn't bind socket "
-						"to Homa port %d: %s\n", port,
-						strerror(errno));
-				exit(1);
-			}
+			fd = open_homa_socket(port);
 			log(NORMAL, "Successfully bound to Homa port %d\n",
 					port);
 			for (j = 0; j < port_threads; j++) {
@@ -0,0 +1,3031 @@
+/* Copyright (c) 2019-2022 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file implements a user-space Homa endpoint that sends and receives
+ * packets through an AF_XDP socket, bypassing the kernel's network stack
+ * (and its SoftIRQ wakeup delays). It provides homa_sendp, homa_recvp,
+ * homa_replyp, and homa_abortp; when it is linked with homa_api.c compiled
+ * with -DHOMA_XDP, programs written against homa.h work both on file
+ * descriptors returned by homa_xdp_socket and on ordinary kernel Homa
+ * sockets (calls on the latter are passed to the kernel module).
+ *
+ * Packet formats come from homa_wire.h, and grant, priority, and pacing
+ * decisions come from homa_policy.h, so the endpoint interoperates with
+ * the kernel module and schedules traffic the same way:
+ * - Receivers grant to several messages at once (the best one from each
+ *   peer, in SRPT order), keeping the total of granted-but-not-received
+ *   bytes under max_incoming, and assign grant priorities by rank.
+ * - Senders choose unscheduled priorities from the cutoffs in the
+ *   receiver's CUTOFFS packets, and scheduled priorities from its grants.
+ *   Priorities go in the IPv4 DSCP or IPv6 traffic class field, as in the
+ *   kernel.
+ * - A pacer tracks when the link will go idle and holds back DATA packets
+ *   (shortest remaining message first) while the NIC queue would exceed
+ *   max_nic_queue_ns.
+ * - Acks for completed client RPCs are buffered per peer and piggybacked
+ *   on DATA (in the segment and after the data), GRANT, RESEND, and BUSY
+ *   packets; acks in all of these are accepted on receipt.
+ * - IPv4 and IPv6 are both supported.
+ * Configuration parameters have the kernel module's default values.
+ *
+ * Limitations:
+ * - All endpoints on an interface share one AF_XDP socket bound to one
+ *   receive queue (the XDP program steers all Homa packets on that queue
+ *   to it). Peers must be reachable without a router.
+ * - DATA packets carry a single segment (no GSO), and each incoming packet
+ *   must fit in a UMEM frame: kernel peers must not send GSO packets
+ *   larger than the MTU (see test_xdp_kernel.sh).
+ * - FIFO grants (grant_fifo_fraction) and the pacer's FIFO fraction are
+ *   not implemented.
+ * - All work happens in the calling threads, which busy-poll the rings
+ *   while they wait; a mutex per interface serializes them.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "homa.h"
+#include "homa_wire.h"
+#include "homa_policy.h"
+#include "homa_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Size of each UMEM frame; each frame holds one packet. */
+#define HOMA_XDP_FRAME_SIZE 2048
+
+/* Total number of UMEM frames. The first HOMA_XDP_RING_SIZE are used
+ * for receiving, the rest for transmitting.
+ */
+#define HOMA_XDP_NUM_FRAMES 4096
+
+/* Number of entries in each of the four AF_XDP rings. */
+#define HOMA_XDP_RING_SIZE 2048
+
+/* Maximum number of packets to process in one call to homa_xdp_poll. */
+#define HOMA_XDP_RX_BATCH 64
+
+/* The values below match the kernel module's defaults (see homa_init
+ * and homa_prios_changed).
+ */
+#define HOMA_XDP_RTT_BYTES 10000
+#define HOMA_XDP_MAX_INCOMING (8*HOMA_XDP_RTT_BYTES)
+#define HOMA_XDP_LINK_MBPS 10000
+#define HOMA_XDP_MAX_NIC_QUEUE_NS 2000
+#define HOMA_XDP_THROTTLE_MIN_BYTES 1000
+#define HOMA_XDP_MAX_SCHED_PRIO (HOMA_MAX_PRIORITIES - 5)
+#define HOMA_XDP_CUTOFF_VERSION 1
+#define HOMA_XDP_PEER_ACKS 32
+
+/* Most grants sent in one call to homa_xdp_send_grants (same as the
+ * kernel's MAX_GRANTS).
+ */
+#define HOMA_XDP_MAX_GRANTS 10
+
+/* Minimum time between CUTOFFS packets sent to the same peer. */
+#define HOMA_XDP_CUTOFFS_NS 1000000
+
+/* Interval between invocations of homa_xdp_timer (the kernel's timer
+ * also runs every millisecond).
+ */
+#define HOMA_XDP_TIMER_NS 1000000
+
+/* How long an RPC may go without hearing from its peer before we send
+ * a RESEND (or NEED_ACK) for it, and the minimum time between successive
+ * RESENDs for the same RPC (the kernel's resend_ticks and resend_interval).
+ */
+#define HOMA_XDP_RESEND_NS 15000000
+#define HOMA_XDP_RESEND_INTERVAL_NS 10000000
+
+/* After this many unanswered RESENDs, an RPC is abandoned (the kernel's
+ * timeout_resends).
+ */
+#define HOMA_XDP_TIMEOUT_RESENDS 5
+
+/* How long homa_xdp_close waits for outstanding RPCs to finish. */
+#define HOMA_XDP_CLOSE_NS 1000000000
+
+/* Largest file descriptor that can refer to an endpoint. */
+#define HOMA_XDP_MAX_FDS 1024
+
+/* Priority used for all control packets (as in the kernel). */
+#define HOMA_XDP_CONTROL_PRIO (HOMA_MAX_PRIORITIES - 1)
+
+/* Unscheduled cutoffs that this machine advertises in CUTOFFS packets. */
+static const int homa_xdp_cutoffs[HOMA_MAX_PRIORITIES] = {
+	INT_MAX, 0, 0, 0, HOMA_MAX_MESSAGE_LENGTH, 15000, 2800, 200
+};
+
+/**
+ * struct homa_xdp_ring - User-space view of one of the four AF_XDP
+ * rings (RX, TX, fill, completion) shared with the kernel.
+ */
+struct homa_xdp_ring {
+	/** @producer: Index of the next entry the producer will fill. */
+	__u32 *producer;
+
+	/** @consumer: Index of the next entry the consumer will take. */
+	__u32 *consumer;
+
+	/**
+	 * @descs: The ring entries: struct xdp_desc for RX and TX,
+	 * __u64 frame addresses for fill and completion.
+	 */
+	void *descs;
+
+	/** @mask: Number of entries - 1. */
+	__u32 mask;
+
+	/** @map: Start of the mmapped region holding the ring. */
+	void *map;
+
+	/** @map_size: Number of bytes at @map. */
+	size_t map_size;
+};
+
+/**
+ * struct homa_xdp_peer - Information about a machine that endpoints on
+ * an interface have communicated with.
+ */
+struct homa_xdp_peer {
+	/** @addr: Address of the peer (IPv4 addresses are mapped to IPv6). */
+	struct in6_addr addr;
+
+	/** @mac: Ethernet address to which packets for @addr are sent. */
+	__u8 mac[ETH_ALEN];
+
+	/**
+	 * @unsched_cutoffs: Priority cutoffs for unscheduled packets, from
+	 * the most recent CUTOFFS packet received from this peer.
+	 */
+	int unsched_cutoffs[HOMA_MAX_PRIORITIES];
+
+	/**
+	 * @cutoff_version: Value from the most recent CUTOFFS packet
+	 * received from this peer; echoed in DATA packets.
+	 */
+	__be16 cutoff_version;
+
+	/** @last_cutoffs: Time (ns) when we last sent CUTOFFS to the peer. */
+	__u64 last_cutoffs;
+
+	/**
+	 * @acks: Completed client RPCs whose servers are on this peer and
+	 * haven't yet been told.
+	 */
+	struct homa_ack acks[HOMA_XDP_PEER_ACKS];
+
+	/** @num_acks: Number of valid entries in @acks. */
+	int num_acks;
+
+	/** @next: Next peer in the interface's list. */
+	struct homa_xdp_peer *next;
+};
+
+/**
+ * enum homa_xdp_rpc_state - Possible values of homa_xdp_rpc.state.
+ * @RPC_OUTGOING:   We are sending a message (a request for client RPCs,
+ *                  a response for server RPCs).
+ * @RPC_INCOMING:   We are receiving a message.
+ * @RPC_READY:      The incoming message is complete (or the RPC failed)
+ *                  and is waiting for homa_recv.
+ * @RPC_IN_SERVICE: Server only: the request has been returned by
+ *                  homa_recv and we are waiting for homa_reply.
+ */
+enum homa_xdp_rpc_state {
+	RPC_OUTGOING   = 1,
+	RPC_INCOMING   = 2,
+	RPC_READY      = 3,
+	RPC_IN_SERVICE = 4,
+};
+
+/**
+ * struct homa_xdp_range - A range of message bytes that has been received.
+ */
+struct homa_xdp_range {
+	/** @start: Offset of the first byte in the range. */
+	__u32 start;
+
+	/** @end: Offset just after the last byte in the range. */
+	__u32 end;
+};
+
+/**
+ * struct homa_xdp_rpc - State of one RPC on a user-space endpoint.
+ */
+struct homa_xdp_rpc {
+	/** @id: Identifier for the RPC, as seen on this machine. */
+	__u64 id;
+
+	/** @ep: Endpoint that owns the RPC. */
+	struct homa_xdp_endpoint *ep;
+
+	/** @peer: The other machine involved in the RPC. */
+	struct homa_xdp_peer *peer;
+
+	/** @dport: Port on @peer used by the RPC. */
+	__u16 dport;
+
+	/** @state: One of the values of &enum homa_xdp_rpc_state. */
+	int state;
+
+	/**
+	 * @error: Nonzero means the RPC failed; homa_recv will return this
+	 * errno value.
+	 */
+	int error;
+
+	/** @completion_cookie: Passed to homa_send; returned by homa_recv. */
+	__u64 completion_cookie;
+
+	/** @out: Contents of the outgoing message (malloc-ed). */
+	char *out;
+
+	/** @out_length: Number of bytes at @out. */
+	__u32 out_length;
+
+	/** @out_next: Offset of the next byte of @out to transmit. */
+	__u32 out_next;
+
+	/** @out_granted: The peer has authorized us to send up to here. */
+	__u32 out_granted;
+
+	/** @out_unsched: Bytes of @out sent without waiting for grants. */
+	__u32 out_unsched;
+
+	/** @out_sched_priority: Priority from the most recent GRANT. */
+	int out_sched_priority;
+
+	/** @out_birth: Time (ns) when @out was handed to us (SRPT ties). */
+	__u64 out_birth;
+
+	/**
+	 * @throttled: True means the pacer held back granted data from @out;
+	 * homa_xdp_pacer will send it when the NIC queue drains.
+	 */
+	bool throttled;
+
+	/** @in: Buffer for the incoming message (malloc-ed), or NULL. */
+	char *in;
+
+	/** @in_length: Total length of the incoming message. */
+	__u32 in_length;
+
+	/** @in_bytes: Number of distinct bytes of @in received so far. */
+	__u32 in_bytes;
+
+	/**
+	 * @in_incoming: The sender may transmit up to this offset (the
+	 * unscheduled bytes plus everything we have granted).
+	 */
+	__u32 in_incoming;
+
+	/** @in_grantable: True means the message is competing for grants. */
+	bool in_grantable;
+
+	/** @in_birth: Time (ns) when @in_grantable was set (SRPT ties). */
+	__u64 in_birth;
+
+	/** @ranges: Sorted, nonoverlapping ranges of @in received so far. */
+	struct homa_xdp_range *ranges;
+
+	/** @num_ranges: Number of entries in @ranges. */
+	int num_ranges;
+
+	/** @last_heard: Time (ns) when we last heard from @peer. */
+	__u64 last_heard;
+
+	/** @last_resend: Time (ns) when we last sent a RESEND for the RPC. */
+	__u64 last_resend;
+
+	/** @resends: Number of RESENDs sent since we last heard from @peer. */
+	int resends;
+
+	/** @next: Next RPC in the endpoint's list (oldest first). */
+	struct homa_xdp_rpc *next;
+};
+
+/**
+ * struct homa_xdp_dev - Information shared by all of the endpoints on one
+ * receive queue of an interface: the AF_XDP socket and its rings, the XDP
+ * program, peers, and the state of the link (for the pacer).
+ */
+struct homa_xdp_dev {
+	/** @mutex: Serializes all operations on the device's endpoints. */
+	pthread_mutex_t mutex;
+
+	/** @ifindex: Interface that packets are sent and received on. */
+	unsigned int ifindex;
+
+	/** @queue: Receive queue of @ifindex that the socket is bound to. */
+	int queue;
+
+	/** @fd: The AF_XDP socket. */
+	int fd;
+
+	/** @prog_fd: XDP program that steers Homa packets to @fd. */
+	int prog_fd;
+
+	/** @map_fd: XSKMAP used by the program at @prog_fd. */
+	int map_fd;
+
+	/** @link_fd: Attaches @prog_fd to the interface. */
+	int link_fd;
+
+	/** @umem: Packet buffer area shared with the kernel. */
+	char *umem;
+
+	/** @rx: Ring on which the kernel returns received packets. */
+	struct homa_xdp_ring rx;
+
+	/** @tx: Ring on which we pass packets to the kernel to send. */
+	struct homa_xdp_ring tx;
+
+	/** @fill: Ring on which we pass free frames for receiving. */
+	struct homa_xdp_ring fill;
+
+	/** @comp: Ring on which the kernel returns transmitted frames. */
+	struct homa_xdp_ring comp;
+
+	/** @free_frames: UMEM addresses of frames available for TX. */
+	__u64 free_frames[HOMA_XDP_NUM_FRAMES - HOMA_XDP_RING_SIZE];
+
+	/** @num_free: Number of valid entries in @free_frames. */
+	int num_free;
+
+	/** @mac: Ethernet address of the interface. */
+	__u8 mac[ETH_ALEN];
+
+	/** @addr4: IPv4 address of the interface (if @has_addr4). */
+	__be32 addr4;
+
+	/** @has_addr4: True means @addr4 is valid. */
+	bool has_addr4;
+
+	/** @addr6: IPv6 address of the interface (if @has_addr6). */
+	struct in6_addr addr6;
+
+	/** @has_addr6: True means @addr6 is valid. */
+	bool has_addr6;
+
+	/** @mtu: Largest IP packet we can send (limited by the frame size). */
+	int mtu;
+
+	/** @next_port: Candidate for the next automatically assigned port. */
+	__u16 next_port;
+
+	/** @next_timer: Time (ns) when homa_xdp_timer should next run. */
+	__u64 next_timer;
+
+	/**
+	 * @ns_per_kbyte: Time to transmit 1000 bytes on the link, from
+	 * homa_ticks_per_kbyte.
+	 */
+	__u32 ns_per_kbyte;
+
+	/**
+	 * @link_idle: Time (ns) when the link is expected to finish
+	 * transmitting everything queued so far.
+	 */
+	__u64 link_idle;
+
+	/** @num_throttled: Number of RPCs whose @throttled is set. */
+	int num_throttled;
+
+	/**
+	 * @need_grants: True means something happened (e.g. data arrived)
+	 * that may allow new grants.
+	 */
+	bool need_grants;
+
+	/** @grant_cands: Scratch space for homa_xdp_send_grants. */
+	struct homa_xdp_rpc **grant_cands;
+
+	/** @max_grant_cands: Number of entries allocated at @grant_cands. */
+	int max_grant_cands;
+
+	/** @peers: All known peers. */
+	struct homa_xdp_peer *peers;
+
+	/** @endpoints: All of the endpoints using this device. */
+	struct homa_xdp_endpoint *endpoints;
+
+	/** @next: Next device in homa_xdp_devs. */
+	struct homa_xdp_dev *next;
+};
+
+/**
+ * struct homa_xdp_endpoint - A user-space Homa socket.
+ */
+struct homa_xdp_endpoint {
+	/** @dev: Device through which the endpoint communicates. */
+	struct homa_xdp_dev *dev;
+
+	/**
+	 * @fd: The endpoint's "file descriptor" (an eventfd, used only to
+	 * reserve a unique number).
+	 */
+	int fd;
+
+	/** @port: Homa port number of this endpoint. */
+	__u16 port;
+
+	/** @next_id: Id to use for the next client RPC. */
+	__u64 next_id;
+
+	/** @rpcs: All active RPCs, oldest first. */
+	struct homa_xdp_rpc *rpcs;
+
+	/** @next: Next endpoint on @dev. */
+	struct homa_xdp_endpoint *next;
+};
+
+/* Protects homa_xdp_devs, homa_xdp_endpoints, and the endpoint list of each
+ * device. Must be acquired before any device's mutex.
+ */
+static pthread_mutex_t homa_xdp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* All open devices. */
+static struct homa_xdp_dev *homa_xdp_devs;
+
+/* Maps file descriptors to endpoints. */
+static struct homa_xdp_endpoint *homa_xdp_endpoints[HOMA_XDP_MAX_FDS];
+
+static void homa_xdp_handle(struct homa_xdp_dev *dev,
+		const struct in6_addr *saddr, const __u8 *smac,
+		const char *pkt, size_t length);
+
+/**
+ * homa_xdp_now() - Return the current time in nanoseconds.
+ */
+static __u64 homa_xdp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * homa_xdp_is_client() - Return true if an RPC id (as seen on this
+ * machine) identifies a client RPC.
+ * @id:   The id to check.
+ */
+static inline bool homa_xdp_is_client(__u64 id)
+{
+	return (id & 1) == 0;
+}
+
+/**
+ * homa_xdp_is_v4() - Return true if an address is an IPv4 address (mapped
+ * to IPv6).
+ * @addr:   The address to check.
+ */
+static inline bool homa_xdp_is_v4(const struct in6_addr *addr)
+{
+	return IN6_IS_ADDR_V4MAPPED(addr);
+}
+
+/**
+ * homa_xdp_map_v4() - Convert an IPv4 address to an IPv4-mapped IPv6
+ * address (the form used for all addresses here, as in the kernel).
+ * @v4:     IPv4 address.
+ * @addr:   The mapped address is stored here.
+ */
+static void homa_xdp_map_v4(__be32 v4, struct in6_addr *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &v4, sizeof(v4));
+}
+
+/**
+ * homa_xdp_v4() - Return the IPv4 address in an IPv4-mapped address.
+ * @addr:   Address for which homa_xdp_is_v4 returns true.
+ */
+static __be32 homa_xdp_v4(const struct in6_addr *addr)
+{
+	__be32 v4;
+
+	memcpy(&v4, &addr->s6_addr[12], sizeof(v4));
+	return v4;
+}
+
+/**
+ * homa_xdp_get_addr() - Extract the address and port from a socket
+ * address passed in by an application.
+ * @sa:     Address supplied by the application.
+ * @addr:   The address is stored here (IPv4 addresses are mapped).
+ * @port:   The port is stored here (host byte order).
+ * Return:  0 for success, -1 if the address family isn't supported
+ *          (errno is set).
+ */
+static int homa_xdp_get_addr(const sockaddr_in_union *sa,
+		struct in6_addr *addr, __u16 *port)
+{
+	if (sa->sa.sa_family == AF_INET) {
+		homa_xdp_map_v4(sa->in4.sin_addr.s_addr, addr);
+		*port = ntohs(sa->in4.sin_port);
+		return 0;
+	}
+	if (sa->sa.sa_family == AF_INET6) {
+		*addr = sa->in6.sin6_addr;
+		*port = ntohs(sa->in6.sin6_port);
+		return 0;
+	}
+	errno = EAFNOSUPPORT;
+	return -1;
+}
+
+/**
+ * homa_xdp_set_addr() - Fill in a socket address to return to an
+ * application.
+ * @sa:     The address is stored here: AF_INET for IPv4 addresses and
+ *          AF_INET6 for all others.
+ * @addr:   Address to return.
+ * @port:   Port to return (host byte order).
+ */
+static void homa_xdp_set_addr(sockaddr_in_union *sa,
+		const struct in6_addr *addr, __u16 port)
+{
+	memset(sa, 0, sizeof(*sa));
+	if (homa_xdp_is_v4(addr)) {
+		sa->in4.sin_family = AF_INET;
+		sa->in4.sin_port = htons(port);
+		sa->in4.sin_addr.s_addr = homa_xdp_v4(addr);
+	} else {
+		sa->in6.sin6_family = AF_INET6;
+		sa->in6.sin6_port = htons(port);
+		sa->in6.sin6_addr = *addr;
+	}
+}
+
+/**
+ * homa_xdp_bpf() - Invoke the bpf system call.
+ * @cmd:    Command to invoke.
+ * @attr:   Arguments for the command.
+ * Return:  Result of the system call.
+ */
+static int homa_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define HOMA_XDP_INSN(CODE, DST, SRC, OFF, IMM)                       \
+	((struct bpf_insn) {.code = (CODE), .dst_reg = (DST),         \
+	.src_reg = (SRC), .off = (OFF), .imm = (IMM)})
+
+/* Index in the program built by homa_xdp_load_prog of the instruction
+ * that loads the XSKMAP's fd.
+ */
+#define HOMA_XDP_MAP_INSN 17
+
+/**
+ * homa_xdp_load_prog() - Create an XSKMAP and an XDP program that
+ * redirects Homa packets (IPv4 or IPv6) to the AF_XDP socket in that map
+ * for the packet's receive queue; all other packets go to the kernel stack
+ * as usual (so ARP, neighbor discovery, ping, etc. keep working).
+ * @dev:    Device; @dev->map_fd and @dev->prog_fd are filled in.
+ * Return:  0 for success, otherwise -1 (errno is set).
+ */
+static int homa_xdp_load_prog(struct homa_xdp_dev *dev)
+{
+	union bpf_attr attr;
+	static const char license[] = "Dual BSD/GPL";
+	struct bpf_insn prog[] = {
+		/* 0: r6 = ctx; r2 = data; r3 = data_end. */
+		HOMA_XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0),
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0),
+
+		/* 3: Need the Ethernet header plus an IPv6 header (every
+		 * IPv4 Homa packet is at least this long too).
+		 */
+		HOMA_XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+		HOMA_XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+				ETH_HLEN + HOMA_IPV6_HEADER_LENGTH),
+		HOMA_XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 16, 0),
+
+		/* 6: r5, r4 = bytes of the Ethertype. */
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 12, 0),
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 13, 0),
+
+		/* 8: IPv4: r5 = protocol. */
+		HOMA_XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 3,
+				ETHERTYPE_IP >> 8),
+		HOMA_XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 12,
+				ETHERTYPE_IP & 0xff),
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2,
+				ETH_HLEN + offsetof(struct iphdr, protocol), 0),
+		HOMA_XDP_INSN(BPF_JMP | BPF_JA, 0, 0, 3, 0),
+
+		/* 12: IPv6: r5 = next header. */
+		HOMA_XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 9,
+				ETHERTYPE_IPV6 >> 8),
+		HOMA_XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 8,
+				ETHERTYPE_IPV6 & 0xff),
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2,
+				ETH_HLEN + offsetof(struct ip6_hdr, ip6_nxt),
+				0),
+
+		/* 15: The protocol must be Homa. */
+		HOMA_XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 6,
+				IPPROTO_HOMA),
+
+		/* 16: return bpf_redirect_map(map, ctx->rx_queue_index,
+		 *                             XDP_PASS);
+		 */
+		HOMA_XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+				offsetof(struct xdp_md, rx_queue_index), 0),
+		HOMA_XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1,
+				BPF_PSEUDO_MAP_FD, 0, 0),
+		HOMA_XDP_INSN(0, 0, 0, 0, 0),
+		HOMA_XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+		HOMA_XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+				BPF_FUNC_redirect_map),
+		HOMA_XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		/* 22: Not a Homa packet. */
+		HOMA_XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+		HOMA_XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(__u32);
+	attr.value_size = sizeof(__u32);
+	attr.max_entries = 64;
+	dev->map_fd = homa_xdp_bpf(BPF_MAP_CREATE, &attr);
+	if (dev->map_fd < 0)
+		return -1;
+
+	/* The map fd must be patched in after the map exists. */
+	prog[HOMA_XDP_MAP_INSN].imm = dev->map_fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (__u64) (uintptr_t) prog;
+	attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+	attr.license = (__u64) (uintptr_t) license;
+	dev->prog_fd = homa_xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (dev->prog_fd < 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * homa_xdp_map_ring() - Map one of an AF_XDP socket's rings into our
+ * address space.
+ * @ring:       Ring to initialize.
+ * @fd:         AF_XDP socket.
+ * @off:        Offsets of the ring's fields, from XDP_MMAP_OFFSETS.
+ * @entry_size: Size of each ring entry.
+ * @pgoff:      Identifies the ring to mmap (e.g. XDP_PGOFF_RX_RING).
+ * Return:      0 for success, otherwise -1 (errno is set).
+ */
+static int homa_xdp_map_ring(struct homa_xdp_ring *ring, int fd,
+		struct xdp_ring_offset *off, size_t entry_size, off_t pgoff)
+{
+	ring->map_size = off->desc + HOMA_XDP_RING_SIZE*entry_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return -1;
+	}
+	ring->producer = (__u32 *) ((char *) ring->map + off->producer);
+	ring->consumer = (__u32 *) ((char *) ring->map + off->consumer);
+	ring->descs = (char *) ring->map + off->desc;
+	ring->mask = HOMA_XDP_RING_SIZE - 1;
+	return 0;
+}
+
+/**
+ * homa_xdp_get_ifinfo() - Fill in the Ethernet address, IP addresses,
+ * and MTU for a device.
+ * @dev:     Device to initialize.
+ * @ifname:  Name of the interface the device runs on.
+ * Return:   0 for success, otherwise -1 (errno is set).
+ */
+static int homa_xdp_get_ifinfo(struct homa_xdp_dev *dev, const char *ifname)
+{
+	struct ifaddrs *addrs, *ifa;
+	struct sockaddr_in6 *sin6;
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+		goto error;
+	memcpy(dev->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+		goto error;
+	dev->mtu = ifr.ifr_mtu;
+	if (dev->mtu > HOMA_XDP_FRAME_SIZE - ETH_HLEN)
+		dev->mtu = HOMA_XDP_FRAME_SIZE - ETH_HLEN;
+	close(fd);
+
+	/* Link-local IPv6 addresses are ignored: they would need scope
+	 * ids to be useful.
+	 */
+	if (getifaddrs(&addrs) < 0)
+		return -1;
+	for (ifa = addrs; ifa != NULL; ifa = ifa->ifa_next) {
+		if ((ifa->ifa_addr == NULL)
+				|| (strcmp(ifa->ifa_name, ifname) != 0))
+			continue;
+		if ((ifa->ifa_addr->sa_family == AF_INET) && !dev->has_addr4) {
+			dev->addr4 = ((struct sockaddr_in *)
+					ifa->ifa_addr)->sin_addr.s_addr;
+			dev->has_addr4 = true;
+		} else if ((ifa->ifa_addr->sa_family == AF_INET6)
+				&& !dev->has_addr6) {
+			sin6 = (struct sockaddr_in6 *) ifa->ifa_addr;
+			if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+				continue;
+			dev->addr6 = sin6->sin6_addr;
+			dev->has_addr6 = true;
+		}
+	}
+	freeifaddrs(addrs);
+	if (!dev->has_addr4 && !dev->has_addr6) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+/**
+ * homa_xdp_dev_free() - Release all of the resources of a device
+ * (including the XDP program attached to its interface).
+ * @dev:     Device to free; must not be in homa_xdp_devs.
+ */
+static void homa_xdp_dev_free(struct homa_xdp_dev *dev)
+{
+	struct homa_xdp_peer *peer;
+
+	while (dev->peers) {
+		peer = dev->peers;
+		dev->peers = peer->next;
+		free(peer);
+	}
+	if (dev->link_fd >= 0)
+		close(dev->link_fd);
+	if (dev->prog_fd >= 0)
+		close(dev->prog_fd);
+	if (dev->map_fd >= 0)
+		close(dev->map_fd);
+	if (dev->rx.map)
+		munmap(dev->rx.map, dev->rx.map_size);
+	if (dev->tx.map)
+		munmap(dev->tx.map, dev->tx.map_size);
+	if (dev->fill.map)
+		munmap(dev->fill.map, dev->fill.map_size);
+	if (dev->comp.map)
+		munmap(dev->comp.map, dev->comp.map_size);
+	if (dev->fd >= 0)
+		close(dev->fd);
+	if (dev->umem)
+		munmap(dev->umem, HOMA_XDP_NUM_FRAMES*HOMA_XDP_FRAME_SIZE);
+	free(dev->grant_cands);
+	pthread_mutex_destroy(&dev->mutex);
+	free(dev);
+}
+
+/**
+ * homa_xdp_dev_open() - Create a device: an AF_XDP socket bound to a
+ * receive queue of an interface, plus the XDP program that steers Homa
+ * packets to it.
+ * @ifname:   Network interface on which to send and receive packets.
+ * @queue:    Receive queue of @ifname to take Homa packets from.
+ * Return:    The new device, or NULL if an error occurred (errno is set).
+ */
+static struct homa_xdp_dev *homa_xdp_dev_open(const char *ifname, int queue)
+{
+	struct homa_xdp_dev *dev;
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	union bpf_attr attr;
+	socklen_t optlen;
+	int ring_size = HOMA_XDP_RING_SIZE;
+	__u32 key, value;
+	__u64 *fill;
+	int i, err;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
+	pthread_mutex_init(&dev->mutex, NULL);
+	dev->fd = -1;
+	dev->prog_fd = -1;
+	dev->map_fd = -1;
+	dev->link_fd = -1;
+	dev->queue = queue;
+	dev->ifindex = if_nametoindex(ifname);
+	if (dev->ifindex == 0)
+		goto error;
+	if (homa_xdp_get_ifinfo(dev, ifname) < 0)
+		goto error;
+
+	dev->umem = mmap(NULL, HOMA_XDP_NUM_FRAMES*HOMA_XDP_FRAME_SIZE,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (dev->umem == MAP_FAILED) {
+		dev->umem = NULL;
+		goto error;
+	}
+	dev->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (dev->fd < 0)
+		goto error;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (__u64) (uintptr_t) dev->umem;
+	reg.len = HOMA_XDP_NUM_FRAMES*HOMA_XDP_FRAME_SIZE;
+	reg.chunk_size = HOMA_XDP_FRAME_SIZE;
+	if (setsockopt(dev->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		goto error;
+	if ((setsockopt(dev->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+			sizeof(ring_size)) < 0)
+			|| (setsockopt(dev->fd, SOL_XDP,
+			XDP_UMEM_COMPLETION_RING, &ring_size,
+			sizeof(ring_size)) < 0)
+			|| (setsockopt(dev->fd, SOL_XDP, XDP_RX_RING,
+			&ring_size, sizeof(ring_size)) < 0)
+			|| (setsockopt(dev->fd, SOL_XDP, XDP_TX_RING,
+			&ring_size, sizeof(ring_size)) < 0))
+		goto error;
+	optlen = sizeof(off);
+	if (getsockopt(dev->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off,
+			&optlen) < 0)
+		goto error;
+	if ((homa_xdp_map_ring(&dev->rx, dev->fd, &off.rx,
+			sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0)
+			|| (homa_xdp_map_ring(&dev->tx, dev->fd, &off.tx,
+			sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+			|| (homa_xdp_map_ring(&dev->fill, dev->fd, &off.fr,
+			sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING) < 0)
+			|| (homa_xdp_map_ring(&dev->comp, dev->fd, &off.cr,
+			sizeof(__u64), XDP_UMEM_PGOFF_COMPLETION_RING) < 0))
+		goto error;
+
+	/* Generic (copy) mode works on any device, including veth. */
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = dev->ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_COPY;
+
+	/* The kernel releases the queue of a recently closed AF_XDP socket
+	 * (and its XDP link) asynchronously, so retry briefly if the queue
+	 * is still busy.
+	 */
+	for (i = 0; bind(dev->fd, (struct sockaddr *) &sxdp,
+			sizeof(sxdp)) < 0; i++) {
+		if ((errno != EBUSY) || (i >= 1000))
+			goto error;
+		usleep(1000);
+	}
+
+	/* Give the kernel frames to receive into; keep the rest for TX. */
+	fill = dev->fill.descs;
+	for (i = 0; i < HOMA_XDP_RING_SIZE; i++)
+		fill[i] = (__u64) i*HOMA_XDP_FRAME_SIZE;
+	__atomic_store_n(dev->fill.producer, HOMA_XDP_RING_SIZE,
+			__ATOMIC_RELEASE);
+	for (i = HOMA_XDP_RING_SIZE; i < HOMA_XDP_NUM_FRAMES; i++)
+		dev->free_frames[dev->num_free++] =
+				(__u64) i*HOMA_XDP_FRAME_SIZE;
+
+	if (homa_xdp_load_prog(dev) < 0)
+		goto error;
+	key = queue;
+	value = dev->fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = dev->map_fd;
+	attr.key = (__u64) (uintptr_t) &key;
+	attr.value = (__u64) (uintptr_t) &value;
+	if (homa_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		goto error;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = dev->prog_fd;
+	attr.link_create.target_ifindex = dev->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	for (i = 0; ; i++) {
+		dev->link_fd = homa_xdp_bpf(BPF_LINK_CREATE, &attr);
+		if (dev->link_fd >= 0)
+			break;
+		if ((errno != EBUSY) || (i >= 1000))
+			goto error;
+		usleep(1000);
+	}
+
+	dev->next_port = HOMA_MIN_DEFAULT_PORT + (getpid() & 0x7fff);
+	dev->next_timer = homa_xdp_now() + HOMA_XDP_TIMER_NS;
+	dev->ns_per_kbyte = homa_ticks_per_kbyte(1000000, HOMA_XDP_LINK_MBPS);
+	return dev;
+
+error:
+	err = errno;
+	homa_xdp_dev_free(dev);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * homa_xdp_ep_find() - Find the endpoint on a device with a given port.
+ * @dev:     Device to search.
+ * @port:    Homa port number.
+ * Return:   The endpoint, or NULL if there is none.
+ */
+static struct homa_xdp_endpoint *homa_xdp_ep_find(struct homa_xdp_dev *dev,
+		__u16 port)
+{
+	struct homa_xdp_endpoint *ep;
+
+	for (ep = dev->endpoints; ep != NULL; ep = ep->next) {
+		if (ep->port == port)
+			return ep;
+	}
+	return NULL;
+}
+
+/**
+ * homa_xdp_socket() - Open a user-space Homa endpoint. All endpoints on
+ * the same interface and queue share one AF_XDP socket.
+ * @ifname:   Network interface on which to send and receive packets.
+ *            It must have an IPv4 address or a global IPv6 address.
+ * @queue:    Receive queue of @ifname to take Homa packets from (0 for
+ *            veth and other single-queue devices).
+ * @port:     Homa port for the endpoint (a server port), or 0 to pick
+ *            a client port automatically.
+ * Return:    A file descriptor to pass to homa_send, homa_recv, etc., or
+ *            -1 if an error occurred (errno is set).
+ */
+int homa_xdp_socket(const char *ifname, int queue, int port)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_dev *dev;
+	unsigned int ifindex;
+	bool new_dev = false;
+	int i, err;
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0)
+		return -1;
+	if ((port < 0) || (port >= HOMA_MIN_DEFAULT_PORT)) {
+		errno = EINVAL;
+		return -1;
+	}
+	ep = calloc(1, sizeof(*ep));
+	if (ep == NULL)
+		return -1;
+	ep->fd = eventfd(0, EFD_CLOEXEC);
+	if (ep->fd < 0)
+		goto error;
+	if (ep->fd >= HOMA_XDP_MAX_FDS) {
+		errno = EMFILE;
+		goto error;
+	}
+	ep->next_id = 2;
+
+	pthread_mutex_lock(&homa_xdp_mutex);
+	for (dev = homa_xdp_devs; dev != NULL; dev = dev->next) {
+		if ((dev->ifindex == ifindex) && (dev->queue == queue))
+			break;
+	}
+	if (dev == NULL) {
+		dev = homa_xdp_dev_open(ifname, queue);
+		if (dev == NULL)
+			goto error_unlock;
+		new_dev = true;
+	}
+	pthread_mutex_lock(&dev->mutex);
+	if (port != 0) {
+		if (homa_xdp_ep_find(dev, port) != NULL) {
+			errno = EADDRINUSE;
+			goto error_unlock_dev;
+		}
+	} else {
+		for (i = 0; ; i++) {
+			if (i >= 0x8000) {
+				errno = EADDRNOTAVAIL;
+				goto error_unlock_dev;
+			}
+			port = dev->next_port;
+			dev->next_port = (port == 0xffff)
+					? HOMA_MIN_DEFAULT_PORT : port + 1;
+			if (homa_xdp_ep_find(dev, port) == NULL)
+				break;
+		}
+	}
+	ep->port = port;
+	ep->dev = dev;
+	ep->next = dev->endpoints;
+	dev->endpoints = ep;
+	if (new_dev) {
+		dev->next = homa_xdp_devs;
+		homa_xdp_devs = dev;
+	}
+	homa_xdp_endpoints[ep->fd] = ep;
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_mutex_unlock(&homa_xdp_mutex);
+	return ep->fd;
+
+error_unlock_dev:
+	pthread_mutex_unlock(&dev->mutex);
+	if (new_dev) {
+		err = errno;
+		homa_xdp_dev_free(dev);
+		errno = err;
+	}
+error_unlock:
+	pthread_mutex_unlock(&homa_xdp_mutex);
+error:
+	err = errno;
+	if (ep->fd >= 0)
+		close(ep->fd);
+	free(ep);
+	errno = err;
+	return -1;
+}
+
+/**
+ * homa_xdp_is_endpoint() - Return true if a file descriptor refers to a
+ * user-space endpoint (otherwise it is presumably a kernel Homa socket).
+ * @fd:      File descriptor to check.
+ */
+static bool homa_xdp_is_endpoint(int fd)
+{
+	return (fd >= 0) && (fd < HOMA_XDP_MAX_FDS)
+			&& (__atomic_load_n(&homa_xdp_endpoints[fd],
+			__ATOMIC_ACQUIRE) != NULL);
+}
+
+/**
+ * homa_xdp_get() - Find the endpoint for a file descriptor and lock its
+ * device.
+ * @fd:      File descriptor returned by homa_xdp_socket.
+ * Return:   The endpoint (its device is locked), or NULL if @fd doesn't
+ *           refer to an endpoint (errno is set to EBADF).
+ */
+static struct homa_xdp_endpoint *homa_xdp_get(int fd)
+{
+	struct homa_xdp_endpoint *ep = NULL;
+
+	pthread_mutex_lock(&homa_xdp_mutex);
+	if ((fd >= 0) && (fd < HOMA_XDP_MAX_FDS))
+		ep = homa_xdp_endpoints[fd];
+	if (ep)
+		pthread_mutex_lock(&ep->dev->mutex);
+	pthread_mutex_unlock(&homa_xdp_mutex);
+	if (ep == NULL)
+		errno = EBADF;
+	return ep;
+}
+
+/**
+ * homa_xdp_put() - Unlock the device of an endpoint returned by
+ * homa_xdp_get.
+ * @ep:      Endpoint.
+ */
+static void homa_xdp_put(struct homa_xdp_endpoint *ep)
+{
+	pthread_mutex_unlock(&ep->dev->mutex);
+}
+
+/**
+ * homa_xdp_kick() - Ask the kernel to transmit packets waiting in the TX
+ * ring, and recycle frames whose transmission has completed. In copy
+ * mode each kick only transmits a limited batch, so this must be invoked
+ * repeatedly until the ring is empty.
+ * @dev:     Device (must be locked).
+ */
+static void homa_xdp_kick(struct homa_xdp_dev *dev)
+{
+	__u64 *comp = dev->comp.descs;
+	__u32 cons, prod;
+
+	if (*dev->tx.producer != __atomic_load_n(dev->tx.consumer,
+			__ATOMIC_ACQUIRE))
+		sendto(dev->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	cons = *dev->comp.consumer;
+	prod = __atomic_load_n(dev->comp.producer, __ATOMIC_ACQUIRE);
+	for ( ; cons != prod; cons++)
+		dev->free_frames[dev->num_free++] =
+				comp[cons & dev->comp.mask];
+	__atomic_store_n(dev->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/**
+ * homa_xdp_peer_find() - Find (or create) the peer for an address.
+ * @dev:     Device (must be locked).
+ * @addr:    Address of the desired peer.
+ * Return:   The peer, or NULL if memory couldn't be allocated.
+ */
+static struct homa_xdp_peer *homa_xdp_peer_find(struct homa_xdp_dev *dev,
+		const struct in6_addr *addr)
+{
+	struct homa_xdp_peer *peer;
+
+	for (peer = dev->peers; peer != NULL; peer = peer->next) {
+		if (memcmp(&peer->addr, addr, sizeof(*addr)) == 0)
+			return peer;
+	}
+	peer = calloc(1, sizeof(*peer));
+	if (peer == NULL)
+		return NULL;
+	peer->addr = *addr;
+
+	/* Until the peer sends CUTOFFS, use the same default as the
+	 * kernel's homa_peer_find.
+	 */
+	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-1] = 0;
+	peer->unsched_cutoffs[HOMA_MAX_PRIORITIES-2] = INT_MAX;
+	peer->next = dev->peers;
+	dev->peers = peer;
+	return peer;
+}
+
+/**
+ * homa_xdp_neigh_lookup() - Look up an address in the kernel's neighbor
+ * table (ARP for IPv4, neighbor discovery for IPv6).
+ * @dev:     Device whose interface should be searched.
+ * @addr:    Address to look up.
+ * @mac:     The Ethernet address is stored here.
+ * Return:   True if the address was found.
+ */
+static bool homa_xdp_neigh_lookup(struct homa_xdp_dev *dev,
+		const struct in6_addr *addr, __u8 *mac)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ndmsg ndm;
+	} req;
+	const void *target;
+	size_t target_length;
+	bool found = false, done = false;
+	char buf[8192];
+	struct nlmsghdr *nh;
+	struct ndmsg *ndm;
+	struct rtattr *rta;
+	int fd, len, attr_len;
+	const void *dst, *lladdr;
+
+	if (homa_xdp_is_v4(addr)) {
+		target = &addr->s6_addr[12];
+		target_length = 4;
+	} else {
+		target = addr;
+		target_length = sizeof(*addr);
+	}
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return false;
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETNEIGH;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ndm.ndm_family = (target_length == 4) ? AF_INET : AF_INET6;
+	if (send(fd, &req, sizeof(req), 0) < 0) {
+		close(fd);
+		return false;
+	}
+	while (!done) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len <= 0)
+			break;
+		for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len);
+				nh = NLMSG_NEXT(nh, len)) {
+			if ((nh->nlmsg_type == NLMSG_DONE)
+					|| (nh->nlmsg_type == NLMSG_ERROR)) {
+				done = true;
+				break;
+			}
+			if ((nh->nlmsg_type != RTM_NEWNEIGH) || found)
+				continue;
+			ndm = NLMSG_DATA(nh);
+			if (((unsigned int) ndm->ndm_ifindex != dev->ifindex)
+					|| !(ndm->ndm_state & (NUD_REACHABLE
+					| NUD_STALE | NUD_DELAY | NUD_PROBE
+					| NUD_PERMANENT)))
+				continue;
+			dst = NULL;
+			lladdr = NULL;
+			attr_len = NLMSG_PAYLOAD(nh, sizeof(*ndm));
+			for (rta = (struct rtattr *) ((char *) ndm
+					+ NLMSG_ALIGN(sizeof(*ndm)));
+					RTA_OK(rta, attr_len);
+					rta = RTA_NEXT(rta, attr_len)) {
+				if ((rta->rta_type == NDA_DST)
+						&& (RTA_PAYLOAD(rta)
+						== target_length))
+					dst = RTA_DATA(rta);
+				else if ((rta->rta_type == NDA_LLADDR)
+						&& (RTA_PAYLOAD(rta)
+						== ETH_ALEN))
+					lladdr = RTA_DATA(rta);
+			}
+			if (dst && lladdr && (memcmp(dst, target,
+					target_length) == 0)) {
+				memcpy(mac, lladdr, ETH_ALEN);
+				found = true;
+			}
+		}
+	}
+	close(fd);
+	return found;
+}
+
+/**
+ * homa_xdp_peer_resolve() - Make sure we know the Ethernet address of a
+ * peer. Since ARP and neighbor discovery packets still go to the kernel,
+ * we can get the kernel to resolve the address by sending a UDP packet
+ * to the peer.
+ * @dev:     Device through which the peer is reached.
+ * @peer:    Peer to resolve.
+ * Return:   0 for success, otherwise -1 (errno is set).
+ */
+static int homa_xdp_peer_resolve(struct homa_xdp_dev *dev,
+		struct homa_xdp_peer *peer)
+{
+	static const __u8 zero[ETH_ALEN];
+	sockaddr_in_union sa;
+	int fd, i;
+
+	if (memcmp(peer->mac, zero, ETH_ALEN) != 0)
+		return 0;
+	homa_xdp_set_addr(&sa, &peer->addr, 9);
+	for (i = 0; i < 1000; i++) {
+		if (homa_xdp_neigh_lookup(dev, &peer->addr, peer->mac))
+			return 0;
+		if ((i % 100) == 0) {
+			fd = socket(sa.sa.sa_family, SOCK_DGRAM, 0);
+			if (fd >= 0) {
+				sendto(fd, "", 0, 0, &sa.sa, sizeof(sa));
+				close(fd);
+			}
+		}
+		usleep(1000);
+	}
+	errno = EHOSTUNREACH;
+	return -1;
+}
+
+/**
+ * homa_xdp_ip_checksum() - Compute the checksum for an IPv4 header.
+ * @iph:     Header whose checksum is needed (check field must be 0).
+ * Return:   The checksum.
+ */
+static __u16 homa_xdp_ip_checksum(const struct iphdr *iph)
+{
+	const __u16 *p = (const __u16 *) iph;
+	__u32 sum = 0;
+	int i;
+
+	for (i = 0; i < iph->ihl*2; i++)
+		sum += p[i];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/**
+ * homa_xdp_ip_header_length() - Return the length of the IP header in
+ * packets sent to a peer.
+ * @peer:    Destination.
+ */
+static inline int homa_xdp_ip_header_length(struct homa_xdp_peer *peer)
+{
+	return homa_xdp_is_v4(&peer->addr) ? HOMA_IPV4_HEADER_LENGTH
+			: HOMA_IPV6_HEADER_LENGTH;
+}
+
+/**
+ * homa_xdp_max_seg() - Return the most message bytes that fit in one
+ * DATA packet sent to a peer.
+ * @dev:     Device the packet will be sent on.
+ * @peer:    Destination.
+ */
+static inline __u32 homa_xdp_max_seg(struct homa_xdp_dev *dev,
+		struct homa_xdp_peer *peer)
+{
+	return dev->mtu - homa_xdp_ip_header_length(peer)
+			- sizeof(struct data_header);
+}
+
+/**
+ * homa_xdp_xmit() - Transmit a Homa packet.
+ * @dev:      Device (must be locked).
+ * @peer:     Destination machine.
+ * @sport:    Source port.
+ * @dport:    Destination port.
+ * @id:       Local id of the RPC the packet belongs to.
+ * @type:     Packet type (DATA, GRANT, etc.).
+ * @header:   Homa header for the packet; the common header will be
+ *            filled in here.
+ * @length:   Number of bytes at @header.
+ * @data:     Data to append after the header (may be NULL).
+ * @data_length: Number of bytes at @data.
+ * @trailer:  Additional bytes to append after @data (may be NULL).
+ * @trailer_length: Number of bytes at @trailer.
+ * @priority: Priority level for the packet.
+ * Return:    0 for success, otherwise -1 (errno is set).
+ */
+static int homa_xdp_xmit(struct homa_xdp_dev *dev, struct homa_xdp_peer *peer,
+		__u16 sport, __u16 dport, __u64 id, int type, void *header,
+		size_t length, const void *data, size_t data_length,
+		const void *trailer, size_t trailer_length, int priority)
+{
+	struct common_header *common = header;
+	size_t ip_length, total;
+	struct ether_header *eth;
+	struct xdp_desc *desc;
+	struct ip6_hdr *ip6;
+	struct iphdr *iph;
+	char *frame, *p;
+	__u32 prod;
+	__u64 addr;
+
+	common->sport = htons(sport);
+	common->dport = htons(dport);
+	common->type = type;
+	common->sender_id = htobe64(id);
+	ip_length = homa_xdp_ip_header_length(peer);
+	total = ETH_HLEN + ip_length + length + data_length + trailer_length;
+	if (total > HOMA_XDP_FRAME_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* Wait for a free frame and a free TX slot. */
+	prod = *dev->tx.producer;
+	while ((dev->num_free == 0) || ((prod - __atomic_load_n(
+			dev->tx.consumer, __ATOMIC_ACQUIRE))
+			>= HOMA_XDP_RING_SIZE))
+		homa_xdp_kick(dev);
+	addr = dev->free_frames[--dev->num_free];
+	frame = dev->umem + addr;
+
+	eth = (struct ether_header *) frame;
+	memcpy(eth->ether_dhost, peer->mac, ETH_ALEN);
+	memcpy(eth->ether_shost, dev->mac, ETH_ALEN);
+	if (homa_xdp_is_v4(&peer->addr)) {
+		eth->ether_type = htons(ETHERTYPE_IP);
+		iph = (struct iphdr *) (frame + ETH_HLEN);
+		memset(iph, 0, sizeof(*iph));
+		iph->version = 4;
+		iph->ihl = sizeof(*iph)/4;
+		iph->tos = priority << 5;
+		iph->tot_len = htons(total - ETH_HLEN);
+		iph->ttl = 64;
+		iph->protocol = IPPROTO_HOMA;
+		iph->saddr = dev->addr4;
+		iph->daddr = homa_xdp_v4(&peer->addr);
+		iph->check = homa_xdp_ip_checksum(iph);
+	} else {
+		eth->ether_type = htons(ETHERTYPE_IPV6);
+		ip6 = (struct ip6_hdr *) (frame + ETH_HLEN);
+		memset(ip6, 0, sizeof(*ip6));
+		ip6->ip6_flow = htonl((6 << 28) | ((priority << 4) << 20));
+		ip6->ip6_plen = htons(total - ETH_HLEN - ip_length);
+		ip6->ip6_nxt = IPPROTO_HOMA;
+		ip6->ip6_hlim = 64;
+		ip6->ip6_src = dev->addr6;
+		ip6->ip6_dst = peer->addr;
+	}
+	p = frame + ETH_HLEN + ip_length;
+	memcpy(p, header, length);
+	p += length;
+	if (data_length) {
+		memcpy(p, data, data_length);
+		p += data_length;
+	}
+	if (trailer_length)
+		memcpy(p, trailer, trailer_length);
+
+	desc = (struct xdp_desc *) dev->tx.descs + (prod & dev->tx.mask);
+	desc->addr = addr;
+	desc->len = total;
+	desc->options = 0;
+	__atomic_store_n(dev->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * homa_xdp_peer_get_acks() - Remove acks from a peer's list of acks
+ * waiting to be sent.
+ * @peer:    Peer whose acks should be taken.
+ * @count:   Maximum number of acks to take.
+ * @dst:     The acks are copied here.
+ * Return:   The number of acks copied to @dst (<= @count).
+ */
+static int homa_xdp_peer_get_acks(struct homa_xdp_peer *peer, int count,
+		struct homa_ack *dst)
+{
+	if (count > peer->num_acks)
+		count = peer->num_acks;
+	memcpy(dst, &peer->acks[peer->num_acks - count],
+			count*sizeof(peer->acks[0]));
+	peer->num_acks -= count;
+	return count;
+}
+
+/**
+ * homa_xdp_send_ack_batch() - Send an ACK packet containing as many of a
+ * peer's waiting acks as will fit.
+ * @dev:     Device (must be locked).
+ * @peer:    Destination for the ACK.
+ * @sport:   Source port for the packet.
+ * @dport:   Destination port for the packet.
+ * @id:      Id for the common header; the server will free the RPC it
+ *           identifies, if any, in addition to those in the acks.
+ */
+static void homa_xdp_send_ack_batch(struct homa_xdp_dev *dev,
+		struct homa_xdp_peer *peer, __u16 sport, __u16 dport, __u64 id)
+{
+	struct homa_ack acks[HOMA_MAX_ACK_BATCH];
+	struct ack_batch batch;
+	int count, in_header;
+
+	memset(&batch, 0, sizeof(batch));
+	count = homa_xdp_peer_get_acks(peer, HOMA_MAX_ACK_BATCH, acks);
+	batch.header.num_acks = htons(count);
+	in_header = (count < NUM_PEER_UNACKED_IDS) ? count
+			: NUM_PEER_UNACKED_IDS;
+	memcpy(batch.header.acks, acks, in_header*sizeof(acks[0]));
+	memcpy(batch.extra, &acks[in_header],
+			(count - in_header)*sizeof(acks[0]));
+	homa_xdp_xmit(dev, peer, sport, dport, id, ACK, &batch,
+			sizeof(batch.header)
+			+ (count - in_header)*sizeof(acks[0]),
+			NULL, 0, NULL, 0, HOMA_XDP_CONTROL_PRIO);
+}
+
+/**
+ * homa_xdp_peer_add_ack() - Record that a client RPC has completed, so its
+ * server can free its state. The ack is piggybacked on a later packet to
+ * the server; if the peer's list is full, a batch of acks is sent in an
+ * ACK packet right away (as in the kernel's homa_peer_add_ack).
+ * @dev:     Device (must be locked).
+ * @rpc:     Client RPC that has completed.
+ */
+static void homa_xdp_peer_add_ack(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc)
+{
+	struct homa_xdp_peer *peer = rpc->peer;
+	struct homa_ack *ack;
+
+	if (peer->num_acks < HOMA_XDP_PEER_ACKS) {
+		ack = &peer->acks[peer->num_acks++];
+		ack->client_id = htobe64(rpc->id);
+		ack->client_port = htons(rpc->ep->port);
+		ack->server_port = htons(rpc->dport);
+		return;
+	}
+	homa_xdp_send_ack_batch(dev, peer, rpc->ep->port, rpc->dport, rpc->id);
+}
+
+/**
+ * homa_xdp_pkt_ack() - Return the ack field of a GRANT, RESEND, or BUSY
+ * packet. This field is optional on receipt (packets from earlier
+ * versions of Homa don't have it).
+ * @pkt:     The packet.
+ * @length:  Number of bytes at @pkt.
+ * Return:   The ack, or NULL if the packet doesn't have one.
+ */
+static struct homa_ack *homa_xdp_pkt_ack(void *pkt, size_t length)
+{
+	struct common_header *common = pkt;
+	size_t offset;
+
+	switch (common->type) {
+	case GRANT:
+		offset = offsetof(struct grant_header, ack);
+		break;
+	case RESEND:
+		offset = offsetof(struct resend_header, ack);
+		break;
+	case BUSY:
+		offset = offsetof(struct busy_header, ack);
+		break;
+	default:
+		return NULL;
+	}
+	if (length < offset + sizeof(struct homa_ack))
+		return NULL;
+	return (struct homa_ack *) ((char *) pkt + offset);
+}
+
+/**
+ * homa_xdp_xmit_control() - Transmit a control packet for an RPC,
+ * piggybacking an ack for the peer if the packet has room for one.
+ * @dev:      Device (must be locked).
+ * @rpc:      RPC the packet refers to.
+ * @type:     Packet type.
+ * @header:   Homa header for the packet.
+ * @length:   Number of bytes at @header.
+ */
+static void homa_xdp_xmit_control(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc, int type, void *header, size_t length)
+{
+	struct homa_ack *ack;
+
+	((struct common_header *) header)->type = type;
+	ack = homa_xdp_pkt_ack(header, length);
+	if (ack)
+		homa_xdp_peer_get_acks(rpc->peer, 1, ack);
+	homa_xdp_xmit(dev, rpc->peer, rpc->ep->port, rpc->dport, rpc->id,
+			type, header, length, NULL, 0, NULL, 0,
+			HOMA_XDP_CONTROL_PRIO);
+}
+
+/**
+ * homa_xdp_xmit_data() - Transmit one DATA packet for an RPC's outgoing
+ * message, piggybacking as many of the peer's acks as will fit.
+ * @dev:        Device (must be locked).
+ * @rpc:        RPC whose data should be sent.
+ * @offset:     Offset of the first byte to send; the packet contains as
+ *              much data as fits, up to the end of the message.
+ * @retransmit: True means this data was already sent once.
+ * @priority:   Priority level for the packet.
+ * Return:      Number of message bytes in the packet, or -1 for errors.
+ */
+static int homa_xdp_xmit_data(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc, __u32 offset, bool retransmit,
+		int priority)
+{
+	struct homa_ack acks[HOMA_MAX_ACK_BATCH];
+	__u32 max_seg = homa_xdp_max_seg(dev, rpc->peer);
+	struct data_header h;
+	__u32 length, incoming;
+	int room, count = 0;
+
+	length = rpc->out_length - offset;
+	if (length > max_seg)
+		length = max_seg;
+	incoming = (rpc->out_granted < rpc->out_length) ? rpc->out_granted
+			: rpc->out_length;
+	memset(&h, 0, sizeof(h));
+	h.common.doff = (sizeof(struct data_header)
+			- sizeof(struct data_segment)) << 2;
+	h.message_length = htonl(rpc->out_length);
+	h.incoming = htonl(incoming);
+	h.cutoff_version = rpc->peer->cutoff_version;
+	h.retransmit = retransmit;
+	h.seg.offset = htonl(offset);
+	h.seg.segment_length = htonl(length);
+	if (homa_xdp_peer_get_acks(rpc->peer, 1, &h.seg.ack) == 1) {
+		room = (max_seg - length)/sizeof(struct homa_ack);
+		if (room > HOMA_MAX_ACK_BATCH)
+			room = HOMA_MAX_ACK_BATCH;
+		count = homa_xdp_peer_get_acks(rpc->peer, room, acks);
+		h.extra_acks = count;
+	}
+	if (homa_xdp_xmit(dev, rpc->peer, rpc->ep->port, rpc->dport, rpc->id,
+			DATA, &h, sizeof(h), rpc->out + offset, length, acks,
+			count*sizeof(acks[0]), priority) < 0)
+		return -1;
+	return length;
+}
+
+/**
+ * homa_xdp_check_nic_queue() - Decide whether a DATA packet may be handed
+ * to the NIC now, and if so, account for its transmission time (the
+ * equivalent of the kernel's homa_check_nic_queue).
+ * @dev:     Device (must be locked).
+ * @bytes:   Length of the packet, starting at the Homa header.
+ * @force:   True means the packet will be sent regardless of the queue
+ *           length.
+ * Return:   True means the packet may be sent.
+ */
+static bool homa_xdp_check_nic_queue(struct homa_xdp_dev *dev, int bytes,
+		bool force)
+{
+	__u64 now = homa_xdp_now();
+
+	if (homa_nic_queue_full(now, dev->link_idle,
+			HOMA_XDP_MAX_NIC_QUEUE_NS) && !force)
+		return false;
+	dev->link_idle = homa_link_idle_after(now, dev->link_idle,
+			homa_link_ticks(homa_wire_bytes(bytes, 1),
+			dev->ns_per_kbyte));
+	return true;
+}
+
+/**
+ * homa_xdp_set_throttled() - Change whether an RPC is waiting for the
+ * pacer.
+ * @dev:        Device (must be locked).
+ * @rpc:        RPC whose state should change.
+ * @throttled:  New value for @rpc->throttled.
+ */
+static void homa_xdp_set_throttled(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc, bool throttled)
+{
+	if (rpc->throttled == throttled)
+		return;
+	rpc->throttled = throttled;
+	dev->num_throttled += throttled ? 1 : -1;
+}
+
+/**
+ * homa_xdp_xmit_rpc() - Transmit as much of an RPC's outgoing message as
+ * has been granted but not yet sent, unless the pacer says the NIC queue
+ * is too long (in which case the RPC is left for homa_xdp_pacer). As in
+ * the kernel, short messages bypass the pacer.
+ * @dev:     Device (must be locked).
+ * @rpc:     RPC whose message should be sent.
+ * @force:   True means send at least one packet even if the NIC queue is
+ *           too long.
+ */
+static void homa_xdp_xmit_rpc(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc, bool force)
+{
+	__u32 limit = rpc->out_granted;
+	__u32 max_seg = homa_xdp_max_seg(dev, rpc->peer);
+	__u32 length;
+	int priority, sent;
+
+	if (limit > rpc->out_length)
+		limit = rpc->out_length;
+	homa_xdp_set_throttled(dev, rpc, false);
+	while (rpc->out_next < limit) {
+		length = rpc->out_length - rpc->out_next;
+		if (length > max_seg)
+			length = max_seg;
+		if (((rpc->out_length - rpc->out_next)
+				>= HOMA_XDP_THROTTLE_MIN_BYTES)
+				&& !homa_xdp_check_nic_queue(dev,
+				sizeof(struct data_header) + length, force)) {
+			homa_xdp_set_throttled(dev, rpc, true);
+			return;
+		}
+		if (rpc->out_next < rpc->out_unsched)
+			priority = homa_cutoff_priority(
+					rpc->peer->unsched_cutoffs,
+					HOMA_MAX_PRIORITIES, rpc->out_length);
+		else
+			priority = rpc->out_sched_priority;
+		sent = homa_xdp_xmit_data(dev, rpc, rpc->out_next, false,
+				priority);
+		if (sent < 0)
+			return;
+		rpc->out_next += sent;
+		force = false;
+	}
+}
+
+/**
+ * homa_xdp_pacer() - Transmit packets from throttled RPCs (fewest bytes
+ * remaining first) until the NIC queue is full again.
+ * @dev:     Device (must be locked).
+ */
+static void homa_xdp_pacer(struct homa_xdp_dev *dev)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_rpc *rpc, *best;
+
+	while (dev->num_throttled > 0) {
+		best = NULL;
+		for (ep = dev->endpoints; ep != NULL; ep = ep->next) {
+			for (rpc = ep->rpcs; rpc != NULL; rpc = rpc->next) {
+				if (!rpc->throttled)
+					continue;
+				if ((best == NULL) || homa_srpt_precedes(
+						rpc->out_length - rpc->out_next,
+						rpc->out_birth,
+						best->out_length
+						- best->out_next,
+						best->out_birth))
+					best = rpc;
+			}
+		}
+		if (best == NULL)
+			break;
+		homa_xdp_xmit_rpc(dev, best, false);
+		if (best->throttled)
+			break;
+	}
+}
+
+/**
+ * homa_xdp_rpc_find() - Find an existing RPC.
+ * @ep:      Endpoint (its device must be locked).
+ * @id:      Id of the RPC (as seen on this machine).
+ * @addr:    Address of the peer.
+ * @dport:   Port on the peer.
+ * Return:   The RPC, or NULL if there is no such RPC.
+ */
+static struct homa_xdp_rpc *homa_xdp_rpc_find(struct homa_xdp_endpoint *ep,
+		__u64 id, const struct in6_addr *addr, __u16 dport)
+{
+	struct homa_xdp_rpc *rpc;
+
+	for (rpc = ep->rpcs; rpc != NULL; rpc = rpc->next) {
+		if ((rpc->id == id) && (homa_xdp_is_client(id)
+				|| ((memcmp(&rpc->peer->addr, addr,
+				sizeof(*addr)) == 0)
+				&& (rpc->dport == dport))))
+			return rpc;
+	}
+	return NULL;
+}
+
+/**
+ * homa_xdp_rpc_new() - Create a new RPC and add it to an endpoint.
+ * @ep:      Endpoint (its device must be locked).
+ * @id:      Id for the RPC (as seen on this machine).
+ * @peer:    Other machine involved in the RPC.
+ * @dport:   Port on @peer.
+ * Return:   The new RPC, or NULL if memory couldn't be allocated.
+ */
+static struct homa_xdp_rpc *homa_xdp_rpc_new(struct homa_xdp_endpoint *ep,
+		__u64 id, struct homa_xdp_peer *peer, __u16 dport)
+{
+	struct homa_xdp_rpc *rpc, **tail;
+
+	rpc = calloc(1, sizeof(*rpc));
+	if (rpc == NULL)
+		return NULL;
+	rpc->id = id;
+	rpc->ep = ep;
+	rpc->peer = peer;
+	rpc->dport = dport;
+	rpc->last_heard = homa_xdp_now();
+	for (tail = &ep->rpcs; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = rpc;
+	return rpc;
+}
+
+/**
+ * homa_xdp_rpc_free() - Remove an RPC from its endpoint and free it.
+ * @dev:     Device (must be locked).
+ * @rpc:     RPC to free.
+ */
+static void homa_xdp_rpc_free(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc)
+{
+	struct homa_xdp_rpc **p;
+
+	for (p = &rpc->ep->rpcs; *p != NULL; p = &(*p)->next) {
+		if (*p == rpc) {
+			*p = rpc->next;
+			break;
+		}
+	}
+	homa_xdp_set_throttled(dev, rpc, false);
+
+	/* Any bytes granted to this RPC can now go to others. */
+	if (rpc->in && (rpc->in_incoming > rpc->in_bytes))
+		dev->need_grants = true;
+	free(rpc->out);
+	free(rpc->in);
+	free(rpc->ranges);
+	free(rpc);
+}
+
+/**
+ * homa_xdp_rpc_reset_in() - Discard any partially received incoming
+ * message for an RPC.
+ * @dev:     Device (must be locked).
+ * @rpc:     RPC to reset.
+ */
+static void homa_xdp_rpc_reset_in(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc)
+{
+	if (rpc->in && (rpc->in_incoming > rpc->in_bytes))
+		dev->need_grants = true;
+	free(rpc->in);
+	free(rpc->ranges);
+	rpc->in = NULL;
+	rpc->ranges = NULL;
+	rpc->num_ranges = 0;
+	rpc->in_length = 0;
+	rpc->in_bytes = 0;
+	rpc->in_incoming = 0;
+	rpc->in_grantable = false;
+}
+
+/**
+ * homa_xdp_msg_out_init() - Prepare an RPC to send a message.
+ * @dev:      Device (must be locked).
+ * @rpc:      RPC that will send the message.
+ * @buf:      Contents of the message (malloc-ed; the RPC takes ownership).
+ * @length:   Number of bytes at @buf.
+ */
+static void homa_xdp_msg_out_init(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc, char *buf, __u32 length)
+{
+	rpc->out = buf;
+	rpc->out_length = length;
+	rpc->out_next = 0;
+	rpc->out_unsched = homa_unsched_bytes(HOMA_XDP_RTT_BYTES,
+			homa_xdp_max_seg(dev, rpc->peer), length);
+	rpc->out_granted = rpc->out_unsched;
+	rpc->out_sched_priority = 0;
+	rpc->out_birth = homa_xdp_now();
+}
+
+/**
+ * homa_xdp_add_range() - Record that a range of an RPC's incoming message
+ * has been received.
+ * @rpc:     RPC that received the data.
+ * @start:   Offset of the first byte received.
+ * @end:     Offset just after the last byte received.
+ * Return:   Number of bytes in the range that hadn't been received before.
+ */
+static __u32 homa_xdp_add_range(struct homa_xdp_rpc *rpc, __u32 start,
+		__u32 end)
+{
+	struct homa_xdp_range *ranges;
+	__u32 new_bytes = end - start;
+	int i, j;
+
+	if (start >= end)
+		return 0;
+	for (i = 0; i < rpc->num_ranges; i++) {
+		struct homa_xdp_range *r = &rpc->ranges[i];
+		__u32 lo = (r->start > start) ? r->start : start;
+		__u32 hi = (r->end < end) ? r->end : end;
+
+		if (lo < hi)
+			new_bytes -= hi - lo;
+	}
+	if (new_bytes == 0)
+		return 0;
+
+	/* Insert the new range in order, then merge neighbors. */
+	ranges = realloc(rpc->ranges,
+			(rpc->num_ranges + 1)*sizeof(*ranges));
+	if (ranges == NULL)
+		return 0;
+	rpc->ranges = ranges;
+	for (i = rpc->num_ranges; (i > 0) && (ranges[i-1].start > start); i--)
+		ranges[i] = ranges[i-1];
+	ranges[i].start = start;
+	ranges[i].end = end;
+	rpc->num_ranges++;
+	for (i = 0, j = 1; j < rpc->num_ranges; j++) {
+		if (ranges[j].start <= ranges[i].end) {
+			if (ranges[j].end > ranges[i].end)
+				ranges[i].end = ranges[j].end;
+		} else {
+			ranges[++i] = ranges[j];
+		}
+	}
+	rpc->num_ranges = i + 1;
+	return new_bytes;
+}
+
+/**
+ * homa_xdp_rpc_acked() - Free a server RPC that its client has
+ * acknowledged.
+ * @dev:     Device (must be locked).
+ * @saddr:   Address of the client.
+ * @ack:     Identifies the RPC (may be unaligned).
+ */
+static void homa_xdp_rpc_acked(struct homa_xdp_dev *dev,
+		const struct in6_addr *saddr, const struct homa_ack *ack)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_rpc *rpc;
+	struct homa_ack a;
+
+	memcpy(&a, ack, sizeof(a));
+	if (a.client_id == 0)
+		return;
+	ep = homa_xdp_ep_find(dev, ntohs(a.server_port));
+	if (ep == NULL)
+		return;
+	rpc = homa_xdp_rpc_find(ep, be64toh(a.client_id) ^ 1, saddr,
+			ntohs(a.client_port));
+	if (rpc && !homa_xdp_is_client(rpc->id))
+		homa_xdp_rpc_free(dev, rpc);
+}
+
+/**
+ * homa_xdp_send_cutoffs() - Send our unscheduled priority cutoffs to the
+ * peer of an RPC.
+ * @dev:     Device (must be locked).
+ * @rpc:     RPC whose peer has out-of-date cutoffs.
+ */
+static void homa_xdp_send_cutoffs(struct homa_xdp_dev *dev,
+		struct homa_xdp_rpc *rpc)
+{
+	struct cutoffs_header h;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
+		h.unsched_cutoffs[i] = htonl(homa_xdp_cutoffs[i]);
+	h.cutoff_version = htons(HOMA_XDP_CUTOFF_VERSION);
+	homa_xdp_xmit_control(dev, rpc, CUTOFFS, &h, sizeof(h));
+}
+
+/**
+ * homa_xdp_data_pkt() - Handle an incoming DATA packet.
+ * @dev:     Device (must be locked).
+ * @ep:      Endpoint to which the packet was sent.
+ * @peer:    Machine that sent the packet.
+ * @id:      Local id of the packet's RPC.
+ * @pkt:     The packet (a data_header, possibly followed by more
+ *           segments or by acks).
+ * @length:  Number of bytes at @pkt.
+ */
+static void homa_xdp_data_pkt(struct homa_xdp_dev *dev,
+		struct homa_xdp_endpoint *ep, struct homa_xdp_peer *peer,
+		__u64 id, const char *pkt, size_t length)
+{
+	const struct data_header *h = (const void *) pkt;
+	__u16 dport = ntohs(h->common.sport);
+	const struct data_segment *seg;
+	__u32 offset, seg_length, msg_length, incoming;
+	struct homa_xdp_rpc *rpc;
+	size_t pos;
+	__u64 now;
+
+	msg_length = ntohl(h->message_length);
+	if ((msg_length == 0) || (msg_length > HOMA_MAX_MESSAGE_LENGTH))
+		return;
+	rpc = homa_xdp_rpc_find(ep, id, &peer->addr, dport);
+	if (rpc == NULL) {
+		if (homa_xdp_is_client(id))
+			return;
+		rpc = homa_xdp_rpc_new(ep, id, peer, dport);
+		if (rpc == NULL)
+			return;
+		rpc->state = RPC_INCOMING;
+	}
+	if (homa_xdp_is_client(id) && (rpc->state == RPC_OUTGOING)) {
+		/* The first packet of the response implies that the server
+		 * has the entire request.
+		 */
+		rpc->out_next = rpc->out_length;
+		homa_xdp_set_throttled(dev, rpc, false);
+		rpc->state = RPC_INCOMING;
+	}
+	if (rpc->state != RPC_INCOMING)
+		return;
+	now = homa_xdp_now();
+	rpc->last_heard = now;
+	rpc->resends = 0;
+	incoming = ntohl(h->incoming);
+	if (incoming > msg_length)
+		incoming = msg_length;
+	if (rpc->in == NULL) {
+		rpc->in = malloc(msg_length);
+		if (rpc->in == NULL)
+			return;
+		rpc->in_length = msg_length;
+		rpc->in_incoming = incoming;
+	} else if (msg_length != rpc->in_length) {
+		return;
+	}
+
+	/* The sender may commit to more than we granted (e.g. to fill
+	 * out a packet); count that as incoming too.
+	 */
+	if (incoming > rpc->in_incoming)
+		rpc->in_incoming = incoming;
+
+	for (pos = offsetof(struct data_header, seg);
+			pos + sizeof(*seg) <= length; ) {
+		seg = (const struct data_segment *) (pkt + pos);
+		offset = ntohl(seg->offset);
+		seg_length = ntohl(seg->segment_length);
+		if ((seg_length > length - pos - sizeof(*seg))
+				|| (offset + seg_length > rpc->in_length))
+			break;
+		if (homa_xdp_add_range(rpc, offset, offset + seg_length)
+				!= 0) {
+			memcpy(rpc->in + offset, seg->data, seg_length);
+			rpc->in_bytes += seg_length;
+		}
+		pos += sizeof(*seg) + seg_length;
+
+		/* Acks follow the data of a single-segment packet. */
+		if (h->extra_acks)
+			break;
+	}
+
+	if (rpc->in_bytes >= rpc->in_length) {
+		rpc->state = RPC_READY;
+		rpc->in_grantable = false;
+		dev->need_grants = true;
+	} else if (!rpc->in_grantable && homa_grant_needed(rpc->in_length,
+			rpc->in_bytes, rpc->in_incoming, HOMA_XDP_RTT_BYTES)) {
+		rpc->in_grantable = true;
+		rpc->in_birth = now;
+	}
+	if (rpc->in_grantable)
+		dev->need_grants = true;
+
+	if ((ntohs(h->cutoff_version) != HOMA_XDP_CUTOFF_VERSION)
+			&& (now - peer->last_cutoffs >= HOMA_XDP_CUTOFFS_NS)) {
+		homa_xdp_send_cutoffs(dev, rpc);
+		peer->last_cutoffs = now;
+	}
+}
+
+/**
+ * homa_xdp_send_grants() - Send grants to incoming messages, in the same
+ * way as the kernel's homa_send_grants: consider the best message from
+ * each peer, in SRPT order, and grant each of them up to a window beyond
+ * what it has received, as long as the total of granted-but-not-received
+ * bytes stays under max_incoming.
+ * @dev:     Device (must be locked).
+ */
+static void homa_xdp_send_grants(struct homa_xdp_dev *dev)
+{
+	struct homa_xdp_rpc **cands, *rpc, *tmp;
+	int available, window, new_grant, increment, rank, i;
+	int num_cands = 0, num_grants = 0, total_incoming = 0;
+	struct homa_xdp_endpoint *ep;
+	struct grant_header grant;
+
+	dev->need_grants = false;
+	for (ep = dev->endpoints; ep != NULL; ep = ep->next) {
+		for (rpc = ep->rpcs; rpc != NULL; rpc = rpc->next) {
+			if ((rpc->state != RPC_INCOMING) || (rpc->in == NULL))
+				continue;
+			if (rpc->in_incoming > rpc->in_bytes)
+				total_incoming += rpc->in_incoming
+						- rpc->in_bytes;
+			if (!rpc->in_grantable)
+				continue;
+
+			/* Only the best message from each peer competes. */
+			for (i = 0; i < num_cands; i++) {
+				if (dev->grant_cands[i]->peer == rpc->peer)
+					break;
+			}
+			if (i < num_cands) {
+				tmp = dev->grant_cands[i];
+				if (homa_srpt_precedes(rpc->in_length
+						- rpc->in_bytes, rpc->in_birth,
+						tmp->in_length - tmp->in_bytes,
+						tmp->in_birth))
+					dev->grant_cands[i] = rpc;
+				continue;
+			}
+			if (num_cands == dev->max_grant_cands) {
+				cands = realloc(dev->grant_cands,
+						2*(num_cands + 8)
+						*sizeof(*cands));
+				if (cands == NULL)
+					continue;
+				dev->grant_cands = cands;
+				dev->max_grant_cands = 2*(num_cands + 8);
+			}
+			dev->grant_cands[num_cands++] = rpc;
+		}
+	}
+	available = HOMA_XDP_MAX_INCOMING - total_incoming;
+	if ((num_cands == 0) || (available <= 0))
+		return;
+
+	/* Sort the candidates in SRPT order (there are few of them). */
+	cands = dev->grant_cands;
+	for (i = 1; i < num_cands; i++) {
+		int j;
+
+		rpc = cands[i];
+		for (j = i; j > 0; j--) {
+			tmp = cands[j-1];
+			if (!homa_srpt_precedes(rpc->in_length - rpc->in_bytes,
+					rpc->in_birth,
+					tmp->in_length - tmp->in_bytes,
+					tmp->in_birth))
+				break;
+			cands[j] = tmp;
+		}
+		cands[j] = rpc;
+	}
+
+	window = homa_grant_window(HOMA_XDP_RTT_BYTES, HOMA_XDP_MAX_INCOMING,
+			0, num_cands);
+	for (rank = 1; rank <= num_cands; rank++) {
+		rpc = cands[rank-1];
+		new_grant = homa_grant_offset(rpc->in_length, rpc->in_bytes,
+				window);
+		increment = new_grant - (int) rpc->in_incoming;
+		if (increment <= 0)
+			continue;
+		if (available <= 0)
+			break;
+		if (increment > available) {
+			increment = available;
+			new_grant = rpc->in_incoming + increment;
+		}
+
+		/* Without this, the timer could request a resend right
+		 * after the grant goes out.
+		 */
+		rpc->last_heard = homa_xdp_now();
+
+		rpc->in_incoming = new_grant;
+		available -= increment;
+		memset(&grant, 0, sizeof(grant));
+		grant.offset = htonl(new_grant);
+		grant.priority = homa_grant_priority(rank,
+				HOMA_XDP_MAX_SCHED_PRIO, num_cands);
+		homa_xdp_xmit_control(dev, rpc, GRANT, &grant, sizeof(grant));
+		if (new_grant == (int) rpc->in_length)
+			rpc->in_grantable = false;
+		num_grants++;
+		if (num_grants == HOMA_XDP_MAX_GRANTS)
+			break;
+	}
+}
+
+/**
+ * homa_xdp_resend_pkt() - Handle an incoming RESEND packet (the same way
+ * as the kernel's homa_resend_pkt).
+ * @dev:     Device (must be locked).
+ * @ep:      Endpoint to which the packet was sent.
+ * @peer:    Machine that sent the packet.
+ * @id:      Local id of the packet's RPC.
+ * @h:       The packet.
+ */
+static void homa_xdp_resend_pkt(struct homa_xdp_dev *dev,
+		struct homa_xdp_endpoint *ep, struct homa_xdp_peer *peer,
+		__u64 id, const struct resend_header *h)
+{
+	__u16 dport = ntohs(h->common.sport);
+	struct unknown_header unknown;
+	struct busy_header busy;
+	struct homa_xdp_rpc *rpc;
+	__u32 start, end, limit;
+	int sent;
+
+	rpc = homa_xdp_rpc_find(ep, id, &peer->addr, dport);
+	if (rpc == NULL) {
+		memset(&unknown, 0, sizeof(unknown));
+		homa_xdp_xmit(dev, peer, ep->port, dport, id, UNKNOWN,
+				&unknown, sizeof(unknown), NULL, 0, NULL, 0,
+				HOMA_XDP_CONTROL_PRIO);
+		return;
+	}
+	rpc->last_heard = homa_xdp_now();
+	rpc->resends = 0;
+	memset(&busy, 0, sizeof(busy));
+	if ((!homa_xdp_is_client(id) && (rpc->state != RPC_OUTGOING))
+			|| (rpc->out == NULL)) {
+		homa_xdp_xmit_control(dev, rpc, BUSY, &busy, sizeof(busy));
+		return;
+	}
+	start = ntohl(h->offset);
+	end = start + ntohl(h->length);
+
+	/* A RESEND implicitly grants the bytes it asks for (in case a
+	 * GRANT was lost).
+	 */
+	if ((rpc->state == RPC_OUTGOING) && (end > rpc->out_granted))
+		rpc->out_granted = (end < rpc->out_length) ? end
+				: rpc->out_length;
+	limit = (rpc->out_granted < rpc->out_length) ? rpc->out_granted
+			: rpc->out_length;
+	if ((rpc->state == RPC_OUTGOING) && (rpc->out_next < limit)) {
+		/* We are still sending (or the pacer is holding packets
+		 * back); the peer just has to wait.
+		 */
+		homa_xdp_xmit_control(dev, rpc, BUSY, &busy, sizeof(busy));
+		homa_xdp_xmit_rpc(dev, rpc, false);
+		return;
+	}
+	if (start == end) {
+		/* The server is checking whether we still care about the
+		 * RPC.
+		 */
+		homa_xdp_xmit_control(dev, rpc, BUSY, &busy, sizeof(busy));
+		return;
+	}
+	if (end > rpc->out_next)
+		end = rpc->out_next;
+	while (start < end) {
+		homa_xdp_check_nic_queue(dev, sizeof(struct data_header)
+				+ homa_xdp_max_seg(dev, peer), true);
+		sent = homa_xdp_xmit_data(dev, rpc, start, true, h->priority);
+		if (sent <= 0)
+			break;
+		start += sent;
+	}
+}
+
+/**
+ * homa_xdp_handle() - Process one incoming Homa packet.
+ * @dev:     Device (must be locked).
+ * @saddr:   Address of the sender (IPv4 addresses are mapped).
+ * @smac:    Ethernet address of the sender (NULL if unknown).
+ * @pkt:     The Homa packet (starting with the common header).
+ * @length:  Number of bytes at @pkt.
+ */
+static void homa_xdp_handle(struct homa_xdp_dev *dev,
+		const struct in6_addr *saddr, const __u8 *smac,
+		const char *pkt, size_t length)
+{
+	const struct common_header *common = (const void *) pkt;
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_peer *peer;
+	struct homa_xdp_rpc *rpc;
+	struct homa_ack *ack;
+	size_t min_length;
+	__u16 dport;
+	__u64 id;
+	int i;
+
+	if (length < sizeof(*common))
+		return;
+	switch (common->type) {
+	case DATA:
+		min_length = sizeof(struct data_header);
+		break;
+	case GRANT:
+		min_length = offsetof(struct grant_header, ack);
+		break;
+	case RESEND:
+		min_length = offsetof(struct resend_header, ack);
+		break;
+	case BUSY:
+		min_length = offsetof(struct busy_header, ack);
+		break;
+	case CUTOFFS:
+		min_length = sizeof(struct cutoffs_header);
+		break;
+	case ACK:
+		min_length = sizeof(struct ack_header);
+		break;
+	case BUNDLE:
+		min_length = sizeof(struct bundle_header);
+		break;
+	default:
+		min_length = sizeof(*common);
+		break;
+	}
+	if (length < min_length)
+		return;
+	if (common->type == BUNDLE) {
+		const struct bundle_header *b = (const void *) pkt;
+		size_t pos = sizeof(*b);
+
+		for (i = 0; i < b->num_items; i++) {
+			__u8 item_length;
+
+			if (pos >= length)
+				break;
+			item_length = pkt[pos];
+			if (pos + 1 + item_length > length)
+				break;
+			homa_xdp_handle(dev, saddr, smac, pkt + pos + 1,
+					item_length);
+			pos += 1 + item_length;
+		}
+		return;
+	}
+
+	/* Handle piggybacked acks first: they may refer to RPCs on other
+	 * endpoints.
+	 */
+	if (common->type == DATA) {
+		const struct data_header *h = (const void *) pkt;
+		size_t trailer = sizeof(*h) + ntohl(h->seg.segment_length);
+
+		homa_xdp_rpc_acked(dev, saddr, &h->seg.ack);
+		for (i = 0; i < h->extra_acks; i++) {
+			if (trailer + (i + 1)*sizeof(struct homa_ack) > length)
+				break;
+			homa_xdp_rpc_acked(dev, saddr, (const void *) (pkt
+					+ trailer + i*sizeof(struct homa_ack)));
+		}
+	} else if (common->type == ACK) {
+		const struct ack_header *h = (const void *) pkt;
+		int num_acks = ntohs(h->num_acks);
+
+		for (i = 0; i < num_acks; i++) {
+			if (sizeof(*h) + ((i < NUM_PEER_UNACKED_IDS) ? 0
+					: (i + 1 - NUM_PEER_UNACKED_IDS)
+					*sizeof(struct homa_ack)) > length)
+				break;
+			homa_xdp_rpc_acked(dev, saddr, (i < NUM_PEER_UNACKED_IDS)
+					? &h->acks[i]
+					: (const void *) (pkt + sizeof(*h)
+					+ (i - NUM_PEER_UNACKED_IDS)
+					*sizeof(struct homa_ack)));
+		}
+	} else {
+		ack = homa_xdp_pkt_ack((void *) pkt, length);
+		if (ack)
+			homa_xdp_rpc_acked(dev, saddr, ack);
+	}
+
+	ep = homa_xdp_ep_find(dev, ntohs(common->dport));
+	if (ep == NULL)
+		return;
+	peer = homa_xdp_peer_find(dev, saddr);
+	if (peer == NULL)
+		return;
+	if (smac)
+		memcpy(peer->mac, smac, ETH_ALEN);
+	id = be64toh(common->sender_id) ^ 1;
+	dport = ntohs(common->sport);
+
+	switch (common->type) {
+	case DATA:
+		homa_xdp_data_pkt(dev, ep, peer, id, pkt, length);
+		break;
+	case GRANT: {
+		const struct grant_header *h = (const void *) pkt;
+
+		rpc = homa_xdp_rpc_find(ep, id, saddr, dport);
+		if ((rpc == NULL) || (rpc->state != RPC_OUTGOING))
+			break;
+		rpc->last_heard = homa_xdp_now();
+		rpc->resends = 0;
+		if (ntohl(h->offset) > rpc->out_granted)
+			rpc->out_granted = (ntohl(h->offset) < rpc->out_length)
+					? ntohl(h->offset) : rpc->out_length;
+		rpc->out_sched_priority = h->priority;
+		homa_xdp_xmit_rpc(dev, rpc, false);
+		break;
+	}
+	case RESEND:
+		homa_xdp_resend_pkt(dev, ep, peer, id, (const void *) pkt);
+		break;
+	case UNKNOWN:
+		rpc = homa_xdp_rpc_find(ep, id, saddr, dport);
+		if (rpc == NULL)
+			break;
+		if (!homa_xdp_is_client(id)) {
+			homa_xdp_rpc_free(dev, rpc);
+			break;
+		}
+		if ((rpc->state == RPC_READY) || (rpc->out == NULL))
+			break;
+
+		/* The server lost the request: start over. */
+		homa_xdp_rpc_reset_in(dev, rpc);
+		rpc->state = RPC_OUTGOING;
+		rpc->out_next = 0;
+		rpc->last_heard = homa_xdp_now();
+		homa_xdp_xmit_rpc(dev, rpc, false);
+		break;
+	case BUSY:
+		rpc = homa_xdp_rpc_find(ep, id, saddr, dport);
+		if (rpc) {
+			rpc->last_heard = homa_xdp_now();
+			rpc->resends = 0;
+		}
+		break;
+	case CUTOFFS: {
+		const struct cutoffs_header *h = (const void *) pkt;
+
+		peer->unsched_cutoffs[0] = INT_MAX;
+		for (i = 1; i < HOMA_MAX_PRIORITIES; i++)
+			peer->unsched_cutoffs[i] = ntohl(h->unsched_cutoffs[i]);
+		peer->cutoff_version = h->cutoff_version;
+		break;
+	}
+	case NEED_ACK:
+		/* As in the kernel, the ACK also carries any other acks
+		 * waiting for this peer.
+		 */
+		rpc = homa_xdp_rpc_find(ep, id, saddr, dport);
+		if ((rpc == NULL) || (rpc->state == RPC_READY))
+			homa_xdp_send_ack_batch(dev, peer, ep->port, dport,
+					id);
+		break;
+	case ACK:
+		rpc = homa_xdp_rpc_find(ep, id, saddr, dport);
+		if (rpc && !homa_xdp_is_client(id))
+			homa_xdp_rpc_free(dev, rpc);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * homa_xdp_timer() - Retransmit requests for RPCs that haven't heard
+ * from their peers recently, and abandon RPCs whose peers have gone
+ * silent for too long.
+ * @dev:     Device (must be locked).
+ * @now:     Current time.
+ */
+static void homa_xdp_timer(struct homa_xdp_dev *dev, __u64 now)
+{
+	struct need_ack_header need_ack;
+	struct resend_header resend;
+	struct homa_xdp_rpc *rpc, *next;
+	struct homa_xdp_endpoint *ep;
+	__u32 start, end;
+
+	for (ep = dev->endpoints; ep != NULL; ep = ep->next) {
+		for (rpc = ep->rpcs; rpc != NULL; rpc = next) {
+			next = rpc->next;
+			if ((rpc->state == RPC_READY)
+					|| (rpc->state == RPC_IN_SERVICE))
+				continue;
+
+			/* As in the kernel, silence doesn't count while we
+			 * have granted data waiting to be sent, or when we
+			 * have received everything we granted.
+			 */
+			if (((rpc->state == RPC_OUTGOING)
+					&& (rpc->out_next < rpc->out_granted)
+					&& (rpc->out_next < rpc->out_length))
+					|| ((rpc->state == RPC_INCOMING)
+					&& rpc->in
+					&& (rpc->in_bytes >= rpc->in_incoming)))
+				rpc->last_heard = now;
+			if ((now - rpc->last_heard < HOMA_XDP_RESEND_NS)
+					|| (now - rpc->last_resend
+					< HOMA_XDP_RESEND_INTERVAL_NS))
+				continue;
+			rpc->resends++;
+			if (rpc->resends > HOMA_XDP_TIMEOUT_RESENDS) {
+				if (homa_xdp_is_client(rpc->id)) {
+					rpc->error = ETIMEDOUT;
+					rpc->state = RPC_READY;
+					homa_xdp_set_throttled(dev, rpc, false);
+				} else {
+					homa_xdp_rpc_free(dev, rpc);
+				}
+				continue;
+			}
+			rpc->last_resend = now;
+			if ((rpc->state == RPC_OUTGOING)
+					&& !homa_xdp_is_client(rpc->id)) {
+				/* The response has been sent; only the ack
+				 * is missing.
+				 */
+				if (rpc->out_next >= rpc->out_length) {
+					memset(&need_ack, 0, sizeof(need_ack));
+					homa_xdp_xmit_control(dev, rpc,
+							NEED_ACK, &need_ack,
+							sizeof(need_ack));
+				}
+				continue;
+			}
+
+			/* Ask for the first range we are missing, up to what
+			 * has been granted (for a client that has heard
+			 * nothing yet, the beginning of the response).
+			 */
+			start = 0;
+			end = rpc->in ? rpc->in_incoming : HOMA_XDP_RTT_BYTES;
+			if (rpc->num_ranges > 0) {
+				if (rpc->ranges[0].start == 0) {
+					start = rpc->ranges[0].end;
+					if ((rpc->num_ranges > 1)
+							&& (rpc->ranges[1].start
+							< end))
+						end = rpc->ranges[1].start;
+				} else if (rpc->ranges[0].start < end) {
+					end = rpc->ranges[0].start;
+				}
+			}
+			if (end < start)
+				end = start;
+			memset(&resend, 0, sizeof(resend));
+			resend.offset = htonl(start);
+			resend.length = htonl(end - start);
+			resend.priority = HOMA_XDP_CONTROL_PRIO;
+			homa_xdp_xmit_control(dev, rpc, RESEND, &resend,
+					sizeof(resend));
+		}
+	}
+}
+
+/**
+ * homa_xdp_rx() - Process a packet received from the AF_XDP socket.
+ * @dev:     Device (must be locked).
+ * @frame:   The packet, starting with the Ethernet header.
+ * @len:     Number of bytes at @frame.
+ */
+static void homa_xdp_rx(struct homa_xdp_dev *dev, char *frame, __u32 len)
+{
+	struct ether_header *eth = (struct ether_header *) frame;
+	struct in6_addr saddr;
+	size_t ihl, ip_length;
+
+	if (len < ETH_HLEN)
+		return;
+	if (eth->ether_type == htons(ETHERTYPE_IP)) {
+		struct iphdr *iph = (struct iphdr *) (frame + ETH_HLEN);
+
+		if (!dev->has_addr4 || (len < ETH_HLEN + sizeof(*iph)))
+			return;
+		ihl = iph->ihl*4;
+		ip_length = ntohs(iph->tot_len);
+		if ((iph->daddr != dev->addr4) || (ihl < sizeof(*iph))
+				|| (ip_length < ihl)
+				|| (ETH_HLEN + ip_length > len))
+			return;
+		homa_xdp_map_v4(iph->saddr, &saddr);
+		homa_xdp_handle(dev, &saddr, eth->ether_shost,
+				frame + ETH_HLEN + ihl, ip_length - ihl);
+	} else if (eth->ether_type == htons(ETHERTYPE_IPV6)) {
+		struct ip6_hdr *ip6 = (struct ip6_hdr *) (frame + ETH_HLEN);
+
+		if (!dev->has_addr6 || (len < ETH_HLEN + sizeof(*ip6)))
+			return;
+		ip_length = ntohs(ip6->ip6_plen);
+		if ((ip6->ip6_nxt != IPPROTO_HOMA)
+				|| (memcmp(&ip6->ip6_dst, &dev->addr6,
+				sizeof(dev->addr6)) != 0)
+				|| (ETH_HLEN + sizeof(*ip6) + ip_length > len))
+			return;
+		saddr = ip6->ip6_src;
+		homa_xdp_handle(dev, &saddr, eth->ether_shost,
+				frame + ETH_HLEN + sizeof(*ip6), ip_length);
+	}
+}
+
+/**
+ * homa_xdp_poll() - Process incoming packets (if any), send any grants
+ * and paced packets that have become possible, run the timer if it is
+ * due, and flush outgoing packets.
+ * @dev:     Device (must be locked).
+ */
+static void homa_xdp_poll(struct homa_xdp_dev *dev)
+{
+	struct xdp_desc *descs = dev->rx.descs;
+	__u64 *fill = dev->fill.descs;
+	__u32 cons, prod, fill_prod;
+	__u64 now;
+	int count;
+
+	cons = *dev->rx.consumer;
+	prod = __atomic_load_n(dev->rx.producer, __ATOMIC_ACQUIRE);
+	fill_prod = *dev->fill.producer;
+	for (count = 0; (cons != prod) && (count < HOMA_XDP_RX_BATCH);
+			cons++, count++) {
+		struct xdp_desc *desc = &descs[cons & dev->rx.mask];
+
+		homa_xdp_rx(dev, dev->umem + desc->addr, desc->len);
+
+		/* The frame can be reused for receiving right away. */
+		fill[fill_prod & dev->fill.mask] = desc->addr
+				- (desc->addr % HOMA_XDP_FRAME_SIZE);
+		fill_prod++;
+	}
+	__atomic_store_n(dev->rx.consumer, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(dev->fill.producer, fill_prod, __ATOMIC_RELEASE);
+
+	if (dev->need_grants)
+		homa_xdp_send_grants(dev);
+	homa_xdp_pacer(dev);
+	now = homa_xdp_now();
+	if (now >= dev->next_timer) {
+		homa_xdp_timer(dev, now);
+		dev->next_timer = now + HOMA_XDP_TIMER_NS;
+	}
+	homa_xdp_kick(dev);
+}
+
+/**
+ * homa_xdp_copy_in() - Copy a message supplied by the application into a
+ * freshly allocated buffer.
+ * @buf:      Message, if contiguous (or NULL).
+ * @iov:      Message, if scattered (used when @buf is NULL).
+ * @length:   Number of bytes at @buf, or number of elements at @iov.
+ * @total:    Total length of the message is returned here.
+ * Return:    The buffer, or NULL for errors (errno is set).
+ */
+static char *homa_xdp_copy_in(const void *buf, const struct iovec *iov,
+		size_t length, __u32 *total)
+{
+	size_t bytes = 0, i;
+	char *result;
+
+	if (buf) {
+		bytes = length;
+	} else {
+		for (i = 0; i < length; i++)
+			bytes += iov[i].iov_len;
+	}
+
+	/* As in the kernel, empty messages aren't allowed. */
+	if ((bytes == 0) || (bytes > HOMA_MAX_MESSAGE_LENGTH)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	result = malloc(bytes);
+	if (result == NULL)
+		return NULL;
+	if (buf) {
+		memcpy(result, buf, bytes);
+	} else {
+		bytes = 0;
+		for (i = 0; i < length; i++) {
+			memcpy(result + bytes, iov[i].iov_base,
+					iov[i].iov_len);
+			bytes += iov[i].iov_len;
+		}
+	}
+	*total = bytes;
+	return result;
+}
+
+/**
+ * homa_sendp() - Send the request message for a new RPC (same interface
+ * as in homa_api.c). Requests on kernel Homa sockets are passed to the
+ * kernel module.
+ * @sockfd:     Endpoint returned by homa_xdp_socket, or a kernel Homa
+ *              socket.
+ * @args:       Structure that contains parameters for this operation;
+ *              results are also returned in this struct.
+ * Return:      0 means the request has been accepted for delivery. If an
+ *              error occurred, -1 is returned and errno is set appropriately.
+ */
+ssize_t homa_sendp(int sockfd, struct homa_send_args *args)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_peer *peer;
+	struct homa_xdp_rpc *rpc;
+	struct in6_addr addr;
+	__u32 length;
+	__u16 port;
+	char *buf;
+
+	if (!homa_xdp_is_endpoint(sockfd))
+		return ioctl(sockfd, HOMAIOCSEND, args);
+	if (homa_xdp_get_addr(&args->dest_addr, &addr, &port) < 0)
+		return -1;
+	buf = homa_xdp_copy_in(args->message_buf, args->iovec, args->length,
+			&length);
+	if (buf == NULL)
+		return -1;
+	ep = homa_xdp_get(sockfd);
+	if (ep == NULL)
+		goto error;
+	if (homa_xdp_is_v4(&addr) ? !ep->dev->has_addr4
+			: !ep->dev->has_addr6) {
+		errno = EAFNOSUPPORT;
+		goto error_put;
+	}
+	peer = homa_xdp_peer_find(ep->dev, &addr);
+	if ((peer == NULL) || (homa_xdp_peer_resolve(ep->dev, peer) < 0))
+		goto error_put;
+	rpc = homa_xdp_rpc_new(ep, ep->next_id, peer, port);
+	if (rpc == NULL)
+		goto error_put;
+	ep->next_id += 2;
+	rpc->state = RPC_OUTGOING;
+	rpc->completion_cookie = args->completion_cookie;
+	homa_xdp_msg_out_init(ep->dev, rpc, buf, length);
+	homa_xdp_xmit_rpc(ep->dev, rpc, false);
+	homa_xdp_kick(ep->dev);
+	args->id = rpc->id;
+	homa_xdp_put(ep);
+	return 0;
+
+error_put:
+	homa_xdp_put(ep);
+error:
+	free(buf);
+	return -1;
+}
+
+/**
+ * homa_replyp() - Send a response message for an RPC (same interface as
+ * in homa_api.c). Responses on kernel Homa sockets are passed to the
+ * kernel module.
+ * @sockfd:     Endpoint returned by homa_xdp_socket, or a kernel Homa
+ *              socket.
+ * @args:       Structure that contains parameters for this operation;
+ *              results are also returned in this struct.
+ * Return:      0 means the response has been accepted for delivery. If an
+ *              error occurred, -1 is returned and errno is set appropriately.
+ */
+ssize_t homa_replyp(int sockfd, struct homa_reply_args *args)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_rpc *rpc;
+	struct in6_addr addr;
+	__u32 length;
+	__u16 port;
+	char *buf;
+
+	if (!homa_xdp_is_endpoint(sockfd))
+		return ioctl(sockfd, HOMAIOCREPLY, args);
+	if (homa_xdp_get_addr(&args->dest_addr, &addr, &port) < 0)
+		return -1;
+	buf = homa_xdp_copy_in(args->message_buf, args->iovec, args->length,
+			&length);
+	if (buf == NULL)
+		return -1;
+	ep = homa_xdp_get(sockfd);
+	if (ep == NULL) {
+		free(buf);
+		return -1;
+	}
+	rpc = homa_xdp_rpc_find(ep, args->id, &addr, port);
+	if ((rpc == NULL) || (rpc->state != RPC_IN_SERVICE)) {
+		/* As in the kernel, replying to a vanished RPC isn't an
+		 * error.
+		 */
+		homa_xdp_put(ep);
+		free(buf);
+		return 0;
+	}
+	homa_xdp_rpc_reset_in(ep->dev, rpc);
+	rpc->state = RPC_OUTGOING;
+	homa_xdp_msg_out_init(ep->dev, rpc, buf, length);
+	rpc->last_heard = homa_xdp_now();
+	rpc->resends = 0;
+	homa_xdp_xmit_rpc(ep->dev, rpc, false);
+	homa_xdp_kick(ep->dev);
+	homa_xdp_put(ep);
+	return 0;
+}
+
+/**
+ * homa_xdp_copy_out() - Copy an incoming message to the application.
+ * @rpc:      RPC whose incoming message should be copied.
+ * @args:     Describes where to copy the message.
+ * Return:    Number of bytes copied.
+ */
+static ssize_t homa_xdp_copy_out(struct homa_xdp_rpc *rpc,
+		struct homa_recv_args *args)
+{
+	size_t copied = 0, chunk, i;
+
+	if (rpc->in == NULL)
+		return 0;
+	if (args->message_buf) {
+		copied = (args->length < rpc->in_length) ? args->length
+				: rpc->in_length;
+		memcpy(args->message_buf, rpc->in, copied);
+		return copied;
+	}
+	for (i = 0; (i < args->length) && (copied < rpc->in_length); i++) {
+		chunk = args->iovec[i].iov_len;
+		if (chunk > rpc->in_length - copied)
+			chunk = rpc->in_length - copied;
+		memcpy(args->iovec[i].iov_base, rpc->in + copied, chunk);
+		copied += chunk;
+	}
+	return copied;
+}
+
+/**
+ * homa_recvp() - Wait for an incoming message and return it (same
+ * interface as in homa_api.c). On a user-space endpoint the calling
+ * thread polls the endpoint's device while it waits; requests on kernel
+ * Homa sockets are passed to the kernel module.
+ * @sockfd:     Endpoint returned by homa_xdp_socket, or a kernel Homa
+ *              socket.
+ * @args:       Structure that contains parameters for this operation;
+ *              results are also returned in this struct.
+ * Return:      The number of bytes of data returned. If an error occurred,
+ *              the return value is -1 and errno is set appropriately.
+ */
+ssize_t homa_recvp(int sockfd, struct homa_recv_args *args)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_rpc *rpc;
+	ssize_t result;
+
+	if (!homa_xdp_is_endpoint(sockfd))
+		return ioctl(sockfd, HOMAIOCRECV, args);
+	if (args->flags & ~HOMA_RECV_VALID_FLAGS) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (1) {
+		ep = homa_xdp_get(sockfd);
+		if (ep == NULL)
+			return -1;
+		homa_xdp_poll(ep->dev);
+		for (rpc = ep->rpcs; rpc != NULL; rpc = rpc->next) {
+			if (args->id) {
+				if (rpc->id == args->id)
+					break;
+				continue;
+			}
+			if ((rpc->state != RPC_READY)
+					|| !(args->flags & (homa_xdp_is_client(
+					rpc->id) ? HOMA_RECV_RESPONSE
+					: HOMA_RECV_REQUEST)))
+				continue;
+			break;
+		}
+		if (args->id && (rpc == NULL)) {
+			homa_xdp_put(ep);
+			errno = EINVAL;
+			return -1;
+		}
+		if (rpc && (rpc->state == RPC_READY))
+			break;
+		homa_xdp_put(ep);
+		if (args->flags & HOMA_RECV_NONBLOCKING) {
+			errno = EAGAIN;
+			return -1;
+		}
+		sched_yield();
+	}
+
+	result = homa_xdp_copy_out(rpc, args);
+	args->length = rpc->in_length;
+	homa_xdp_set_addr(&args->source_addr, &rpc->peer->addr, rpc->dport);
+	args->id = rpc->id;
+	args->completion_cookie = rpc->completion_cookie;
+	if (rpc->error) {
+		errno = rpc->error;
+		result = -1;
+	}
+	if (homa_xdp_is_client(rpc->id)) {
+		if (!rpc->error)
+			homa_xdp_peer_add_ack(ep->dev, rpc);
+		homa_xdp_rpc_free(ep->dev, rpc);
+	} else {
+		rpc->state = RPC_IN_SERVICE;
+	}
+	homa_xdp_kick(ep->dev);
+	homa_xdp_put(ep);
+	return result;
+}
+
+/**
+ * homa_abortp() - Terminate the execution of an RPC (same interface as
+ * in homa_api.c). Requests on kernel Homa sockets are passed to the
+ * kernel module.
+ * @sockfd:     Endpoint returned by homa_xdp_socket, or a kernel Homa
+ *              socket.
+ * @args:       Structure that contains parameters for this operation.
+ * Return:      0 for success, otherwise -1 (errno is set).
+ */
+int homa_abortp(int sockfd, struct homa_abort_args *args)
+{
+	struct homa_xdp_endpoint *ep;
+	struct homa_xdp_rpc *rpc, *next;
+	bool found = false;
+
+	if (!homa_xdp_is_endpoint(sockfd))
+		return ioctl(sockfd, HOMAIOCABORT, args);
+	ep = homa_xdp_get(sockfd);
+	if (ep == NULL)
+		return -1;
+	for (rpc = ep->rpcs; rpc != NULL; rpc = next) {
+		next = rpc->next;
+		if (!homa_xdp_is_client(rpc->id)
+				|| (args->id && (rpc->id != args->id)))
+			continue;
+		found = true;
+		if (args->error == 0) {
+			homa_xdp_rpc_free(ep->dev, rpc);
+		} else {
+			rpc->error = args->error;
+			rpc->state = RPC_READY;
+			homa_xdp_set_throttled(ep->dev, rpc, false);
+		}
+	}
+	homa_xdp_put(ep);
+	if (args->id && !found) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * homa_xdp_flush_acks() - Send all of the acks waiting for any peer in
+ * explicit ACK packets, so servers don't have to wait for NEED_ACK
+ * timeouts after we go away.
+ * @dev:     Device (must be locked).
+ */
+static void homa_xdp_flush_acks(struct homa_xdp_dev *dev)
+{
+	struct homa_xdp_peer *peer;
+	struct homa_ack *ack;
+
+	for (peer = dev->peers; peer != NULL; peer = peer->next) {
+		while (peer->num_acks > 0) {
+			ack = &peer->acks[peer->num_acks - 1];
+			homa_xdp_send_ack_batch(dev, peer,
+					ntohs(ack->client_port),
+					ntohs(ack->server_port),
+					be64toh(ack->client_id));
+		}
+	}
+}
+
+/**
+ * homa_xdp_close() - Close a user-space endpoint and release all of its
+ * resources. When the last endpoint on an interface is closed, the
+ * AF_XDP socket and the XDP program attached to the interface are
+ * released too.
+ * @fd:      Endpoint returned by homa_xdp_socket.
+ * Return:   0 for success, otherwise -1 (errno is set).
+ */
+int homa_xdp_close(int fd)
+{
+	struct homa_xdp_endpoint *ep, **p;
+	struct homa_xdp_dev *dev, **d;
+	__u64 deadline;
+
+	ep = homa_xdp_get(fd);
+	if (ep == NULL)
+		return -1;
+	dev = ep->dev;
+
+	/* Give responses already handed to homa_reply a chance to finish
+	 * (and be acknowledged), and make sure servers hear about
+	 * completed client RPCs.
+	 */
+	deadline = homa_xdp_now() + HOMA_XDP_CLOSE_NS;
+	homa_xdp_flush_acks(dev);
+	while (ep->rpcs && (homa_xdp_now() < deadline))
+		homa_xdp_poll(dev);
+	homa_xdp_flush_acks(dev);
+	homa_xdp_put(ep);
+
+	pthread_mutex_lock(&homa_xdp_mutex);
+	pthread_mutex_lock(&dev->mutex);
+	homa_xdp_endpoints[fd] = NULL;
+	for (p = &dev->endpoints; *p != NULL; p = &(*p)->next) {
+		if (*p == ep) {
+			*p = ep->next;
+			break;
+		}
+	}
+	while (ep->rpcs)
+		homa_xdp_rpc_free(dev, ep->rpcs);
+	if (dev->endpoints == NULL) {
+		while ((*dev->tx.producer != *dev->tx.consumer)
+				&& (homa_xdp_now() < deadline))
+			homa_xdp_kick(dev);
+		for (d = &homa_xdp_devs; *d != NULL; d = &(*d)->next) {
+			if (*d == dev) {
+				*d = dev->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&dev->mutex);
+		homa_xdp_dev_free(dev);
+	} else {
+		pthread_mutex_unlock(&dev->mutex);
+	}
+	pthread_mutex_unlock(&homa_xdp_mutex);
+	close(fd);
+	free(ep);
+	return 0;
+}
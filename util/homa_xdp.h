@@ -0,0 +1,39 @@
+/* Copyright (c) 2019-2022 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file declares the functions used to open and close a user-space
+ * Homa endpoint that runs over AF_XDP (see homa_xdp.c). Once an endpoint
+ * has been opened, its file descriptor can be passed to the usual
+ * homa_send/homa_recv/homa_reply functions declared in homa.h; those
+ * functions still work on kernel Homa sockets too. All endpoints on the
+ * same interface and queue share one AF_XDP socket.
+ */
+
+#ifndef _HOMA_XDP_H
+#define _HOMA_XDP_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+extern int homa_xdp_socket(const char *ifname, int queue, int port);
+extern int homa_xdp_close(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HOMA_XDP_H */
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Tests the user-space Homa endpoint (homa_xdp.c) by running xdp_test's
+# client and server in two network namespaces connected by a veth pair,
+# first over IPv4 and then over IPv6.
+# Must be run as root from this directory after "make xdp_test".
+# Exits with status 0 if every response matched its request.
+
+port=500
+ns_client=homa_xdp_c
+ns_server=homa_xdp_s
+
+cleanup() {
+    ip netns del $ns_client 2>/dev/null
+    ip netns del $ns_server 2>/dev/null
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add $ns_client || exit 1
+ip netns add $ns_server || exit 1
+ip link add veth_c netns $ns_client type veth peer name veth_s \
+        netns $ns_server || exit 1
+ip -n $ns_client addr add 10.99.0.1/24 dev veth_c
+ip -n $ns_server addr add 10.99.0.2/24 dev veth_s
+ip -n $ns_client addr add fd00:99::1/64 dev veth_c nodad
+ip -n $ns_server addr add fd00:99::2/64 dev veth_s nodad
+ip -n $ns_client link set veth_c up
+ip -n $ns_server link set veth_s up
+
+ip netns exec $ns_server ./xdp_test server veth_s $port 20 &
+server=$!
+sleep 1
+ip netns exec $ns_client ./xdp_test client veth_c 10.99.0.2 $port
+status=$?
+if [ $status -eq 0 ]; then
+    ip netns exec $ns_client ./xdp_test client veth_c fd00:99::2 $port
+    status=$?
+fi
+if [ $status -ne 0 ]; then
+    kill $server 2>/dev/null
+fi
+wait $server
+server_status=$?
+if [ $status -ne 0 ] || [ $server_status -ne 0 ]; then
+    echo "test_xdp.sh FAILED"
+    exit 1
+fi
+echo "test_xdp.sh passed"
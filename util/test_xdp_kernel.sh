@@ -0,0 +1,101 @@
+#!/bin/sh
+# Tests interoperation between the user-space Homa endpoint (homa_xdp.c)
+# and the kernel module. The kernel side runs in the root network namespace
+# (the module's sysctls only exist there); the user-space side runs in a
+# separate namespace, connected by a veth pair. xdp_test is run in both
+# directions (kernel server with user-space client, then the reverse) over
+# IPv4 and IPv6, followed by a short cp_node run with --xdp on the client.
+# Must be run as root from this directory after "make xdp_test cp_node".
+#
+# Usage: test_xdp_kernel.sh [path to homa.ko]
+#
+# Exits with status 0 if every response matched its request.
+
+module=${1:-../homa.ko}
+port=500
+ns=homa_xdp_u
+loaded=0
+
+cleanup() {
+    ip netns del $ns 2>/dev/null
+    ip link del veth_k 2>/dev/null
+    if [ -n "$old_gso" ]; then
+        sysctl -q net.homa.max_gso_size=$old_gso
+    fi
+    if [ $loaded -eq 1 ]; then
+        rmmod homa
+    fi
+}
+trap cleanup EXIT
+ip netns del $ns 2>/dev/null
+ip link del veth_k 2>/dev/null
+
+if ! grep -q "^homa " /proc/modules; then
+    insmod $module || exit 1
+    loaded=1
+fi
+
+# Each incoming packet must fit in one of the endpoint's UMEM frames, so
+# the kernel must not send GSO packets containing more than one segment.
+old_gso=$(sysctl -n net.homa.max_gso_size) || exit 1
+sysctl -q net.homa.max_gso_size=1500 || exit 1
+
+ip netns add $ns || exit 1
+ip link add veth_k type veth peer name veth_u netns $ns || exit 1
+ip addr add 10.99.1.1/24 dev veth_k
+ip -n $ns addr add 10.99.1.2/24 dev veth_u
+ip addr add fd00:99:1::1/64 dev veth_k nodad
+ip -n $ns addr add fd00:99:1::2/64 dev veth_u nodad
+ethtool -K veth_k tso off gso off >/dev/null 2>&1
+ip link set veth_k up
+ip -n $ns link set veth_u up
+
+failed=0
+
+# run_pair server_ns server_if client_ns client_if server_addr [ipv6]
+run_pair() {
+    $1 ./xdp_test server $2 $port 1000000 $6 &
+    server=$!
+    sleep 1
+    $3 ./xdp_test client $4 $5 $port
+    status=$?
+    kill $server 2>/dev/null
+    wait $server 2>/dev/null
+    if [ $status -ne 0 ]; then
+        echo "FAILED: client $4 -> server $2 at $5"
+        failed=1
+    fi
+}
+
+in_ns="ip netns exec $ns"
+run_pair "" - "$in_ns" veth_u 10.99.1.1
+run_pair "" - "$in_ns" veth_u fd00:99:1::1 ipv6
+run_pair "$in_ns" veth_u "" - 10.99.1.2
+run_pair "$in_ns" veth_u "" - fd00:99:1::2
+
+# cp_node: kernel server, user-space client.
+hosts=$(mktemp)
+echo "10.99.1.1 node-1" > $hosts
+(echo "server --ports 1"; sleep 6; echo "exit") | ./cp_node \
+        > /tmp/test_xdp_kernel_server.log 2>&1 &
+server=$!
+sleep 1
+(echo "client --xdp veth_u --workload w3 --client-max 4"; sleep 4;
+        echo "stop clients"; sleep 1; echo "exit") | \
+        ip netns exec $ns unshare -m sh -c \
+        "mount --bind $hosts /etc/hosts && ./cp_node" \
+        > /tmp/test_xdp_kernel_client.log 2>&1
+wait $server
+rm -f $hosts
+if ! grep -q "Clients:" /tmp/test_xdp_kernel_client.log \
+        || grep -q "ERROR\|FATAL" /tmp/test_xdp_kernel_client.log; then
+    echo "FAILED: cp_node --xdp against the kernel (see" \
+            "/tmp/test_xdp_kernel_client.log)"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "test_xdp_kernel.sh FAILED"
+    exit 1
+fi
+echo "test_xdp_kernel.sh passed"
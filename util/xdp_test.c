@@ -0,0 +1,205 @@
+/* Copyright (c) 2019-2022 Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This is a test program for the user-space Homa endpoint in homa_xdp.c.
+ * It uses only the homa_send/homa_recv/homa_reply functions from homa.h.
+ * The server echoes every request; the client sends requests of various
+ * lengths (single-packet, unscheduled-only, and ones that need grants)
+ * and checks that each response matches its request.
+ *
+ * Usage: xdp_test server ifname port [count [ipv6]]
+ *        xdp_test client ifname server_ip port
+ *
+ * An ifname of "-" means use a kernel Homa socket instead of a user-space
+ * endpoint (the server uses IPv6 if "ipv6" is given; the client uses the
+ * family of server_ip), so the endpoint can be tested against the kernel
+ * module. See test_xdp.sh and test_xdp_kernel.sh for scripts that run this
+ * over a veth pair.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "homa.h"
+#include "homa_xdp.h"
+
+static char request[HOMA_MAX_MESSAGE_LENGTH];
+static char response[HOMA_MAX_MESSAGE_LENGTH];
+
+/**
+ * server() - Echo requests back to their senders.
+ * @fd:      Endpoint on which to receive requests.
+ * @count:   Number of requests to handle before returning (0 means
+ *           run forever).
+ * Return:   0 for success, 1 for errors.
+ */
+static int server(int fd, int count)
+{
+	sockaddr_in_union source;
+	uint64_t id;
+	ssize_t length;
+	int handled;
+
+	for (handled = 0; (count == 0) || (handled < count); handled++) {
+		id = 0;
+		memset(&source, 0, sizeof(source));
+		length = homa_recv(fd, request, sizeof(request),
+				HOMA_RECV_REQUEST, &source, &id, NULL, NULL);
+		if (length < 0) {
+			printf("homa_recv failed: %s\n", strerror(errno));
+			return 1;
+		}
+		if (homa_reply(fd, request, length, &source, id) < 0) {
+			printf("homa_reply failed: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * client() - Send requests of various lengths and check the responses.
+ * @fd:      Endpoint to use for the requests.
+ * @dest:    Address of the server.
+ * Return:   0 for success, 1 for errors.
+ */
+static int client(int fd, sockaddr_in_union *dest)
+{
+	static const int lengths[] = {1, 100, 1400, 1500, 5000, 10000,
+			10001, 50000, 200000, HOMA_MAX_MESSAGE_LENGTH};
+	sockaddr_in_union source;
+	uint64_t id, cookie;
+	size_t msglen;
+	ssize_t length;
+	int i, j;
+
+	for (i = 0; i < (int) (sizeof(lengths)/sizeof(lengths[0])); i++) {
+		for (j = 0; j < lengths[i]; j++)
+			request[j] = (char) (i + j*7);
+		if (homa_send(fd, request, lengths[i], dest, &id, i + 1) < 0) {
+			printf("homa_send failed for length %d: %s\n",
+					lengths[i], strerror(errno));
+			return 1;
+		}
+		memset(&source, 0, sizeof(source));
+		length = homa_recv(fd, response, sizeof(response),
+				HOMA_RECV_RESPONSE, &source, &id, &msglen,
+				&cookie);
+		if (length < 0) {
+			printf("homa_recv failed for length %d: %s\n",
+					lengths[i], strerror(errno));
+			return 1;
+		}
+		if ((length != lengths[i]) || (msglen != (size_t) lengths[i])
+				|| (cookie != (uint64_t) (i + 1))
+				|| (memcmp(request, response, length) != 0)) {
+			printf("Bad response for length %d: got %zd bytes, "
+					"msglen %zu, cookie %" PRIu64 "\n",
+					lengths[i], length, msglen, cookie);
+			return 1;
+		}
+		printf("Length %d OK\n", lengths[i]);
+	}
+	return 0;
+}
+
+/**
+ * open_socket() - Open a user-space endpoint or a kernel Homa socket;
+ * exits the program if this fails.
+ * @ifname:  Interface for a user-space endpoint, or "-" for a kernel
+ *           socket.
+ * @port:    Port to bind to, or 0 for a client socket.
+ * @family:  Address family for a kernel socket.
+ * Return:   File descriptor for the socket.
+ */
+static int open_socket(const char *ifname, int port, int family)
+{
+	sockaddr_in_union addr;
+	int fd;
+
+	if (strcmp(ifname, "-") != 0) {
+		fd = homa_xdp_socket(ifname, 0, port);
+		if (fd < 0) {
+			printf("Couldn't open endpoint on %s: %s\n", ifname,
+					strerror(errno));
+			exit(1);
+		}
+		return fd;
+	}
+	fd = socket(family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		printf("Couldn't open Homa socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (port == 0)
+		return fd;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_INET) {
+		addr.in4.sin_family = AF_INET;
+		addr.in4.sin_port = htons(port);
+	} else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(port);
+	}
+	if (bind(fd, &addr.sa, sizeof(addr)) != 0) {
+		printf("Couldn't bind to Homa port %d: %s\n", port,
+				strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+int main(int argc, char** argv)
+{
+	sockaddr_in_union dest;
+	int fd, status, family;
+
+	if ((argc >= 4) && (strcmp(argv[1], "server") == 0)) {
+		family = ((argc >= 6) && (strcmp(argv[5], "ipv6") == 0))
+				? AF_INET6 : AF_INET;
+		fd = open_socket(argv[2], atoi(argv[3]), family);
+		status = server(fd, (argc >= 5) ? atoi(argv[4]) : 0);
+	} else if ((argc >= 5) && (strcmp(argv[1], "client") == 0)) {
+		memset(&dest, 0, sizeof(dest));
+		if (inet_pton(AF_INET, argv[3], &dest.in4.sin_addr) == 1) {
+			dest.in4.sin_family = AF_INET;
+			dest.in4.sin_port = htons(atoi(argv[4]));
+		} else if (inet_pton(AF_INET6, argv[3],
+				&dest.in6.sin6_addr) == 1) {
+			dest.in6.sin6_family = AF_INET6;
+			dest.in6.sin6_port = htons(atoi(argv[4]));
+		} else {
+			printf("Bad server address %s\n", argv[3]);
+			exit(1);
+		}
+		fd = open_socket(argv[2], 0, dest.sa.sa_family);
+		status = client(fd, &dest);
+	} else {
+		printf("Usage: %s server ifname port [count [ipv6]]\n"
+				"       %s client ifname server_ip port\n",
+				argv[0], argv[0]);
+		exit(1);
+	}
+	if (strcmp(argv[2], "-") == 0)
+		close(fd);
+	else
+		homa_xdp_close(fd);
+	exit(status);
+}